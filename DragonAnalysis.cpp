@@ -0,0 +1,269 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+// DragonAnalysis.cpp
+//
+// ****Function****
+//  The corruption check of DragonDaqMOnlineCarlos, moved out of it so that
+//  DragonReanalyze runs exactly the same code on recorded files. Per
+//  FEB/channel/capacitor/gain the last _npointers ADC values are kept; an
+//  event whose samples are shifted from the closest of them by more than
+//  sigmaCut, or whose mean ADC is below adcCut, is corrupted.
+//  The global Ev and maps of the online program are now an AnalysisState,
+//  one per thread, and the TTree Fill() of the dump pass a callback, so
+//  nothing here needs ROOT.
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include <math.h>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <sys/mman.h>
+
+#include "DragonAnalysis.hh"
+
+AnalysisState *AnalysisNew(int firstFeb, int nFeb)
+{
+  AnalysisState *st=new AnalysisState();
+  st->firstFeb=firstFeb;
+  st->nFeb=nFeb;
+  st->eventsMap=new EventsMapFeb[nFeb]();
+  st->eventsMapUpt=new EventsMapUptFeb[nFeb]();
+  st->mapped=NULL;
+  st->mappedSize=0;
+  st->history=0;
+  st->sigmaCut=4;
+  st->adcCut=200;
+  st->classifier=NULL;
+  st->dump=NULL;
+  st->dumpArg=NULL;
+  return st;
+}
+
+void AnalysisDelete(AnalysisState *st)
+{
+  if(st==NULL) return;
+  if(st->mapped) munmap(st->mapped,st->mappedSize);
+  else
+    {
+      delete [] st->eventsMap;
+      delete [] st->eventsMapUpt;
+    }
+  ClassifierDelete(st->classifier);
+  delete st;
+}
+
+double probFunc(double diff){
+  double d1=diff; d1*=d1/3.36391e+00/3.36391e+00;
+  double d2=diff; d2*=d2/3.45210e+01/3.45210e+01;
+
+  return log(1+5.19912e+04/1.12390e+07*exp(-0.5*d2+0.5*d1))+log(1.12390e+07)+0.5*d1;
+}
+
+bool analyze(AnalysisState *st,
+	     unsigned short *buffer,
+	     int start,
+	     int end,
+	     int /*store_prob*/,  //ignored
+	     int /*Time*/,        //ignored
+	     int dump){  // ignored
+  bool corrupted=false;
+
+  using namespace std;
+
+  EVT &Ev=st->Ev;
+  const int last_row=(end-start)/8;
+  int roi_size=(last_row-3.0)/2.0;
+  //cout<<"ROI SIZE "<<roi_size<<endl;
+  int roi_border=start+3+roi_size;
+  
+
+  int &Event=Ev.Event;
+  int &Trigger=Ev.Trigger;
+  unsigned short *stopCellId=0;
+
+  double adc_sum=0;
+  int adc_counter=0;
+
+
+  int odd=0; // Set to 1 for the odd channels
+
+  int guys=0;
+  double mean=0;
+
+  for(int row=0;row<last_row;row++){
+    
+    if(row==0){
+      // Evt Number and so on
+      unsigned short *prow=&buffer[start+row*8];
+      Event=prow[1]+0xffff*prow[0];
+      Trigger=prow[3]+0xffff*prow[2];
+
+      if(dump && 0) cout<<"###>>"<<endl<<"EVENT "<<Event<<" TRIGGER "<<Trigger<<" Corr Read Evt:"<<Ev.Counter<<endl;
+      continue;
+    }
+    
+    if(row==1) continue; // FLAGS
+    
+    if(row==2){
+      stopCellId=&buffer[start+row*8];
+      if(dump && 0){
+	cout<<"###>>"<<"STOP CELLS ";
+	for(int ii=0;ii<8;ii++) cout<<"###>>"<<buffer[ii]<<" ";
+      }
+      continue;
+    }
+    
+    if(row>=roi_border) odd=1;
+
+    for(int record=0;record<8;record++){
+      if(odd && record>5) break; // DO NOT READ THE _TAG, whatever it is
+      
+      int channel=(record&0xfffe)+odd;
+      int low_gain=record%2;
+      
+      int cellId=row-(odd?roi_border:3)        // Slices-offset
+	+stopCellId[channel];                  // Stop cell id
+      
+
+      int adc=buffer[start+row*8+record];
+      int roi=row-(odd?roi_border:3);
+
+      if(dump && 0){
+	if(record==0) cout<<"###>>"<<endl<<"ROI "<<roi<<" ";
+	fprintf(stderr,"(c%i,g%i) %i ",channel,low_gain,adc);
+      }
+
+      Ev.Channel=channel;
+      Ev.LowGain=low_gain;
+      Ev.CellId=cellId%4096;
+      Ev.Roi=roi;
+      Ev.Adc=adc;
+
+      // Update the map
+      int *value=st->eventsMap[Ev.Id-st->firstFeb][Ev.Channel][Ev.CellId][Ev.LowGain];
+      int &upts=st->eventsMapUpt[Ev.Id-st->firstFeb][Ev.Channel][Ev.CellId][Ev.LowGain];
+
+
+      if(roi>1 && roi<roi_size-1){ 
+
+	  // Search for the closer one
+	  int closer=_npointers;
+	  int vals[_npointers+1];
+	  vals[closer]=9999999;
+	  for(int i=0;i<_npointers;i++) vals[i]=abs(Ev.Adc-value[i]);  // Try to use vectorization
+	  for(int i=0;i<_npointers;i++) closer=vals[i]<vals[closer]?i:closer;
+	  
+	  if(closer<_npointers && value[closer]>0){
+	    
+	    Ev.AdcCorr=value[closer];
+	    if(Ev.Trigger>100){
+	      guys++;
+	      mean+=(Ev.Adc-Ev.AdcCorr);
+	    }
+	    //	    if(Ev.Adc-Ev.AdcCorr<-150) corrupted=true;
+	    Ev.Status=0;
+
+
+	    /*
+	    if(otree){
+	      bool store_it=false;
+	      if(gRandom->Uniform()<0.01) {Ev.Status+=1;store_it=true;}
+	      if(Ev.Trigger!=Ev.Event){Ev.Status+=10; store_it=true;}
+	      if(Ev.Adc-Ev.AdcCorr<-150) {Ev.Status+=100; store_it=true;}
+	      if(Ev.Adc<50) {Ev.Status+=1000; store_it=true;}
+	      if(store_it) otree->Fill();
+	    }
+	    */
+	    if(dump && st->dump) st->dump(st->dumpArg,Ev);
+
+	  }
+	  
+	  adc_sum+=Ev.Adc;
+	  adc_counter++;
+
+	  if(Ev.Adc>0){
+	    value[upts%_npointers]=Ev.Adc;
+	    upts++;
+	  }
+      }
+      
+    }
+  }
+  
+
+  Ev.Adc=adc_sum/adc_counter;
+
+
+  double sigmas=fabs(mean/guys)*sqrt(guys)/7.993;
+  if(guys>1 && sigmas>st->sigmaCut) corrupted=1;
+  
+  return corrupted;
+}
+
+
+bool Analysis(AnalysisState *st,unsigned short *buffer,int start,int end,int store,int threshold){
+  bool corrupted=analyze(st,buffer,start,end,store,threshold);
+  if(st->Ev.Adc<st->adcCut){corrupted=1;analyze(st,buffer,start,end,store,threshold,1);} ///// TEST TO DUMP CORRUPTED
+  return corrupted;
+}
+
+unsigned short *AnalysisSwap(unsigned char *ev,int HeaderSize,int rddepth)
+{
+  // Correct endiness, including the flags and capacitor id
+  for(int b=HeaderSize-8*3*2; b<HeaderSize+16*rddepth*2;b+=2) *(ev+b-1)=*(ev+b+1);
+  ev--;
+  return (unsigned short*)ev;
+}
+
+// The ROI samples of a corrupted event with their running pedestal, as the
+// dump pass of analyze() gives them
+static void ClassifierDump(AnalysisState *st,const unsigned char *ev,int rddepth)
+{
+  EVT &Ev=st->Ev;
+  const unsigned char *data=ev+EV_HEADER_SIZE;
+  for(int half=0;half<2;half++)
+    for(int slice=2;slice<rddepth-2;slice++)
+      for(int record=0;record<8;record++){
+	if(half && record>5) break; // DO NOT READ THE _TAG, whatever it is
+	const unsigned char *w=data+((half*rddepth+slice)*8+record)*2;
+	int stop=(ev[EV_OFF_STOPCELL+2*((record&~1)+half)]<<8 | ev[EV_OFF_STOPCELL+2*((record&~1)+half)+1]);
+	Ev.Channel=(record&~1)+half;
+	Ev.LowGain=record%2;
+	Ev.CellId=(slice+stop)%4096;
+	Ev.Roi=slice;
+	Ev.Adc=(w[0]<<8 | w[1]);
+	Ev.AdcCorr=(int)ClassifierPed(st->classifier,Ev.Id,Ev.Channel,Ev.LowGain,Ev.CellId);
+	st->dump(st->dumpArg,Ev);
+      }
+}
+
+bool AnalysisEvent(AnalysisState *st,unsigned char *ev,int feb,int HeaderSize,int rddepth,int time)
+{
+  EVT &Ev=st->Ev;
+  if(st->classifier && HeaderSize==EV_HEADER_SIZE)
+    {
+      Ev.Id=feb;
+      Ev.Status=0;
+      Ev.Counter++;
+      Ev.Time=time;
+      Ev.Event=EventBe32(ev+EV_OFF_EVCOUNT);
+      Ev.Trigger=EventBe32(ev+EV_OFF_TRIGCOUNT);
+      ClassifierResult r;
+      bool corrupted=ClassifierEvent(st->classifier,ev,feb,rddepth,&r);
+      if(corrupted && st->dump) ClassifierDump(st,ev,rddepth);
+      Ev.Adc=r.meanAdc;
+      return corrupted;
+    }
+
+  unsigned short *buffer=AnalysisSwap(ev,HeaderSize,rddepth);
+
+  Ev.Id=feb;
+  Ev.Status=0;
+  Ev.Counter++;
+  Ev.Time=time;
+  return Analysis(st,buffer,    // Where
+		  (HeaderSize-8*3*2)/2,
+		  (HeaderSize+16*rddepth*2)/2,
+		  0,
+		  0);
+}
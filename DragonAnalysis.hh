@@ -0,0 +1,79 @@
+#ifndef DRAGON_ANALYSIS_H
+#define DRAGON_ANALYSIS_H
+
+#include "DragonClassifier.hh"
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Online corruption check of DragonDaqMOnlineCarlos, see DragonAnalysis.cpp
+///////////////////////////////////////////////////////////////////////////////////////////
+struct EVT{
+  int Delay; //muse
+  int Time;
+  int Event;
+  int Trigger;
+  float Adc;
+  int Counter;
+
+  int Id;
+  int Channel;
+  int LowGain;
+  int CellId;
+  int Roi;
+
+  int AdcCorr;
+
+  int Status;
+};
+
+
+const int _ncells=4096;
+const int _ngains=2;
+const int _nchannels=7;
+const int _npointers=4;
+
+// One map per FEB (Ev.Id)
+typedef int EventsMapFeb[_nchannels][_ncells][_ngains][_npointers];
+typedef int EventsMapUptFeb[_nchannels][_ncells][_ngains];
+
+// Everything the analysis keeps from one event to the next, for the FEBs
+// firstFeb..firstFeb+nFeb-1. One per thread: the maps of a FEB must see
+// its events in order.
+struct AnalysisState
+{
+  EVT Ev;
+  int firstFeb;
+  int nFeb;
+  EventsMapFeb *eventsMap;     // This is an event map of the ADC counts. We keep always two of them
+  EventsMapUptFeb *eventsMapUpt;
+  void *mapped;                // snapshot the maps are mmap()ed from (DragonPedestal.cpp), NULL if allocated
+  size_t mappedSize;
+  unsigned long long history;  // events analysed by the runs before, from the snapshot
+  double sigmaCut;             // corrupted when the mean shift is beyond this, 4
+  float adcCut;                // corrupted when the mean ADC is below this, 200
+  Classifier *classifier;      // when set, decides instead of the two tests above (v5 only)
+  // gets every sample the dump pass of a corrupted event goes through
+  // (the TTree Fill() of the online program), NULL for none
+  void (*dump)(void *arg, const EVT &ev);
+  void *dumpArg;
+};
+
+AnalysisState *AnalysisNew(int firstFeb, int nFeb);
+void AnalysisDelete(AnalysisState *st);
+
+double probFunc(double diff);
+bool analyze(AnalysisState *st,unsigned short *buffer,int start,int end,int store_prob,int Time,int dump=false);
+bool Analysis(AnalysisState *st,unsigned short *buffer,int start,int end,int store,int threshold=10);
+
+// Swaps the words of the event at ev in place for analyze(), including the
+// flags and capacitor ids, by moving every byte one place down: ev must
+// have a spare byte before it. Returns the start of the swapped words.
+unsigned short *AnalysisSwap(unsigned char *ev,int HeaderSize,int rddepth);
+
+// The online step for one event of FEB feb read at ev, which must have a
+// spare byte before it: the words are swapped in place (the event is not
+// usable afterwards), then Ev is set up and Analysis() run. With a
+// classifier, ClassifierEvent() decides instead and a corrupted event
+// goes to the dump callback sample by sample.
+// Returns true when the event is found corrupted.
+bool AnalysisEvent(AnalysisState *st,unsigned char *ev,int feb,int HeaderSize,int rddepth,int time);
+#endif
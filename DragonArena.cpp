@@ -0,0 +1,85 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+// DragonArena.cpp
+//
+// ****Function****
+//  Pre-sized event buffers for the read loop, so that a run does no heap
+//  allocation per event and large read depths no longer live on the stack.
+//  Each FEB owns a fixed number of slots of one event each. A stage takes
+//  a slot from the FEB's free list as an EventHandle, reads into it, and
+//  moves the handle on (or back) without copying the event; the slot is
+//  returned when the last handle goes away.
+//  The arena is one mapping backed, in order of preference, by
+//    - 2 MB hugetlbfs pages (MAP_HUGETLB, needs vm.nr_hugepages),
+//    - transparent hugepages (madvise(MADV_HUGEPAGE) on a 2 MB aligned range),
+//    - normal pages,
+//  which keeps a few hundred MB of slots within a handful of TLB entries.
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "DragonArena.hh"
+
+#define ARENA_HUGE (2UL<<20)
+
+EventArena *ArenaNew(int nFeb, int nSlot, size_t slotSize)
+{
+  if(nFeb<1 || nSlot<1) return NULL;
+  EventArena *a=new EventArena;
+  a->nFeb=nFeb;
+  a->nSlot=nSlot;
+  a->slotSize=(slotSize+63)&~(size_t)63;
+  size_t total=(size_t)nFeb*nSlot;
+  size_t bytes=total*a->slotSize;
+
+  a->mapSize=(bytes+ARENA_HUGE-1)&~(ARENA_HUGE-1);
+  a->map=mmap(NULL,a->mapSize,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB,-1,0);
+  if(a->map!=MAP_FAILED)
+    {
+      a->huge=2;
+      a->base=(unsigned char *)a->map;
+    }
+  else
+    {
+      // one extra huge page to align the start
+      a->mapSize+=ARENA_HUGE;
+      a->map=mmap(NULL,a->mapSize,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+      if(a->map==MAP_FAILED)
+	{
+	  perror("ArenaNew()");
+	  delete a;
+	  return NULL;
+	}
+      a->base=(unsigned char *)(((uintptr_t)a->map+ARENA_HUGE-1)&~(uintptr_t)(ARENA_HUGE-1));
+      a->huge= madvise(a->base,bytes,MADV_HUGEPAGE)==0 ? 1 : 0;
+    }
+
+  a->meta=new ArenaMeta[total]();
+  a->next=new std::atomic<unsigned int>[total];
+  a->free=new ArenaFree[nFeb];
+  for(int f=0;f<nFeb;f++)
+    {
+      // slot order: the lowest address is taken first
+      a->free[f].head=0;
+      for(int k=nSlot-1;k>=0;k--) ArenaPush(a,(unsigned int)f*nSlot+k);
+    }
+  return a;
+}
+
+void ArenaDelete(EventArena *a)
+{
+  if(a==NULL) return;
+  munmap(a->map,a->mapSize);
+  delete[] a->meta;
+  delete[] a->next;
+  delete[] a->free;
+  delete a;
+}
+
+void ArenaPrint(const EventArena *a, const char *who)
+{
+  static const char *Backing[]={"4k pages","transparent hugepages","hugetlb pages"};
+  printf("%s: %d FEB(s) x %d slots of %lu bytes, %.1f MB on %s\n",who,a->nFeb,a->nSlot,
+	 (unsigned long)a->slotSize,(double)a->nFeb*a->nSlot*a->slotSize/(1<<20),Backing[a->huge]);
+}
@@ -0,0 +1,123 @@
+#ifndef DRAGON_ARENA_H
+#define DRAGON_ARENA_H
+
+#include <stddef.h>
+#include <atomic>
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Event buffer arena, see DragonArena.cpp
+///////////////////////////////////////////////////////////////////////////////////////////
+
+// What travels with an event between the stages
+struct ArenaMeta
+{
+  int feb;                    // global FEB index
+  int size;                   // bytes in the slot
+  unsigned long long arrival; // DragonClockNow() of the first byte
+};
+
+// Head of a free list: (ABA tag << 32) | (slot+1), 0 when empty
+struct ArenaFree
+{
+  std::atomic<unsigned long long> head;
+} __attribute__((aligned(64)));
+
+struct EventArena
+{
+  int nFeb;
+  int nSlot;                       // slots per FEB
+  size_t slotSize;                 // bytes, multiple of 64
+  unsigned char *base;             // slot s at base+s*slotSize, FEB f owns [f*nSlot,(f+1)*nSlot)
+  void *map;
+  size_t mapSize;
+  int huge;                        // 2: MAP_HUGETLB, 1: madvise(MADV_HUGEPAGE), 0: 4k pages
+  ArenaMeta *meta;                 // per slot
+  std::atomic<unsigned int> *next; // free list links, per slot
+  ArenaFree *free;                 // per FEB
+};
+
+// nFeb*nSlot slots of at least slotSize bytes. The pages are not touched
+// here, see NumaTouch(). Returns NULL on failure.
+EventArena *ArenaNew(int nFeb, int nSlot, size_t slotSize);
+void ArenaDelete(EventArena *a);
+void ArenaPrint(const EventArena *a, const char *who);
+
+// Lock-free (Treiber) stack per FEB: one stage takes, any stage gives back
+inline int ArenaPop(EventArena *a, int feb)
+{
+  std::atomic<unsigned long long> &head=a->free[feb].head;
+  unsigned long long h=head.load(std::memory_order_acquire);
+  for(;;)
+    {
+      unsigned int top=(unsigned int)h;
+      if(top==0) return -1;
+      unsigned int s=top-1;
+      unsigned long long n=((h>>32)+1)<<32 | a->next[s].load(std::memory_order_relaxed);
+      if(head.compare_exchange_weak(h,n,std::memory_order_acquire,std::memory_order_acquire)) return s;
+    }
+}
+
+inline void ArenaPush(EventArena *a, unsigned int s)
+{
+  std::atomic<unsigned long long> &head=a->free[s/a->nSlot].head;
+  unsigned long long h=head.load(std::memory_order_relaxed);
+  for(;;)
+    {
+      a->next[s].store((unsigned int)h,std::memory_order_relaxed);
+      unsigned long long n=((h>>32)+1)<<32 | (s+1);
+      if(head.compare_exchange_weak(h,n,std::memory_order_release,std::memory_order_relaxed)) return;
+    }
+}
+
+/******************************************/
+//  Ownership of one slot. Move-only, the slot goes back to the
+//  free list when the last owner is destroyed or Release()s it.
+/******************************************/
+class EventHandle
+{
+ public:
+  EventHandle() : arena(NULL), slot(0) {}
+  EventHandle(EventArena *a, unsigned int s) : arena(a), slot(s) {}
+  EventHandle(EventHandle &&o) : arena(o.arena), slot(o.slot) { o.arena=NULL; }
+  EventHandle &operator=(EventHandle &&o)
+  {
+    if(this!=&o)
+      {
+	Release();
+	arena=o.arena;
+	slot=o.slot;
+	o.arena=NULL;
+      }
+    return *this;
+  }
+  ~EventHandle() { Release(); }
+  EventHandle(const EventHandle &)=delete;
+  EventHandle &operator=(const EventHandle &)=delete;
+
+  bool Valid() const { return arena!=NULL; }
+  unsigned char *Data() const { return arena->base+(size_t)slot*arena->slotSize; }
+  ArenaMeta &Meta() const { return arena->meta[slot]; }
+  // Hands the slot over as a plain index (e.g. through a ring), see ArenaAdopt()
+  unsigned int Detach() { arena=NULL; return slot; }
+  void Release()
+  {
+    if(arena) ArenaPush(arena,slot);
+    arena=NULL;
+  }
+ private:
+  EventArena *arena;
+  unsigned int slot;
+};
+
+// Invalid handle when the FEB (index inside the arena) has no free slot
+inline EventHandle ArenaGet(EventArena *a, int feb)
+{
+  int s=ArenaPop(a,feb);
+  return s<0 ? EventHandle() : EventHandle(a,s);
+}
+
+inline EventHandle ArenaAdopt(EventArena *a, unsigned int slot)
+{
+  return EventHandle(a,slot);
+}
+#endif
@@ -0,0 +1,450 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+// DragonBench.cpp
+//
+// ****Function****
+//  Microbenchmarks of the code run on every event, on synthetic v5 events
+//  (pedestal-like samples, random stop cells) at each read depth of -r:
+//    memcpy    : copy of the event, the reference for the others
+//    swap      : in-place word swap of DragonDaqMOnlineCarlos (AnalysisSwap)
+//    decode    : waveform decode of the offline tools (EventDecodeWaveforms)
+//    threshold : -t scan of DragonDaqMOnline (EventThresholdScan)
+//    header    : framing check, header decode and counter check
+//    analyze   : copy to a slot and AnalysisEvent(), events of 1 FEB
+//    analyzeN  : the same over -f FEBs, whose maps don't fit the caches
+//    classify  : the likelihood test of -L (DragonClassifier.cpp), AVX2
+//    classify_scalar : the same without AVX2
+//    probfunc  : probFunc(), per call
+//  Each kernel runs for -t seconds over a pool of events. The results go
+//  to DragonBench.json: ns/event, bytes/cycle and, when perf_event_open()
+//  is allowed, cycles, instructions, cache misses and branch misses per
+//  event. The cycles are the TSC ones when there are no hardware counters.
+//
+// ****Usage****
+//   make DragonBench
+//   ./DragonBench [-r 30,40,1024] [-k swap,analyze] [-t 0.3] [-f 16] [-o bench.json]
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <string>
+#include <vector>
+
+#include "DragonEvent.hh"
+#include "DragonClock.hh"
+#include "DragonAnalysis.hh"
+
+#define POOL_BYTES (32<<20)
+#define POOL_MAX   4096
+
+/******************************************/
+//  Hardware counters, one group
+/******************************************/
+enum { HW_CYCLES=0, HW_INSTRUCTIONS, HW_CACHE_MISSES, HW_BRANCH_MISSES, HW_N };
+
+static const unsigned long long HwConfig[HW_N]=
+  {PERF_COUNT_HW_CPU_CYCLES,PERF_COUNT_HW_INSTRUCTIONS,PERF_COUNT_HW_CACHE_MISSES,PERF_COUNT_HW_BRANCH_MISSES};
+
+struct HwCounters
+{
+  int fd[HW_N];
+  bool on;
+};
+
+static void HwOpen(HwCounters *hw)
+{
+  hw->on=false;
+  for(int c=0;c<HW_N;c++)
+    {
+      struct perf_event_attr attr;
+      memset(&attr,0,sizeof(attr));
+      attr.size=sizeof(attr);
+      attr.type=PERF_TYPE_HARDWARE;
+      attr.config=HwConfig[c];
+      attr.disabled= c==0;
+      attr.exclude_kernel=1;
+      attr.exclude_hv=1;
+      attr.read_format=PERF_FORMAT_GROUP;
+      hw->fd[c]=syscall(__NR_perf_event_open,&attr,0,-1,c==0 ? -1 : hw->fd[0],0);
+      if(hw->fd[c]<0)
+	{
+	  for(int k=0;k<c;k++) close(hw->fd[k]);
+	  return;
+	}
+    }
+  hw->on=true;
+}
+
+static void HwStart(HwCounters *hw)
+{
+  if(!hw->on) return;
+  ioctl(hw->fd[0],PERF_EVENT_IOC_RESET,PERF_IOC_FLAG_GROUP);
+  ioctl(hw->fd[0],PERF_EVENT_IOC_ENABLE,PERF_IOC_FLAG_GROUP);
+}
+
+static void HwStop(HwCounters *hw, unsigned long long *value)
+{
+  if(!hw->on) return;
+  ioctl(hw->fd[0],PERF_EVENT_IOC_DISABLE,PERF_IOC_FLAG_GROUP);
+  unsigned long long buf[1+HW_N];
+  if(read(hw->fd[0],buf,sizeof(buf))!=(ssize_t)sizeof(buf) || buf[0]!=HW_N)
+    {
+      hw->on=false;
+      return;
+    }
+  for(int c=0;c<HW_N;c++) value[c]=buf[1+c];
+}
+
+/******************************************/
+//  Synthetic events
+/******************************************/
+static unsigned int Rand(unsigned int *s)
+{
+  *s=*s*1664525u+1013904223u;
+  return *s>>8;
+}
+
+static void Be16(unsigned char *p, unsigned int v) { p[0]=v>>8; p[1]=v; }
+static void Be32(unsigned char *p, unsigned int v) { Be16(p,v>>16); Be16(p+2,v); }
+
+// Event k of a FEB: counters from k, samples around a pedestal of its capacitor
+static void MakeEvent(unsigned char *ev, int rd, unsigned int k, int feb, unsigned int *seed)
+{
+  memset(ev,0,EV_HEADER_SIZE);
+  Be16(ev,0xAAAA);
+  Be16(ev+EV_OFF_PPS,k/1000);
+  Be32(ev+EV_OFF_10MHZ,k*1000);
+  Be32(ev+EV_OFF_EVCOUNT,k);
+  Be32(ev+EV_OFF_TRIGCOUNT,k);
+  unsigned long long c133=k*13300ULL;
+  Be32(ev+EV_OFF_CLOCK133,c133>>32);
+  Be32(ev+EV_OFF_CLOCK133+4,c133);
+  memset(ev+EV_OFF_SEPARATOR,0xDD,8);
+  unsigned int stop[EV_NCHANNEL];
+  for(int ch=0;ch<EV_NCHANNEL;ch++)
+    {
+      stop[ch]=Rand(seed)%EV_NCELL;
+      Be16(ev+EV_OFF_STOPCELL+2*ch,stop[ch]);
+    }
+  unsigned char *d=ev+EV_HEADER_SIZE;
+  for(int half=0;half<2;half++)
+    for(int s=0;s<rd;s++)
+      for(int r=0;r<8;r++)
+	{
+	  int ch=(r&~1)+half;
+	  unsigned int cell=(s+stop[ch])%EV_NCELL;
+	  unsigned int ped=400+(cell*2654435761u+feb*97+r*13)%64;
+	  Be16(d+((half*rd+s)*8+r)*2,ped+Rand(seed)%8);
+	}
+}
+
+struct Pool
+{
+  int rd;
+  int evsize;
+  int nFeb;
+  int n;
+  std::vector<unsigned char> raw;     // n events back to back
+  std::vector<unsigned char> slot;    // n slots of evsize+16, the event at +4
+};
+
+static void PoolMake(Pool *p, int rd, int nFeb)
+{
+  p->rd=rd;
+  p->evsize=EV_HEADER_SIZE+2*8*2*rd;
+  p->nFeb=nFeb;
+  p->n=POOL_BYTES/p->evsize;
+  if(p->n>POOL_MAX) p->n=POOL_MAX;
+  if(p->n<nFeb) p->n=nFeb;
+  p->raw.resize((size_t)p->n*p->evsize);
+  p->slot.resize((size_t)p->n*(p->evsize+16));
+  unsigned int seed=12345;
+  for(int k=0;k<p->n;k++)
+    MakeEvent(&p->raw[(size_t)k*p->evsize],rd,k/nFeb,k%nFeb,&seed);
+}
+
+/******************************************/
+//  Kernels: run over the events a..b-1 of the pool
+/******************************************/
+static volatile unsigned long long Sink;
+
+static void KernelMemcpy(Pool *p, AnalysisState *, int a, int b)
+{
+  for(int k=a;k<b;k++)
+    memcpy(&p->slot[(size_t)k*(p->evsize+16)+4],&p->raw[(size_t)k*p->evsize],p->evsize);
+}
+
+static void KernelSwap(Pool *p, AnalysisState *, int a, int b)
+{
+  unsigned long long s=0;
+  for(int k=a;k<b;k++)
+    s+=AnalysisSwap(&p->slot[(size_t)k*(p->evsize+16)+4],EV_HEADER_SIZE,p->rd)[8];
+  Sink+=s;
+}
+
+static void KernelDecode(Pool *p, AnalysisState *, int a, int b)
+{
+  static std::vector<unsigned short> adc;
+  adc.resize(EV_NCHANNEL*EV_NGAIN*p->rd);
+  unsigned long long s=0;
+  for(int k=a;k<b;k++)
+    {
+      EventDecodeWaveforms(&p->raw[(size_t)k*p->evsize],p->rd,&adc[0]);
+      s+=adc[k%adc.size()];
+    }
+  Sink+=s;
+}
+
+static void KernelThreshold(Pool *p, AnalysisState *, int a, int b)
+{
+  unsigned long long s=0;
+  for(int k=a;k<b;k++)
+    {
+      int first=999999,last=-1,latest=0;
+      s+=EventThresholdScan(&p->raw[(size_t)k*p->evsize],EV_HEADER_SIZE,p->rd,404,&first,&last,&latest);
+    }
+  Sink+=s;
+}
+
+static void KernelHeader(Pool *p, AnalysisState *, int a, int b)
+{
+  static CounterStat cs;
+  unsigned long long s=0;
+  for(int k=a;k<b;k++)
+    {
+      const unsigned char *ev=&p->raw[(size_t)k*p->evsize];
+      EventHeader h;
+      unsigned int dTrigger;
+      s+=EventFramed(ev);
+      EventDecodeHeader(ev,&h);
+      s+=h.clock133+h.stopCell[k&7];
+      s+=CounterCheck(&cs,ev,&dTrigger)+dTrigger;
+    }
+  Sink+=s;
+}
+
+static void KernelAnalyze(Pool *p, AnalysisState *st, int a, int b)
+{
+  unsigned long long s=0;
+  for(int k=a;k<b;k++)
+    {
+      unsigned char *slot=&p->slot[(size_t)k*(p->evsize+16)+4];
+      memcpy(slot,&p->raw[(size_t)k*p->evsize],p->evsize);
+      s+=AnalysisEvent(st,slot,k%p->nFeb,EV_HEADER_SIZE,p->rd,k);
+    }
+  Sink+=s;
+}
+
+static void KernelClassify(Pool *p, AnalysisState *st, int a, int b)
+{
+  unsigned long long s=0;
+  for(int k=a;k<b;k++)
+    {
+      ClassifierResult r;
+      s+=ClassifierEvent(st->classifier,&p->raw[(size_t)k*p->evsize],k%p->nFeb,p->rd,&r);
+    }
+  Sink+=s;
+}
+
+// one call per "event", over diffs of -200..200
+static void KernelProb(Pool *, AnalysisState *, int a, int b)
+{
+  double s=0;
+  for(int k=a;k<b;k++) s+=probFunc((k%401)-200);
+  Sink+=(unsigned long long)s;
+}
+
+struct Kernel
+{
+  const char *name;
+  void (*run)(Pool *, AnalysisState *, int, int);
+  bool manyFebs;
+  int classifier;   // 0: none, 1: best, 2: scalar
+  int bytes;        // bytes read per event: BYTES_EVENT, BYTES_HEADER or BYTES_NONE
+};
+
+enum { BYTES_EVENT=0, BYTES_HEADER, BYTES_NONE };
+
+static const Kernel Kernels[]=
+  {
+    {"memcpy",KernelMemcpy,false,0,BYTES_EVENT},
+    {"swap",KernelSwap,false,0,BYTES_EVENT},
+    {"decode",KernelDecode,false,0,BYTES_EVENT},
+    {"threshold",KernelThreshold,false,0,BYTES_EVENT},
+    {"header",KernelHeader,false,0,BYTES_HEADER},
+    {"analyze",KernelAnalyze,false,0,BYTES_EVENT},
+    {"analyzeN",KernelAnalyze,true,0,BYTES_EVENT},
+    {"classify",KernelClassify,false,1,BYTES_EVENT},
+    {"classify_scalar",KernelClassify,false,2,BYTES_EVENT},
+    {"probfunc",KernelProb,false,0,BYTES_NONE},
+  };
+static const int NKernel=sizeof(Kernels)/sizeof(Kernels[0]);
+
+struct Result
+{
+  const char *kernel;
+  int rd;
+  int nFeb;
+  unsigned long long events;
+  double ns;
+  unsigned long long bytesPerEvent;
+  bool hw;
+  unsigned long long hwValue[HW_N];
+};
+
+static void Run(const Kernel &kn, Pool *p, double seconds, HwCounters *hw, Result *r)
+{
+  AnalysisState *st=AnalysisNew(0,p->nFeb);
+  if(kn.classifier)
+    {
+      ClassifierConf conf;
+      ClassifierDefault(&conf);
+      st->classifier=ClassifierNew(conf,0,p->nFeb);
+      if(kn.classifier==2) st->classifier->avx2=false;
+    }
+  // one pass to warm up the caches, the maps of the analysis and the
+  // pedestals of the classifier
+  kn.run(p,st,0,p->n);
+  unsigned long long budget=(unsigned long long)(seconds*1e9);
+  unsigned long long events=0;
+  unsigned long long value[HW_N]={0,0,0,0};
+  HwStart(hw);
+  unsigned long long t0=DragonClockNow(),t=t0;
+  int batch= p->n<256 ? p->n : 256;
+  int k=0;
+  while(t-t0<budget)
+    {
+      kn.run(p,st,k,k+batch);
+      events+=batch;
+      k+=batch;
+      if(k+batch>p->n) k=0;
+      t=DragonClockNow();
+    }
+  HwStop(hw,value);
+  AnalysisDelete(st);
+  r->kernel=kn.name;
+  r->rd=p->rd;
+  r->nFeb=p->nFeb;
+  r->events=events;
+  r->ns=t-t0;
+  r->bytesPerEvent= kn.bytes==BYTES_EVENT ? p->evsize : kn.bytes==BYTES_HEADER ? EV_HEADER_SIZE : 0;
+  r->hw=hw->on;
+  memcpy(r->hwValue,value,sizeof(value));
+}
+
+static bool Selected(const std::vector<std::string> &only, const char *name)
+{
+  if(only.empty()) return true;
+  for(size_t i=0;i<only.size();i++)
+    if(only[i]==name) return true;
+  return false;
+}
+
+static void Split(const char *s, std::vector<std::string> &out)
+{
+  std::string str(s);
+  size_t a=0;
+  while(a<=str.size())
+    {
+      size_t b=str.find(',',a);
+      if(b==std::string::npos) b=str.size();
+      if(b>a) out.push_back(str.substr(a,b-a));
+      a=b+1;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+  std::vector<std::string> rdList,only;
+  double seconds=0.3;
+  int nFeb=16;
+  const char *output="DragonBench.json";
+  int opt;
+  while((opt=getopt(argc,argv,"hr:k:t:f:o:"))!=-1)
+    {
+      switch(opt)
+	{
+	case 'r': Split(optarg,rdList); break;
+	case 'k': Split(optarg,only); break;
+	case 't': seconds=atof(optarg); break;
+	case 'f': nFeb=atoi(optarg); break;
+	case 'o': output=optarg; break;
+	default:
+	  printf("Usage: %s [-r readdepths] [-k kernels] [-t seconds] [-f febs] [-o output]\n",argv[0]);
+	  printf("  -r : read depths, default 30,40,1024\n");
+	  printf("  -k : kernels, default all of:");
+	  for(int i=0;i<NKernel;i++) printf(" %s",Kernels[i].name);
+	  printf("\n");
+	  printf("  -t : time per kernel and read depth, default 0.3 sec\n");
+	  printf("  -f : FEBs of analyzeN, default 16\n");
+	  printf("  -o : JSON output, default DragonBench.json, - for stdout\n");
+	  exit(opt=='h' ? 0 : 1);
+	}
+    }
+  if(rdList.empty()) Split("30,40,1024",rdList);
+  if(nFeb<1) nFeb=1;
+  FILE *fp= strcmp(output,"-")==0 ? stdout : fopen(output,"w");
+  if(fp==NULL)
+    {
+      perror(output);
+      exit(1);
+    }
+  DragonClockInit();
+  HwCounters hw;
+  HwOpen(&hw);
+  if(!hw.on) fprintf(stderr,"no hardware counters (perf_event_open), cycles from the TSC\n");
+
+  std::vector<Result> result;
+  for(size_t i=0;i<rdList.size();i++)
+    {
+      int rd=atoi(rdList[i].c_str());
+      if(rd<4)
+	{
+	  fprintf(stderr,"read depth %s ignored\n",rdList[i].c_str());
+	  continue;
+	}
+      Pool one,many;
+      PoolMake(&one,rd,1);
+      if(Selected(only,"analyzeN")) PoolMake(&many,rd,nFeb);
+      for(int k=0;k<NKernel;k++)
+	{
+	  if(!Selected(only,Kernels[k].name)) continue;
+	  Result r;
+	  Run(Kernels[k],Kernels[k].manyFebs ? &many : &one,seconds,&hw,&r);
+	  fprintf(stderr,"RD%-5d %-16s %10.1f ns/event\n",rd,r.kernel,r.ns/r.events);
+	  result.push_back(r);
+	}
+    }
+
+  fprintf(fp,"{\n  \"host\": {\"cpus\": %ld, \"tsc_hz\": %.0f, \"hw_counters\": %s},\n",
+	  sysconf(_SC_NPROCESSORS_ONLN),DragonClock.useTsc ? DragonClock.tscHz : 0.0,hw.on ? "true" : "false");
+  fprintf(fp,"  \"results\": [\n");
+  for(size_t i=0;i<result.size();i++)
+    {
+      const Result &r=result[i];
+      double ev=r.events;
+      double cycles= r.hw ? r.hwValue[HW_CYCLES] : r.ns*1e-9*DragonClock.tscHz;
+      fprintf(fp,"    {\"kernel\": \"%s\", \"rddepth\": %d, \"febs\": %d, \"events\": %llu, \"ns_per_event\": %.2f, "
+	      "\"bytes_per_event\": %llu, \"cycles_per_event\": %.1f, \"bytes_per_cycle\": %.3f, \"cycles\": \"%s\"",
+	      r.kernel,r.rd,r.nFeb,r.events,r.ns/ev,r.bytesPerEvent,cycles/ev,
+	      cycles>0 ? r.bytesPerEvent*ev/cycles : 0.0,r.hw ? "perf" : "tsc");
+      if(r.hw)
+	fprintf(fp,", \"instructions_per_event\": %.1f, \"ipc\": %.2f, \"cache_misses_per_event\": %.3f, \"branch_misses_per_event\": %.3f",
+		r.hwValue[HW_INSTRUCTIONS]/ev,cycles>0 ? r.hwValue[HW_INSTRUCTIONS]/cycles : 0.0,
+		r.hwValue[HW_CACHE_MISSES]/ev,r.hwValue[HW_BRANCH_MISSES]/ev);
+      fprintf(fp,"}%s\n",i+1<result.size() ? "," : "");
+    }
+  fprintf(fp,"  ]\n}\n");
+  if(fp!=stdout)
+    {
+      fclose(fp);
+      fprintf(stderr,"results in %s\n",output);
+    }
+  return 0;
+}
@@ -0,0 +1,422 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+// DragonClassifier.cpp
+//
+// ****Function****
+//  Per-event corruption test on the likelihood of the samples. Every
+//  sample of the ROI (the first and last 2 slices left out, as analyze()
+//  does) is compared with the running pedestal of its capacitor; its
+//  residual x has, for a good event, the two-gaussian density of probFunc()
+//    p(x) = (exp(-0.5*d1) + ratio*exp(-0.5*d2)) / norm
+//  with parameters per FEB/channel/gain from a calibration file. The event
+//  statistic is the z-score of the summed -log p(x),
+//    z = sum(nll-nllMean) / sqrt(sum nllSigma^2)
+//  and the event is corrupted when z > zcut. A shifted baseline and the
+//  empty events caught by the Adc<200 test both give a large z, so this
+//  replaces both tests of DragonDaqMOnlineCarlos (-L).
+//  A row of the v5 data is 8 samples of 4 channels x 2 gains at one slice,
+//  so one row is one AVX2 vector: byte swap, gather of the 8 pedestals,
+//  and log(1+exp()) from a table (linear interpolation, gathered too).
+//  The scalar code does the same with the same table, for hosts without
+//  AVX2. Good events update the pedestals of their cells afterwards.
+//
+// ****Calibration file****
+//    # feb channel gain  mu  sigma1  sigma2  ratio  norm  [nllMean nllSigma]
+//    *   *       *       0   3.36391 34.5210 4.626e-3 1.12390e7
+//    3   5       1       0.4 4.1     30.2    6.1e-3   1.3e7
+//    zcut 5
+//    alpha 0.0625
+//    min_samples 64
+//    min_seen 4
+//  "*" matches all, the last matching line wins, gain 0 is high gain.
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CLASS_HAVE_AVX2 1
+#endif
+
+#include "DragonClassifier.hh"
+
+#define SP_MIN   -16.0f
+#define SP_MAX    16.0f
+#define SP_STEP   32          // table points per unit
+#define SP_N      ((int)((SP_MAX-SP_MIN)*SP_STEP)+2)
+
+// log(1+exp(z)) on [SP_MIN,SP_MAX]
+struct SoftplusTable
+{
+  float v[SP_N];
+  SoftplusTable()
+  {
+    for(int i=0;i<SP_N;i++)
+      {
+	double z=SP_MIN+(double)i/SP_STEP;
+	v[i]=(float)(z>0 ? z+log1p(exp(-z)) : log1p(exp(z)));
+      }
+  }
+};
+
+static const float *Softplus()
+{
+  static SoftplusTable table;
+  return table.v;
+}
+
+static inline float SoftplusScalar(const float *tab, float z)
+{
+  if(z>SP_MAX) return z;
+  float zc= z<SP_MIN ? SP_MIN : z;
+  float t=(zc-SP_MIN)*SP_STEP;
+  int i=(int)t;
+  if(i>SP_N-2) i=SP_N-2;
+  float f=t-(float)i;
+  return tab[i]+f*(tab[i+1]-tab[i]);
+}
+
+static inline double ModelNll(const ClassModel &m, double x)
+{
+  double d1=(x-m.mu)*(x-m.mu)/(m.sigma1*m.sigma1);
+  double d2=(x-m.mu)*(x-m.mu)/(m.sigma2*m.sigma2);
+  double z=log(m.ratio)+0.5*d1-0.5*d2;
+  double sp= z>0 ? z+log1p(exp(-z)) : log1p(exp(z));
+  return log(m.norm)+0.5*d1-sp;
+}
+
+// Mean and spread of -log p over p, by summation on a fine grid
+static void ModelMoments(ClassModel *m)
+{
+  double wide= m->sigma2>m->sigma1 ? m->sigma2 : m->sigma1;
+  double narrow= m->sigma2>m->sigma1 ? m->sigma1 : m->sigma2;
+  double step=narrow/20;
+  double z=0,s1=0,s2=0;
+  for(double x=m->mu-12*wide;x<=m->mu+12*wide;x+=step)
+    {
+      double nll=ModelNll(*m,x);
+      double p=exp(-(nll-log(m->norm)));
+      z+=p;
+      s1+=p*nll;
+      s2+=p*nll*nll;
+    }
+  double mean=s1/z;
+  m->nllMean=(float)mean;
+  m->nllSigma=(float)sqrt(s2/z-mean*mean);
+}
+
+void ClassifierDefault(ClassifierConf *conf)
+{
+  // the parameters of probFunc()
+  ClassRule all={-1,-1,-1,{0,3.36391f,34.5210f,5.19912e+04f/1.12390e+07f,1.12390e+07f,0,0}};
+  ModelMoments(&all.model);
+  conf->rule.assign(1,all);
+  conf->zCut=5;
+  conf->alpha=1.0f/16;
+  conf->minSamples=64;
+  conf->minSeen=4;
+}
+
+static bool ReadIndex(const std::string &s, int &out)
+{
+  if(s=="*")
+    {
+      out=-1;
+      return true;
+    }
+  char *end;
+  long v=strtol(s.c_str(),&end,0);
+  if(end==s.c_str() || *end!='\0' || v<0) return false;
+  out=(int)v;
+  return true;
+}
+
+int ClassifierRead(const char *file, ClassifierConf *conf)
+{
+  std::ifstream ifs(file);
+  if(!ifs)
+    {
+      printf("Can't open %s\n",file);
+      return -1;
+    }
+  std::string str;
+  int line=0;
+  while(std::getline(ifs,str))
+    {
+      line++;
+      size_t hash=str.find('#');
+      if(hash!=std::string::npos) str.erase(hash);
+      std::istringstream iss(str);
+      std::string first;
+      if(!(iss>>first)) continue;
+      if(first=="zcut" || first=="alpha" || first=="min_samples")
+	{
+	  double v;
+	  if(!(iss>>v) || v<=0)
+	    {
+	      printf("%s:%d: expected \"%s <value>\"\n",file,line,first.c_str());
+	      return -1;
+	    }
+	  if(first=="zcut") conf->zCut=v;
+	  else if(first=="alpha") conf->alpha= v<1 ? v : 1;
+	  else conf->minSamples=(int)v;
+	  continue;
+	}
+      if(first=="min_seen")
+	{
+	  int v;
+	  if(!(iss>>v) || v<1 || v>255)
+	    {
+	      printf("%s:%d: expected \"min_seen <1..255>\"\n",file,line);
+	      return -1;
+	    }
+	  conf->minSeen=v;
+	  continue;
+	}
+      ClassRule r;
+      std::string ch,g;
+      ClassModel &m=r.model;
+      if(!ReadIndex(first,r.feb) || !(iss>>ch>>g) || !ReadIndex(ch,r.channel) || !ReadIndex(g,r.gain)
+	 || r.channel>=EV_NCHANNEL || r.gain>=EV_NGAIN
+	 || !(iss>>m.mu>>m.sigma1>>m.sigma2>>m.ratio>>m.norm)
+	 || m.sigma1<=0 || m.sigma2<=0 || m.ratio<=0 || m.norm<=0)
+	{
+	  printf("%s:%d: expected \"feb channel gain mu sigma1 sigma2 ratio norm [nllMean nllSigma]\"\n",file,line);
+	  return -1;
+	}
+      if(!(iss>>m.nllMean>>m.nllSigma) || m.nllSigma<=0) ModelMoments(&m);
+      conf->rule.push_back(r);
+    }
+  return 0;
+}
+
+static const ClassModel &ModelOf(const ClassifierConf &conf, int feb, int channel, int gain)
+{
+  size_t k=0;
+  for(size_t i=0;i<conf.rule.size();i++)
+    {
+      const ClassRule &r=conf.rule[i];
+      if((r.feb<0 || r.feb==feb) && (r.channel<0 || r.channel==channel) && (r.gain<0 || r.gain==gain)) k=i;
+    }
+  return conf.rule[k].model;
+}
+
+Classifier *ClassifierNew(const ClassifierConf &conf, int firstFeb, int nFeb)
+{
+  Classifier *cl=new Classifier;
+  cl->conf=conf;
+  cl->firstFeb=firstFeb;
+  cl->nFeb=nFeb;
+#ifdef CLASS_HAVE_AVX2
+  cl->avx2=__builtin_cpu_supports("avx2");
+#else
+  cl->avx2=false;
+#endif
+  cl->lanes.resize(nFeb*2);
+  cl->ped.assign((size_t)nFeb*EV_NCHANNEL*EV_NGAIN*EV_NCELL,0.0f);
+  cl->seen.assign(cl->ped.size(),0);
+  for(int f=0;f<nFeb;f++)
+    for(int half=0;half<2;half++)
+      {
+	ClassLanes &L=cl->lanes[f*2+half];
+	for(int r=0;r<8;r++)
+	  {
+	    int ch=(r&~1)+half;
+	    int g=r&1;
+	    const ClassModel &m=ModelOf(conf,firstFeb+f,ch,g);
+	    L.mu[r]=m.mu;
+	    L.inv1[r]=1.0f/(m.sigma1*m.sigma1);
+	    L.inv2[r]=1.0f/(m.sigma2*m.sigma2);
+	    L.logRatio[r]=logf(m.ratio);
+	    L.logNorm[r]=logf(m.norm);
+	    L.nllMean[r]=m.nllMean;
+	    L.nllVar[r]=m.nllSigma*m.nllSigma;
+	    L.base[r]=(ch*EV_NGAIN+g)*EV_NCELL;
+	    L.use[r]= ch==EV_NCHANNEL-1 ? 0 : -1;  // DO NOT READ THE _TAG, as analyze()
+	  }
+      }
+  Softplus();
+  return cl;
+}
+
+void ClassifierDelete(Classifier *cl)
+{
+  delete cl;
+}
+
+struct ClassSums
+{
+  double acc;      // sum of nll-nllMean
+  double var;      // sum of nllSigma^2
+  int n;
+  double adc;
+  int nAdc;
+};
+
+static void SumScalar(const ClassLanes *lanes, const float *ped, const unsigned char *data,
+		      const unsigned int *stop, int rd, ClassSums *s)
+{
+  const float *tab=Softplus();
+  for(int half=0;half<2;half++)
+    {
+      const ClassLanes &L=lanes[half];
+      for(int slice=2;slice<rd-2;slice++)
+	{
+	  const unsigned char *row=data+(half*rd+slice)*16;
+	  for(int r=0;r<8;r++)
+	    {
+	      if(!L.use[r]) continue;
+	      float adc=(float)(row[2*r]<<8 | row[2*r+1]);
+	      s->adc+=adc;
+	      s->nAdc++;
+	      float p=ped[L.base[r]+((slice+stop[(r&~1)+half])&(EV_NCELL-1))];
+	      if(!(p>0)) continue;
+	      float x=adc-p-L.mu[r];
+	      float x2=x*x;
+	      float d1=x2*L.inv1[r];
+	      float d2=x2*L.inv2[r];
+	      float nll=L.logNorm[r]+0.5f*d1-SoftplusScalar(tab,L.logRatio[r]+0.5f*(d1-d2));
+	      s->acc+=nll-L.nllMean[r];
+	      s->var+=L.nllVar[r];
+	      s->n++;
+	    }
+	}
+    }
+}
+
+#ifdef CLASS_HAVE_AVX2
+__attribute__((target("avx2,fma")))
+static void SumAvx2(const ClassLanes *lanes, const float *ped, const unsigned char *data,
+		    const unsigned int *stop, int rd, ClassSums *s)
+{
+  const float *tab=Softplus();
+  const __m128i bswap=_mm_setr_epi8(1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14);
+  const __m256i cellMask=_mm256_set1_epi32(EV_NCELL-1);
+  const __m256 spMin=_mm256_set1_ps(SP_MIN);
+  const __m256 spMax=_mm256_set1_ps(SP_MAX);
+  const __m256 spStep=_mm256_set1_ps(SP_STEP);
+  const __m256i spLast=_mm256_set1_epi32(SP_N-2);
+  const __m256 half_=_mm256_set1_ps(0.5f);
+  const __m256 zero=_mm256_setzero_ps();
+  __m256 acc=zero,var=zero,adcSum=zero;
+  __m256i n=_mm256_setzero_si256();
+  int nAdc=0;
+  for(int half=0;half<2;half++)
+    {
+      const ClassLanes &L=lanes[half];
+      const __m256 mu=_mm256_loadu_ps(L.mu);
+      const __m256 inv1=_mm256_loadu_ps(L.inv1);
+      const __m256 inv2=_mm256_loadu_ps(L.inv2);
+      const __m256 logRatio=_mm256_loadu_ps(L.logRatio);
+      const __m256 logNorm=_mm256_loadu_ps(L.logNorm);
+      const __m256 nllMean=_mm256_loadu_ps(L.nllMean);
+      const __m256 nllVar=_mm256_loadu_ps(L.nllVar);
+      const __m256i base=_mm256_loadu_si256((const __m256i *)L.base);
+      const __m256 use=_mm256_castsi256_ps(_mm256_loadu_si256((const __m256i *)L.use));
+      const __m256i stopv=_mm256_setr_epi32(stop[half],stop[half],stop[2+half],stop[2+half],
+					    stop[4+half],stop[4+half],stop[6+half],stop[6+half]);
+      for(int slice=2;slice<rd-2;slice++)
+	{
+	  __m128i w=_mm_loadu_si128((const __m128i *)(data+(half*rd+slice)*16));
+	  __m256 adc=_mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_shuffle_epi8(w,bswap)));
+	  adcSum=_mm256_add_ps(adcSum,_mm256_and_ps(adc,use));
+	  __m256i idx=_mm256_add_epi32(base,_mm256_and_si256(_mm256_add_epi32(stopv,_mm256_set1_epi32(slice)),cellMask));
+	  __m256 p=_mm256_i32gather_ps(ped,idx,4);
+	  __m256 valid=_mm256_and_ps(use,_mm256_cmp_ps(p,zero,_CMP_GT_OQ));
+	  __m256 x=_mm256_sub_ps(_mm256_sub_ps(adc,p),mu);
+	  __m256 x2=_mm256_mul_ps(x,x);
+	  __m256 d1=_mm256_mul_ps(x2,inv1);
+	  __m256 d2=_mm256_mul_ps(x2,inv2);
+	  // log(1+exp(z)) from the table
+	  __m256 z=_mm256_fmadd_ps(half_,_mm256_sub_ps(d1,d2),logRatio);
+	  __m256 t=_mm256_mul_ps(_mm256_sub_ps(_mm256_min_ps(_mm256_max_ps(z,spMin),spMax),spMin),spStep);
+	  __m256i i=_mm256_min_epi32(_mm256_cvttps_epi32(t),spLast);
+	  __m256 f=_mm256_sub_ps(t,_mm256_cvtepi32_ps(i));
+	  __m256 a=_mm256_i32gather_ps(tab,i,4);
+	  __m256 b=_mm256_i32gather_ps(tab+1,i,4);
+	  __m256 sp=_mm256_fmadd_ps(f,_mm256_sub_ps(b,a),a);
+	  sp=_mm256_blendv_ps(sp,z,_mm256_cmp_ps(z,spMax,_CMP_GT_OQ));
+	  __m256 nll=_mm256_sub_ps(_mm256_fmadd_ps(half_,d1,logNorm),sp);
+	  acc=_mm256_add_ps(acc,_mm256_and_ps(_mm256_sub_ps(nll,nllMean),valid));
+	  var=_mm256_add_ps(var,_mm256_and_ps(nllVar,valid));
+	  n=_mm256_sub_epi32(n,_mm256_castps_si256(valid));
+	}
+      nAdc+= rd>4 ? (rd-4)*(half ? 6 : 8) : 0;
+    }
+  float fa[8] __attribute__((aligned(32))),fv[8] __attribute__((aligned(32))),fs[8] __attribute__((aligned(32)));
+  int in[8] __attribute__((aligned(32)));
+  _mm256_store_ps(fa,acc);
+  _mm256_store_ps(fv,var);
+  _mm256_store_ps(fs,adcSum);
+  _mm256_store_si256((__m256i *)in,n);
+  for(int k=0;k<8;k++)
+    {
+      s->acc+=fa[k];
+      s->var+=fv[k];
+      s->adc+=fs[k];
+      s->n+=in[k];
+    }
+  s->nAdc+=nAdc;
+}
+#endif
+
+bool ClassifierEvent(Classifier *cl, const unsigned char *ev, int feb, int rddepth, ClassifierResult *r)
+{
+  int f=feb-cl->firstFeb;
+  const ClassLanes *lanes=&cl->lanes[f*2];
+  float *ped=&cl->ped[(size_t)f*EV_NCHANNEL*EV_NGAIN*EV_NCELL];
+  const unsigned char *data=ev+EV_HEADER_SIZE;
+  unsigned int stop[EV_NCHANNEL];
+  for(int ch=0;ch<EV_NCHANNEL;ch++)
+    stop[ch]=(ev[EV_OFF_STOPCELL+2*ch]<<8 | ev[EV_OFF_STOPCELL+2*ch+1])&(EV_NCELL-1);
+
+  ClassSums s={0,0,0,0,0};
+#ifdef CLASS_HAVE_AVX2
+  if(cl->avx2) SumAvx2(lanes,ped,data,stop,rddepth,&s);
+  else
+#endif
+    SumScalar(lanes,ped,data,stop,rddepth,&s);
+  r->z= s.var>0 ? (float)(s.acc/sqrt(s.var)) : 0;
+  r->n=s.n;
+  r->meanAdc= s.nAdc ? (float)(s.adc/s.nAdc) : 0;
+  bool corrupted= s.n>=cl->conf.minSamples && r->z>cl->conf.zCut;
+  if(corrupted) return true;
+
+  // the good events keep the pedestals up to date: plain average of the
+  // first 1/alpha samples of a cell, then exponential. A pedestal is kept
+  // negative, so the test above leaves it out, until it has minSeen samples.
+  const float alpha=cl->conf.alpha;
+  const int nAverage= alpha>1.0f/255 ? (int)(1/alpha+0.5f) : 255;
+  const int ready= cl->conf.minSeen<nAverage ? cl->conf.minSeen : nAverage;
+  unsigned char *seen=&cl->seen[(size_t)f*EV_NCHANNEL*EV_NGAIN*EV_NCELL];
+  for(int half=0;half<2;half++)
+    {
+      const ClassLanes &L=lanes[half];
+      for(int slice=2;slice<rddepth-2;slice++)
+	{
+	  const unsigned char *row=data+(half*rddepth+slice)*16;
+	  for(int k=0;k<8;k++)
+	    {
+	      if(!L.use[k]) continue;
+	      float adc=(float)(row[2*k]<<8 | row[2*k+1]);
+	      int c=L.base[k]+((slice+stop[(k&~1)+half])&(EV_NCELL-1));
+	      int n=seen[c];
+	      float p=fabsf(ped[c]);
+	      if(n<nAverage)
+		{
+		  p+=(adc-p)/(n+1);
+		  seen[c]=++n;
+		}
+	      else p+=alpha*(adc-p);
+	      ped[c]= n>=ready ? p : -p;
+	    }
+	}
+    }
+  return false;
+}
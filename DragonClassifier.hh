@@ -0,0 +1,94 @@
+#ifndef DRAGON_CLASSIFIER_H
+#define DRAGON_CLASSIFIER_H
+
+#include <math.h>
+#include <vector>
+
+#include "DragonEvent.hh"
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Likelihood corruption classifier, see DragonClassifier.cpp
+///////////////////////////////////////////////////////////////////////////////////////////
+
+// Residual model of one FEB/channel/gain: a narrow and a wide gaussian,
+//   p(x) = (exp(-0.5*d1) + ratio*exp(-0.5*d2)) / norm,  d = ((x-mu)/sigma)^2
+// nllMean/nllSigma: mean and spread of -log p(x) for good samples,
+// integrated from the model when the calibration file doesn't give them
+struct ClassModel
+{
+  float mu;
+  float sigma1;
+  float sigma2;
+  float ratio;
+  float norm;
+  float nllMean;
+  float nllSigma;
+};
+
+// One line of the calibration file, -1 for "*"
+struct ClassRule
+{
+  int feb;
+  int channel;
+  int gain;
+  ClassModel model;
+};
+
+struct ClassifierConf
+{
+  std::vector<ClassRule> rule;   // in file order, the last matching one wins
+  float zCut;                    // corrupted above this z-score, default 5
+  float alpha;                   // weight of an event in the running pedestals, default 1/16
+  int minSamples;                // no decision below this, default 64
+  int minSeen;                   // samples a pedestal needs to be used, default 4
+};
+
+// Per-lane constants of one half (even or odd channels) of a row of 8 samples
+struct ClassLanes
+{
+  float mu[8];
+  float inv1[8];        // 1/sigma1^2
+  float inv2[8];        // 1/sigma2^2
+  float logRatio[8];
+  float logNorm[8];
+  float nllMean[8];
+  float nllVar[8];
+  int base[8];          // (channel*EV_NGAIN+gain)*EV_NCELL
+  int use[8];           // -1, 0 for the channel 7 tag
+};
+
+// Running pedestals and constants of the FEBs firstFeb..firstFeb+nFeb-1
+struct Classifier
+{
+  ClassifierConf conf;
+  int firstFeb;
+  int nFeb;
+  bool avx2;
+  std::vector<ClassLanes> lanes;   // [feb][half]
+  std::vector<float> ped;          // [feb][(channel*EV_NGAIN+gain)*EV_NCELL+cell], <=0 until ready
+  std::vector<unsigned char> seen; // the same, samples in the pedestal up to 1/alpha
+};
+
+struct ClassifierResult
+{
+  float z;              // z-score of the summed -log p over the samples
+  int n;                // samples with a pedestal
+  float meanAdc;
+};
+
+void ClassifierDefault(ClassifierConf *conf);
+// Reads a calibration file on top of the defaults (probFunc's parameters)
+int  ClassifierRead(const char *file, ClassifierConf *conf);
+Classifier *ClassifierNew(const ClassifierConf &conf, int firstFeb, int nFeb);
+void ClassifierDelete(Classifier *cl);
+
+// Classifies a v5 event of FEB feb (as read, big endian) and, when it is
+// good, updates the running pedestals of its cells with it.
+// Returns true when the event is corrupted.
+bool ClassifierEvent(Classifier *cl, const unsigned char *ev, int feb, int rddepth, ClassifierResult *r);
+
+inline float ClassifierPed(const Classifier *cl, int feb, int channel, int gain, int cell)
+{
+  return fabsf(cl->ped[(size_t)(feb-cl->firstFeb)*EV_NCHANNEL*EV_NGAIN*EV_NCELL+(channel*EV_NGAIN+gain)*EV_NCELL+cell]);
+}
+#endif
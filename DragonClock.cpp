@@ -0,0 +1,83 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+// DragonClock.cpp
+//
+// ****Function****
+//  Calibration of the TSC against CLOCK_MONOTONIC_RAW, so that
+//  DragonClockNow() costs a rdtsc and a multiply (a few nsec) per event.
+//  Set DRAGON_CLOCK=raw in the environment to force clock_gettime().
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "DragonClock.hh"
+
+DragonClockCal DragonClock={0,0,0,0,0};
+
+// The TSC is only trusted when it does not change with frequency or C-states
+static bool TscInvariant()
+{
+  FILE *fp=fopen("/proc/cpuinfo","r");
+  if(fp==NULL) return false;
+  char line[4096];
+  bool constant=false,nonstop=false;
+  while(fgets(line,sizeof(line),fp))
+    {
+      if(strncmp(line,"flags",5)!=0) continue;
+      constant= strstr(line," constant_tsc")!=NULL;
+      nonstop = strstr(line," nonstop_tsc")!=NULL;
+      break;
+    }
+  fclose(fp);
+  return constant && nonstop;
+}
+
+void DragonClockInit()
+{
+  DragonClock.useTsc=0;
+#if defined(__x86_64__) || defined(__i386__)
+  const char *env=getenv("DRAGON_CLOCK");
+  if(env && strcmp(env,"raw")==0) return;
+  if(!TscInvariant()) return;
+
+  // Bracket each clock_gettime() between two rdtsc and keep the tightest pair
+  unsigned long long tsc[2],ns[2];
+  for(int k=0;k<2;k++)
+    {
+      unsigned long long best=~0ULL;
+      for(int trial=0;trial<16;trial++)
+	{
+	  unsigned long long t1=__rdtsc();
+	  unsigned long long n=DragonClockRaw();
+	  unsigned long long t2=__rdtsc();
+	  if(t2-t1<best)
+	    {
+	      best=t2-t1;
+	      tsc[k]=t1+(t2-t1)/2;
+	      ns[k]=n;
+	    }
+	}
+      if(k==0) usleep(50000);
+    }
+  if(ns[1]<=ns[0] || tsc[1]<=tsc[0]) return;
+  DragonClock.tscHz=(double)(tsc[1]-tsc[0])*1e9/(double)(ns[1]-ns[0]);
+  DragonClock.mult=(unsigned long long)((double)(ns[1]-ns[0])*4294967296.0/(double)(tsc[1]-tsc[0]));
+  DragonClock.tsc0=tsc[1];
+  DragonClock.ns0=ns[1];
+  DragonClock.useTsc=1;
+  printf("DragonClock: TSC %.3f MHz calibrated against CLOCK_MONOTONIC_RAW\n",DragonClock.tscHz/1e6);
+#endif
+}
+
+// CLOCK_REALTIME - CLOCK_MONOTONIC_RAW [nsec], to convert timestamps to wall time
+unsigned long long DragonClockRealtimeOffset()
+{
+  struct timespec ts;
+  unsigned long long raw1=DragonClockRaw();
+  clock_gettime(CLOCK_REALTIME,&ts);
+  unsigned long long raw2=DragonClockRaw();
+  unsigned long long real=(unsigned long long)ts.tv_sec*1000000000ULL+ts.tv_nsec;
+  return real-(raw1+(raw2-raw1)/2);
+}
@@ -0,0 +1,52 @@
+#ifndef DRAGON_CLOCK_H
+#define DRAGON_CLOCK_H
+
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Host clock for per-event timestamps
+//   nsec on the CLOCK_MONOTONIC_RAW time base. When the TSC is invariant
+//   (constant_tsc+nonstop_tsc) it is read with rdtsc and scaled with the
+//   calibration done in DragonClockInit(), otherwise clock_gettime() is used,
+//   as it is on the CPUs other than x86.
+///////////////////////////////////////////////////////////////////////////////////////////
+struct DragonClockCal
+{
+  int useTsc;
+  unsigned long long tsc0;  // TSC at calibration
+  unsigned long long ns0;   // CLOCK_MONOTONIC_RAW at calibration [nsec]
+  unsigned long long mult;  // nsec per tick << 32
+  double tscHz;
+};
+extern DragonClockCal DragonClock;
+
+void DragonClockInit();
+unsigned long long DragonClockRealtimeOffset();
+
+inline unsigned long long DragonClockRaw()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW,&ts);
+  return (unsigned long long)ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+inline unsigned long long DragonClockNow()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  if(DragonClock.useTsc)
+    {
+      unsigned long long dt=__rdtsc()-DragonClock.tsc0;
+#if defined(__x86_64__)
+      return DragonClock.ns0+(unsigned long long)(((unsigned __int128)dt*DragonClock.mult)>>32);
+#else
+      // no 128 bit integers on i386 (mult < 2^32 with a TSC above 1 GHz)
+      return DragonClock.ns0+(dt>>32)*DragonClock.mult+(((dt&0xffffffffULL)*DragonClock.mult)>>32);
+#endif
+    }
+#endif
+  return DragonClockRaw();
+}
+#endif
@@ -0,0 +1,214 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+// DragonColumnar.cpp
+//
+// ****Function****
+//  In the raw and the decoded event files one channel/gain is a few bytes
+//  in every event, so reading it means reading the whole file. The
+//  columnar file (written by DragonConvert -C) stores the events in chunks
+//  (one per chunk of the input, so one FEB per chunk unless the input was
+//  unified); within a chunk each header field and each channel/gain
+//  waveform is a contiguous block:
+//    feb[n] flags[n] event[n] ... stopcell[n][8] wave_c0_high[n][rd] ...
+//  The index at the end of the file gives, for every chunk and column,
+//  its place and the min/max of its values, so a scan reads one column
+//  and skips the chunks which can't match (a FEB, an event range, an
+//  amplitude cut) without touching them. The file is read through mmap(),
+//  only the blocks used are paged in.
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "DragonColumnar.hh"
+
+static const char *Name[COL_NCOLUMN]=
+  {"feb","flags","event","trigger","pps","clock10","clock133","arrival","stopcell",
+   "wave_c0_high","wave_c0_low","wave_c1_high","wave_c1_low","wave_c2_high","wave_c2_low",
+   "wave_c3_high","wave_c3_low","wave_c4_high","wave_c4_low","wave_c5_high","wave_c5_low",
+   "wave_c6_high","wave_c6_low","wave_c7_high","wave_c7_low"};
+
+const char *ColumnName(int col)
+{
+  return col>=0 && col<COL_NCOLUMN ? Name[col] : "?";
+}
+
+int ColumnFind(const char *name)
+{
+  for(int col=0;col<COL_NCOLUMN;col++)
+    if(strcmp(ColumnName(col),name)==0) return col;
+  return -1;
+}
+
+int ColumnWidth(int col, int rddepth)
+{
+  if(col==COL_STOPCELL) return EV_NCHANNEL;
+  return col>=COL_WAVE ? rddepth : 1;
+}
+
+int ColumnSize(int col)
+{
+  switch(col)
+    {
+    case COL_EVENT: case COL_TRIGGER: case COL_CLOCK10: return 4;
+    case COL_CLOCK133: case COL_ARRIVAL: return 8;
+    default: return 2;
+    }
+}
+
+static inline size_t Align(size_t n)
+{
+  return (n+COLUMNAR_ALIGN-1)&~(size_t)(COLUMNAR_ALIGN-1);
+}
+
+size_t ColumnarChunkBytes(int rddepth, unsigned int n)
+{
+  size_t bytes=0;
+  for(int col=0;col<COL_NCOLUMN;col++) bytes+=Align(ColumnBytes(col,rddepth,n));
+  return bytes;
+}
+
+// Copies one value per event and keeps the min/max
+template <class T>
+static void Gather(unsigned char *dst, const unsigned char *rows, size_t stride, size_t field,
+		   unsigned int n, ColumnarBlock *b)
+{
+  T *out=(T *)dst;
+  T lo=0,hi=0;
+  for(unsigned int k=0;k<n;k++)
+    {
+      T v;
+      memcpy(&v,rows+k*stride+field,sizeof(v));
+      out[k]=v;
+      if(k==0 || v<lo) lo=v;
+      if(k==0 || v>hi) hi=v;
+    }
+  b->min=(long long)lo;
+  b->max=(long long)hi;
+}
+
+void ColumnarBuild(unsigned char *dst, unsigned long long off, const unsigned char *rows,
+		   unsigned int n, int rddepth, ColumnarChunk *chunk, ColumnarBlock *blocks)
+{
+  const size_t stride=ConvertRecordSize(rddepth);
+  chunk->nEvents=n;
+  chunk->reserved=0;
+  size_t pos=0;
+  for(int col=0;col<COL_NCOLUMN;col++)
+    {
+      ColumnarBlock *b=&blocks[col];
+      unsigned char *d=dst+pos;
+      b->offset=off+pos;
+      b->bytes=ColumnBytes(col,rddepth,n);
+      switch(col)
+	{
+	case COL_FEB:      Gather<unsigned short>(d,rows,stride,offsetof(ConvertRecord,feb),n,b); break;
+	case COL_FLAGS:    Gather<unsigned short>(d,rows,stride,offsetof(ConvertRecord,flags),n,b); break;
+	case COL_EVENT:    Gather<unsigned int>(d,rows,stride,offsetof(ConvertRecord,event),n,b); break;
+	case COL_TRIGGER:  Gather<unsigned int>(d,rows,stride,offsetof(ConvertRecord,trigger),n,b); break;
+	case COL_PPS:      Gather<unsigned short>(d,rows,stride,offsetof(ConvertRecord,pps),n,b); break;
+	case COL_CLOCK10:  Gather<unsigned int>(d,rows,stride,offsetof(ConvertRecord,clock10),n,b); break;
+	case COL_CLOCK133: Gather<unsigned long long>(d,rows,stride,offsetof(ConvertRecord,clock133),n,b); break;
+	case COL_ARRIVAL:  Gather<unsigned long long>(d,rows,stride,offsetof(ConvertRecord,arrival),n,b); break;
+	default:
+	  {
+	    // stop cells, or one channel/gain waveform: a run of values per event
+	    int width=ColumnWidth(col,rddepth);
+	    size_t field= col==COL_STOPCELL ? offsetof(ConvertRecord,stopCell)
+	      : sizeof(ConvertRecord)+(size_t)(col-COL_WAVE)*rddepth*sizeof(short);
+	    bool sign= col>=COL_WAVE;
+	    long long lo=0,hi=0;
+	    for(unsigned int k=0;k<n;k++)
+	      {
+		const unsigned char *src=rows+k*stride+field;
+		memcpy(d+(size_t)k*width*2,src,(size_t)width*2);
+		for(int w=0;w<width;w++)
+		  {
+		    unsigned short u;
+		    memcpy(&u,src+2*w,2);
+		    long long v= sign ? (long long)(short)u : (long long)u;
+		    if((k==0 && w==0) || v<lo) lo=v;
+		    if((k==0 && w==0) || v>hi) hi=v;
+		  }
+	      }
+	    b->min=lo;
+	    b->max=hi;
+	  }
+	}
+      size_t end=pos+b->bytes;
+      pos=Align(end);
+      memset(dst+end,0,pos-end);
+    }
+}
+
+ColumnarFile *ColumnarOpen(const char *path)
+{
+  int fd=open(path,O_RDONLY);
+  struct stat st;
+  if(fd<0 || fstat(fd,&st)!=0)
+    {
+      perror(path);
+      if(fd>=0) close(fd);
+      return NULL;
+    }
+  if((size_t)st.st_size<sizeof(ColumnarHeader))
+    {
+      printf("%s: not a columnar file\n",path);
+      close(fd);
+      return NULL;
+    }
+  void *m=mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+  close(fd);
+  if(m==MAP_FAILED)
+    {
+      perror(path);
+      return NULL;
+    }
+  ColumnarFile *f=new ColumnarFile;
+  f->map=(const unsigned char *)m;
+  f->size=st.st_size;
+  memcpy(&f->hdr,f->map,sizeof(f->hdr));
+  if(memcmp(f->hdr.magic,COLUMNAR_MAGIC,sizeof(f->hdr.magic))!=0 || f->hdr.nColumn!=COL_NCOLUMN
+     || f->hdr.indexOffset+f->hdr.nChunk*ColumnarIndexEntry()>f->size)
+    {
+      printf("%s: not a columnar file, or truncated\n",path);
+      ColumnarClose(f);
+      return NULL;
+    }
+  return f;
+}
+
+void ColumnarClose(ColumnarFile *f)
+{
+  if(f==NULL) return;
+  munmap((void *)f->map,f->size);
+  delete f;
+}
+
+void ColumnarPrefetch(const ColumnarFile *f, size_t k, int col)
+{
+  const ColumnarBlock *b=ColumnarBlockAt(f,k,col);
+  long page=sysconf(_SC_PAGESIZE);
+  size_t start=b->offset&~(size_t)(page-1);
+  madvise((void *)(f->map+start),b->offset+b->bytes-start,MADV_WILLNEED);
+}
+
+void ColumnarAll(const ColumnarFile *f, std::vector<size_t> &chunks)
+{
+  chunks.resize(f->hdr.nChunk);
+  for(size_t k=0;k<chunks.size();k++) chunks[k]=k;
+}
+
+void ColumnarSelect(const ColumnarFile *f, int col, long long lo, long long hi, std::vector<size_t> &chunks)
+{
+  size_t n=0;
+  for(size_t i=0;i<chunks.size();i++)
+    {
+      const ColumnarBlock *b=ColumnarBlockAt(f,chunks[i],col);
+      if(b->max>=lo && b->min<=hi) chunks[n++]=chunks[i];
+    }
+  chunks.resize(n);
+}
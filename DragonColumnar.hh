@@ -0,0 +1,115 @@
+#ifndef DRAGON_COLUMNAR_H
+#define DRAGON_COLUMNAR_H
+
+#include <stddef.h>
+#include <vector>
+
+#include "DragonEvent.hh"
+#include "DragonConvert.hh"
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Columnar event file, see DragonColumnar.cpp (host byte order)
+//   ColumnarHeader, the column blocks of every chunk (64 byte aligned),
+//   then the chunk index at indexOffset: for each chunk a ColumnarChunk
+//   followed by nColumn ColumnarBlock.
+///////////////////////////////////////////////////////////////////////////////////////////
+#define COLUMNAR_MAGIC "DRGCOL01"
+#define COLUMNAR_ALIGN 64
+
+enum
+  {
+    COL_FEB=0,       // unsigned short
+    COL_FLAGS,       // unsigned short, CONV_MISFRAMED
+    COL_EVENT,       // unsigned int
+    COL_TRIGGER,     // unsigned int
+    COL_PPS,         // unsigned short
+    COL_CLOCK10,     // unsigned int
+    COL_CLOCK133,    // unsigned long long
+    COL_ARRIVAL,     // unsigned long long
+    COL_STOPCELL,    // unsigned short x 8 per event
+    COL_WAVE,        // short x rddepth per event, COL_WAVE+channel*EV_NGAIN+gain
+    COL_NCOLUMN=COL_WAVE+EV_NCHANNEL*EV_NGAIN
+  };
+
+struct ColumnarHeader
+{
+  char magic[8];
+  unsigned int rddepth;
+  unsigned int nColumn;
+  unsigned long long nEvents;
+  unsigned long long nChunk;
+  unsigned long long indexOffset;
+  unsigned int flags;              // CONV_RAW
+  unsigned int reserved;
+};
+
+struct ColumnarChunk
+{
+  unsigned long long firstEvent;   // index of its first event in the file
+  unsigned int nEvents;
+  unsigned int reserved;
+};
+
+// One column of one chunk, min/max over all its values
+struct ColumnarBlock
+{
+  unsigned long long offset;
+  unsigned long long bytes;
+  long long min;
+  long long max;
+};
+
+const char *ColumnName(int col);     // "event", "wave_c3_low", ...
+int  ColumnFind(const char *name);   // -1 when unknown
+int  ColumnWidth(int col, int rddepth);  // values per event
+int  ColumnSize(int col);            // bytes per value
+inline size_t ColumnBytes(int col, int rddepth, unsigned int n)
+{
+  return (size_t)n*ColumnWidth(col,rddepth)*ColumnSize(col);
+}
+inline size_t ColumnarIndexEntry()
+{
+  return sizeof(ColumnarChunk)+COL_NCOLUMN*sizeof(ColumnarBlock);
+}
+// Bytes of the column blocks of a chunk of n events, padding included
+size_t ColumnarChunkBytes(int rddepth, unsigned int n);
+
+// Transposes n DragonConvert records (recordSize bytes each) into the
+// column blocks of one chunk at dst, which lands at file offset off.
+// Fills the chunk's index entry.
+void ColumnarBuild(unsigned char *dst, unsigned long long off, const unsigned char *rows,
+		   unsigned int n, int rddepth, ColumnarChunk *chunk, ColumnarBlock *blocks);
+
+/******************************************/
+//  Reader, the whole file mmap()ed read only
+/******************************************/
+struct ColumnarFile
+{
+  const unsigned char *map;
+  size_t size;
+  ColumnarHeader hdr;
+};
+
+ColumnarFile *ColumnarOpen(const char *path);
+void ColumnarClose(ColumnarFile *f);
+
+inline const ColumnarChunk *ColumnarChunkAt(const ColumnarFile *f, size_t k)
+{
+  return (const ColumnarChunk *)(f->map+f->hdr.indexOffset+k*ColumnarIndexEntry());
+}
+inline const ColumnarBlock *ColumnarBlockAt(const ColumnarFile *f, size_t k, int col)
+{
+  return (const ColumnarBlock *)((const unsigned char *)(ColumnarChunkAt(f,k)+1))+col;
+}
+inline const void *ColumnarData(const ColumnarFile *f, size_t k, int col)
+{
+  return f->map+ColumnarBlockAt(f,k,col)->offset;
+}
+
+// Starts reading a block in, ahead of its use (the skipped blocks are never read)
+void ColumnarPrefetch(const ColumnarFile *f, size_t k, int col);
+// Every chunk of the file
+void ColumnarAll(const ColumnarFile *f, std::vector<size_t> &chunks);
+// Keeps the chunks of the list whose [min,max] of col overlaps [lo,hi]
+void ColumnarSelect(const ColumnarFile *f, int col, long long lo, long long hi, std::vector<size_t> &chunks);
+#endif
@@ -0,0 +1,223 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+// DragonConf.cpp
+//
+// ****Function****
+//  Reads Connection.conf. The original "IP port" lines are still valid;
+//  socket options may follow on the same line, or be given for all FEBs
+//  on a "default" line (a FEB's own value wins):
+//
+//    #IP address Port [option=value ...]
+//    default rcvbuf=8M busy_poll=50 quickack=1
+//    192.168.1.143  24  cpu=2 incoming_cpu=2
+//    192.168.1.144  24  rcvbuf=16M cpu=3
+//
+//  rcvbuf=<bytes>[K|M]  SO_RCVBUF (doubled by the kernel, capped by
+//                       net.core.rmem_max unless running with CAP_NET_ADMIN)
+//  busy_poll=<usec>     SO_BUSY_POLL
+//  quickack=0|1         TCP_QUICKACK
+//  incoming_cpu=<core>  SO_INCOMING_CPU
+//  cpu=<core>           core of the thread reading the FEB
+//
+//  Large receive buffers and busy polling keep SiTCP from running into
+//  retransmissions when the host stalls for a moment.
+//
+//  A camera is read by several acquisition processes, on one host or on
+//  several writing to the same storage, each given the same file and a
+//  shard of it (ConfShard): "1/4" for the second quarter of the FEBs, or
+//  ranges of their indices "16-31". A FEB keeps its index in the whole
+//  file, so the data files of the shards never clash and DragonMerge
+//  puts them back together.
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include <fstream>
+#include <sstream>
+
+#include "DragonConf.hh"
+
+static const TcpSockOpt SockOptUnset={-1,-1,-1,-1,-1};
+
+static bool ConfValue(const std::string &val, int &out)
+{
+  char *end;
+  long long v=strtoll(val.c_str(),&end,0);
+  if(end==val.c_str()) return false;
+  if(*end=='k' || *end=='K') { v<<=10; end++; }
+  else if(*end=='m' || *end=='M') { v<<=20; end++; }
+  if(*end!='\0' || v<0 || v>0x7fffffff) return false;
+  out=(int)v;
+  return true;
+}
+
+static bool ConfOption(const std::string &opt, TcpSockOpt &so)
+{
+  size_t eq=opt.find('=');
+  if(eq==std::string::npos) return false;
+  std::string key=opt.substr(0,eq);
+  int v;
+  if(!ConfValue(opt.substr(eq+1),v)) return false;
+  if(key=="rcvbuf")            so.rcvbuf=v;
+  else if(key=="busy_poll")    so.busyPoll=v;
+  else if(key=="quickack")     so.quickack=v;
+  else if(key=="incoming_cpu") so.incomingCpu=v;
+  else if(key=="cpu")          so.readerCpu=v;
+  else return false;
+  return true;
+}
+
+static void ConfMerge(int &v, int def)
+{
+  if(v<0) v=def;
+}
+
+int ConfRead(const char *file, std::vector<FebConf> &febs)
+{
+  std::ifstream ifs(file);
+  if(!ifs)
+    {
+      printf("Can't open %s\n",file);
+      return -1;
+    }
+  febs.clear();
+  TcpSockOpt def=SockOptUnset;
+  std::string str;
+  int line=0;
+  while(std::getline(ifs,str))
+    {
+      line++;
+      size_t hash=str.find('#');
+      if(hash!=std::string::npos) str.erase(hash);
+      std::istringstream iss(str);
+      std::string first;
+      if(!(iss>>first)) continue;
+
+      TcpSockOpt so=SockOptUnset;
+      FebConf feb;
+      bool isDefault= first=="default";
+      if(!isDefault)
+	{
+	  int port;
+	  if(!(iss>>port) || port<=0 || port>65535)
+	    {
+	      printf("%s:%d: expected \"IP port\"\n",file,line);
+	      return -1;
+	    }
+	  feb.host=first;
+	  feb.port=(unsigned short)port;
+	}
+      std::string opt;
+      while(iss>>opt)
+	if(!ConfOption(opt,so))
+	  {
+	    printf("%s:%d: unknown option %s\n",file,line,opt.c_str());
+	    return -1;
+	  }
+      if(isDefault)
+	{
+	  ConfMerge(so.rcvbuf,def.rcvbuf);
+	  ConfMerge(so.busyPoll,def.busyPoll);
+	  ConfMerge(so.quickack,def.quickack);
+	  ConfMerge(so.incomingCpu,def.incomingCpu);
+	  ConfMerge(so.readerCpu,def.readerCpu);
+	  def=so;
+	  continue;
+	}
+      feb.opt=so;
+      feb.index=febs.size();
+      febs.push_back(feb);
+    }
+  // "default" applies to every FEB, wherever it appears in the file
+  for(size_t i=0;i<febs.size();i++)
+    {
+      TcpSockOpt &so=febs[i].opt;
+      ConfMerge(so.rcvbuf,def.rcvbuf);
+      ConfMerge(so.busyPoll,def.busyPoll);
+      ConfMerge(so.quickack,def.quickack);
+      ConfMerge(so.incomingCpu,def.incomingCpu);
+      ConfMerge(so.readerCpu,def.readerCpu);
+    }
+  return 0;
+}
+
+int ConfShard(const char *spec, std::vector<FebConf> &febs, std::string *tag)
+{
+  int n=febs.size();
+  std::vector<bool> keep(n,false);
+  int k,nShard;
+  char c;
+  if(sscanf(spec,"%d/%d%c",&k,&nShard,&c)==2)
+    {
+      if(nShard<1 || k<0 || k>=nShard)
+	{
+	  printf("Bad shard %s, expected k/N with 0<=k<N\n",spec);
+	  return -1;
+	}
+      for(int i=(long long)k*n/nShard;i<(long long)(k+1)*n/nShard;i++) keep[i]=true;
+      char buf[32];
+      snprintf(buf,sizeof(buf),"_S%dof%d",k,nShard);
+      *tag=buf;
+    }
+  else
+    {
+      std::string s(spec);
+      *tag="_S";
+      size_t p=0;
+      while(p<s.size())
+	{
+	  size_t comma=s.find(',',p);
+	  std::string tok=s.substr(p, comma==std::string::npos ? std::string::npos : comma-p);
+	  p= comma==std::string::npos ? s.size() : comma+1;
+	  int first,last;
+	  int m=sscanf(tok.c_str(),"%d-%d%c",&first,&last,&c);
+	  if(m==1 && tok.find('-')==std::string::npos) last=first;
+	  else if(m!=2)
+	    {
+	      printf("Bad shard %s, expected k/N or index ranges like 0-15,32\n",spec);
+	      return -1;
+	    }
+	  if(first<0 || last<first || last>=n)
+	    {
+	      printf("Shard %s: FEB %s out of the %d of the file\n",spec,tok.c_str(),n);
+	      return -1;
+	    }
+	  for(int i=first;i<=last;i++) keep[i]=true;
+	  if(tag->size()>2) *tag+="_";
+	  *tag+=tok;
+	}
+    }
+  std::vector<FebConf> kept;
+  for(int i=0;i<n;i++)
+    if(keep[i]) kept.push_back(febs[i]);
+  febs.swap(kept);
+  return 0;
+}
+
+int ConfFebId(const std::string &host)
+{
+  size_t dot=host.rfind('.');
+  return atoi(host.c_str()+(dot==std::string::npos ? 0 : dot+1));
+}
+
+int ConfPinReader(const TcpSockOpt *opt, int nFeb)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for(int i=0;i<nFeb;i++)
+    if(opt[i].readerCpu>=0 && opt[i].readerCpu<CPU_SETSIZE) CPU_SET(opt[i].readerCpu,&set);
+  int n=CPU_COUNT(&set);
+  if(n==0) return 0;
+  if(sched_setaffinity(0,sizeof(set),&set)!=0)
+    {
+      perror("sched_setaffinity");
+      return 0;
+    }
+  printf("Reader pinned to core(s)");
+  for(int c=0;c<CPU_SETSIZE;c++)
+    if(CPU_ISSET(c,&set)) printf(" %d",c);
+  printf("\n");
+  return n;
+}
@@ -0,0 +1,43 @@
+#ifndef DRAGON_CONF_H
+#define DRAGON_CONF_H
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Connection.conf, see DragonConf.cpp for the syntax
+///////////////////////////////////////////////////////////////////////////////////////////
+
+// Socket tuning of one FEB, -1 leaves the kernel default
+struct TcpSockOpt
+{
+  int rcvbuf;       // SO_RCVBUF [bytes], SO_RCVBUFFORCE is tried first
+  int busyPoll;     // SO_BUSY_POLL [usec]
+  int quickack;     // TCP_QUICKACK, re-armed after every event when 1
+  int incomingCpu;  // SO_INCOMING_CPU
+  int readerCpu;    // core of the thread reading this FEB
+};
+
+struct FebConf
+{
+  std::string host;
+  unsigned short port;
+  TcpSockOpt opt;
+  int index;        // of the FEB in the file, from 0: its number in the data file names
+};
+
+int  ConfRead(const char *file, std::vector<FebConf> &febs);
+
+// Keeps the FEBs of one acquisition process of several: "k/N" is the
+// k-th (from 0) of N contiguous ranges, "0-15,32,40-47" lists indices.
+// tag gets a suffix for the names of the files shared by the FEBs.
+int  ConfShard(const char *spec, std::vector<FebConf> &febs, std::string *tag);
+
+// Number used in the data file names: last field of a dotted address
+int  ConfFebId(const std::string &host);
+
+// Pin the calling thread to the readerCpu of the given FEBs.
+// Returns the number of cores in the mask, 0 if none was configured.
+int  ConfPinReader(const TcpSockOpt *opt, int nFeb);
+#endif
@@ -0,0 +1,505 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+// DragonConvert.cpp
+//
+// ****Function****
+//  Converts the raw data files of DragonDaqM (_FEB<i>_IP<id>.dat, with or
+//  without -T, rolled over or unified) into one decoded event file
+//  (DragonConvert.hh), using all cores:
+//    - the input files are mmap()ed and cut into chunks of whole events,
+//      which is a division since every event has the same size,
+//    - pass 1: the threads take chunks from a shared counter, decode them
+//      (DragonEvent.cpp) and sum the samples of every capacitor of every
+//      FEB/channel/gain into their own tables, merged at the end,
+//    - pass 2: the threads decode the chunks again, subtract the pedestal
+//      of each capacitor and pwrite() their buffer straight to its place
+//      in the output, which is known from the event index alone.
+//  Nothing is serialised but the chunk counter and the merge of the sums,
+//  so the conversion scales with the number of cores until the disk is
+//  the limit.
+//  With -C the output is a columnar file (DragonColumnar.cpp) instead: the
+//  threads transpose their chunk into column blocks, whose size is also
+//  known in advance, and the chunk index with the min/max of every column
+//  is written at the end. -S scans such a file, reading only the blocks
+//  of the chunks whose min/max can match the cuts.
+//
+// ****Usage****
+//   make DragonConvert
+//   ./DragonConvert -o night.dcv [-r 30] [-j 16] [-R] [-C] calRD30_FEB*.dat
+//   ./DragonConvert -S night.dcol feb:3:3 wave_c0_high:-4000:-50
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "DragonEvent.hh"
+#include "DragonRecord.hh"
+#include "DragonClock.hh"
+#include "DragonConvert.hh"
+#include "DragonColumnar.hh"
+
+#define CHUNK_EVENTS 4096
+
+struct Chunk
+{
+  int file;
+  unsigned long long first;
+  unsigned long long n;
+};
+
+// Sums of the samples of every capacitor of one FEB
+struct PedSum
+{
+  std::vector<unsigned long long> sum; // [(channel*EV_NGAIN+gain)*EV_NCELL+cell]
+  std::vector<unsigned int> n;
+  PedSum() : sum(EV_NCHANNEL*EV_NGAIN*EV_NCELL,0), n(EV_NCHANNEL*EV_NGAIN*EV_NCELL,0) {}
+};
+
+struct Convert
+{
+  std::vector<EventFile> in;
+  std::vector<unsigned long long> outFirst; // index of the first event of each file in the output
+  std::vector<Chunk> chunk;
+  std::atomic<size_t> next;
+  int rddepth;
+  int evsize;
+  unsigned int recordSize;
+  bool raw;
+  int pass;
+  pthread_mutex_t mutex;
+  std::vector<PedSum *> sum;           // per FEB, merged pass 1 sums
+  std::vector<std::vector<float> > ped; // per FEB, pedestal of every capacitor
+  int outfd;
+  bool columnar;
+  std::vector<unsigned long long> chunkOff; // -C: file offset of the blocks of each chunk
+  std::vector<unsigned char> index;          // -C: chunk index, one entry per chunk
+  std::atomic<unsigned long long> misframed;
+  std::atomic<bool> failed;
+};
+
+static void ConvertEvent(Convert *cv, const EventFile &f, unsigned long long k,
+			 ConvertRecord *rec, unsigned short *adc, bool *framed)
+{
+  DragonRecord dr;
+  const unsigned char *p=EventFileAt(&f,k,&dr);
+  memset(rec,0,sizeof(*rec));
+  rec->feb=dr.feb;
+  rec->arrival=dr.arrival;
+  *framed=EventFramed(p);
+  if(!*framed) rec->flags|=CONV_MISFRAMED;
+  EventHeader h;
+  EventDecodeHeader(p,&h);
+  rec->clock133=h.clock133;
+  rec->event=h.event;
+  rec->trigger=h.trigger;
+  rec->clock10=h.clock10;
+  rec->pps=h.pps;
+  memcpy(rec->stopCell,h.stopCell,sizeof(rec->stopCell));
+  EventDecodeWaveforms(p,cv->rddepth,adc);
+}
+
+// Pass 1: sums per capacitor, slice 0 left out as in the online threshold scan
+static void PedAccumulate(std::vector<PedSum *> &sum, const ConvertRecord &rec, const unsigned short *adc, int rd)
+{
+  if(rec.feb>=sum.size()) sum.resize(rec.feb+1,NULL);
+  PedSum *&ps=sum[rec.feb];
+  if(ps==NULL) ps=new PedSum;
+  for(int c=0;c<EV_NCHANNEL;c++)
+    for(int g=0;g<EV_NGAIN;g++)
+      {
+	const unsigned short *w=adc+(c*EV_NGAIN+g)*rd;
+	size_t base=(size_t)(c*EV_NGAIN+g)*EV_NCELL;
+	for(int s=1;s<rd;s++)
+	  {
+	    size_t cell=base+((rec.stopCell[c]+s)&(EV_NCELL-1));
+	    ps->sum[cell]+=w[s];
+	    ps->n[cell]++;
+	  }
+      }
+}
+
+static void *ConvertLoop(void *arg)
+{
+  Convert *cv=(Convert *)arg;
+  const int rd=cv->rddepth;
+  const unsigned int rs=cv->recordSize;
+  std::vector<PedSum *> sum;
+  std::vector<unsigned char> out,col;
+  std::vector<unsigned short> adc(EV_NCHANNEL*EV_NGAIN*rd);
+  if(cv->pass==2) out.resize((size_t)CHUNK_EVENTS*rs);
+  if(cv->pass==2 && cv->columnar) col.resize(ColumnarChunkBytes(rd,CHUNK_EVENTS));
+  unsigned long long misframed=0;
+  for(;;)
+    {
+      size_t c=cv->next.fetch_add(1);
+      if(c>=cv->chunk.size() || cv->failed.load()) break;
+      const Chunk &ck=cv->chunk[c];
+      const EventFile &f=cv->in[ck.file];
+      unsigned long long outFirst=cv->outFirst[ck.file];
+      for(unsigned long long k=0;k<ck.n;k++)
+	{
+	  ConvertRecord rec;
+	  bool framed;
+	  ConvertEvent(cv,f,ck.first+k,&rec,&adc[0],&framed);
+	  if(cv->pass==1)
+	    {
+	      if(framed) PedAccumulate(sum,rec,&adc[0],rd);
+	      else misframed++;
+	      continue;
+	    }
+	  unsigned char *o=&out[(size_t)k*rs];
+	  memcpy(o,&rec,sizeof(rec));
+	  short *w=(short *)(o+sizeof(rec));
+	  if(cv->raw || rec.feb>=cv->ped.size() || cv->ped[rec.feb].empty())
+	    for(size_t s=0;s<adc.size();s++) w[s]=(short)adc[s];
+	  else
+	    {
+	      const float *ped=&cv->ped[rec.feb][0];
+	      for(int cg=0;cg<EV_NCHANNEL*EV_NGAIN;cg++)
+		{
+		  const float *pc=ped+(size_t)cg*EV_NCELL;
+		  int stop=rec.stopCell[cg/EV_NGAIN];
+		  for(int s=0;s<rd;s++)
+		    {
+		      float v=adc[cg*rd+s]-pc[(stop+s)&(EV_NCELL-1)];
+		      w[cg*rd+s]=(short)(v<0 ? v-0.5f : v+0.5f);
+		    }
+		}
+	    }
+	}
+      if(cv->pass==2)
+	{
+	  // the place of every event in the output is known, no merge needed
+	  size_t len=(size_t)ck.n*rs;
+	  off_t off=sizeof(ConvertFileHeader)+(off_t)(outFirst+ck.first)*rs;
+	  const unsigned char *buf=&out[0];
+	  if(cv->columnar)
+	    {
+	      ColumnarChunk *entry=(ColumnarChunk *)&cv->index[c*ColumnarIndexEntry()];
+	      off=cv->chunkOff[c];
+	      ColumnarBuild(&col[0],off,&out[0],ck.n,rd,entry,(ColumnarBlock *)(entry+1));
+	      entry->firstEvent=outFirst+ck.first;
+	      len=ColumnarChunkBytes(rd,ck.n);
+	      buf=&col[0];
+	    }
+	  size_t done=0;
+	  while(done<len)
+	    {
+	      ssize_t ret=pwrite(cv->outfd,buf+done,len-done,off+done);
+	      if(ret<=0)
+		{
+		  perror("pwrite");
+		  cv->failed=true;
+		  break;
+		}
+	      done+=ret;
+	    }
+	}
+    }
+  if(cv->pass==1)
+    {
+      cv->misframed+=misframed;
+      pthread_mutex_lock(&cv->mutex);
+      if(cv->sum.size()<sum.size()) cv->sum.resize(sum.size(),NULL);
+      for(size_t i=0;i<sum.size();i++)
+	{
+	  if(sum[i]==NULL) continue;
+	  if(cv->sum[i]==NULL)
+	    {
+	      cv->sum[i]=sum[i];
+	      continue;
+	    }
+	  for(size_t k=0;k<sum[i]->sum.size();k++)
+	    {
+	      cv->sum[i]->sum[k]+=sum[i]->sum[k];
+	      cv->sum[i]->n[k]+=sum[i]->n[k];
+	    }
+	  delete sum[i];
+	}
+      pthread_mutex_unlock(&cv->mutex);
+    }
+  return NULL;
+}
+
+static void RunPass(Convert *cv, int pass, int nThread)
+{
+  cv->pass=pass;
+  cv->next=0;
+  std::vector<pthread_t> th(nThread);
+  for(int t=0;t<nThread;t++)
+    if(pthread_create(&th[t],NULL,ConvertLoop,cv)!=0)
+      {
+	printf("can't create converter thread %d\n",t);
+	exit(1);
+      }
+  for(int t=0;t<nThread;t++) pthread_join(th[t],NULL);
+}
+
+// Mean of each capacitor, capacitors never seen get the mean of their channel/gain
+static void PedFinish(Convert *cv)
+{
+  cv->ped.resize(cv->sum.size());
+  for(size_t i=0;i<cv->sum.size();i++)
+    {
+      PedSum *ps=cv->sum[i];
+      if(ps==NULL) continue;
+      std::vector<float> &ped=cv->ped[i];
+      ped.assign(EV_NCHANNEL*EV_NGAIN*EV_NCELL,0);
+      for(int cg=0;cg<EV_NCHANNEL*EV_NGAIN;cg++)
+	{
+	  unsigned long long s=0,n=0;
+	  size_t base=(size_t)cg*EV_NCELL;
+	  for(int c=0;c<EV_NCELL;c++)
+	    {
+	      s+=ps->sum[base+c];
+	      n+=ps->n[base+c];
+	    }
+	  float mean= n ? (float)s/n : 0;
+	  for(int c=0;c<EV_NCELL;c++)
+	    ped[base+c]= ps->n[base+c] ? (float)ps->sum[base+c]/ps->n[base+c] : mean;
+	}
+      delete ps;
+      cv->sum[i]=NULL;
+    }
+}
+
+/******************************************/
+//  -S: cuts "column[:min:max]" on a columnar file
+/******************************************/
+struct Cut
+{
+  int col;
+  long long lo;
+  long long hi;
+  unsigned long long n;      // values read
+  unsigned long long inside; // values within [lo,hi]
+};
+
+template <class T>
+static void CutCount(Cut *cut, const void *data, size_t nValues)
+{
+  const T *v=(const T *)data;
+  unsigned long long inside=0;
+  for(size_t k=0;k<nValues;k++) inside+= (long long)v[k]>=cut->lo && (long long)v[k]<=cut->hi;
+  cut->inside+=inside;
+  cut->n+=nValues;
+}
+
+static int Scan(const char *path, int nArg, char **arg)
+{
+  ColumnarFile *f=ColumnarOpen(path);
+  if(f==NULL) return 1;
+  std::vector<Cut> cut;
+  for(int a=0;a<nArg;a++)
+    {
+      char name[64];
+      Cut c={-1,-(1LL<<62),1LL<<62,0,0};
+      int n=sscanf(arg[a],"%63[^:]:%lld:%lld",name,&c.lo,&c.hi);
+      c.col=ColumnFind(name);
+      if(c.col<0 || n==2)
+	{
+	  printf("Bad cut %s, expected <column>[:<min>:<max>] with columns\n ",arg[a]);
+	  for(int k=0;k<COL_NCOLUMN;k++) printf(" %s",ColumnName(k));
+	  printf("\n");
+	  ColumnarClose(f);
+	  return 1;
+	}
+      cut.push_back(c);
+    }
+  DragonClockInit();
+  unsigned long long t0=DragonClockNow();
+  std::vector<size_t> chunks;
+  ColumnarAll(f,chunks);
+  for(size_t i=0;i<cut.size();i++) ColumnarSelect(f,cut[i].col,cut[i].lo,cut[i].hi,chunks);
+  unsigned long long events=0,bytes=0;
+  for(size_t i=0;i<chunks.size();i++)
+    for(size_t j=0;j<cut.size();j++) ColumnarPrefetch(f,chunks[i],cut[j].col);
+  for(size_t i=0;i<chunks.size();i++)
+    {
+      events+=ColumnarChunkAt(f,chunks[i])->nEvents;
+      for(size_t j=0;j<cut.size();j++)
+	{
+	  const ColumnarBlock *b=ColumnarBlockAt(f,chunks[i],cut[j].col);
+	  const void *d=ColumnarData(f,chunks[i],cut[j].col);
+	  size_t n=b->bytes/ColumnSize(cut[j].col);
+	  bytes+=b->bytes;
+	  if(cut[j].col>=COL_WAVE) CutCount<short>(&cut[j],d,n);
+	  else if(ColumnSize(cut[j].col)==2) CutCount<unsigned short>(&cut[j],d,n);
+	  else if(ColumnSize(cut[j].col)==4) CutCount<unsigned int>(&cut[j],d,n);
+	  else CutCount<unsigned long long>(&cut[j],d,n);
+	}
+    }
+  double sec=(DragonClockNow()-t0)*1e-9;
+  printf("%s: RD%u, %llu events in %llu chunks\n",path,f->hdr.rddepth,f->hdr.nEvents,f->hdr.nChunk);
+  printf("%lu chunks (%llu events) can pass the cuts, %llu of %lu bytes read in %.3f sec\n",
+	 (unsigned long)chunks.size(),events,bytes,(unsigned long)f->size,sec);
+  for(size_t j=0;j<cut.size();j++)
+    printf("%-14s [%lld,%lld]: %llu of %llu values\n",ColumnName(cut[j].col),cut[j].lo,cut[j].hi,
+	   cut[j].inside,cut[j].n);
+  ColumnarClose(f);
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  Convert cv;
+  cv.rddepth=-1;
+  cv.raw=false;
+  cv.columnar=false;
+  const char *output=NULL;
+  const char *scan=NULL;
+  int nThread=sysconf(_SC_NPROCESSORS_ONLN);
+  int opt;
+  while((opt=getopt(argc,argv,"ho:r:j:RCS:"))!=-1)
+    {
+      switch(opt)
+	{
+	case 'o': output=optarg; break;
+	case 'r': cv.rddepth=atoi(optarg); break;
+	case 'j': nThread=atoi(optarg); break;
+	case 'R': cv.raw=true; break;
+	case 'C': cv.columnar=true; break;
+	case 'S': scan=optarg; break;
+	default:
+	  printf("Usage: %s -o <output> [-r readdepth] [-j threads] [-R] [-C] <DragonDaqM .dat files>\n",argv[0]);
+	  printf("       %s -S <columnar file> [<column>[:<min>:<max>] ...]\n",argv[0]);
+	  printf("  -r : read depth, default from the RD<n> in the first file name\n");
+	  printf("  -j : threads, default is one per core\n");
+	  printf("  -R : keep the raw ADC counts (no pedestal subtraction)\n");
+	  printf("  -C : write a columnar file (DragonColumnar.hh)\n");
+	  printf("  -S : scan a columnar file, counting the values of each column within\n");
+	  printf("       [min,max] in the chunks which can pass all the cuts\n");
+	  printf("Only the Dragon v5 event layout is decoded.\n");
+	  exit(opt=='h' ? 0 : 1);
+	}
+    }
+  if(scan) return Scan(scan,argc-optind,argv+optind);
+  if(output==NULL || optind>=argc)
+    {
+      printf("%s -h for usage\n",argv[0]);
+      exit(1);
+    }
+  if(nThread<1) nThread=1;
+  if(cv.rddepth<=0) cv.rddepth=EventFileRddepth(argv[optind]);
+  if(cv.rddepth<=0)
+    {
+      printf("Can't guess the read depth from %s, use -r\n",argv[optind]);
+      exit(1);
+    }
+  cv.evsize=EV_HEADER_SIZE+2*8*2*cv.rddepth;
+  cv.recordSize=ConvertRecordSize(cv.rddepth);
+  DragonClockInit();
+
+  unsigned long long nEvents=0;
+  size_t inBytes=0;
+  for(int a=optind;a<argc;a++)
+    {
+      EventFile f;
+      if(EventFileOpen(&f,argv[a],cv.evsize)!=0) exit(1);
+      cv.outFirst.push_back(nEvents);
+      nEvents+=f.nEvents;
+      inBytes+=f.size;
+      for(unsigned long long k=0;k<f.nEvents;k+=CHUNK_EVENTS)
+	{
+	  Chunk ck={(int)cv.in.size(),k, f.nEvents-k<CHUNK_EVENTS ? f.nEvents-k : CHUNK_EVENTS};
+	  cv.chunk.push_back(ck);
+	}
+      printf("%s: %llu events%s\n",f.name.c_str(),f.nEvents,f.records ? " with records" : "");
+      cv.in.push_back(f);
+    }
+  printf("%llu events of RD%d in %lu chunks, %d threads\n",nEvents,cv.rddepth,(unsigned long)cv.chunk.size(),nThread);
+
+  cv.outfd=open(output,O_WRONLY|O_CREAT|O_TRUNC,0644);
+  if(cv.outfd<0)
+    {
+      perror(output);
+      exit(1);
+    }
+  ColumnarHeader chdr;
+  if(cv.columnar)
+    {
+      // the blocks of each chunk follow each other, the index comes last
+      unsigned long long off=(sizeof(ColumnarHeader)+COLUMNAR_ALIGN-1)&~(COLUMNAR_ALIGN-1ULL);
+      for(size_t c=0;c<cv.chunk.size();c++)
+	{
+	  cv.chunkOff.push_back(off);
+	  off+=ColumnarChunkBytes(cv.rddepth,cv.chunk[c].n);
+	}
+      cv.index.assign(cv.chunk.size()*ColumnarIndexEntry(),0);
+      memset(&chdr,0,sizeof(chdr));
+      memcpy(chdr.magic,COLUMNAR_MAGIC,sizeof(chdr.magic));
+      chdr.rddepth=cv.rddepth;
+      chdr.nColumn=COL_NCOLUMN;
+      chdr.nEvents=nEvents;
+      chdr.nChunk=cv.chunk.size();
+      chdr.indexOffset=off;
+      chdr.flags= cv.raw ? CONV_RAW : 0;
+      if(ftruncate(cv.outfd,off+cv.index.size())!=0)
+	{
+	  perror(output);
+	  exit(1);
+	}
+    }
+  else
+    {
+      ConvertFileHeader hdr;
+      memset(&hdr,0,sizeof(hdr));
+      memcpy(hdr.magic,CONVERT_MAGIC,sizeof(hdr.magic));
+      hdr.rddepth=cv.rddepth;
+      hdr.recordSize=cv.recordSize;
+      hdr.nEvents=nEvents;
+      hdr.flags= cv.raw ? CONV_RAW : 0;
+      if(pwrite(cv.outfd,&hdr,sizeof(hdr),0)!=(ssize_t)sizeof(hdr)
+	 || ftruncate(cv.outfd,sizeof(hdr)+(off_t)nEvents*cv.recordSize)!=0)
+	{
+	  perror(output);
+	  exit(1);
+	}
+    }
+
+  pthread_mutex_init(&cv.mutex,NULL);
+  cv.misframed=0;
+  cv.failed=false;
+  unsigned long long t0=DragonClockNow();
+  if(!cv.raw)
+    {
+      RunPass(&cv,1,nThread);
+      PedFinish(&cv);
+    }
+  unsigned long long t1=DragonClockNow();
+  RunPass(&cv,2,nThread);
+  unsigned long long t2=DragonClockNow();
+  // the header goes last, so a file without its index is never taken as complete
+  if(cv.columnar && !cv.failed.load()
+     && (pwrite(cv.outfd,&cv.index[0],cv.index.size(),chdr.indexOffset)!=(ssize_t)cv.index.size()
+	 || pwrite(cv.outfd,&chdr,sizeof(chdr),0)!=(ssize_t)sizeof(chdr)))
+    {
+      perror(output);
+      cv.failed=true;
+    }
+  close(cv.outfd);
+  for(size_t i=0;i<cv.in.size();i++)
+    EventFileClose(&cv.in[i]);
+  if(cv.failed.load())
+    {
+      printf("conversion failed, %s is incomplete\n",output);
+      return 1;
+    }
+
+  double sec=(t2-t0)*1e-9;
+  if(sec<=0) sec=1e-9;
+  if(!cv.raw) printf("pedestals: %.3f sec, %llu misframed events left out\n",(t1-t0)*1e-9,cv.misframed.load());
+  printf("converted %llu events in %.3f sec: %.0f events/s, %.1f MB/s in\n",
+	 nEvents,sec,nEvents/sec,inBytes/sec/1e6);
+  if(cv.columnar) printf("output %s, columnar, %lu chunks\n",output,(unsigned long)cv.chunk.size());
+  else printf("output %s, %lu bytes per event\n",output,(unsigned long)cv.recordSize);
+  return 0;
+}
@@ -0,0 +1,43 @@
+#ifndef DRAGON_CONVERT_H
+#define DRAGON_CONVERT_H
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Decoded event file written by DragonConvert (host byte order)
+//   ConvertFileHeader, then nEvents records of recordSize bytes:
+//   a ConvertRecord followed by the waveforms as short
+//   adc[(channel*EV_NGAIN+gain)*rddepth+slice], pedestal subtracted
+//   unless CONV_RAW is set in the file flags.
+///////////////////////////////////////////////////////////////////////////////////////////
+#define CONVERT_MAGIC   "DRGCONV1"
+#define CONV_RAW        0x0001   // file flags: waveforms as read, no pedestal subtraction
+#define CONV_MISFRAMED  0x0001   // record flags: the event markers were missing
+
+struct ConvertFileHeader
+{
+  char magic[8];
+  unsigned int rddepth;
+  unsigned int recordSize;
+  unsigned long long nEvents;
+  unsigned int flags;
+  unsigned int reserved;
+};
+
+struct ConvertRecord
+{
+  unsigned long long clock133;
+  unsigned long long arrival;      // DragonRecord arrival time, 0 without -T
+  unsigned int event;
+  unsigned int trigger;
+  unsigned int clock10;
+  unsigned short pps;
+  unsigned short feb;              // FEB index of the DAQ
+  unsigned short flags;
+  unsigned short stopCell[8];
+  unsigned short reserved[3];
+};
+
+inline unsigned int ConvertRecordSize(int rddepth)
+{
+  return sizeof(ConvertRecord)+2*8*2*rddepth;
+}
+#endif
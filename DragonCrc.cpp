@@ -0,0 +1,230 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+// DragonCrc.cpp
+//
+// ****Function****
+//  Block checksums of the recorded data, so that a file damaged on its
+//  way to the archive can be told from an event the FEB sent corrupted.
+//  The writer of DragonDaqM computes the CRC32C of every block of -K
+//  bytes (1 MB by default) of each data file as it writes it, and appends
+//  it to a sidecar file <file>.crc:
+//      # DragonCrc CRC32C 1048576
+//      <offset> <length> <crc>          one line per block, crc in hex
+//  The last block of a file is shorter. The sidecar is text so that it
+//  can be checked by hand; DragonVerify re-checks files in parallel.
+//  CRC32C is the checksum of iSCSI/ext4: the SSE4.2 crc32 instruction
+//  does 8 bytes per instruction, and a slicing-by-8 table is used on
+//  hosts without it, with the same result.
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC_HAVE_SSE42 1
+#endif
+
+#include "DragonCrc.hh"
+
+#define CRC_POLY 0x82F63B78U      // reflected Castagnoli polynomial
+#define CRC_HEAD "# DragonCrc CRC32C %u\n"
+#define CRC_LINE "%llu %u %08x\n"
+
+struct CrcTable
+{
+  unsigned int t[8][256];
+  CrcTable()
+  {
+    for(unsigned int i=0;i<256;i++)
+      {
+	unsigned int c=i;
+	for(int k=0;k<8;k++) c= c&1 ? (c>>1)^CRC_POLY : c>>1;
+	t[0][i]=c;
+      }
+    for(unsigned int i=0;i<256;i++)
+      for(int s=1;s<8;s++)
+	t[s][i]=(t[s-1][i]>>8)^t[0][t[s-1][i]&0xff];
+  }
+};
+
+static const CrcTable &Table()
+{
+  static CrcTable table;
+  return table;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// checksum
+///////////////////////////////////////////////////////////////////////////////////////////
+unsigned int Crc32cSoft(unsigned int crc, const void *buf, size_t len)
+{
+  const unsigned int (*t)[256]=Table().t;
+  const unsigned char *p=(const unsigned char *)buf;
+  crc=~crc;
+  for(;len && ((size_t)p&7);len--) crc=(crc>>8)^t[0][(crc^*p++)&0xff];
+  for(;len>=8;len-=8,p+=8)
+    {
+      unsigned int lo,hi;
+      memcpy(&lo,p,4);
+      memcpy(&hi,p+4,4);
+      lo^=crc;
+      crc=t[7][lo&0xff]^t[6][(lo>>8)&0xff]^t[5][(lo>>16)&0xff]^t[4][lo>>24]^
+	t[3][hi&0xff]^t[2][(hi>>8)&0xff]^t[1][(hi>>16)&0xff]^t[0][hi>>24];
+    }
+  for(;len;len--) crc=(crc>>8)^t[0][(crc^*p++)&0xff];
+  return ~crc;
+}
+
+#ifdef CRC_HAVE_SSE42
+__attribute__((target("sse4.2")))
+static unsigned int Crc32cSse42(unsigned int crc, const void *buf, size_t len)
+{
+  const unsigned char *p=(const unsigned char *)buf;
+  unsigned long long c=~crc;
+  for(;len && ((size_t)p&7);len--) c=_mm_crc32_u8((unsigned int)c,*p++);
+  for(;len>=8;len-=8,p+=8)
+    {
+      unsigned long long v;
+      memcpy(&v,p,8);
+      c=_mm_crc32_u64(c,v);
+    }
+  for(;len;len--) c=_mm_crc32_u8((unsigned int)c,*p++);
+  return ~(unsigned int)c;
+}
+#endif
+
+bool Crc32cHard()
+{
+#ifdef CRC_HAVE_SSE42
+  static bool hard=__builtin_cpu_supports("sse4.2");
+  return hard;
+#else
+  return false;
+#endif
+}
+
+unsigned int Crc32c(unsigned int crc, const void *buf, size_t len)
+{
+#ifdef CRC_HAVE_SSE42
+  if(Crc32cHard()) return Crc32cSse42(crc,buf,len);
+#endif
+  return Crc32cSoft(crc,buf,len);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// sidecar
+///////////////////////////////////////////////////////////////////////////////////////////
+CrcWriter *CrcOpen(const std::string &data, unsigned int block)
+{
+  std::string name=data+CRC_SUFFIX;
+  FILE *fp=fopen(name.c_str(),"w");
+  if(fp==NULL)
+    {
+      printf("Can't open %s : %s\n",name.c_str(),strerror(errno));
+      return NULL;
+    }
+  fprintf(fp,CRC_HEAD,block);
+  CrcWriter *c=new CrcWriter;
+  c->fp=fp;
+  c->block=block;
+  c->offset=0;
+  c->filled=0;
+  c->crc=0;
+  return c;
+}
+
+static void CrcFlushBlock(CrcWriter *c)
+{
+  fprintf(c->fp,CRC_LINE,c->offset,c->filled,c->crc);
+  c->offset+=c->filled;
+  c->filled=0;
+  c->crc=0;
+}
+
+void CrcUpdate(CrcWriter *c, const void *buf, size_t len)
+{
+  const unsigned char *p=(const unsigned char *)buf;
+  while(len)
+    {
+      size_t n=c->block-c->filled;
+      if(n>len) n=len;
+      c->crc=Crc32c(c->crc,p,n);
+      c->filled+=n;
+      p+=n;
+      len-=n;
+      if(c->filled==c->block) CrcFlushBlock(c);
+    }
+}
+
+int CrcClose(CrcWriter *c, bool sync)
+{
+  if(c==NULL) return 0;
+  if(c->filled) CrcFlushBlock(c);
+  int ret=0;
+  if(fflush(c->fp)!=0 || (sync && fdatasync(fileno(c->fp))!=0)) ret=-1;
+  fclose(c->fp);
+  delete c;
+  return ret;
+}
+
+int CrcWrite(const std::string &data, unsigned int block, const std::vector<CrcBlock> &blocks)
+{
+  std::string name=data+CRC_SUFFIX;
+  FILE *fp=fopen(name.c_str(),"w");
+  if(fp==NULL)
+    {
+      printf("Can't open %s : %s\n",name.c_str(),strerror(errno));
+      return -1;
+    }
+  fprintf(fp,CRC_HEAD,block);
+  for(size_t k=0;k<blocks.size();k++)
+    fprintf(fp,CRC_LINE,blocks[k].offset,blocks[k].length,blocks[k].crc);
+  int ret= fclose(fp)==0 ? 0 : -1;
+  if(ret!=0) perror(name.c_str());
+  return ret;
+}
+
+int CrcRead(const std::string &data, unsigned int *block, std::vector<CrcBlock> &blocks)
+{
+  std::string name=data+CRC_SUFFIX;
+  FILE *fp=fopen(name.c_str(),"r");
+  if(fp==NULL) return -1;
+  blocks.clear();
+  char line[128];
+  int ret=0;
+  if(fgets(line,sizeof(line),fp)==NULL || sscanf(line,"# DragonCrc CRC32C %u",block)!=1 || *block==0)
+    ret=-1;
+  unsigned long long expect=0;
+  while(ret==0 && fgets(line,sizeof(line),fp))
+    {
+      CrcBlock b;
+      if(sscanf(line,"%llu %u %x",&b.offset,&b.length,&b.crc)!=3 || b.offset!=expect || b.length>*block)
+	{
+	  ret=-1;
+	  break;
+	}
+      expect+=b.length;
+      blocks.push_back(b);
+    }
+  fclose(fp);
+  if(ret!=0) printf("%s is damaged\n",name.c_str());
+  return ret;
+}
+
+int CrcParse(const char *spec, unsigned int *block)
+{
+  char *end;
+  double v=strtod(spec,&end);
+  if(*end=='k' || *end=='K') { v*=1024; end++; }
+  else if(*end=='M') { v*=1024*1024; end++; }
+  if(*end!='\0' || v<0 || v>(1U<<30))
+    {
+      printf("Bad checksum block size %s, expected <bytes>[k|M] up to 1G, 0 for none\n",spec);
+      return -1;
+    }
+  *block=(unsigned int)v;
+  return 0;
+}
@@ -0,0 +1,51 @@
+#ifndef DRAGON_CRC_H
+#define DRAGON_CRC_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// CRC32C (Castagnoli) of the data files, see DragonCrc.cpp
+///////////////////////////////////////////////////////////////////////////////////////////
+#define CRC_BLOCK_DEFAULT (1U<<20)     // bytes per checksum
+#define CRC_SUFFIX        ".crc"       // sidecar: <file>.crc
+
+// crc: 0 to start, the previous result to go on with the next bytes
+unsigned int Crc32c(unsigned int crc, const void *buf, size_t len);
+unsigned int Crc32cSoft(unsigned int crc, const void *buf, size_t len);
+// true when Crc32c() uses the SSE4.2 crc32 instruction
+bool Crc32cHard();
+
+// One line of the sidecar
+struct CrcBlock
+{
+  unsigned long long offset;
+  unsigned int length;
+  unsigned int crc;
+};
+
+// Checksums of a file being written, one per block of block bytes
+struct CrcWriter
+{
+  FILE *fp;                    // the sidecar
+  unsigned int block;
+  unsigned long long offset;   // of the current block in the data file
+  unsigned int filled;         // bytes of the current block so far
+  unsigned int crc;
+};
+
+// Creates <data>.crc for blocks of block bytes, NULL when it can't
+CrcWriter *CrcOpen(const std::string &data, unsigned int block);
+void CrcUpdate(CrcWriter *c, const void *buf, size_t len);
+// Writes the last partial block and closes the sidecar
+int  CrcClose(CrcWriter *c, bool sync);
+
+// Writes the sidecar of data from its checksums
+int  CrcWrite(const std::string &data, unsigned int block, const std::vector<CrcBlock> &blocks);
+// Reads the sidecar of data, -1 when there is none or it is damaged
+int  CrcRead(const std::string &data, unsigned int *block, std::vector<CrcBlock> &blocks);
+// Parses "<size>" with an optional k/M suffix, 0 to disable
+int  CrcParse(const char *spec, unsigned int *block);
+#endif
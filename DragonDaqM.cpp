@@ -19,16 +19,35 @@
 //    (2)can save datas from them.
 //    (3)measures throughput of taking data from FEBs.
 //    (4)can also measure each read() function for FEBs (close inspection mode).
+//    (5)serves per-FEB rates and counters on a local socket (-m, DragonMetrics.cpp)
+//       and appends them to a rate time series every second (-M).
+//    (6)can tag each stored event with its host arrival time (-T, DragonRecord.hh).
+//    (7)can run as a daemon keeping the FEB connections open between runs (-D).
+//    (8)connects to all FEBs in parallel and reconnects lost FEBs in background (DragonTcp.cpp).
+//    (9)reads the FEBs from several ingest threads (-j), with no fixed limit on the number of FEBs.
+//   (10)writes the data from a separate writer thread and degrades gracefully
+//        when the disk falls behind (-O, DragonOverload.cpp).
+//   (11)keeps the ingest threads and their buffers on the NUMA node of the NIC (-N, DragonNuma.cpp).
+//   (12)counts the events lost by each FEB from the header counters (DragonEvent.cpp).
+//   (13)can run until signalled (-C), rolling the data files over by size
+//        or age (-R), per FEB or in one file for all FEBs (-U, DragonWriter.cpp).
+//   (14)stores the CRC32C of every block of the data files next to them (-K, DragonCrc.cpp).
+//   (15)can read a shard of the FEBs of Connection.conf (-S), so that several processes
+//        share a camera; DragonMerge merges their files by event counter or clock.
+//   (16)streams the events to subscribers over TCP or a Unix socket (-F, DragonForward.cpp),
+//        with or without the data files.
 //
 // ****Usage****
 // 0.Deploy DragonDaqM.cpp, DragonDaqM.hh, and Connection.conf 
 // 1.If no executable file, Compile these with: 
 //         ****************************************************
-//         *       g++ -o DragonDaqM DragonDaqM.cpp -lrt        *
+//         *       make DragonDaqM                            *
 //         ****************************************************
 // 2.Edit connection configuration in Connection.conf
 //    which is a table of IP address and port number of the Dragon FEBs.
 //   Even if you rewrite ip address, you don't have to re-compile.
+//   Socket options (SO_RCVBUF, busy polling, reader core...) may follow
+//   the port number, see DragonConf.cpp.
 //
 // 3.Submit this with: 
 //         **********************************************************
@@ -38,6 +57,13 @@
 //     note2:The option -i (input frequency) have nothing to do with DAQ, it is just for measurement.
 //     note3:Unless you specify -s, data will not be created. 
 //            Instead, just blank file will be created.
+//     note4:With -D <path>, connections are made once and runs are driven from
+//            the control socket, e.g. with
+//              echo "configure readdepth=30 ndaq=10000 output=cal save=1" | socat - UNIX:<path>
+//              echo start | socat - UNIX:<path>
+//     note5:With -S, run one process per shard on the same Connection.conf, e.g.
+//              ./DragonDaqM -S 0/2 -s -T -o cal ; ./DragonDaqM -S 1/2 -s -T -o cal
+//            then ./DragonMerge -o cal_merged.dat calRD30_FEB*.dat
 ///////////////////////////////////////////////////////////////////////////////////////////
 
 #include <unistd.h>
@@ -64,17 +90,1020 @@
 #include <string>
 
 #include "DragonDaqM.hh"
+#include "DragonMetrics.hh"
+#include "DragonHist.hh"
+#include "DragonClock.hh"
+#include "DragonTcp.hh"
+#include "DragonConf.hh"
+#include "DragonForward.hh"
+#include "DragonRecord.hh"
+#include "DragonOverload.hh"
+#include "DragonNuma.hh"
+#include "DragonArena.hh"
+#include "DragonEvent.hh"
+#include "DragonWriter.hh"
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////
-// main program
+// run control
 ///////////////////////////////////////////////////////////////////////////////////////////
 
 //eth_dragon sock[48];
  
 #include <getopt.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <atomic>
+#include <vector>
+
+/******************************************/
+//  Parameters of one run
+//  (command line, or "configure" in daemon mode)
+/******************************************/
+struct RunParam
+{
+  int rddepth;
+  int dragonVer;
+  int infreq;
+  bool datacreate;
+  unsigned int ndaq;
+  int prescale;
+  std::string fileNameHeader;
+  bool closeinspect;
+  bool timestamp;
+  int queueMB;            // event arena of each ingest thread [MB]
+  OverloadConf overload;
+  int numa[2];            // node of the ingest and of the writer threads (DragonNuma.hh)
+  bool continuous;        // run until SIGINT/SIGTERM or "stop", ndaq is ignored
+  RollConf roll;          // data file rollover (DragonWriter.hh)
+  unsigned int crcBlock;  // bytes per CRC32C in the .crc sidecars, 0: none (DragonCrc.hh)
+  std::vector<int> febIndex; // of each FEB in Connection.conf, for the file names and records
+  std::string shardTag;   // -S, in the names of the files of all the FEBs
+};
+
+// Set by SIGINT/SIGTERM, ends the run (and the daemon) cleanly
+static std::atomic<bool> StopSignal(false);
+
+// Subscribers of the events (-F), kept across the runs of the daemon
+static Forwarder *Forward=NULL;
+
+static void StopHandler(int)
+{
+  StopSignal.store(true);
+}
+
+/******************************************/
+//  Control socket of the daemon mode
+/******************************************/
+struct DaemonCtl
+{
+  int listenfd;
+  int clientfd;
+  std::string path;
+  std::string inbuf;
+};
+
+//Definition of Event Size
+int EventSize(int dragonVer, int rddepth)
+{
+  if(dragonVer>=4)
+    {
+      //evsize=16*(rddepth*2+2);
+      return 2+2+4+4+4+8+8+2*8+2*8+2*8*2*rddepth; //bytes
+    }
+  else
+    {
+      return 16*(rddepth*2+1);
+    }
+}
+
+static void CtlReply(DaemonCtl *ctl, const char *fmt, ...)
+{
+  if(ctl==NULL || ctl->clientfd<0) return;
+  char line[1024];
+  va_list ap;
+  va_start(ap,fmt);
+  int len=vsnprintf(line,sizeof(line)-1,fmt,ap);
+  va_end(ap);
+  if(len<0) return;
+  if(len>(int)sizeof(line)-2) len=sizeof(line)-2;
+  line[len++]='\n';
+  if(write(ctl->clientfd,line,len)<0)
+    {
+      close(ctl->clientfd);
+      ctl->clientfd=-1;
+    }
+}
+
+// Appends the listening and the client socket (-1 when none) to pfd
+static void CtlPollSet(DaemonCtl *ctl, std::vector<struct pollfd> &pfd)
+{
+  struct pollfd p={ctl->listenfd,POLLIN,0};
+  pfd.push_back(p);
+  p.fd=ctl->clientfd;
+  pfd.push_back(p);
+}
+
+// Accept/read the control connection when poll() reported it
+static void CtlPoll(DaemonCtl *ctl, const struct pollfd *pfd)
+{
+  if(pfd[0].revents)
+    {
+      int fd=accept(ctl->listenfd,NULL,NULL);
+      if(fd>=0)
+	{
+	  if(ctl->clientfd>=0) close(ctl->clientfd); // one controller at a time
+	  ctl->clientfd=fd;
+	  ctl->inbuf.clear();
+	}
+    }
+  else if(ctl->clientfd>=0 && pfd[1].fd==ctl->clientfd && pfd[1].revents)
+    {
+      char buf[512];
+      int ret=read(ctl->clientfd,buf,sizeof(buf));
+      if(ret<=0)
+	{
+	  close(ctl->clientfd);
+	  ctl->clientfd=-1;
+	}
+      else
+	ctl->inbuf.append(buf,ret);
+    }
+}
+
+// true when a complete command line is in cmd
+static bool CtlCommand(DaemonCtl *ctl, std::string &cmd)
+{
+  size_t eol=ctl->inbuf.find('\n');
+  if(eol==std::string::npos) return false;
+  cmd=ctl->inbuf.substr(0,eol);
+  ctl->inbuf.erase(0,eol+1);
+  if(!cmd.empty() && cmd[cmd.size()-1]=='\r') cmd.erase(cmd.size()-1);
+  return true;
+}
+
+static int CtlOpen(DaemonCtl *ctl, const char *path)
+{
+  struct sockaddr_un addr;
+  memset(&addr,0,sizeof(addr));
+  addr.sun_family=AF_UNIX;
+  if(strlen(path)>=sizeof(addr.sun_path))
+    {
+      printf("Control socket path too long : %s\n",path);
+      return -1;
+    }
+  strcpy(addr.sun_path,path);
+  unlink(path);
+  ctl->path=path;
+  ctl->clientfd=-1;
+  ctl->listenfd=socket(AF_UNIX,SOCK_STREAM,0);
+  if(ctl->listenfd<0 || bind(ctl->listenfd,(struct sockaddr *)&addr,sizeof(addr))!=0
+     || listen(ctl->listenfd,4)!=0)
+    {
+      perror("CtlOpen()");
+      return -1;
+    }
+  return 0;
+}
+
+// "configure key=value ..." : returns false on an unknown key
+static bool Configure(RunParam &par, const std::string &args, std::string &err)
+{
+  std::istringstream iss(args);
+  std::string kv;
+  while(iss>>kv)
+    {
+      size_t eq=kv.find('=');
+      if(eq==std::string::npos)
+	{
+	  err="expected key=value : "+kv;
+	  return false;
+	}
+      std::string key=kv.substr(0,eq);
+      const char *val=kv.c_str()+eq+1;
+      if(key=="readdepth")        par.rddepth=atoi(val);
+      else if(key=="ndaq")        par.ndaq=(unsigned int)atoi(val);
+      else if(key=="output")      par.fileNameHeader=val;
+      else if(key=="prescale")    par.prescale= atoi(val)>0 ? atoi(val) : 1;
+      else if(key=="save")        par.datacreate= atoi(val)!=0;
+      else if(key=="infreq")      par.infreq=atoi(val);
+      else if(key=="version")     par.dragonVer=atoi(val);
+      else if(key=="timestamp")   par.timestamp= atoi(val)!=0;
+      else if(key=="closeinspect")par.closeinspect= atoi(val)!=0;
+      else if(key=="queue")       par.queueMB= atoi(val)>0 ? atoi(val) : par.queueMB;
+      else if(key=="continuous")  par.continuous= atoi(val)!=0;
+      else if(key=="unified")     par.roll.unified= atoi(val)!=0;
+      else if(key=="crc")
+	{
+	  if(CrcParse(val,&par.crcBlock)!=0)
+	    {
+	      err="bad checksum block (e.g. 1M, 0 for none) : "+std::string(val);
+	      return false;
+	    }
+	}
+      else if(key=="rollover")
+	{
+	  RollConf roll;
+	  RollInit(&roll);
+	  roll.unified=par.roll.unified;
+	  if(std::string(val)!="0" && RollParse(val,&roll)!=0)
+	    {
+	      err="bad rollover (e.g. 2G, 10m or 1G,600s) : "+std::string(val);
+	      return false;
+	    }
+	  par.roll=roll;
+	}
+      else if(key=="numa")
+	{
+	  if(NumaParse(val,par.numa,2)!=0)
+	    {
+	      err="bad numa placement : "+std::string(val);
+	      return false;
+	    }
+	}
+      else if(key=="overload")
+	{
+	  OverloadConf ovl;
+	  if(OverloadParse(val,&ovl)!=0 || ovl.policy==OVL_SKIP)
+	    {
+	      err="bad overload policy (none, prescale or drop) : "+std::string(val);
+	      return false;
+	    }
+	  par.overload=ovl;
+	}
+      else
+	{
+	  err="unknown key : "+key;
+	  return false;
+	}
+    }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// ingest threads
+//   The FEBs are split in contiguous ranges, one per ingest thread. Each
+//   thread waits on its own sockets with epoll (no FD_SETSIZE limit) and
+//   is the only one reading its FEBs. The events to store are queued to
+//   the writer thread, so a slow disk fills the queue instead of stalling
+//   the sockets; the fill of the queue drives the overload controller.
+///////////////////////////////////////////////////////////////////////////////////////////
+
+/******************************************/
+//  Per-FEB state of a run
+/******************************************/
+struct FebRun
+{
+  std::string datafile;
+  int index;                              // in Connection.conf (-S)
+  std::atomic<unsigned long long> llRead; // bytes, also read by "status"
+  unsigned long long llWritten;           // events, writer thread only
+  OverloadLoss loss;                      // ingest thread only
+  FrameStat frame;                        // ingest thread only
+  CounterStat counter;                    // ingest thread only
+};
+
+/******************************************/
+//  Writer queue of one ingest thread: the events are read straight
+//  into slots of the thread's arena (DragonArena.hh), and the slot
+//  indices go through a ring with a single producer (the ingest thread)
+//  and a single consumer (the writer). The ring holds every slot of the
+//  arena, so pushing never fails: running out of slots is what fills up.
+/******************************************/
+struct EventQueue
+{
+  EventArena *arena;                       // first touched by the ingest thread
+  int nSlot;                               // all slots of the arena
+  std::vector<unsigned int> slot;
+  std::atomic<unsigned long long> head;    // slots queued, ingest thread
+  std::atomic<unsigned long long> tail;    // slots written, writer thread
+};
+
+static EventQueue *QueueNew(int nFeb, int evsize, int mbytes)
+{
+  long long n=((long long)mbytes<<20)/((long long)evsize*nFeb);
+  EventArena *arena=ArenaNew(nFeb, n<16 ? 16 : (int)n,evsize);
+  if(arena==NULL) exit(1);
+  EventQueue *q=new EventQueue;
+  q->arena=arena;
+  q->nSlot=arena->nFeb*arena->nSlot;
+  q->slot.resize(q->nSlot);
+  q->head=0;
+  q->tail=0;
+  return q;
+}
+
+static void QueueDelete(EventQueue *q)
+{
+  ArenaDelete(q->arena);
+  delete q;
+}
+
+static inline double QueueFill(const EventQueue *q)
+{
+  return (double)(q->head.load(std::memory_order_relaxed)-q->tail.load(std::memory_order_acquire))/q->nSlot;
+}
+
+static inline void QueuePush(EventQueue *q, EventHandle &&ev)
+{
+  unsigned long long h=q->head.load(std::memory_order_relaxed);
+  q->slot[h%q->nSlot]=ev.Detach();
+  q->head.store(h+1,std::memory_order_release);
+}
+
+/******************************************/
+//  State shared by the ingest threads of a run
+/******************************************/
+struct RunShared
+{
+  const RunParam *par;
+  int evsize;
+  unsigned long long lReadBytes;
+  FebRun *feb;
+  int *sock;                 // -1 while the FEB is (re)connecting
+  const TcpSockOpt *sockOpt;
+  const std::string *IPAddr;
+  FebInspect *inspect;
+  FILE *fp_ms;
+  std::atomic<bool> end;
+  struct timespec tsEnd;     // set by whoever ends the run
+  int nFeb;
+  std::vector<EventQueue *> queue; // one per ingest thread
+  std::atomic<bool> ingestDone;    // the writer exits once the queues are empty
+  MetricsShard *writerMetrics;
+  DataWriter *files;               // data files, writer thread only
+  bool timestamp;                  // DragonRecord framing (-T, or a unified file)
+  Forwarder *forward;              // subscribers (-F), writer thread only
+};
+
+/******************************************/
+//  One ingest thread, reading the FEBs [first,last)
+/******************************************/
+struct Ingest
+{
+  int first;
+  int last;
+  MetricsShard *metrics;
+  std::vector<unsigned char> buf; // receive buffer when nothing is stored, kept across runs
+  std::vector<int> watched;       // fd registered in epoll for each FEB
+  RunShared *run;
+  EventQueue *queue;
+  OverloadState ovl;
+  pthread_t thread;
+};
+
+// Pins the calling thread to a node, NUMA_NIC being the node of the NIC of the FEBs [first,last)
+static int PinNode(int node, const int *sock, int first, int last, const char *who)
+{
+  if(node==NUMA_NIC) node=NumaFebNode(sock,first,last);
+  if(node<0 || NumaPinNode(node)!=0) return -1;
+  printf("%s on NUMA node %d\n",who,node);
+  return node;
+}
+
+static void RunEnd(RunShared *run)
+{
+  if(!run->end.exchange(true)) clock_gettime(CLOCK_REALTIME,&run->tsEnd);
+}
+
+// Registers the sockets which (re)appeared since the last call
+static void IngestWatch(Ingest *in, int epfd)
+{
+  for(int i=in->first;i<in->last;i++)
+    {
+      int fd=in->run->sock[i];
+      int &w=in->watched[i-in->first];
+      if(fd<0 || fd==w) continue;
+      struct epoll_event ev;
+      ev.events=EPOLLIN;
+      ev.data.u32=i;
+      if(epoll_ctl(epfd,EPOLL_CTL_ADD,fd,&ev)==0) w=fd;
+      else perror("epoll_ctl");
+    }
+}
+
+static void *IngestLoop(void *arg)
+{
+  Ingest *in=(Ingest *)arg;
+  RunShared *run=in->run;
+  const RunParam &par=*run->par;
+  const int evsize=run->evsize;
+  const bool queued= par.datacreate || run->forward; // events go to the writer thread
+  const bool closeinspect=par.closeinspect;
+  const bool framed= par.dragonVer>=4; // 0xAAAA ... 0xDDDD header
+  const OverloadConf &ovl=par.overload;
+  MetricsShard *metrics=in->metrics;
+  FebInspect *inspect=run->inspect;
+  EventQueue *queue=in->queue;
+  int *sock=run->sock;
+  // cpu= in Connection.conf wins over the NUMA placement
+  if(ConfPinReader(run->sockOpt+in->first,in->last-in->first)==0)
+    {
+      char who[64];
+      snprintf(who,sizeof(who),"ingest thread of FEB %d-%d",in->first,in->last-1);
+      PinNode(par.numa[0],sock,in->first,in->last,who);
+    }
+  // buffers are touched first from here, so they end up on this thread's node
+  if(in->buf.size()<(size_t)evsize) in->buf.resize(evsize);
+  EventArena *arena= queue ? queue->arena : NULL;
+  if(arena) NumaTouch(arena->base,(size_t)arena->nFeb*arena->nSlot*arena->slotSize);
+
+  int epfd=epoll_create1(0);
+  if(epfd<0)
+    {
+      perror("epoll_create1");
+      RunEnd(run);
+      return NULL;
+    }
+  in->watched.assign(in->last-in->first,-1);
+  IngestWatch(in,epfd);
+  struct epoll_event evs[64];
+  while(!run->end.load(std::memory_order_relaxed))
+    {
+      if(ReconnectPoll(sock,in->first,in->last)>0) IngestWatch(in,epfd);
+      int nev=epoll_wait(epfd,evs,64,10);
+      for(int k=0;k<nev && !run->end.load(std::memory_order_relaxed);k++)
+	{
+	  int i=evs[k].data.u32;
+	  if(sock[i]<0) continue;
+	  FebRun &feb=run->feb[i];
+	  unsigned long long llRead=feb.llRead.load(std::memory_order_relaxed);
+	  unsigned long long tArrival=DragonClockNow();
+	  // decided before the read, so that an event thrown away never waits for a slot
+	  int loss=-1; // OVL_PRESCALED or OVL_DROPPED, -1 if queued or not sampled
+	  bool store=false;
+	  if(queued && (llRead/evsize)%par.prescale==0)
+	    {
+	      int level=OverloadUpdate(&in->ovl,&ovl,QueueFill(queue),tArrival);
+	      if((llRead/evsize)%OverloadPrescale(&in->ovl,&ovl,par.prescale)!=0) loss=OVL_PRESCALED;
+	      // no trigger flag in DragonDaqM: every event is droppable
+	      else if(level>0 && ovl.policy==OVL_DROP) loss=OVL_DROPPED;
+	      else store=true;
+	    }
+	  // read into a slot of the arena, so that a stored event is never copied
+	  EventHandle ev;
+	  if(store)
+	    {
+	      ev=ArenaGet(arena,i-in->first);
+	      if(!ev.Valid() && ovl.policy!=OVL_DROP)
+		{
+		  // no free slot: wait for the writer, the FEB sees the backpressure
+		  feb.loss.c[OVL_STALLED]++;
+		  while(!(ev=ArenaGet(arena,i-in->first)).Valid()) usleep(50);
+		  tArrival=DragonClockNow();
+		}
+	      if(!ev.Valid())
+		{
+		  store=false;
+		  loss=OVL_DROPPED;
+		}
+	    }
+	  unsigned char *__g_buff= ev.Valid() ? ev.Data() : &in->buf[0];
+	  if(closeinspect) InspectArrival(&inspect[i],tArrival);
+	  int n=ReadEvent(sock[i],__g_buff,evsize,framed,&feb.frame,closeinspect ? &inspect[i] : NULL);
+	  if(n<=0)
+	    {
+	      // Drop the partial event and let the FEB reconnect in background
+	      fprintf(run->fp_ms,"read() from sock[%d] failed, connection lost\n",i);
+	      printf("connection to %s lost after %llu events\n",run->IPAddr[i].c_str(),llRead/evsize);
+	      close(sock[i]);
+	      sock[i]=-1;
+	      in->watched[i-in->first]=-1;
+	      ReconnectLost(i,llRead/evsize);
+	      continue;
+	    }
+	  if(feb.frame.resynced) MetricsAdd(metrics,i,M_MISFRAMED,1);
+	  if(framed)
+	    {
+	      unsigned int dTrigger;
+	      int lost=CounterCheck(&feb.counter,__g_buff,&dTrigger);
+	      if(lost>0) MetricsAdd(metrics,i,M_LOST,lost);
+	      else if(lost<0) MetricsAdd(metrics,i,M_DUPLICATE,1);
+	      if(dTrigger) MetricsAdd(metrics,i,M_TRIGGERS,dTrigger);
+	    }
+	  TcpQuickAck(sock[i],&run->sockOpt[i]);
+	  if(loss>=0)
+	    {
+	      feb.loss.c[loss]++;
+	      MetricsAdd(metrics,i,loss==OVL_PRESCALED ? M_DEGRADED : M_DROPPED,1);
+	    }
+	  else if(store)
+	    {
+	      ArenaMeta &m=ev.Meta();
+	      m.feb=i;
+	      m.size=n;
+	      m.arrival=tArrival;
+	      QueuePush(queue,std::move(ev));
+	    }
+	  // a queued event is done once the writer has written it
+	  if(closeinspect && !queued) InspectDone(&inspect[i],tArrival);
+	  MetricsAdd(metrics,i,M_EVENTS,1);
+	  MetricsAdd(metrics,i,M_BYTES_READ,n);
+	  llRead+=(unsigned long long)n;
+	  feb.llRead.store(llRead,std::memory_order_relaxed);
+	  if( llRead >= run->lReadBytes )
+	    {
+	      printf("finished %d \n",i);
+	      RunEnd(run);
+	    }
+	}
+    }
+  close(epfd);
+  return NULL;
+}
 
+// Writes what the ingest threads queued, until they are done and the queues empty
+static void *WriterLoop(void *arg)
+{
+  RunShared *run=(RunShared *)arg;
+  const bool timestamp=run->timestamp;
+  MetricsShard *metrics=run->writerMetrics;
+  DataWriter *files=run->files;
+  Forwarder *forward=run->forward;
+  const bool datacreate=run->par->datacreate;
+  PinNode(run->par->numa[1],run->sock,0,run->nFeb,"writer thread");
+  for(;;)
+    {
+      bool done=run->ingestDone.load(std::memory_order_acquire);
+      int nWritten=0;
+      for(size_t t=0;t<run->queue.size();t++)
+	{
+	  EventQueue *q=run->queue[t];
+	  unsigned long long tail=q->tail.load(std::memory_order_relaxed);
+	  unsigned long long head=q->head.load(std::memory_order_acquire);
+	  for(;tail<head;tail++)
+	    {
+	      EventHandle ev=ArenaAdopt(q->arena,q->slot[tail%q->nSlot]);
+	      const ArenaMeta &m=ev.Meta();
+	      int i=m.feb;
+	      FebRun &feb=run->feb[i];
+	      DragonRecord rec;
+	      RecordFill(&rec,feb.index,m.size,m.arrival);
+	      if(forward) ForwardPut(forward,&rec,ev.Data(),m.size);
+	      if(datacreate)
+		{
+		  int nBytes= timestamp ? m.size+sizeof(DragonRecord) : m.size;
+		  WriterFile(files,i,nBytes,m.arrival);
+		  if(timestamp) WriterPut(files,i,&rec,sizeof(rec));
+		  WriterPut(files,i,ev.Data(),m.size);
+		  feb.llWritten++;
+		  MetricsAdd(metrics,i,M_EVENTS_WRITTEN,1);
+		  MetricsAdd(metrics,i,M_BYTES_WRITTEN,nBytes);
+		}
+	      if(run->inspect) InspectDone(&run->inspect[i],m.arrival);
+	      ev.Release();
+	      q->tail.store(tail+1,std::memory_order_release);
+	      nWritten++;
+	    }
+	}
+      if(nWritten==0)
+	{
+	  if(done) break;
+	  if(forward) ForwardFlush(forward,DragonClockNow(),false);
+	  usleep(200);
+	}
+    }
+  if(forward) ForwardFlush(forward,0,true);
+  return NULL;
+}
+
+// Splits the FEBs over nThread ingest threads
+static void IngestSetup(std::vector<Ingest> &ingest, int nServ, int nThread)
+{
+  if(nThread>nServ) nThread=nServ;
+  if(nThread<1) nThread=1;
+  ingest.resize(nThread);
+  for(int t=0;t<nThread;t++)
+    {
+      ingest[t].first=(long long)nServ*t/nThread;
+      ingest[t].last=(long long)nServ*(t+1)/nThread;
+      ingest[t].metrics=MetricsNewShard();
+      ingest[t].run=NULL;
+      ingest[t].queue=NULL;
+    }
+  printf("%d ingest thread(s) for %d FEBs\n",nThread,nServ);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// one run: open files, read until ndaq events (or "stop", or a signal), write the summary
+///////////////////////////////////////////////////////////////////////////////////////////
+int RunDaq(const RunParam &par, int nServ, const std::string *IPAddr,
+	   int *sock, const TcpSockOpt *sockOpt, std::vector<Ingest> &ingest, DaemonCtl *ctl)
+{
+  using namespace std;
+
+  const int rddepth=par.rddepth;
+  const int infreq=par.infreq;
+  const bool datacreate=par.datacreate;
+  const bool closeinspect=par.closeinspect;
+  const bool timestamp=par.timestamp || par.roll.unified; // the FEB of each event must be known
+  stringstream fileName;
+  fileName<<par.fileNameHeader<<"RD"<<rddepth;
+
+  int evsize=EventSize(par.dragonVer,rddepth);
+  MetricsSetEvsize(evsize);   // -r may have changed since the last run
+  //Definition of Data Size
+  unsigned long long lReadBytes = (unsigned long long)evsize*par.ndaq; //data size to read.
+  if(par.continuous) lReadBytes=~0ULL;
+
+ /******************************************/
+  //  Difinitions for Close Inspection
+  /******************************************/
+  unsigned long long llstartdiffusec;
+  FebInspect *inspect=NULL; // per-FEB latency histograms
+
+  /******************************************/
+  //  preparation of measurement summary file
+  /******************************************/
+  stringstream daqmesfile;
+  daqmesfile<<"DragonDaqM"<<par.shardTag<<"_RD"<<rddepth<<".dat";
+  FILE *fp_ms;
+  bool isnewfile=false;
+  if ((fp_ms = fopen(daqmesfile.str().c_str(),"r"))== NULL)
+    {
+      isnewfile=true;
+    }
+  else
+    {
+      int frddepth;
+      if(fscanf(fp_ms, "The result of DragonDaqM RD%d\n",&frddepth)!=1 || frddepth!=rddepth)
+	{
+	  printf("Confirm readdepth you specify and that in %s\n",daqmesfile.str().c_str());
+	  //	  exit(EXIT_FAILURE);
+	}
+      fclose(fp_ms);
+    }
+
+  if ((fp_ms = fopen(daqmesfile.str().c_str(),"a"))== NULL)
+    {
+      printf("output file open error! exit");
+      return -1;
+    }
+  else if(isnewfile)
+    {
+      fprintf(fp_ms,"The result of DragonDaqM RD%d\n",rddepth);
+      fprintf(fp_ms,"InFreq[Hz] ");
+      for(int i=0;i<nServ;i++)fprintf(fp_ms,"RdFreq%d[Hz] RdRate%d[Mbps] ",i,i);
+      fprintf(fp_ms,"\n");
+    }
+  else{
+    printf("The file %s already exists. Data will be added to it.\n",daqmesfile.str().c_str());
+  }
+
+   /******************************************/
+  // Preparation of Data File
+  /******************************************/
+  //Initialization of Data File
+  vector<FebRun> feb(nServ);
+  vector<string> stem;
+  vector<int> stemFeb;
+  if(par.roll.unified) stem.push_back(fileName.str()+"_ALL"+par.shardTag);
+  for(int i =0;i<nServ;i++)
+    {
+      int DragonId = ConfFebId(IPAddr[i]);
+      stringstream datafile;
+      feb[i].index=par.febIndex[i];
+      datafile<<fileName.str()<<"_FEB"<<feb[i].index<<"_IP"<<DragonId;
+      feb[i].datafile=datafile.str();
+      if(!par.roll.unified)
+	{
+	  stem.push_back(feb[i].datafile);
+	  stemFeb.push_back(feb[i].index);
+	}
+    }
+  DataWriter *files=WriterOpen(par.roll,stem,stemFeb,timestamp && datacreate,datacreate ? par.crcBlock : 0);
+  if(files==NULL)
+    {
+      fclose(fp_ms);
+      return -1;
+    }
+  for(int i =0;i<nServ;i++)
+    {
+      feb[i].llRead=0;
+      feb[i].llWritten=0;
+      memset(&feb[i].loss,0,sizeof(feb[i].loss));
+      memset(&feb[i].frame,0,sizeof(feb[i].frame));
+      memset(&feb[i].counter,0,sizeof(feb[i].counter));
+    }
+
+  /******************************************/
+  //  Data Extraction
+  /******************************************/
+  struct timespec tsStart,tsRStart;
+  RunShared run;
+  run.par=&par;
+  run.evsize=evsize;
+  run.lReadBytes=lReadBytes;
+  run.feb=&feb[0];
+  run.sock=sock;
+  run.sockOpt=sockOpt;
+  run.IPAddr=IPAddr;
+  run.fp_ms=fp_ms;
+  run.end=false;
+  run.ingestDone=false;
+  run.nFeb=nServ;
+  run.files=files;
+  run.timestamp=timestamp;
+  run.forward=Forward;
+  vector<NumaStat> numaBefore,numaAfter;
+  NumaStatRead(numaBefore);
+  static MetricsShard *writerMetrics=MetricsNewShard();
+  run.writerMetrics=writerMetrics;
+  // before the writer starts, it fills the arrival-to-write histograms
+  if(closeinspect) inspect=InspectNew(nServ);
+  run.inspect=inspect;
+  pthread_t writer;
+  const bool queued= datacreate || Forward;
+  if(queued)
+    {
+      for(size_t t=0;t<ingest.size();t++)
+	{
+	  ingest[t].queue=QueueNew(ingest[t].last-ingest[t].first,evsize,par.queueMB);
+	  run.queue.push_back(ingest[t].queue);
+	}
+      ArenaPrint(ingest[0].queue->arena,"Event arena of ingest thread 0");
+      if(pthread_create(&writer,NULL,WriterLoop,&run)!=0)
+	{
+	  printf("can't create writer thread\n");
+	  exit(1);
+	}
+    }
+  clock_gettime(CLOCK_REALTIME,&tsStart);
+
+  tsRStart=tsStart;
+  run.tsEnd=tsStart;
+  llstartdiffusec = GetRealTimeInterval(&tsStart,&tsRStart);
+  for(size_t t=0;t<ingest.size();t++)
+    {
+      ingest[t].run=&run;
+      OverloadInit(&ingest[t].ovl);
+      if(pthread_create(&ingest[t].thread,NULL,IngestLoop,&ingest[t])!=0)
+	{
+	  printf("can't create ingest thread %d\n",(int)t);
+	  exit(1);
+	}
+    }
+
+  // The main thread only serves the control socket until the run ends
+  if(par.continuous) printf("continuous run, stop with SIGINT/SIGTERM%s\n",ctl ? " or \"stop\"" : "");
+  while(!run.end.load())
+    {
+      if(StopSignal.load())
+	{
+	  RunEnd(&run);
+	  printf("stopped by signal\n");
+	  break;
+	}
+      if(ctl==NULL)
+	{
+	  usleep(10000);
+	  continue;
+	}
+      vector<struct pollfd> pfd;
+      CtlPollSet(ctl,pfd);
+      poll(&pfd[0],pfd.size(),10);
+      std::string cmd;
+      CtlPoll(ctl,&pfd[0]);
+      while(CtlCommand(ctl,cmd))
+	{
+	  if(cmd=="stop")
+	    {
+	      RunEnd(&run);
+	      printf("stopped by control\n");
+	    }
+	  else if(cmd=="status")
+	    {
+	      unsigned long long nev=0;
+	      for(int i=0;i<nServ;i++) nev+=feb[i].llRead.load()/evsize;
+	      CtlReply(ctl,"OK running %llu events",nev);
+	    }
+	  else
+	    CtlReply(ctl,"ERR run in progress");
+	}
+    }
+  for(size_t t=0;t<ingest.size();t++)
+    {
+      pthread_join(ingest[t].thread,NULL);
+      ingest[t].run=NULL;
+    }
+  struct timespec tsEnd=run.tsEnd;
+  unsigned long long tEnd=DragonClockNow();
+  NumaStatRead(numaAfter);
+  if(queued)
+    {
+      run.ingestDone.store(true,std::memory_order_release);
+      pthread_join(writer,NULL);
+      for(size_t t=0;t<ingest.size();t++)
+	{
+	  QueueDelete(ingest[t].queue);
+	  ingest[t].queue=NULL;
+	}
+    }
+  printf("***** Data Acquisition End *****\n");
+  vector<unsigned long long> llRead(nServ);
+  for(int i=0;i<nServ;i++) llRead[i]=feb[i].llRead.load();
+  WriterClose(files);
+  /******************************************/
+  //  Measurement summary
+  /******************************************/
+  unsigned long long llusec = GetRealTimeInterval(&tsRStart,&tsEnd);
+  if(llusec==0) llusec=1;
+  double * readfreq = new double[nServ];
+  double * readrate = new double[nServ];
+  for(int i=0;i<nServ;i++)
+    {
+      readfreq[i] = (double)llRead[i]/(double)(evsize)/llusec*1000000.0;
+      readrate[i] = (double)(llRead[i]*8.0)/llusec*1000000.0/1000./1000.;
+      /*In throughput definition,unit factor is 1000 instead of 1024.*/
+      /*actually,duration for DAQ started after acquiring the first event */
+    }
+  //output to measurement file
+  fprintf(fp_ms,"%6d     ",infreq);
+  for(int i=0;i<nServ;i++)
+    fprintf(fp_ms,"%10.3f   %10.3f   ",readfreq[i],readrate[i]);
+  for(int i=0;i<nServ;i++)
+    {
+      /*modified(2)*/
+      fprintf(fp_ms,"%d ",ConfFebId(IPAddr[i]));
+    }
+  fprintf(fp_ms,"\n");
+  //output to terminal
+  printf("***** Throughput *****\n");
+  for(int i=0;i<nServ;i++)
+    printf("From %s: %llu bytes/%llu usec = %gMbps\n",
+	   IPAddr[i].c_str()  ,llRead[i],llusec,readrate[i]);
+  printf("***** # of events *****\n");
+  for(int i=0;i<nServ;i++)
+    printf("From %s: %6.0f events were read with residual of %d bytes\n",
+	   IPAddr[i].c_str()  ,(double)llRead[i]/(double)evsize,(int)(llRead[i]%evsize));
+  printf("InFreq[Hz]  ReadFreq[Hz] DataSize[Bytes] ReadTime[us] ReadRate[Mbps] IPaddress  NumberOfEvents(Written)\n");
+  for(int i=0;i<nServ;i++){
+    printf("%d      %g        %llu       %llu     %g    %s     %llu(%llu)\n",
+	   infreq,
+	   readfreq[i],
+	   llRead[i],
+	   llusec,
+	   readrate[i],
+	   IPAddr[i].c_str(),
+	   llRead[i]/evsize,
+	   feb[i].llWritten
+	   );
+  }
+  ReconnectReport(stdout,nServ,IPAddr);
+  vector<OverloadState> ovl(ingest.size());
+  vector<OverloadLoss> loss(nServ);
+  for(size_t t=0;t<ingest.size();t++) ovl[t]=ingest[t].ovl;
+  for(int i=0;i<nServ;i++) loss[i]=feb[i].loss;
+  OverloadReport(stdout,&par.overload,&ovl[0],ovl.size(),&loss[0],nServ,IPAddr,tEnd);
+  NumaStatReport(stdout,numaBefore,numaAfter);
+  vector<FrameStat> frame(nServ);
+  for(int i=0;i<nServ;i++) frame[i]=feb[i].frame;
+  FrameReport(stdout,&frame[0],nServ,IPAddr);
+  vector<CounterStat> counter(nServ);
+  for(int i=0;i<nServ;i++) counter[i]=feb[i].counter;
+  CounterReport(stdout,&counter[0],nServ,IPAddr);
+  WriterReport(stdout,files);
+  ForwardReport(stdout,Forward);
+  delete files;
+  CtlReply(ctl,"OK run finished %s",fileName.str().c_str());
+  delete[] readfreq;
+  delete[] readrate;
+  /****************************************************/
+  /***** Detailed measurement report output START *****/
+  /****************************************************/
+  if(closeinspect)
+    {
+      if(access("DragonDaqMes",F_OK)!=0 &&
+	 mkdir("DragonDaqMes",
+	       S_IRUSR|S_IWUSR|S_IXUSR|
+	       S_IRGRP|S_IWGRP|S_IXGRP|
+	       S_IROTH|S_IWOTH|S_IXOTH)!=0)
+	{
+	  printf("Directory creation error on creating Measurement file");
+	  fclose(fp_ms);
+	  return -1;
+	}
+      time_t tnow;
+      struct tm *sttnow;
+      time(&tnow);
+      sttnow = localtime(&tnow);
+      char buf[160];
+      sprintf(buf,"DragonDaqMes/RD%dinfreq%d_%02d%02d_%02d%02d%02d.dat"
+	      ,rddepth
+	      ,infreq
+	      ,sttnow->tm_mon
+	      ,sttnow->tm_mday
+	      ,sttnow->tm_hour
+	      ,sttnow->tm_min
+	      ,sttnow->tm_sec);
+      FILE *fp_md;
+      fp_md = fopen(buf,"w");
+      fprintf(fp_md,"InFreq[Hz]  RdFreq[Hz] DataSize[Bytes] RdTime[us]  RdRate[Mbps] ctime1-Start[usec]\n");
+      fprintf(fp_md,"%d      %g       %llu       %llu     %g       %llu\n",
+	      infreq,
+	      (double)llRead[0]/(double)evsize/llusec*1000000.0,
+	      llRead[0],
+	      llusec,
+	      (double)llRead[0]*8.0/llusec*1000000.0/1024.0/1024.0,
+	      llstartdiffusec
+	      );
+      InspectReport(fp_md,inspect,nServ,IPAddr);
+      fclose(fp_md);
+      delete[] inspect;
+    }
+  /****************************************************/
+  /***** Detailed measurement report output END   *****/
+  /****************************************************/
+  fclose(fp_ms);
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// daemon mode: keep the FEB connections open and run on request
+//   commands on the control socket (one per line):
+//     configure key=value ...  readdepth,ndaq,output,prescale,save,infreq,
+//                              version,timestamp,closeinspect,queue,overload,numa,
+//                              continuous,rollover,unified
+//     start | stop | status | quit
+///////////////////////////////////////////////////////////////////////////////////////////
+void DaemonLoop(RunParam &par, int nServ, const std::string *IPAddr,
+		int *sock, const TcpSockOpt *sockOpt, std::vector<Ingest> &ingest, DaemonCtl *ctl)
+{
+  using namespace std;
+  unsigned long long llDrained=0;
+  vector<unsigned char> drainBuf;
+  vector<struct pollfd> pfd;
+  printf("Daemon waiting for commands on %s\n",ctl->path.c_str());
+  while(!StopSignal.load())
+    {
+      int evsize=EventSize(par.dragonVer,par.rddepth);
+      if(drainBuf.size()<(size_t)evsize) drainBuf.resize(evsize);
+
+      ReconnectPoll(sock,nServ);
+      TcpPollSet(sock,nServ,pfd);
+      CtlPollSet(ctl,pfd);
+      poll(&pfd[0],pfd.size(),100);
+
+      // Between runs the data is read and thrown away, event by event,
+      // so the FEB never stalls and the next run starts on an event boundary
+      for(int i=0;i<nServ;i++)
+	if(sock[i]>=0 && pfd[i].revents)
+	  {
+	    int n=ReadEvent(sock[i],&drainBuf[0],evsize,par.dragonVer>=4,NULL,NULL);
+	    if(n<=0)
+	      {
+		printf("read() from sock[%d] failed while draining, connection lost\n",i);
+		close(sock[i]);
+		sock[i]=-1;
+		ReconnectLost(i,0);
+		continue;
+	      }
+	    llDrained+=n;
+	  }
+
+      std::string cmd;
+      CtlPoll(ctl,&pfd[nServ]);
+      while(CtlCommand(ctl,cmd))
+	{
+	  string verb=cmd.substr(0,cmd.find(' '));
+	  string args= cmd.find(' ')==string::npos ? "" : cmd.substr(cmd.find(' ')+1);
+	  if(verb=="configure")
+	    {
+	      string err;
+	      if(Configure(par,args,err)) CtlReply(ctl,"OK");
+	      else CtlReply(ctl,"ERR %s",err.c_str());
+	    }
+	  else if(verb=="start")
+	    {
+	      CtlReply(ctl,"OK run started");
+	      RunDaq(par,nServ,IPAddr,sock,sockOpt,ingest,ctl);
+	    }
+	  else if(verb=="stop")
+	    CtlReply(ctl,"OK no run in progress");
+	  else if(verb=="status")
+	    CtlReply(ctl,"OK idle rd=%d ndaq=%u output=%s prescale=%d save=%d drained=%llu bytes",
+		     par.rddepth,par.ndaq,par.fileNameHeader.c_str(),par.prescale,
+		     (int)par.datacreate,llDrained);
+	  else if(verb=="quit")
+	    {
+	      CtlReply(ctl,"OK bye");
+	      return;
+	    }
+	  else if(!verb.empty())
+	    CtlReply(ctl,"ERR unknown command %s",verb.c_str());
+	}
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// main program
+///////////////////////////////////////////////////////////////////////////////////////////
 struct option options[] =
   {
     {"help"     ,no_argument       ,NULL ,'h'},
@@ -86,28 +1115,59 @@ struct option options[] =
     {"version"  ,required_argument ,NULL ,'v'},
     {"closeinspect" ,no_argument   ,NULL ,'c'},
     {"configfile" ,required_argument   ,NULL ,'f'},
+    {"metrics" ,required_argument   ,NULL ,'m'},
+    {"rates" ,required_argument   ,NULL ,'M'},
+    {"connect-timeout" ,required_argument   ,NULL ,'k'},
+    {"timestamp" ,no_argument   ,NULL ,'T'},
+    {"prescale" ,required_argument   ,NULL ,'p'},
+    {"daemon" ,required_argument   ,NULL ,'D'},
+    {"ingest-threads" ,required_argument   ,NULL ,'j'},
+    {"overload" ,required_argument   ,NULL ,'O'},
+    {"queue" ,required_argument   ,NULL ,'q'},
+    {"numa" ,required_argument   ,NULL ,'N'},
+    {"continuous" ,no_argument   ,NULL ,'C'},
+    {"rollover" ,required_argument   ,NULL ,'R'},
+    {"unified" ,no_argument   ,NULL ,'U'},
+    {"crc" ,required_argument   ,NULL ,'K'},
+    {"shard" ,required_argument   ,NULL ,'S'},
+    {"forward" ,required_argument   ,NULL ,'F'},
     {0,0,0,0}
   };
 
 int main(int argc, char *argv[])
 {
   using namespace std;
-  
-  int rddepth=30;
-  int dragonVer=5;
-  int infreq=0;
-  bool datacreate=false;
-  unsigned int ndaq=1000;
-  string fileNameHeader;
-  stringstream fileName;
-  bool closeinspect=false;
+
+  RunParam par;
+  par.rddepth=30;
+  par.dragonVer=5;
+  par.infreq=0;
+  par.datacreate=false;
+  par.ndaq=1000;
+  par.prescale=1;
+  par.closeinspect=false;
+  par.timestamp=false;
+  par.queueMB=64;
+  OverloadParse(NULL,&par.overload);
+  par.numa[0]=NUMA_NIC;
+  par.numa[1]=NUMA_NIC;
+  par.continuous=false;
+  RollInit(&par.roll);
+  par.crcBlock=CRC_BLOCK_DEFAULT;
   string configfile = "Connection.conf";
+  const char *shardSpec = NULL;
+  const char *forwardSpec = NULL;
+  const char *metricsSpec = NULL;
+  const char *seriesSpec = NULL;
+  int connectTimeout = TCP_CONNECT_TIMEOUT_MS;
+  const char *daemonSocket = NULL;
+  int nIngest = 0; // 0: one thread per 32 FEBs
   /******************************************/
   //  Handling input arguments
   /******************************************/
   int opt;
   int index;
-  while((opt=getopt_long(argc,argv,"hi:n:o:r:sv:cf:",options,&index)) !=-1){
+  while((opt=getopt_long(argc,argv,"hi:n:o:r:sv:cf:m:M:k:Tp:D:j:O:q:N:CR:UK:S:F:",options,&index)) !=-1){
     switch(opt){
     case 'h':
  TERM_COLOR_RED;
@@ -123,67 +1183,138 @@ int main(int argc, char *argv[])
       printf("-v|--version   <Dragon Version>      : Default is 5.\n");
       printf("-c|--closeinspect                    : Default is false.\n");
       printf("-f|--configfile                      : .\n");
+      printf("-m|--metrics <port|unix:path>        : Serve per-FEB metrics. Default is off.\n");
+      printf("-M|--rates <file>[,<sec>]            : Append the per-FEB counters and rates to file every sec\n");
+      printf("                                       (default 1), CSV for a .csv file, binary otherwise.\n");
+      printf("-k|--connect-timeout <msec>          : Per-FEB connection timeout. Default is 3000.\n");
+      printf("-T|--timestamp                       : Prefix each stored event with its arrival time.\n");
+      printf("-p|--prescale                        : Save one event out of N. Default is 1.\n");
+      printf("-D|--daemon <control socket path>    : Keep connections open and wait for\n");
+      printf("                                       configure/start/stop/status/quit commands.\n");
+      printf("-j|--ingest-threads <N>              : Threads reading the FEBs. Default is one per 32 FEBs.\n");
+      printf("-q|--queue <MB>                      : Event slots of each ingest thread. Default is 64.\n");
+      printf("-N|--numa <ingest>[:<writer>]        : NUMA node (number, nic or any) of the ingest and\n");
+      printf("                                       writer threads. Default is nic:nic.\n");
+      printf("-O|--overload <policy>[:high[:low]]  : When the writer queue fills above high%% (default 80),\n");
+      printf("                                       prescale: double the prescale at each step,\n");
+      printf("                                       drop: drop events until it is back below low%% (default 50),\n");
+      printf("                                       none: wait for the writer (default).\n");
+      printf("-C|--continuous                      : Run until SIGINT/SIGTERM (or stop), -n is ignored.\n");
+      printf("-R|--rollover <size>[,<age>]         : Start a new data file at a size (k, M, G) or\n");
+      printf("                                       an age (s, m, h), e.g. 2G or 1G,10m.\n");
+      printf("-U|--unified                         : One data file for all FEBs, implies -T.\n");
+      printf("-K|--crc <bytes>[k|M]                : CRC32C of every block of the data files in <file>.crc\n");
+      printf("                                       (DragonCrc.cpp, check with DragonVerify). Default is 1M, 0 for none.\n");
+      printf("-S|--shard <k/N|ranges>              : Read only the k-th (from 0) of N parts of the FEBs of the\n");
+      printf("                                       config file, or those of the index ranges, e.g. 0-15,32.\n");
+      printf("                                       The FEBs keep their index; merge the parts with DragonMerge.\n");
+      printf("-F|--forward <socket>[,<MB>[,<kB>]]  : Stream the events, after -p and -O, in batches of kB\n");
+      printf("                                       (default 256) to the subscribers of [addr:]port (loopback\n");
+      printf("                                       unless addr is given) or unix:path, each with a queue of\n");
+      printf("                                       MB (default 64) past which it loses batches. -s is not needed.\n");
       printf("********* CAUTION ********\n");
       printf("Make sure to specify readdepth to Dragon through rpcp command.\n");
       printf("If RD=1024,limit is 3kHz at 1Gbps. so 10000events will take 10s. \n");
       printf("If RD=30,limit is 120kHz at 1Gbps. so 1000000events will take 10s. \n");
-      printf("Close inspection mode will store\n");
-      printf("  time differences between events.\n");
+      printf("Close inspection mode will store per-FEB histograms of\n");
+      printf("  inter-event time, read() duration, bytes per read() and\n");
+      printf("  arrival-to-write time (p50/p99/p99.9/max) for every event\n");
       printf("  as a file named RDXXinfreqXX_MMDD_HHMMSS.dat\n");
       printf("  in DragonDaqMes directory which will be made automatically.\n");
       printf("\n");
   TERM_COLOR_RESET;
       exit(0);
     case 'i':
-      infreq=atoi(optarg);
+      par.infreq=atoi(optarg);
       break;
     case 'o':
-      //sprintf(fileNameHeader,"%s",optarg);
-      //if(sizeof(optarg)==0);
-      //      printf("%d\n",sizeof(optarg));
-      fileNameHeader=optarg;
-      //outputfile=optarg;
+      par.fileNameHeader=optarg;
       break;
     case 's':
-      datacreate=true;
+      par.datacreate=true;
       break;
     case 'n':
-      ndaq=(unsigned int)atoi(optarg);
-      printf("ndaq %d\n",ndaq);
+      par.ndaq=(unsigned int)atoi(optarg);
+      printf("ndaq %d\n",par.ndaq);
       break;
     case 'r':
-      rddepth=atoi(optarg);
+      par.rddepth=atoi(optarg);
       break;
     case 'v':
-      dragonVer=atoi(optarg);
+      par.dragonVer=atoi(optarg);
      break;
     case 'c':
-      closeinspect=true;
+      par.closeinspect=true;
       break;
     case 'f' :
       configfile=optarg;
       break;
+    case 'm' :
+      metricsSpec=optarg;
+      break;
+    case 'M' :
+      seriesSpec=optarg;
+      break;
+    case 'k' :
+      connectTimeout=atoi(optarg);
+      break;
+    case 'T' :
+      par.timestamp=true;
+      break;
+    case 'p' :
+      par.prescale= atoi(optarg)>0 ? atoi(optarg) : 1;
+      break;
+    case 'D' :
+      daemonSocket=optarg;
+      break;
+    case 'j' :
+      nIngest=atoi(optarg);
+      break;
+    case 'O' :
+      if(OverloadParse(optarg,&par.overload)!=0) exit(1);
+      if(par.overload.policy==OVL_SKIP)
+	{
+	  printf("DragonDaqM has no analysis to skip, use prescale or drop\n");
+	  exit(1);
+	}
+      break;
+    case 'q' :
+      par.queueMB= atoi(optarg)>0 ? atoi(optarg) : par.queueMB;
+      break;
+    case 'N' :
+      if(NumaParse(optarg,par.numa,2)!=0) exit(1);
+      break;
+    case 'C' :
+      par.continuous=true;
+      break;
+    case 'R' :
+      if(RollParse(optarg,&par.roll)!=0) exit(1);
+      break;
+    case 'K' :
+      if(CrcParse(optarg,&par.crcBlock)!=0) exit(1);
+      break;
+    case 'U' :
+      par.roll.unified=true;
+      break;
+    case 'S' :
+      shardSpec=optarg;
+      break;
+    case 'F' :
+      forwardSpec=optarg;
+      break;
     default:
       printf("%s -h for usage\n",argv[0]);
     }
   }
-  printf("");
-  fileName<<fileNameHeader<<"RD"<<rddepth;
+  DragonClockInit();
+  // the first signal ends the run cleanly, a second one kills as before
+  struct sigaction sa;
+  memset(&sa,0,sizeof(sa));
+  sa.sa_handler=StopHandler;
+  sa.sa_flags=SA_RESETHAND|SA_RESTART;
+  sigaction(SIGINT,&sa,NULL);
+  sigaction(SIGTERM,&sa,NULL);
 
-  //Definition of Event Size
-  int evsize;
-  if(dragonVer>=4)
-    {
-      //evsize=16*(rddepth*2+2);
-      evsize=2+2+4+4+4+8+8+2*8+2*8+2*8*2*rddepth; //bytes
-    }
-  else
-    {
-      evsize=16*(rddepth*2+1);
-    }
-  unsigned char __g_buff[evsize];//receive buffer
-  //Definition of Data Size
-  unsigned long lReadBytes = (unsigned long)evsize*(unsigned long)ndaq; //data size to read.
   TERM_COLOR_BLUE;
   printf("*********************************************\n");
   printf("*********************************************\n");
@@ -192,7 +1323,7 @@ int main(int argc, char *argv[])
   printf("**            K.Ishio 2015 April           **\n");
   printf("**                                         **\n");
   printf("**  Aquired Data:                          **\n");
-  printf("**    %s_FEBNN.dat from connection #NN    \n",fileName.str().c_str());
+  printf("**    %sRD%d_FEBNN.dat from connection #NN    \n",par.fileNameHeader.c_str(),par.rddepth);
   printf("**  Measurement Data:                      **\n");
   printf("**    Summary is  DragonDaq.dat            **\n");
   printf("**    Close inspection is in DragonDaqMes  **\n");
@@ -200,375 +1331,87 @@ int main(int argc, char *argv[])
   printf("*********************************************\n");
   TERM_COLOR_RESET;
 
- /******************************************/
-  //  Difinitions for Close Inspection
-  /******************************************/
-  unsigned long long llstartdiffusec;
-  unsigned long long lltime_diff[1000]={0};
-  
   /******************************************/
   //  Reading Connection Configuration
   /******************************************/
-  char szAddr[48][16];
-  std::string IPAddr[48];
-  unsigned short shPort[48]={0};
-  unsigned long lConnected[48] ={0};
   //  const char *ConfFile = "Connection.conf";
   const char *ConfFile = configfile.c_str();
   cout<<"Config file = "<<configfile<<endl;
-  std::ifstream ifs(ConfFile);
-  std::string str;
-  int nServ=0;
-  while (std::getline(ifs,str)){
-    if(str[0]== '#' || str.length()==0)continue;
-    std::istringstream iss(str);
-    iss >> szAddr[nServ] >> shPort[nServ];
-    nServ++;
+  std::vector<FebConf> febConf;
+  if(ConfRead(ConfFile,febConf)!=0) exit(1);
+  if(shardSpec && ConfShard(shardSpec,febConf,&par.shardTag)!=0) exit(1);
+  int nServ=febConf.size();
+  if(nServ==0){
+    printf("No connection in %s%s\n",ConfFile,shardSpec ? " for this shard" : "");
+    exit(1);
   }
+  std::vector<std::string> IPAddr(nServ);
+  std::vector<const char *> hosts(nServ);
+  std::vector<unsigned short> shPort(nServ);
+  std::vector<unsigned long> lConnected(nServ,0);
+  std::vector<TcpSockOpt> sockOpt(nServ);
   for(int nserver=0;nserver<nServ;nserver++)
     {
-      IPAddr[nserver] = szAddr[nserver];
+      IPAddr[nserver] = febConf[nserver].host;
+      hosts[nserver]=IPAddr[nserver].c_str();
+      shPort[nserver]=febConf[nserver].port;
+      sockOpt[nserver]=febConf[nserver].opt;
+      par.febIndex.push_back(febConf[nserver].index);
     }
-
-  if(nServ>48){
-    printf("The number of connections excessed limit.");
-    exit(1);
-  }
+  if(shardSpec)
+    printf("Shard %s: FEB %d to %d of %s\n",shardSpec,par.febIndex.front(),par.febIndex.back(),ConfFile);
   cout<<"Num Server = "<<nServ<<endl;
+  // a socket and a data file per FEB
+  TcpRaiseFdLimit(2*nServ+64);
+  if(MetricsStart(metricsSpec,nServ,&IPAddr[0],EventSize(par.dragonVer,par.rddepth))!=0) exit(1);
+  if(MetricsSeriesStart(seriesSpec)!=0) exit(1);
+  if(forwardSpec && (Forward=ForwardStart(forwardSpec))==NULL) exit(1);
+  std::vector<Ingest> ingest;
+  IngestSetup(ingest,nServ, nIngest>0 ? nIngest : (nServ+31)/32);
 
-  /******************************************/
-  //  preparation of measurement summary file
-  /******************************************/
-  stringstream daqmesfile;
-  daqmesfile<<"DragonDaqM_RD"<<rddepth<<".dat";
-  FILE *fp_ms;
-  bool isnewfile;
-  if ((fp_ms = fopen(daqmesfile.str().c_str(),"r"))== NULL)
-    {
-      isnewfile=true;
-    }
-  else
-    {
-      std::string tempstr;
-      int frddepth;
-      fscanf(fp_ms, "The result of DragonDaqM RD%d\n",&frddepth);
-      if(frddepth!=rddepth)
-	{
-	  printf("Confirm readdepth you specify and that in %s\n",daqmesfile.str().c_str());
-	  //	  exit(EXIT_FAILURE);
-	}
-    }
-
-  if ((fp_ms = fopen(daqmesfile.str().c_str(),"a"))== NULL)
-    {
-      printf("output file open error! exit");
-      exit(EXIT_FAILURE);
-    }
-  else if(isnewfile)
-    {
-      fprintf(fp_ms,"The result of DragonDaqM RD%d\n",rddepth);
-      fprintf(fp_ms,"InFreq[Hz] ");
-      for(int i=0;i<nServ;i++)fprintf(fp_ms,"RdFreq%d[Hz] RdRate%d[Mbps] ",i,i);
-      fprintf(fp_ms,"\n");
-      
-      //printf("result is NULL ,fp_ms = %d\n",fp_ms);
-      //      std::cout<<"fp_ms="<<fp_ms<<std::endl;
-    }
-  else{
-    printf("The file %s already exists. Data will be added to it.\n",daqmesfile.str().c_str());
-    //printf("result is not NULL ,fp_ms = %d\n" , fp_ms);
-  }
-
-   /******************************************/
-  // Preparation of Data File
-  /******************************************/
-  //Initialization of Data File
-  char datafile[48][128];
-  FILE *fp_d[48];
-  // if(nServ==1)
-  //   {
-  //     sprintf(datafile[0],"%s.dat",outputfile,i);      
-  //     fp_d[0] = fopen(datafile[0],"wb");
-  //   }
-  // else
-    // {
-      for(int i =0;i<nServ;i++)
-	{
-	  //	  sprintf(datafile[i],"%s_FEB%d.dat",fileName.str().c_str(),i);
-	  int DragonId = atoi(IPAddr[i].substr(10).c_str());
-	  sprintf(datafile[i],"%s_FEB%d_IP%d.dat",fileName.str().c_str(),i, DragonId);
-	  cout<<"File "<<i+1<<" "<<datafile[i]<<endl;
-	  fp_d[i] = fopen(datafile[i],"wb");
-	}
-    // }
+  DaemonCtl ctl;
+  if(daemonSocket && CtlOpen(&ctl,daemonSocket)!=0) exit(1);
 
   /******************************************/
   //  Connection Initialization
   /******************************************/
-  int sock[48];
-  int isconnect=0;
-  for(int i =0;i<nServ;i++)
-    {
-      printf("read from server(%s:%u) %lu bytes\n",szAddr[i],shPort[i],lReadBytes);
-      sock[i] = ConnectTcp(szAddr[i],shPort[i],lConnected[i]);
-      printf("connection established\n");
-      printf("lConnected[%d]=%lu\n",i,lConnected[i]);
-      if(sock[i]<0)isconnect=1;
-      //      usleep(10000);
-    }
-
+  std::vector<int> sock(nServ,-1);
+  int nConnected=ConnectTcpAll(nServ,&hosts[0],&shPort[0],&sock[0],&lConnected[0],connectTimeout,&sockOpt[0]);
+  printf("%d/%d connections established\n",nConnected,nServ);
+  for(int i=0;i<nServ;i++) printf("lConnected[%d]=%lu\n",i,lConnected[i]);
+  int isconnect=(nConnected==0);
+  std::string nicName;
+  int nicNode=NumaFebNode(&sock[0],0,nServ,&nicName);
+  if(nicNode>=0)
+    printf("FEBs reached through %s, NUMA node %d of %d\n",nicName.c_str(),nicNode,NumaNodeCount());
+  // FEBs which failed, or are lost during the run, are retried in background
+  ReconnectStart(nServ,&hosts[0],&shPort[0],connectTimeout,&sockOpt[0]);
+  for(int i=0;i<nServ;i++)
+    if(sock[i]<0) ReconnectLost(i,0);
+  MetricsAddGauge("dragon_feb_socket_backlog_bytes","Bytes waiting in the socket receive queue",
+		  MetricsSocketBacklog,&sock[0]);
 
-  /******************************************/
-  //  Data Extraction
-  /******************************************/
-  //Maximum value of file discriptor
-  int maxfd=sock[0];
+  int ret=0;
   if(isconnect==0)
     {
-      memset(__g_buff,0,sizeof(__g_buff));		
-      fd_set fds, readfds;
-      FD_ZERO(&readfds);
-      for(int i=0;i<nServ;i++)FD_SET(sock[i], &readfds);
-      for(int i=1;i<nServ;i++)
-	{
-	  if(sock[i]>maxfd)maxfd=sock[i];
-	}
-
-      struct timeval tv;
-      tv.tv_sec = 0;
-      tv.tv_usec = 10000;
-      int n= 0;
-      unsigned long long llRead[48] = {0};
-      struct timespec tsStart,tsEnd,tsRStart;
-      struct timespec tsctime1,tsctime2;
-      int readcount =-1;
-      clock_gettime(CLOCK_REALTIME,&tsStart);
-      int j=0;
-
-      clock_gettime(CLOCK_REALTIME,&tsctime1);
-      tsRStart=tsctime1;
-      llstartdiffusec = GetRealTimeInterval(&tsStart,&tsctime1);
-      bool RunEnd=false;
-      while(!RunEnd)
-	{
-	  memcpy(&fds,&readfds,sizeof(fd_set));
-      	  select(maxfd+1, &fds, NULL, NULL,&tv);
-	  if(readcount==0)
-	    {
-	      //usleep(500000);
-	      // clock_gettime(CLOCK_REALTIME,&tsctime1);
-	      // tsRStart=tsctime1;
-	      // llstartdiffusec = GetRealTimeInterval(&tsStart,&tsctime1);
-	      // readcount++;
-	    }
-
-	  // {
-	  //   if( FD_ISSET(sock[0], &fds) )
-	  //     {
-	  // 	//printf("come here %d\n",__LINE__);
-	  // 	int n=0;
-	  // 	while(n<evsize)
-	  // 	  {
-	  // 	    int ret = read( sock[0],__g_buff+n,evsize-n);
-	  // 	    if(ret<0)
-	  // 	      {
-	  // 		fprintf(fp_ms,"read() from sock[%d] failed\n",0);
-	  // 		exit(1);
-	  // 	      }
-	  // 	    n+=ret;
-	  // 	  }
-	  // 	//printf("FEB1 read %d \n ",n);
-	  // 	if(datacreate)
-	  // 	  {
-	  // 	    fwrite(__g_buff,n,1,fp_d[0]);
-	  // 	  }
-	  // 	if(j<1000)
-	  // 	  {
-	  // 	    clock_gettime(CLOCK_REALTIME,&tsctime2);					     
-	  // 	    lltime_diff[j] = GetRealTimeInterval(&tsctime1,&tsctime2);
-	  // 	    tsctime1=tsctime2;
-	  // 	    //cout<<j<<endl;
-	  // 	  }
-	  // 	readcount++;
-	  // 	//if(readcount%100==0)printf("n=%d\n",n);
-	  // 	llRead[0] += (unsigned long long)n;
-	  // 	if( llRead[0] >= (unsigned long long)lReadBytes ) 
-	  // 	  {
-	  // 	    clock_gettime(CLOCK_REALTIME,&tsEnd);
-	  // 	    printf("finished here \n");
-	  // 	    break;
-	  // 	  }
-	  // 	j++;
-	  //     }/**if(FD_ISSET(sock1,&fds))**/
-	  // }
-
-	  // printf("come here %d\n",__LINE__);
-	  for(int i=0;i<nServ;i++){
-	    if( FD_ISSET(sock[i], &fds) )
-	      {
-		int n=0;
-		while(n<evsize)
-		  {
-		    int ret = read( sock[i],__g_buff+n,evsize-n);
-		    if(ret<0)
-		      {
-			fprintf(fp_ms,"read() from sock[%d] failed\n",i);
-			exit(1);
-		      }
-		    n+=ret;
-		  }
-		if(datacreate==1)
-		  {
-		    fwrite(__g_buff,n,1,fp_d[i]);
-		  }
-		//printf("FEB[%d] read %d Bytes\n ",i,n);
-		//		readcount++;
-		//if(readcount%100==0)printf("n=%d\n",n);
-		llRead[i] += (unsigned long long)n;
-		if( llRead[i] >= (unsigned long long)lReadBytes ) 
-		  {
-		    clock_gettime(CLOCK_REALTIME,&tsEnd);
-		    printf("finished %d \n",i);
-		    RunEnd=true;
-		    break;
-		  }
-		    // if( llRead[0] >= lReadBytes ) 
-		    // 	{
-		    // 	  clock_gettime(CLOCK_REALTIME,&tsEnd);
-		    // 	  break;
-		    // 	}
-	      }/**if(FD_ISSET(sock[i],&fds))**/
-	  }/**for(i<nServ)**/
-	}/**for(;;)**/
-      printf("***** Data Acquisition End *****\n");
-      //printf("readcount :%d\n",readcount);
-      for(int i=0;i<nServ;i++)
-	{
-	  close(sock[i]);
-	  fclose(fp_d[i]);
-	}
-      /******************************************/
-      //  Measurement summary 
-      /******************************************/
-      unsigned long long llusec = GetRealTimeInterval(&tsRStart,&tsEnd);
-      double * readfreq = new double[nServ];
-      double * readrate = new double[nServ];
-      for(int i=0;i<nServ;i++)
-	{
-	  readfreq[i] = (double)llRead[i]/(double)(evsize)/llusec*1000000.0;
-	  readrate[i] = (double)(llRead[i]*8.0)/llusec*1000000.0/1000./1000.;
-	  /*In throughput definition,unit factor is 1000 instead of 1024.*/
-	  /*actually,duration for DAQ started after acquiring the first event */
-	}
-      //output to measurement file
-      fprintf(fp_ms,"%6d     ",infreq);
-      for(int i=0;i<nServ;i++)
-	  fprintf(fp_ms,"%10.3f   %10.3f   ",readfreq[i],readrate[i]);
-      for(int i=0;i<nServ;i++)
-	{
-	  // fprintf(fp_ms,"%s ",szAddr[i]);
-
-	  /*modified(1)*/
-	  // char a[2];
-	  // char b[16]="";
-	  // strncpy(b,szAddr[i],16);
-	  // strncpy(a,b+11,sizeof(b)-11);
-	  // fprintf(fp_ms,"%s ",a);
-	  
-	  /*modified(2)*/
-	  char a[2];
-	  strncpy(a,szAddr[i]+11,sizeof(szAddr[i]-11));
-	  fprintf(fp_ms,"%s ",a);
-
-	}
-      fprintf(fp_ms,"\n");
-      //output to terminal
-      printf("***** Throughput *****\n");
-      for(int i=0;i<nServ;i++)
-	printf("From %s: %llu bytes/%llu usec = %gMbps\n",
-	       szAddr[i]  ,llRead[i],llusec,readrate[i]);
-      printf("***** # of events *****\n");
-      for(int i=0;i<nServ;i++)
-	printf("From %s: %6.0f events were read with residual of %d bytes\n",
-	       szAddr[i]  ,(double)llRead[i]/(double)evsize,llRead[i]%evsize);
-      printf("InFreq[Hz]  ReadFreq[Hz] DataSize[Bytes] ReadTime[us] ReadRate[Mbps] IPaddress\n");
-      for(int i=0;i<nServ;i++){
-      printf("%d      %g        %llu       %llu     %g    %s\n",
-	     infreq, 
-	     readfreq[i],
-	     llRead[i],
-	     llusec,
-	     readrate[i],
-	     szAddr[i]
-	     );
-      }	      
-      delete[] readfreq;
-      delete[] readrate;
-      /****************************************************/
-      /***** Detailed measurement report output START *****/
-      /****************************************************/
-      if(closeinspect)
-	{
-	  if(chdir("DragonDaqMes")==0)
-	    {
-	      //printf("MeasurementData will be created in DragonDaqMes.\n");
-	    }
-	  else
-	    {
-	      if(mkdir("DragonDaqMes",
-		       S_IRUSR|S_IWUSR|S_IXUSR|
-		       S_IRGRP|S_IWGRP|S_IXGRP|
-		       S_IROTH|S_IWOTH|S_IXOTH)==0)	
-		{
-		  chdir("DragonDaqMes");
-		  //printf("Directory DragonDaqMes is created.\n");
-		  //printf("MeasurementData will be created in DragonDaqMes.\n");
-		}
-	      else
-		{
-		  printf("Directory creation error on creating Measurement file");
-		  return -1;
-		}
-	    }
-	  time_t tnow;
-	  struct tm *sttnow;
-	  time(&tnow);
-	  sttnow = localtime(&tnow);
-	  char buf[126];
-	  sprintf(buf,"RD%dinfreq%d_%02d%02d_%02d%02d%02d.dat"
-		  ,rddepth
-		  ,infreq
-		  ,sttnow->tm_mon
-		  ,sttnow->tm_mday
-		  ,sttnow->tm_hour
-		  ,sttnow->tm_min
-		  ,sttnow->tm_sec);
-	  FILE *fp_md;
-	  fp_md = fopen(buf,"w");
-	  //  fprintf(fp_md,"InFreq[Hz]  RdFreq[Hz] WrFreq[Hz] DataSize[Bytes] RdTime[us] WrTime[us] RdRate[Mbps] wst-rst[usec] wen-ren[usec]\n");
-	  //  fprintf(fp_md,"%d      %g    %g       %d       %llu       %llu     %g       %llu       %llu\n",
-	  fprintf(fp_md,"InFreq[Hz]  RdFreq[Hz] DataSize[Bytes] RdTime[us]  RdRate[Mbps] ctime1-Start[usec]\n");
-	  fprintf(fp_md,"%d      %g       %llu       %llu     %g       %llu\n",
-		  infreq, 
-		  (double)llRead[0]/976.0/llusec*1000000.0,
-		  llRead,
-		  llusec,
-		  (double)llRead[0]*8.0/llusec*1000000.0/1024.0/1024.0,
-		  llstartdiffusec
-		  );
-	  for(int i=0;i<1000;i++)
-	    {
-	      fprintf(fp_md,"%llu\n",lltime_diff[i]);
-	    }
-	  fclose(fp_md);
-	}
-      /****************************************************/
-      /***** Detailed measurement report output END   *****/
-      /****************************************************/
+      if(daemonSocket)
+	DaemonLoop(par,nServ,&IPAddr[0],&sock[0],&sockOpt[0],ingest,&ctl);
+      else
+	ret=RunDaq(par,nServ,&IPAddr[0],&sock[0],&sockOpt[0],ingest,NULL);
     }else{
     printf("can't connect to servert\n");
   }
-  fclose(fp_ms);
+  ReconnectStop();
+  ForwardStop(Forward);
+  MetricsStop();
+  for(int i=0;i<nServ;i++)
+    if(sock[i]>=0) close(sock[i]);
+  if(daemonSocket)
+    {
+      close(ctl.listenfd);
+      unlink(ctl.path.c_str());
+    }
+  return ret;
 }
 ///////////////////////////////////////////////////////////////////////////////////////////
 // main program END
@@ -576,66 +1419,6 @@ int main(int argc, char *argv[])
 
 
 
-///////////////////////////////////////////////////////////////////////////////////////////
-// connect to a server(SiTCP)
-///////////////////////////////////////////////////////////////////////////////////////////
-int ConnectTcp(const char *pszHost, unsigned short shPort, unsigned long &lConnectedIP )
-{
-  int sockTcp = -1;
-  struct sockaddr_in addrTcp;
-  sockTcp = socket(AF_INET, SOCK_STREAM, 0);
-  if( sockTcp < 0 ){
-    perror("socket");
-    return -1;
-  }
-  addrTcp.sin_family = AF_INET;
-  addrTcp.sin_port = htons(shPort);
-  addrTcp.sin_addr.s_addr = inet_addr(pszHost);
-  if( addrTcp.sin_addr.s_addr == 0xffffffff ){
-    struct hostent *host = gethostbyname(pszHost);
-    if( host == NULL ){
-      if( h_errno == HOST_NOT_FOUND ){
-	printf("ConnectTcp() host not found : %s\n",pszHost);
-      }else{
-	printf("ConnectTcp() %s : %s\n",hstrerror(h_errno),pszHost);
-	fprintf(stderr,"%s : %s\n",hstrerror(h_errno),pszHost);
-      }
-      return -2;
-    }
-    unsigned int **addrptr = (unsigned int **)host->h_addr_list;
-    while( *addrptr != NULL){
-      addrTcp.sin_addr.s_addr = *(*addrptr);
-      if(connect(sockTcp,(struct sockaddr *)&addrTcp,sizeof(addrTcp)) ==0 )
-	{			
-	  lConnectedIP = (unsigned long )addrTcp.sin_addr.s_addr;
-	  break;
-	}
-      addrptr++;
-    }
-    if( addrptr == NULL) {
-      perror("ConnectTCP()::connect(1)");
-      printf("ERROR:ConnectTCP:: host not found (%d) to %s:%u\n",sockTcp,pszHost,shPort);
-      return -3;
-    }else{
-      printf("ConnectTCP::Connected0(%d) to %s:%u\n",sockTcp,pszHost,shPort);
-    }
-  }else{
-    if(connect(sockTcp,(struct sockaddr *)&addrTcp,sizeof(addrTcp)) !=0 )
-      {
-	perror("ConnectTCP()::connect(2)");
-	printf("ERROR:ConnectTCP:: can't connect not found (%d) to %08X %s:%u\n",addrTcp.sin_addr.s_addr,sockTcp,pszHost,shPort);
-	sockTcp = -1;
-	close(sockTcp);
-	return -4;
-      }else{
-      lConnectedIP = (unsigned long )addrTcp.sin_addr.s_addr;
-      printf("ConnectTCP::Connected1(%d) %s:%d\n",sockTcp,pszHost,shPort);
-    }
-  }
-  return( sockTcp );
-}
-
-
 ///////////////////////////////////////////////////////////////////////////////////////////
 // time calc
 ///////////////////////////////////////////////////////////////////////////////////////////
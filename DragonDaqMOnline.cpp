@@ -1,5 +1,5 @@
 ///////////////////////////////////////////////////////////////////////////////////////////
-// DragonDaqM.cpp
+// DragonDaqMOnline.cpp
 // by Kazuma Ishio Univ. of Tokyo
 // Last update on 2015/04/27
 //
@@ -19,16 +19,28 @@
 //    (2)can save datas from them.
 //    (3)measures throughput of taking data from FEBs.
 //    (4)can also measure each read() function for FEBs (close inspection mode).
+//    (5)serves per-FEB rates and counters on a local socket (-m, DragonMetrics.cpp)
+//       and appends them to a rate time series every second (-M).
+//    (6)can tag each stored event with its host arrival time (-T, DragonRecord.hh).
+//    (7)connects to all FEBs in parallel and reconnects lost FEBs in background (DragonTcp.cpp).
+//    (8)has no fixed limit on the number of FEBs (poll() instead of select()).
+//    (9)degrades the processing when the host falls behind (-O, DragonOverload.cpp).
+//   (10)runs on the NUMA node of the NIC the FEBs are reached through (-N, DragonNuma.cpp).
+//   (11)counts the events lost by each FEB from the header counters (DragonEvent.cpp).
+//   (12)can check only the header of most events and fully decode a sample
+//        of them, and those failing a header check (-S, DragonEvent.cpp).
 //
 // ****Usage****
-// 0.Deploy DragonDaqM.cpp, DragonDaqM.hh, and Connection.conf 
+// 0.Deploy DragonDaqMOnline.cpp, DragonDaqM.hh, and Connection.conf 
 // 1.If no executable file, Compile these with: 
 //         ****************************************************
-//         *       g++ -o DragonDaqM DragonDaqM.cpp -lrt        *
+//         *       make DragonDaqMOnline                      *
 //         ****************************************************
 // 2.Edit connection configuration in Connection.conf
 //    which is a table of IP address and port number of the Dragon FEBs.
 //   Even if you rewrite ip address, you don't have to re-compile.
+//   Socket options (SO_RCVBUF, busy polling, reader core...) may follow
+//   the port number, see DragonConf.cpp.
 //
 // 3.Submit this with: 
 //         **********************************************************
@@ -64,6 +76,16 @@
 #include <string>
 
 #include "DragonDaqM.hh"
+#include "DragonMetrics.hh"
+#include "DragonHist.hh"
+#include "DragonClock.hh"
+#include "DragonTcp.hh"
+#include "DragonConf.hh"
+#include "DragonRecord.hh"
+#include "DragonOverload.hh"
+#include "DragonNuma.hh"
+#include "DragonArena.hh"
+#include "DragonEvent.hh"
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////
@@ -86,8 +108,15 @@ struct option options[] =
     {"version"  ,required_argument ,NULL ,'v'},
     {"closeinspect" ,no_argument   ,NULL ,'c'},
     {"configfile" ,required_argument   ,NULL ,'f'},
+    {"metrics" ,required_argument   ,NULL ,'m'},
+    {"rates" ,required_argument   ,NULL ,'M'},
+    {"connect-timeout" ,required_argument   ,NULL ,'k'},
+    {"timestamp" ,no_argument   ,NULL ,'T'},
     {"prescale" ,required_argument   ,NULL ,'p'},
     {"threshold" ,required_argument   ,NULL ,'t'},
+    {"overload" ,required_argument   ,NULL ,'O'},
+    {"numa" ,required_argument   ,NULL ,'N'},
+    {"sample" ,required_argument   ,NULL ,'S'},
     {0,0,0,0}
   };
 
@@ -104,14 +133,22 @@ int main(int argc, char *argv[])
   stringstream fileName;
   bool closeinspect=false;
   string configfile = "Connection.conf";
+  const char *metricsSpec = NULL;
+  const char *seriesSpec = NULL;
+  unsigned int sample = 0;  // -S, 0: every event fully decoded
+  int connectTimeout = TCP_CONNECT_TIMEOUT_MS;
+  bool timestamp=false;
   int PreScaleFactor = 1;
   unsigned int ADCthreshold = 0;
+  OverloadConf ovlConf;
+  OverloadParse(NULL,&ovlConf);
+  int numaNode = NUMA_NIC;
   /******************************************/
   //  Handling input arguments
   /******************************************/
   int opt;
   int index;
-  while((opt=getopt_long(argc,argv,"hi:n:o:r:sv:cf:p:t:",options,&index)) !=-1){
+  while((opt=getopt_long(argc,argv,"hi:n:o:r:sv:cf:p:t:m:M:k:TO:N:S:",options,&index)) !=-1){
     switch(opt){
     case 'h':
  TERM_COLOR_RED;
@@ -127,14 +164,28 @@ int main(int argc, char *argv[])
       printf("-v|--version   <Dragon Version>      : Default is 5.\n");
       printf("-c|--closeinspect                    : Default is false.\n");
       printf("-f|--configfile                      : .\n");
+      printf("-m|--metrics <port|unix:path>        : Serve per-FEB metrics. Default is off.\n");
+      printf("-M|--rates <file>[,<sec>]            : Append the per-FEB counters and rates to file every sec\n");
+      printf("                                       (default 1), CSV for a .csv file, binary otherwise.\n");
+      printf("-k|--connect-timeout <msec>          : Per-FEB connection timeout. Default is 3000.\n");
+      printf("-T|--timestamp                       : Prefix each stored event with its arrival time.\n");
       printf("-p|--prescale                        : Default is 1 (no pre-scaling) .\n");
       printf("-t|--threshold                       : Default is 0 .\n");
+      printf("-N|--numa <node|nic|any>             : NUMA node to run on. Default is nic.\n");
+      printf("-S|--sample <N>                      : Check the header of every event, analyse only one event in N\n");
+      printf("                                       (by EventCounter) and those failing a header check.\n");
+      printf("-O|--overload <policy>[:high[:low]]  : When a socket receive queue fills above high%% (default 80),\n");
+      printf("                                       prescale: double the prescale at each step,\n");
+      printf("                                       skip: skip the threshold scan,\n");
+      printf("                                       drop: store only the flagged events,\n");
+      printf("                                       until it is back below low%% (default 50).\n");
       printf("********* CAUTION ********\n");
       printf("Make sure to specify readdepth to Dragon through rpcp command.\n");
       printf("If RD=1024,limit is 3kHz at 1Gbps. so 10000events will take 10s. \n");
       printf("If RD=30,limit is 120kHz at 1Gbps. so 1000000events will take 10s. \n");
-      printf("Close inspection mode will store\n");
-      printf("  time differences between events.\n");
+      printf("Close inspection mode will store per-FEB histograms of\n");
+      printf("  inter-event time, read() duration, bytes per read() and\n");
+      printf("  arrival-to-write time (p50/p99/p99.9/max) for every event\n");
       printf("  as a file named RDXXinfreqXX_MMDD_HHMMSS.dat\n");
       printf("  in DragonDaqMes directory which will be made automatically.\n");
       printf("\n");
@@ -169,18 +220,45 @@ int main(int argc, char *argv[])
     case 'f' :
       configfile=optarg;
       break;
+    case 'm' :
+      metricsSpec=optarg;
+      break;
+    case 'M' :
+      seriesSpec=optarg;
+      break;
+    case 'k' :
+      connectTimeout=atoi(optarg);
+      break;
+    case 'T' :
+      timestamp=true;
+      break;
     case 'p' :
       PreScaleFactor = atoi(optarg);
       break;
     case 't' :
       ADCthreshold = atoi(optarg);
       break;
+    case 'S' :
+      sample=(unsigned int)atoi(optarg);
+      break;
+    case 'N' :
+      if(NumaParse(optarg,&numaNode,1)!=0) exit(1);
+      break;
+    case 'O' :
+      if(OverloadParse(optarg,&ovlConf)!=0) exit(1);
+      break;
     default:
       printf("%s -h for usage\n",argv[0]);
     }
   }
   printf("");
   fileName<<fileNameHeader<<"RD"<<rddepth;
+  if(sample>0 && dragonVer<5)
+    {
+      printf("-S needs the v5 event header\n");
+      exit(1);
+    }
+  DragonClockInit();
 
   //Definition of Event Size
   int evsize;
@@ -208,7 +286,7 @@ int main(int argc, char *argv[])
 	2*8+ // flag
 	2*8; // first capacitor id
     }
-  unsigned char __g_buff[evsize];//receive buffer
+  unsigned char *__g_buff=NULL;//receive buffer, a slot of the event arena
   //Definition of Data Size
   unsigned long lReadBytes = (unsigned long)evsize*(unsigned long)ndaq; //data size to read.
   TERM_COLOR_BLUE;
@@ -231,37 +309,42 @@ int main(int argc, char *argv[])
   //  Difinitions for Close Inspection
   /******************************************/
   unsigned long long llstartdiffusec;
-  unsigned long long lltime_diff[1000]={0};
+  FebInspect *inspect=NULL; // per-FEB latency histograms
   
   /******************************************/
   //  Reading Connection Configuration
   /******************************************/
-  char szAddr[48][16];
-  std::string IPAddr[48];
-  unsigned short shPort[48]={0};
-  unsigned long lConnected[48] ={0};
   //  const char *ConfFile = "Connection.conf";
   const char *ConfFile = configfile.c_str();
   cout<<"Config file = "<<configfile<<endl;
-  std::ifstream ifs(ConfFile);
-  std::string str;
-  int nServ=0;
-  while (std::getline(ifs,str)){
-    if(str[0]== '#' || str.length()==0)continue;
-    std::istringstream iss(str);
-    iss >> szAddr[nServ] >> shPort[nServ];
-    nServ++;
+  std::vector<FebConf> febConf;
+  if(ConfRead(ConfFile,febConf)!=0) exit(1);
+  int nServ=febConf.size();
+  if(nServ==0){
+    printf("No connection in %s\n",ConfFile);
+    exit(1);
   }
+  std::vector<std::string> IPAddr(nServ);
+  std::vector<const char *> szAddr(nServ);
+  std::vector<unsigned short> shPort(nServ);
+  std::vector<unsigned long> lConnected(nServ,0);
+  std::vector<TcpSockOpt> sockOpt(nServ);
   for(int nserver=0;nserver<nServ;nserver++)
     {
-      IPAddr[nserver] = szAddr[nserver];
+      IPAddr[nserver] = febConf[nserver].host;
+      szAddr[nserver] = IPAddr[nserver].c_str();
+      shPort[nserver]=febConf[nserver].port;
+      sockOpt[nserver]=febConf[nserver].opt;
     }
-
-  if(nServ>48){
-    printf("The number of connections excessed limit.");
-    exit(1);
-  }
   cout<<"Num Server = "<<nServ<<endl;
+  // one event slot per FEB, touched first by the read loop (after the NUMA pinning)
+  EventArena *arena=ArenaNew(nServ,1,evsize);
+  if(arena==NULL) exit(1);
+  // a socket and a data file per FEB
+  TcpRaiseFdLimit(2*nServ+64);
+  if(MetricsStart(metricsSpec,nServ,&IPAddr[0],evsize)!=0) exit(1);
+  if(MetricsSeriesStart(seriesSpec)!=0) exit(1);
+  MetricsShard *metrics=MetricsNewShard();
 
   /******************************************/
   //  preparation of measurement summary file
@@ -310,8 +393,8 @@ int main(int argc, char *argv[])
   // Preparation of Data File
   /******************************************/
   //Initialization of Data File
-  char datafile[48][128];
-  FILE *fp_d[48];
+  std::vector<std::string> datafile(nServ);
+  std::vector<FILE *> fp_d(nServ);
   // if(nServ==1)
   //   {
   //     sprintf(datafile[0],"%s.dat",outputfile,i);      
@@ -322,59 +405,69 @@ int main(int argc, char *argv[])
       for(int i =0;i<nServ;i++)
 	{
 	  //	  sprintf(datafile[i],"%s_FEB%d.dat",fileName.str().c_str(),i);
-	  int DragonId = atoi(IPAddr[i].substr(10).c_str());
-	  sprintf(datafile[i],"%s_FEB%d_IP%d.dat",fileName.str().c_str(),i, DragonId);
+	  int DragonId = ConfFebId(IPAddr[i]);
+	  stringstream datafileName;
+	  datafileName<<fileName.str()<<"_FEB"<<i<<"_IP"<<DragonId<<".dat";
+	  datafile[i]=datafileName.str();
 	  cout<<"File "<<i+1<<" "<<datafile[i]<<endl;
-	  fp_d[i] = fopen(datafile[i],"wb");
+	  fp_d[i] = fopen(datafile[i].c_str(),"wb");
+	  if(timestamp && datacreate) RecordWriteSync(fp_d[i],i,DragonClockNow(),DragonClockRealtimeOffset());
 	}
     // }
 
   /******************************************/
   //  Connection Initialization
   /******************************************/
-  int sock[48];
-  int isconnect=0;
-  for(int i =0;i<nServ;i++)
+  std::vector<int> sock(nServ,-1);
+  int nConnected=ConnectTcpAll(nServ,&szAddr[0],&shPort[0],&sock[0],&lConnected[0],connectTimeout,&sockOpt[0]);
+  printf("%d/%d connections established\n",nConnected,nServ);
+  for(int i=0;i<nServ;i++) printf("lConnected[%d]=%lu\n",i,lConnected[i]);
+  int isconnect=(nConnected==0);
+  // FEBs which failed, or are lost during the run, are retried in background
+  ReconnectStart(nServ,&szAddr[0],&shPort[0],connectTimeout,&sockOpt[0]);
+  // cpu= in Connection.conf wins over the NUMA placement
+  if(ConfPinReader(&sockOpt[0],nServ)==0)
     {
-      printf("read from server(%s:%u) %lu bytes\n",szAddr[i],shPort[i],lReadBytes);
-      sock[i] = ConnectTcp(szAddr[i],shPort[i],lConnected[i]);
-      printf("connection established\n");
-      printf("lConnected[%d]=%lu\n",i,lConnected[i]);
-      if(sock[i]<0)isconnect=1;
-      //      usleep(10000);
+      std::string nicName;
+      int nicNode=NumaFebNode(&sock[0],0,nServ,&nicName);
+      if(nicNode>=0)
+	printf("FEBs reached through %s, NUMA node %d of %d\n",nicName.c_str(),nicNode,NumaNodeCount());
+      int node= numaNode==NUMA_NIC ? nicNode : numaNode;
+      if(node>=0 && NumaPinNode(node)==0) printf("Running on NUMA node %d\n",node);
     }
+  for(int i=0;i<nServ;i++)
+    if(sock[i]<0) ReconnectLost(i,0);
+  MetricsAddGauge("dragon_feb_socket_backlog_bytes","Bytes waiting in the socket receive queue",
+		  MetricsSocketBacklog,&sock[0]);
 
 
   /******************************************/
   //  Data Extraction
   /******************************************/
-  //Maximum value of file discriptor
-  int maxfd=sock[0];
+  std::vector<struct pollfd> pfd;
 
-  int NumberOfEvents[48]={0};
-  int WrittenNumberOfEvents[48]={0};
+  std::vector<int> NumberOfEvents(nServ,0);
+  std::vector<int> WrittenNumberOfEvents(nServ,0);
   unsigned short tempADCcount=0;
-  int DataCorruption[48]={0};
-  int PrevDataCorruption[48]={0};
+  std::vector<int> DataCorruption(nServ,0);
+  std::vector<int> PrevDataCorruption(nServ,0);
+  OverloadState ovl;
+  OverloadInit(&ovl);
+  std::vector<OverloadLoss> loss(nServ);
+  std::vector<FrameStat> frame(nServ);
+  std::vector<CounterStat> counter(nServ);
+  std::vector<HeaderCheck> hcheck(nServ);
   if(isconnect==0)
     {
-      memset(__g_buff,0,sizeof(__g_buff));		
-      fd_set fds, readfds;
-      FD_ZERO(&readfds);
-      for(int i=0;i<nServ;i++)FD_SET(sock[i], &readfds);
-      for(int i=1;i<nServ;i++)
-	{
-	  if(sock[i]>maxfd)maxfd=sock[i];
-	}
+      TcpPollSet(&sock[0],nServ,pfd);
 
-      struct timeval tv;
-      tv.tv_sec = 0;
-      tv.tv_usec = 10000;
       int n= 0;
-      unsigned long long llRead[48] = {0};
+      std::vector<unsigned long long> llRead(nServ,0);
       struct timespec tsStart,tsEnd,tsRStart;
       struct timespec tsctime1,tsctime2;
       int readcount =-1;
+      std::vector<NumaStat> numaBefore,numaAfter;
+      NumaStatRead(numaBefore);
       clock_gettime(CLOCK_REALTIME,&tsStart);
       int j=0;
 
@@ -382,10 +475,11 @@ int main(int argc, char *argv[])
       tsRStart=tsctime1;
       llstartdiffusec = GetRealTimeInterval(&tsStart,&tsctime1);
       bool RunEnd=false;
+      if(closeinspect) inspect=InspectNew(nServ);
       while(!RunEnd)
 	{
-	  memcpy(&fds,&readfds,sizeof(fd_set));
-      	  select(maxfd+1, &fds, NULL, NULL,&tv);
+	  if(ReconnectPoll(&sock[0],nServ)>0) TcpPollSet(&sock[0],nServ,pfd);
+	  poll(&pfd[0],nServ,10);
 	  if(readcount==0)
 	    {
 	      //usleep(500000);
@@ -395,65 +489,46 @@ int main(int argc, char *argv[])
 	      // readcount++;
 	    }
 
-	  // {
-	  //   if( FD_ISSET(sock[0], &fds) )
-	  //     {
-	  // 	//printf("come here %d\n",__LINE__);
-	  // 	int n=0;
-	  // 	while(n<evsize)
-	  // 	  {
-	  // 	    int ret = read( sock[0],__g_buff+n,evsize-n);
-	  // 	    if(ret<0)
-	  // 	      {
-	  // 		fprintf(fp_ms,"read() from sock[%d] failed\n",0);
-	  // 		exit(1);
-	  // 	      }
-	  // 	    n+=ret;
-	  // 	  }
-	  // 	//printf("FEB1 read %d \n ",n);
-	  // 	if(datacreate)
-	  // 	  {
-	  // 	    fwrite(__g_buff,n,1,fp_d[0]);
-	  // 	  }
-	  // 	if(j<1000)
-	  // 	  {
-	  // 	    clock_gettime(CLOCK_REALTIME,&tsctime2);					     
-	  // 	    lltime_diff[j] = GetRealTimeInterval(&tsctime1,&tsctime2);
-	  // 	    tsctime1=tsctime2;
-	  // 	    //cout<<j<<endl;
-	  // 	  }
-	  // 	readcount++;
-	  // 	//if(readcount%100==0)printf("n=%d\n",n);
-	  // 	llRead[0] += (unsigned long long)n;
-	  // 	if( llRead[0] >= (unsigned long long)lReadBytes ) 
-	  // 	  {
-	  // 	    clock_gettime(CLOCK_REALTIME,&tsEnd);
-	  // 	    printf("finished here \n");
-	  // 	    break;
-	  // 	  }
-	  // 	j++;
-	  //     }/**if(FD_ISSET(sock1,&fds))**/
-	  // }
-
 	  // printf("come here %d\n",__LINE__);
 	  for(int i=0;i<nServ;i++){
-	    if( FD_ISSET(sock[i], &fds) )
+	    if( sock[i]>=0 && pfd[i].revents )
 	      {
-		int n=0;
-		while(n<evsize)
+		EventHandle ev=ArenaGet(arena,i);
+		__g_buff=ev.Data();
+		unsigned long long tArrival=DragonClockNow();
+		if(closeinspect) InspectArrival(&inspect[i],tArrival);
+		int n=ReadEvent(sock[i],__g_buff,evsize,dragonVer>4,&frame[i],closeinspect ? &inspect[i] : NULL);
+		if(n<=0)
 		  {
-		    int ret = read( sock[i],__g_buff+n,evsize-n);
-		    if(ret<0)
-		      {
-			fprintf(fp_ms,"read() from sock[%d] failed\n",i);
-			exit(1);
-		      }
-		    n+=ret;
+		    // Drop the partial event and let the FEB reconnect in background
+		    fprintf(fp_ms,"read() from sock[%d] failed, connection lost\n",i);
+		    printf("connection to %s lost after %d events\n",IPAddr[i].c_str(),NumberOfEvents[i]);
+		    close(sock[i]);
+		    sock[i]=-1;
+		    ReconnectLost(i,NumberOfEvents[i]);
+		    pfd[i].fd=-1;
+		    continue;
 		  }
+		if(frame[i].resynced) MetricsAdd(metrics,i,M_MISFRAMED,1);
+		unsigned int hdrFail=0;
+		if(dragonVer>4)
+		  {
+		    unsigned int dTrigger;
+		    int lost=CounterCheck(&counter[i],__g_buff,&dTrigger);
+		    if(lost>0) MetricsAdd(metrics,i,M_LOST,lost);
+		    else if(lost<0) MetricsAdd(metrics,i,M_DUPLICATE,1);
+		    if(dTrigger) MetricsAdd(metrics,i,M_TRIGGERS,dTrigger);
+		    hdrFail=HeaderCheckEvent(&hcheck[i],__g_buff,frame[i].resynced,lost);
+		    if(hdrFail) MetricsAdd(metrics,i,M_FLAGGED,1);
+		  }
+		TcpQuickAck(sock[i],&sockOpt[i]);
 
 		NumberOfEvents[i]++;
 		PrevDataCorruption[i]=0;
 		DataCorruption[i]=0;
+		// the socket backlog of the FEB just read drives the overload controller
+		if(NumberOfEvents[i]%16==0)
+		  OverloadUpdate(&ovl,&ovlConf,TcpBacklogFill(sock[i]),tArrival);
 
 		int first_record=999999;
 		int last_record=-1;
@@ -461,33 +536,27 @@ int main(int argc, char *argv[])
 		  
 		if(datacreate==1)
 		  {
-	
-		    //		    for(int b=HeaderSize; b<evsize;b++)
-		    for(int b=HeaderSize; b<HeaderSize+16*rddepth*2;b+=2)
+		    bool analyze= !(ovl.level>0 && ovlConf.policy==OVL_SKIP);
+		    if(!analyze)
 		      {
-			unsigned char tempbuf[32];
-			tempbuf[0] = __g_buff[b+1];
-			tempbuf[1] = __g_buff[b];
-			memcpy((char *)&tempADCcount,tempbuf,sizeof(unsigned short));
-			//			cout<<"board["<<i<<"] "<<b<<" "<<tempADCcount<<endl;
-
-			int slice=((b-HeaderSize)/16)%40;
-
-			if(tempADCcount<ADCthreshold && slice!=0)
-			  //			if(tempADCcount<ADCthreshold)
-			  {
-			    if(b>last_record) last_record=b;
-			    if(b<first_record) first_record=b;
-			    latest_value=tempADCcount;
-			    DataCorruption[i]++;
-			    //			    cout<<"Data corrupted !!!!!"<<DataCorruption[i]<<" "<< b<<" "<<tempADCcount<<endl;
-			  }
+			loss[i].c[OVL_UNANALYZED]++;
+			MetricsAdd(metrics,i,M_DEGRADED,1);
+		      }
+		    // header only, unless in the sample or failing a header check
+		    if(analyze && dragonVer>4)
+		      analyze=HeaderCheckDecode(&hcheck[i],__g_buff,hdrFail,sample);
+		    if(analyze)
+		      {
+			MetricsAdd(metrics,i,M_DECODED,1);
+			DataCorruption[i]=EventThresholdScan(__g_buff,HeaderSize,rddepth,ADCthreshold,
+							     &first_record,&last_record,&latest_value);
 		      }
 
 		    if(DataCorruption[i]){
 		      //		    if(DataCorruption[i]>4){
 		      cout<<"DATA CORRUPTED FOR EVENT "<<NumberOfEvents[i]<<" "<<szAddr[i]<<" From "<<first_record<<" TO "<<last_record<<" latest "<<latest_value<<" RECORDS "<<DataCorruption[i]<<endl;
 		      PrevDataCorruption[i]=DataCorruption[i];
+		      MetricsAdd(metrics,i,M_CORRUPTED,1);
 
 		      //DUMP
 		      int counter=0;
@@ -512,15 +581,43 @@ int main(int argc, char *argv[])
 		      
 		    }
 
-		    if(NumberOfEvents[i]%PreScaleFactor==0 || DataCorruption[i]>0)
+		    bool keep= NumberOfEvents[i]%PreScaleFactor==0;
+		    // with -S, the events failing a header check are stored and never dropped
+		    bool flagged= sample>0 && hdrFail!=0;
+		    if(keep && NumberOfEvents[i]%OverloadPrescale(&ovl,&ovlConf,PreScaleFactor)!=0)
+		      {
+			keep=false;
+			loss[i].c[OVL_PRESCALED]++;
+			MetricsAdd(metrics,i,M_DEGRADED,1);
+		      }
+		    else if(keep && ovl.level>0 && ovlConf.policy==OVL_DROP && DataCorruption[i]==0 && !flagged)
+		      {
+			keep=false;
+			loss[i].c[OVL_DROPPED]++;
+			MetricsAdd(metrics,i,M_DROPPED,1);
+		      }
+		    if(keep || DataCorruption[i]>0 || flagged)
 		      {
+			int nWritten=n;
+			if(timestamp)
+			  {
+			    DragonRecord rec;
+			    RecordFill(&rec,i,n,tArrival);
+			    fwrite(&rec,sizeof(rec),1,fp_d[i]);
+			    nWritten+=sizeof(rec);
+			  }
 			fwrite(__g_buff,n,1,fp_d[i]);
 			WrittenNumberOfEvents[i]++;
+			MetricsAdd(metrics,i,M_EVENTS_WRITTEN,1);
+			MetricsAdd(metrics,i,M_BYTES_WRITTEN,nWritten);
 		      }
 		  }
 		//printf("FEB[%d] read %d Bytes\n ",i,n);
 		//		readcount++;
 		//if(readcount%100==0)printf("n=%d\n",n);
+		if(closeinspect) InspectDone(&inspect[i],tArrival);
+		MetricsAdd(metrics,i,M_EVENTS,1);
+		MetricsAdd(metrics,i,M_BYTES_READ,n);
 		    llRead[i] += (unsigned long long)n;
 		if( llRead[i] >= (unsigned long long)lReadBytes ) 
 		  {
@@ -538,6 +635,9 @@ int main(int argc, char *argv[])
 	  }/**for(i<nServ)**/
 	}/**for(;;)**/
       printf("***** Data Acquisition End *****\n");
+      NumaStatRead(numaAfter);
+      MetricsStop();
+      ReconnectStop();
       //printf("readcount :%d\n",readcount);
       for(int i=0;i<nServ;i++)
 	{
@@ -573,9 +673,7 @@ int main(int argc, char *argv[])
 	  // fprintf(fp_ms,"%s ",a);
 	  
 	  /*modified(2)*/
-	  char a[2];
-	  strncpy(a,szAddr[i]+11,sizeof(szAddr[i]-11));
-	  fprintf(fp_ms,"%s ",a);
+	  fprintf(fp_ms,"%d ",ConfFebId(IPAddr[i]));
 
 	}
       fprintf(fp_ms,"\n");
@@ -601,6 +699,12 @@ int main(int argc, char *argv[])
 	     WrittenNumberOfEvents[i]
 	     );
       }	      
+      ReconnectReport(stdout,nServ,&IPAddr[0]);
+      OverloadReport(stdout,&ovlConf,&ovl,1,&loss[0],nServ,&IPAddr[0],DragonClockNow());
+      NumaStatReport(stdout,numaBefore,numaAfter);
+      FrameReport(stdout,&frame[0],nServ,&IPAddr[0]);
+      CounterReport(stdout,&counter[0],nServ,&IPAddr[0]);
+      if(sample>0) HeaderCheckReport(stdout,&hcheck[0],nServ,&IPAddr[0],sample);
       delete[] readfreq;
       delete[] readrate;
       /****************************************************/
@@ -649,16 +753,13 @@ int main(int argc, char *argv[])
 	  fprintf(fp_md,"InFreq[Hz]  RdFreq[Hz] DataSize[Bytes] RdTime[us]  RdRate[Mbps] ctime1-Start[usec]\n");
 	  fprintf(fp_md,"%d      %g       %llu       %llu     %g       %llu\n",
 		  infreq, 
-		  (double)llRead[0]/976.0/llusec*1000000.0,
-		  llRead,
+		  (double)llRead[0]/(double)evsize/llusec*1000000.0,
+		  llRead[0],
 		  llusec,
 		  (double)llRead[0]*8.0/llusec*1000000.0/1024.0/1024.0,
 		  llstartdiffusec
 		  );
-	  for(int i=0;i<1000;i++)
-	    {
-	      fprintf(fp_md,"%llu\n",lltime_diff[i]);
-	    }
+	  InspectReport(fp_md,inspect,nServ,&IPAddr[0]);
 	  fclose(fp_md);
 	}
       /****************************************************/
@@ -675,66 +776,6 @@ int main(int argc, char *argv[])
 
 
 
-///////////////////////////////////////////////////////////////////////////////////////////
-// connect to a server(SiTCP)
-///////////////////////////////////////////////////////////////////////////////////////////
-int ConnectTcp(const char *pszHost, unsigned short shPort, unsigned long &lConnectedIP )
-{
-  int sockTcp = -1;
-  struct sockaddr_in addrTcp;
-  sockTcp = socket(AF_INET, SOCK_STREAM, 0);
-  if( sockTcp < 0 ){
-    perror("socket");
-    return -1;
-  }
-  addrTcp.sin_family = AF_INET;
-  addrTcp.sin_port = htons(shPort);
-  addrTcp.sin_addr.s_addr = inet_addr(pszHost);
-  if( addrTcp.sin_addr.s_addr == 0xffffffff ){
-    struct hostent *host = gethostbyname(pszHost);
-    if( host == NULL ){
-      if( h_errno == HOST_NOT_FOUND ){
-	printf("ConnectTcp() host not found : %s\n",pszHost);
-      }else{
-	printf("ConnectTcp() %s : %s\n",hstrerror(h_errno),pszHost);
-	fprintf(stderr,"%s : %s\n",hstrerror(h_errno),pszHost);
-      }
-      return -2;
-    }
-    unsigned int **addrptr = (unsigned int **)host->h_addr_list;
-    while( *addrptr != NULL){
-      addrTcp.sin_addr.s_addr = *(*addrptr);
-      if(connect(sockTcp,(struct sockaddr *)&addrTcp,sizeof(addrTcp)) ==0 )
-	{			
-	  lConnectedIP = (unsigned long )addrTcp.sin_addr.s_addr;
-	  break;
-	}
-      addrptr++;
-    }
-    if( addrptr == NULL) {
-      perror("ConnectTCP()::connect(1)");
-      printf("ERROR:ConnectTCP:: host not found (%d) to %s:%u\n",sockTcp,pszHost,shPort);
-      return -3;
-    }else{
-      printf("ConnectTCP::Connected0(%d) to %s:%u\n",sockTcp,pszHost,shPort);
-    }
-  }else{
-    if(connect(sockTcp,(struct sockaddr *)&addrTcp,sizeof(addrTcp)) !=0 )
-      {
-	perror("ConnectTCP()::connect(2)");
-	printf("ERROR:ConnectTCP:: can't connect not found (%d) to %08X %s:%u\n",addrTcp.sin_addr.s_addr,sockTcp,pszHost,shPort);
-	sockTcp = -1;
-	close(sockTcp);
-	return -4;
-      }else{
-      lConnectedIP = (unsigned long )addrTcp.sin_addr.s_addr;
-      printf("ConnectTCP::Connected1(%d) %s:%d\n",sockTcp,pszHost,shPort);
-    }
-  }
-  return( sockTcp );
-}
-
-
 ///////////////////////////////////////////////////////////////////////////////////////////
 // time calc
 ///////////////////////////////////////////////////////////////////////////////////////////
@@ -1,5 +1,5 @@
 ///////////////////////////////////////////////////////////////////////////////////////////
-// DragonDaqM.cpp
+// DragonDaqMOnlineCarlos.cpp
 // by Kazuma Ishio Univ. of Tokyo
 // Last update on 2015/04/27
 //
@@ -19,16 +19,31 @@
 //    (2)can save datas from them.
 //    (3)measures throughput of taking data from FEBs.
 //    (4)can also measure each read() function for FEBs (close inspection mode).
+//    (5)serves per-FEB rates and counters on a local socket (-m, DragonMetrics.cpp)
+//       and appends them to a rate time series every second (-M).
+//    (6)connects to all FEBs in parallel and reconnects lost FEBs in background (DragonTcp.cpp).
+//    (7)has no fixed limit on the number of FEBs (poll() instead of select()).
+//    (8)analyses fewer events when the host falls behind (-O, DragonOverload.cpp).
+//    (9)runs on the NUMA node of the NIC the FEBs are reached through (-N, DragonNuma.cpp).
+//   (10)counts the events lost by each FEB from the header counters (DragonEvent.cpp).
+//   (11)checks the events for corruption (DragonAnalysis.cpp), which DragonReanalyze repeats offline.
+//   (12)can decide on the likelihood of the samples instead (-L, DragonClassifier.cpp).
+//   (13)keeps its pedestal maps from one run to the next (-P, DragonPedestal.cpp).
+//   (14)paces the reads of each FEB to the usec for the dead time studies (-t, DragonPacer.cpp).
+//   (15)can check only the header of most events and fully decode a sample
+//        of them, and those failing a header check (-S, DragonEvent.cpp).
 //
 // ****Usage****
-// 0.Deploy DragonDaqM.cpp, DragonDaqM.hh, and Connection.conf 
+// 0.Deploy DragonDaqMOnlineCarlos.cpp, DragonDaqM.hh, and Connection.conf 
 // 1.If no executable file, Compile these with: 
 //         ****************************************************
-//         *       g++ -o DragonDaqM DragonDaqM.cpp -lrt        *
+//         *       make DragonDaqMOnlineCarlos                *
 //         ****************************************************
 // 2.Edit connection configuration in Connection.conf
 //    which is a table of IP address and port number of the Dragon FEBs.
 //   Even if you rewrite ip address, you don't have to re-compile.
+//   Socket options (SO_RCVBUF, busy polling, reader core...) may follow
+//   the port number, see DragonConf.cpp.
 //
 // 3.Submit this with: 
 //         **********************************************************
@@ -50,6 +65,7 @@
 #include <iostream>
 //#include "termcolor.h"
 #include <stdlib.h>
+#include <limits.h>
 
 #include <time.h>     //for measuring time
 #include <sys/time.h> //for making filename
@@ -64,38 +80,22 @@
 #include <string>
 
 #include "DragonDaqM.hh"
+#include "DragonMetrics.hh"
+#include "DragonHist.hh"
+#include "DragonClock.hh"
+#include "DragonTcp.hh"
+#include "DragonConf.hh"
+#include "DragonOverload.hh"
+#include "DragonNuma.hh"
+#include "DragonArena.hh"
+#include "DragonEvent.hh"
 
 
 
 
-struct EVT{
-  int Delay; //muse
-  int Time;
-  int Event;
-  int Trigger;
-  float Adc;
-  int Counter;
-
-  int Id;
-  int Channel;
-  int LowGain;
-  int CellId;
-  int Roi;
-
-  int AdcCorr;
-
-  int Status;
-}Ev;
-
-
-const int _ncells=4096;
-const int _nmodules=19;
-const int _ngains=2;
-const int _nchannels=7;
-const int _npointers=4;
-
-int eventsMap[_nmodules][_nchannels][_ncells][_ngains][_npointers]={-1};  // This is an event map of the ADC counts. We keep always two of them
-int eventsMapUpt[_nmodules][_nchannels][_ncells][_ngains]={0};  // This is an event map of the ADC counts
+#include "DragonAnalysis.hh"
+#include "DragonPedestal.hh"
+#include "DragonPacer.hh"
 
 
 #include "TFile.h"
@@ -106,12 +106,12 @@ int eventsMapUpt[_nmodules][_nchannels][_ncells][_ngains]={0};  // This is an ev
 bool ShouldStore=false;
 TFile *ftree=0;
 TTree *otree=0;
-bool Analysis(unsigned short *buffer,int start,int end,int store,int threshold=10);
-double probFunc(double diff){
-  double d1=diff; d1*=d1/3.36391e+00/3.36391e+00;
-  double d2=diff; d2*=d2/3.45210e+01/3.45210e+01;
-
-  return log(1+5.19912e+04/1.12390e+07*exp(-0.5*d2+0.5*d1))+log(1.12390e+07)+0.5*d1;
+// The TTree gets the samples of the corrupted events
+unsigned long long TreeBytes=0;  // filled so far
+static void TreeFill(void *arg, const EVT &/*ev*/)
+{
+  int n=((TTree *)arg)->Fill();
+  if(n>0) TreeBytes+=n;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////
@@ -134,8 +134,16 @@ struct option options[] =
     {"version"  ,required_argument ,NULL ,'v'},
     {"closeinspect" ,no_argument   ,NULL ,'c'},
     {"configfile" ,required_argument   ,NULL ,'f'},
+    {"metrics" ,required_argument   ,NULL ,'m'},
+    {"rates" ,required_argument   ,NULL ,'M'},
+    {"connect-timeout" ,required_argument   ,NULL ,'k'},
     {"wait" ,required_argument   ,NULL ,'w'},
     {"time" ,required_argument   ,NULL ,'t'},
+    {"overload" ,required_argument   ,NULL ,'O'},
+    {"numa" ,required_argument   ,NULL ,'N'},
+    {"sample" ,required_argument   ,NULL ,'S'},
+    {"likelihood" ,required_argument   ,NULL ,'L'},
+    {"pedestals" ,required_argument   ,NULL ,'P'},
     {0,0,0,0}
   };
 
@@ -152,14 +160,25 @@ int main(int argc, char *argv[])
   stringstream fileName;
   bool closeinspect=false;
   string configfile = "Connection.conf";
-  int Waiting = 100;
-  unsigned int Time = 0;  // Number of channels beyond threshold to be considered as bad
+  const char *metricsSpec = NULL;
+  const char *seriesSpec = NULL;
+  unsigned int sample = 0;  // -S, 0: every event fully decoded
+  int connectTimeout = TCP_CONNECT_TIMEOUT_MS;
+  int Waiting = -1;  // 100, 0 after a warm start
+  PacerConf pacerConf;
+  PacerParse(NULL,&pacerConf);
+  OverloadConf ovlConf;
+  OverloadParse(NULL,&ovlConf);
+  int numaNode = NUMA_NIC;
+  const char *calibFile = NULL;
+  std::string pedFile;
+  double pedPeriod = 600;  // sec
   /******************************************/
   //  Handling input arguments
   /******************************************/
   int opt;
   int index;
-  while((opt=getopt_long(argc,argv,"hi:n:o:r:sv:cf:p:t:",options,&index)) !=-1){
+  while((opt=getopt_long(argc,argv,"hi:n:o:r:sv:cf:p:w:t:m:M:k:O:N:L:P:S:",options,&index)) !=-1){
     switch(opt){
     case 'h':
  TERM_COLOR_RED;
@@ -175,14 +194,31 @@ int main(int argc, char *argv[])
       printf("-v|--version   <Dragon Version>      : Default is 5.\n");
       printf("-c|--closeinspect                    : Default is false.\n");
       printf("-f|--configfile                      : .\n");
-      printf("-w|--wait                            : Numbers of events to start dalying default is 100 .\n");
-      printf("-t|--time                            : Minimum time between events in us is 0 .\n");
+      printf("-m|--metrics <port|unix:path>        : Serve per-FEB metrics. Default is off.\n");
+      printf("-M|--rates <file>[,<sec>]            : Append the per-FEB counters and rates to file every sec\n");
+      printf("                                       (default 1), CSV for a .csv file, binary otherwise.\n");
+      printf("-k|--connect-timeout <msec>          : Per-FEB connection timeout. Default is 3000.\n");
+      printf("-w|--wait <events|all>               : Events of each FEB paced by -t, default is 100 (0 after a warm start).\n");
+      printf("-t|--time <usec|delay:<usec>|rate:<Hz>|script:<file>>\n");
+      printf("                                     : Time between the reads of each FEB, default is none (DragonPacer.cpp).\n");
+      printf("-N|--numa <node|nic|any>             : NUMA node to run on. Default is nic.\n");
+      printf("-S|--sample <N>                      : Check the header of every event, analyse only one event in N\n");
+      printf("                                       (by EventCounter) and those failing a header check.\n");
+      printf("-L|--likelihood <calib file|default>  : Likelihood test of the samples instead of the\n");
+      printf("                                       4 sigma and Adc<200 tests (DragonClassifier.cpp).\n");
+      printf("-P|--pedestals <file>[,<sec>]        : Start from the pedestal snapshot in file, write it back\n");
+      printf("                                       at the end and every sec (default 600) (DragonPedestal.cpp).\n");
+      printf("-O|--overload <policy>[:high[:low]]  : When a socket receive queue fills above high%% (default 80),\n");
+      printf("                                       prescale: analyse one event in 2,4,8... ,\n");
+      printf("                                       skip: analyse none,\n");
+      printf("                                       until it is back below low%% (default 50).\n");
       printf("********* CAUTION ********\n");
       printf("Make sure to specify readdepth to Dragon through rpcp command.\n");
       printf("If RD=1024,limit is 3kHz at 1Gbps. so 10000events will take 10s. \n");
       printf("If RD=30,limit is 120kHz at 1Gbps. so 1000000events will take 10s. \n");
-      printf("Close inspection mode will store\n");
-      printf("  time differences between events.\n");
+      printf("Close inspection mode will store per-FEB histograms of\n");
+      printf("  inter-event time, read() duration, bytes per read() and\n");
+      printf("  arrival-to-write time (p50/p99/p99.9/max) for every event\n");
       printf("  as a file named RDXXinfreqXX_MMDD_HHMMSS.dat\n");
       printf("  in DragonDaqMes directory which will be made automatically.\n");
       printf("\n");
@@ -213,11 +249,53 @@ int main(int argc, char *argv[])
     case 'f' :
       configfile=optarg;
       break;
+    case 'm' :
+      metricsSpec=optarg;
+      break;
+    case 'M' :
+      seriesSpec=optarg;
+      break;
+    case 'k' :
+      connectTimeout=atoi(optarg);
+      break;
     case 'w' :
-      Waiting = atoi(optarg);
+      Waiting = strcmp(optarg,"all")==0 ? INT_MAX : atoi(optarg);
       break;
     case 't' :
-      Time = atoi(optarg);
+      if(PacerParse(optarg,&pacerConf)!=0) exit(1);
+      break;
+    case 'S' :
+      sample=(unsigned int)atoi(optarg);
+      break;
+    case 'N' :
+      if(NumaParse(optarg,&numaNode,1)!=0) exit(1);
+      break;
+    case 'L' :
+      calibFile=optarg;
+      break;
+    case 'P' :
+      {
+	pedFile=optarg;
+	size_t comma=pedFile.rfind(',');
+	if(comma!=std::string::npos)
+	  {
+	    pedPeriod=atof(pedFile.c_str()+comma+1);
+	    pedFile.erase(comma);
+	  }
+	if(pedFile.empty() || pedPeriod<=0)
+	  {
+	    printf("Bad -P %s, expected <file>[,<sec>]\n",optarg);
+	    exit(1);
+	  }
+      }
+      break;
+    case 'O' :
+      if(OverloadParse(optarg,&ovlConf)!=0) exit(1);
+      if(ovlConf.policy==OVL_DROP)
+	{
+	  printf("No raw data is stored here, use prescale or skip\n");
+	  exit(1);
+	}
       break;
     default:
       printf("%s -h for usage\n",argv[0]);
@@ -225,6 +303,12 @@ int main(int argc, char *argv[])
   }
   printf("");
   fileName<<fileNameHeader<<"RD"<<rddepth;
+  if(sample>0 && dragonVer<5)
+    {
+      printf("-S needs the v5 event header\n");
+      exit(1);
+    }
+  DragonClockInit();
 
   //Definition of Event Size
   int evsize;
@@ -251,8 +335,7 @@ int main(int argc, char *argv[])
 	2*8+ // flag
 	2*8; // first capacitor id
     }
-  unsigned char __real_buffer[evsize+16];
-  unsigned char *__g_buff=__real_buffer+4; // Trick to change the endianess in a single pass
+  unsigned char *__g_buff=NULL; // slot of the event arena +4 : Trick to change the endianess in a single pass
 
   //Definition of Data Size
 
@@ -277,37 +360,74 @@ int main(int argc, char *argv[])
   //  Difinitions for Close Inspection
   /******************************************/
   unsigned long long llstartdiffusec;
-  unsigned long long lltime_diff[1000]={0};
+  FebInspect *inspect=NULL; // per-FEB latency histograms
   
   /******************************************/
   //  Reading Connection Configuration
   /******************************************/
-  char szAddr[48][16];
-  std::string IPAddr[48];
-  unsigned short shPort[48]={0};
-  unsigned long lConnected[48] ={0};
   //  const char *ConfFile = "Connection.conf";
   const char *ConfFile = configfile.c_str();
   cout<<"Config file = "<<configfile<<endl;
-  std::ifstream ifs(ConfFile);
-  std::string str;
-  int nServ=0;
-  while (std::getline(ifs,str)){
-    if(str[0]== '#' || str.length()==0)continue;
-    std::istringstream iss(str);
-    iss >> szAddr[nServ] >> shPort[nServ];
-    nServ++;
+  std::vector<FebConf> febConf;
+  if(ConfRead(ConfFile,febConf)!=0) exit(1);
+  int nServ=febConf.size();
+  if(nServ==0){
+    printf("No connection in %s\n",ConfFile);
+    exit(1);
   }
+  std::vector<std::string> IPAddr(nServ);
+  std::vector<const char *> szAddr(nServ);
+  std::vector<unsigned short> shPort(nServ);
+  std::vector<unsigned long> lConnected(nServ,0);
+  std::vector<TcpSockOpt> sockOpt(nServ);
   for(int nserver=0;nserver<nServ;nserver++)
     {
-      IPAddr[nserver] = szAddr[nserver];
+      IPAddr[nserver] = febConf[nserver].host;
+      szAddr[nserver] = IPAddr[nserver].c_str();
+      shPort[nserver]=febConf[nserver].port;
+      sockOpt[nserver]=febConf[nserver].opt;
     }
-
-  if(nServ>48){
-    printf("The number of connections excessed limit.");
-    exit(1);
-  }
   cout<<"Num Server = "<<nServ<<endl;
+  // one event slot per FEB, touched first by the read loop (after the NUMA pinning)
+  EventArena *arena=ArenaNew(nServ,1,evsize+16);
+  if(arena==NULL) exit(1);
+  AnalysisState *ana=AnalysisNew(0,nServ);
+  EVT &Ev=ana->Ev;
+  if(calibFile)
+    {
+      ClassifierConf calib;
+      ClassifierDefault(&calib);
+      if(strcmp(calibFile,"default")!=0 && ClassifierRead(calibFile,&calib)!=0) exit(1);
+      if(dragonVer<5) printf("-L needs Dragon v5 events, ignored\n");
+      ana->classifier=ClassifierNew(calib,0,nServ);
+    }
+  PedSnapWriter *pedSnap=NULL;
+  int pedWarm=0;
+  if(!pedFile.empty())
+    {
+      std::vector<std::string> febNames(nServ);
+      for(int k=0;k<nServ;k++)
+	{
+	  std::ostringstream name;
+	  name<<IPAddr[k]<<":"<<shPort[k];
+	  febNames[k]=name.str();
+	}
+      pedWarm=PedSnapLoad(pedFile.c_str(),ana,febNames);
+      if(pedWarm<0) exit(1);
+      pedSnap=PedSnapStart(pedFile.c_str(),febNames,rddepth,ana);
+    }
+  if(Waiting<0) Waiting= pedWarm>0 ? 0 : 100;
+  Pacer *pacer=NULL;
+  if(pacerConf.profile!=PACE_OFF && Waiting>0)
+    {
+      pacerConf.limit= Waiting==INT_MAX ? ~0ULL : (unsigned long long)Waiting;
+      pacer=PacerNew(pacerConf,nServ);
+    }
+  // a socket and a data file per FEB
+  TcpRaiseFdLimit(2*nServ+64);
+  if(MetricsStart(metricsSpec,nServ,&IPAddr[0],evsize)!=0) exit(1);
+  if(MetricsSeriesStart(seriesSpec)!=0) exit(1);
+  MetricsShard *metrics=MetricsNewShard();
 
   /******************************************/
   //  preparation of measurement summary file
@@ -351,14 +471,16 @@ int main(int argc, char *argv[])
   // Preparation of Data File
   /******************************************/
   //Initialization of Data File
-  char datafile[48][128];
-  FILE *fp_d[48];
+  std::vector<std::string> datafile(nServ);
+  std::vector<FILE *> fp_d(nServ);
   for(int i =0;i<nServ;i++)
     {
-      int DragonId = atoi(IPAddr[i].substr(10).c_str());
-      sprintf(datafile[i],"%s_FEB%d_IP%d.dat",fileName.str().c_str(),i, DragonId);
+      int DragonId = ConfFebId(IPAddr[i]);
+      stringstream datafileName;
+      datafileName<<fileName.str()<<"_FEB"<<i<<"_IP"<<DragonId<<".dat";
+      datafile[i]=datafileName.str();
       cout<<"File "<<i+1<<" "<<datafile[i]<<endl;
-      fp_d[i] = fopen(datafile[i],"wb");
+      fp_d[i] = fopen(datafile[i].c_str(),"wb");
     }
 
   /******************************/
@@ -384,58 +506,70 @@ int main(int argc, char *argv[])
 
 		//		":Status/I"
 	);
+  ana->dump=TreeFill;
+  ana->dumpArg=otree;
   gRandom->SetSeed(time(0));
 
   Ev.Time=(int)time(NULL);
   Ev.Counter=0;
-  Ev.Delay=Time;
+  Ev.Delay=0;
 
   /******************************************/
   //  Connection Initialization
   /******************************************/
-  int sock[48];
-  int isconnect=0;
-  for(int i =0;i<nServ;i++)
+  std::vector<int> sock(nServ,-1);
+  int nConnected=ConnectTcpAll(nServ,&szAddr[0],&shPort[0],&sock[0],&lConnected[0],connectTimeout,&sockOpt[0]);
+  printf("%d/%d connections established\n",nConnected,nServ);
+  for(int i=0;i<nServ;i++) printf("lConnected[%d]=%lu\n",i,lConnected[i]);
+  int isconnect=(nConnected==0);
+  // FEBs which failed, or are lost during the run, are retried in background
+  ReconnectStart(nServ,&szAddr[0],&shPort[0],connectTimeout,&sockOpt[0]);
+  // cpu= in Connection.conf wins over the NUMA placement
+  if(ConfPinReader(&sockOpt[0],nServ)==0)
     {
-      printf("read from server(%s:%u) %lu bytes\n",szAddr[i],shPort[i],lReadBytes);
-      sock[i] = ConnectTcp(szAddr[i],shPort[i],lConnected[i]);
-      printf("connection established\n");
-      printf("lConnected[%d]=%lu\n",i,lConnected[i]);
-      if(sock[i]<0)isconnect=1;
+      std::string nicName;
+      int nicNode=NumaFebNode(&sock[0],0,nServ,&nicName);
+      if(nicNode>=0)
+	printf("FEBs reached through %s, NUMA node %d of %d\n",nicName.c_str(),nicNode,NumaNodeCount());
+      int node= numaNode==NUMA_NIC ? nicNode : numaNode;
+      if(node>=0 && NumaPinNode(node)==0) printf("Running on NUMA node %d\n",node);
     }
+  for(int i=0;i<nServ;i++)
+    if(sock[i]<0) ReconnectLost(i,0);
+  MetricsAddGauge("dragon_feb_socket_backlog_bytes","Bytes waiting in the socket receive queue",
+		  MetricsSocketBacklog,&sock[0]);
 
 
 
   /******************************************/
   //  Data Extraction
   /******************************************/
-  //Maximum value of file discriptor
-  int maxfd=sock[0];
+  std::vector<struct pollfd> pfd;
 
-  int NumberOfEvents[48]={0};
-  int WrittenNumberOfEvents[48]={0};
+  std::vector<int> NumberOfEvents(nServ,0);
+  std::vector<int> WrittenNumberOfEvents(nServ,0);
   unsigned short tempADCcount=0;
-  int DataCorruption[48]={0};
-  int PrevDataCorruption[48]={0};
+  std::vector<int> DataCorruption(nServ,0);
+  std::vector<int> PrevDataCorruption(nServ,0);
+  OverloadState ovl;
+  OverloadInit(&ovl);
+  std::vector<OverloadLoss> loss(nServ);
+  std::vector<FrameStat> frame(nServ);
+  std::vector<CounterStat> counter(nServ);
+  std::vector<HeaderCheck> hcheck(nServ);
 
   if(isconnect==0)
     {
 
-      memset(__real_buffer,0,sizeof(__real_buffer));		
-      fd_set fds, readfds;
+      TcpPollSet(&sock[0],nServ,pfd);                          // Add our guys to the set of file descriptors
 
-      FD_ZERO(&readfds);                                       // Clear the set of file descriptors
-      for(int i=0;i<nServ;i++)FD_SET(sock[i], &readfds);       // Add our guys to the set of file descriptos
-      for(int i=1;i<nServ;i++) if(sock[i]>maxfd)maxfd=sock[i]; // Update the max file descriptor
-
-      struct timeval tv;
-      tv.tv_sec = 0;
-      tv.tv_usec = 10000;
       int n= 0;
-      unsigned long long llRead[48] = {0};
+      std::vector<unsigned long long> llRead(nServ,0);
       struct timespec tsStart,tsEnd,tsRStart;
       struct timespec tsctime1,tsctime2;
       int readcount =-1;
+      std::vector<NumaStat> numaBefore,numaAfter;
+      NumaStatRead(numaBefore);
       clock_gettime(CLOCK_REALTIME,&tsStart);
       int j=0;
 
@@ -443,39 +577,69 @@ int main(int argc, char *argv[])
       tsRStart=tsctime1;
       llstartdiffusec = GetRealTimeInterval(&tsStart,&tsctime1);
       bool RunEnd=false;
+      if(closeinspect) inspect=InspectNew(nServ);
 
-      struct timespec prev_time;
-      clock_gettime(CLOCK_REALTIME,&prev_time);
+      unsigned long long prev_time=DragonClockNow();
+      unsigned long long pedLast=prev_time;
+      const unsigned long long pedPeriodNs=(unsigned long long)(pedPeriod*1e9);
 
       
       while(!RunEnd)
 	{
-	  memcpy(&fds,&readfds,sizeof(fd_set));   // Copy the file descriptos set
-      	  select(maxfd+1, &fds, NULL, NULL,&tv);  // Look for those ready to be read
+	  if(ReconnectPoll(&sock[0],nServ)>0) TcpPollSet(&sock[0],nServ,pfd);
+	  poll(&pfd[0],nServ,10);                  // Look for those ready to be read
 
 
-	  if(Ev.Counter<=Waiting) // Ensure we clear the Dragon memory
-	    usleep(Time);
+	  if(pacer) // Ensure we clear the Dragon memory
+	    PacerWait(pacer,&pfd[0],DragonClockNow());
+	  if(pedSnap && DragonClockNow()-pedLast>=pedPeriodNs)
+	    {
+	      PedSnapRequest(pedSnap,ana);
+	      pedLast=DragonClockNow();
+	    }
 	  //	  else
-	  //	    clock_gettime(CLOCK_REALTIME,&prev_time);
+	  //	    prev_time=DragonClockNow();
 
 	  for(int i=0;i<nServ;i++){
-	    // Bring __g_buff to its real value
-	    __g_buff=__real_buffer+4;
 	    
-	    if( FD_ISSET(sock[i], &fds))
+	    if( sock[i]>=0 && pfd[i].revents )
 	      {
-		int n=0;
-		while(n<evsize)
+		unsigned long long tArrival=DragonClockNow();
+		if(pacer && !PacerDue(pacer,i,tArrival)) continue;
+		EventHandle ev=ArenaGet(arena,i);
+		// Bring __g_buff to its real value
+		__g_buff=ev.Data()+4;
+		if(closeinspect) InspectArrival(&inspect[i],tArrival);
+		int n=ReadEvent(sock[i],__g_buff,evsize,dragonVer>4,&frame[i],closeinspect ? &inspect[i] : NULL);
+		if(n<=0)
 		  {
-		    int ret = read( sock[i],__g_buff+n,evsize-n);  // Read it
-		    if(ret<0)
-		      {
-			fprintf(fp_ms,"read() from sock[%d] failed\n",i);
-			exit(1);
-		      }
-		    n+=ret;
+		    // Drop the partial event and let the FEB reconnect in background
+		    fprintf(fp_ms,"read() from sock[%d] failed, connection lost\n",i);
+		    printf("connection to %s lost after %d events\n",IPAddr[i].c_str(),NumberOfEvents[i]);
+		    close(sock[i]);
+		    sock[i]=-1;
+		    ReconnectLost(i,NumberOfEvents[i]);
+		    pfd[i].fd=-1;
+		    continue;
+		  }
+		if(pacer)
+		  {
+		    PacerRead(pacer,i,tArrival,DragonClockNow());
+		    Ev.Delay=PacerGapUs(pacer,i);
+		  }
+		if(frame[i].resynced) MetricsAdd(metrics,i,M_MISFRAMED,1);
+		unsigned int hdrFail=0;
+		if(dragonVer>4)
+		  {
+		    unsigned int dTrigger;
+		    int lost=CounterCheck(&counter[i],__g_buff,&dTrigger);
+		    if(lost>0) MetricsAdd(metrics,i,M_LOST,lost);
+		    else if(lost<0) MetricsAdd(metrics,i,M_DUPLICATE,1);
+		    if(dTrigger) MetricsAdd(metrics,i,M_TRIGGERS,dTrigger);
+		    hdrFail=HeaderCheckEvent(&hcheck[i],__g_buff,frame[i].resynced,lost);
+		    if(hdrFail) MetricsAdd(metrics,i,M_FLAGGED,1);
 		  }
+		TcpQuickAck(sock[i],&sockOpt[i]);
 		
 		
 	
@@ -486,28 +650,37 @@ int main(int argc, char *argv[])
 		int first_record=999999;
 		int last_record=-1;
 		int latest_value=0;
+
+		// the socket backlog of the FEB just read drives the overload controller
+		if(NumberOfEvents[i]%16==0)
+		  OverloadUpdate(&ovl,&ovlConf,TcpBacklogFill(sock[i]),tArrival);
+		bool analyze=true;
+		if(datacreate==1 && ovl.level>0)
+		  {
+		    if(ovlConf.policy==OVL_SKIP)
+		      {
+			analyze=false;
+			loss[i].c[OVL_UNANALYZED]++;
+		      }
+		    else if(NumberOfEvents[i]%OverloadPrescale(&ovl,&ovlConf,1)!=0)
+		      {
+			analyze=false;
+			loss[i].c[OVL_PRESCALED]++;
+		      }
+		    if(!analyze) MetricsAdd(metrics,i,M_DEGRADED,1);
+		  }
+		// header only, unless in the sample or failing a header check
+		if(datacreate==1 && analyze && dragonVer>4)
+		  analyze=HeaderCheckDecode(&hcheck[i],__g_buff,hdrFail,sample);
 		
-		if(datacreate==1)                 // Analyze
+		if(datacreate==1 && analyze)                 // Analyze
 		  {
-		    // Correct endiness, including the flags and capacitor id
-		    for(int b=HeaderSize-8*3*2; b<HeaderSize+16*rddepth*2;b+=2) *(__g_buff+b-1)=*(__g_buff+b+1);
-		    __g_buff--;
-
-		    Ev.Id=i;
-		    Ev.Status=0;
-
 		    bool corrupted=false;
-		    Ev.Counter++;	  
-		    struct timespec curr_time;
-		    clock_gettime(CLOCK_REALTIME,&curr_time);
-		    unsigned long long delta=GetRealTimeInterval(&prev_time,&curr_time);
-		    Ev.Time=int(delta);
-		    //		    prev_time=curr_time;
-		    corrupted=Analysis((unsigned short*)__g_buff,    // Where
-				       (HeaderSize-8*3*2)/2,
-				       (HeaderSize+16*rddepth*2)/2,
-				       0,
-				       0);
+		    unsigned long long delta=(tArrival-prev_time)/1000; // usec
+		    unsigned long long treeBytes=TreeBytes;
+		    //		    prev_time=tArrival;
+		    corrupted=AnalysisEvent(ana,__g_buff,i,HeaderSize,rddepth,int(delta));
+		    MetricsAdd(metrics,i,M_DECODED,1);
 
 		    
 		    
@@ -516,9 +689,15 @@ int main(int argc, char *argv[])
 			ShouldStore=true;
 			//			fwrite(__g_buff,n,1,fp_d[i]);
 			WrittenNumberOfEvents[i]++;
+			MetricsAdd(metrics,i,M_EVENTS_WRITTEN,1);
+			MetricsAdd(metrics,i,M_BYTES_WRITTEN,TreeBytes-treeBytes);
 			cout<<"CORRUPTED ? ? ? ? "<<i<<endl;
+			MetricsAdd(metrics,i,M_CORRUPTED,1);
 		      }
 		  }
+		if(closeinspect) InspectDone(&inspect[i],tArrival);
+		MetricsAdd(metrics,i,M_EVENTS,1);
+		MetricsAdd(metrics,i,M_BYTES_READ,n);
 		llRead[i] += (unsigned long long)n;
 		if( llRead[i] >= (unsigned long long)lReadBytes ) 
 		  {
@@ -532,6 +711,9 @@ int main(int argc, char *argv[])
 	  }/**for(i<nServ)**/
 	}/**for(;;)**/
       printf("***** Data Acquisition End *****\n");
+      NumaStatRead(numaAfter);
+      MetricsStop();
+      ReconnectStop();
       for(int i=0;i<nServ;i++)
 	{
 	  close(sock[i]);
@@ -555,9 +737,7 @@ int main(int argc, char *argv[])
       for(int i=0;i<nServ;i++)
 	{
 
-	  char a[2];
-	  strncpy(a,szAddr[i]+11,sizeof(szAddr[i]-11));
-	  fprintf(fp_ms,"%s ",a);
+	  fprintf(fp_ms,"%d ",ConfFebId(IPAddr[i]));
 	  
 	}
       fprintf(fp_ms,"\n");
@@ -583,6 +763,13 @@ int main(int argc, char *argv[])
 	       WrittenNumberOfEvents[i]
 	       );
       }	      
+      ReconnectReport(stdout,nServ,&IPAddr[0]);
+      OverloadReport(stdout,&ovlConf,&ovl,1,&loss[0],nServ,&IPAddr[0],DragonClockNow());
+      NumaStatReport(stdout,numaBefore,numaAfter);
+      FrameReport(stdout,&frame[0],nServ,&IPAddr[0]);
+      CounterReport(stdout,&counter[0],nServ,&IPAddr[0]);
+      if(sample>0) HeaderCheckReport(stdout,&hcheck[0],nServ,&IPAddr[0],sample);
+      if(pacer) PacerReport(stdout,pacer,&IPAddr[0]);
       delete[] readfreq;
       delete[] readrate;
       /****************************************************/
@@ -626,16 +813,13 @@ int main(int argc, char *argv[])
 	  fprintf(fp_md,"InFreq[Hz]  RdFreq[Hz] DataSize[Bytes] RdTime[us]  RdRate[Mbps] ctime1-Start[usec]\n");
 	  fprintf(fp_md,"%d      %g       %llu       %llu     %g       %llu\n",
 		  infreq, 
-		  (double)llRead[0]/976.0/llusec*1000000.0,
-		  llRead,
+		  (double)llRead[0]/(double)evsize/llusec*1000000.0,
+		  llRead[0],
 		  llusec,
 		  (double)llRead[0]*8.0/llusec*1000000.0/1024.0/1024.0,
 		  llstartdiffusec
 		  );
-	  for(int i=0;i<1000;i++)
-	    {
-	      fprintf(fp_md,"%llu\n",lltime_diff[i]);
-	    }
+	  InspectReport(fp_md,inspect,nServ,&IPAddr[0]);
 	  fclose(fp_md);
 	}
       /****************************************************/
@@ -653,6 +837,16 @@ int main(int argc, char *argv[])
     ftree->Close();
     if(!ShouldStore) gSystem->Exec(Form("rm %s",ftree->GetName()));
   }
+  if(pedSnap)
+    {
+      unsigned long long nSkipped=pedSnap->nSkipped;
+      if(PedSnapStop(pedSnap,ana)==0)
+	printf("Pedestal snapshot %s written, %llu periodic ones skipped\n",pedFile.c_str(),nSkipped);
+      else
+	printf("Pedestal snapshot %s NOT written, the next warm start uses an older one\n",pedFile.c_str());
+    }
+  AnalysisDelete(ana);
+  if(pacer) PacerDelete(pacer);
 
   fclose(fp_ms);
 
@@ -665,66 +859,6 @@ int main(int argc, char *argv[])
 
 
 
-///////////////////////////////////////////////////////////////////////////////////////////
-// connect to a server(SiTCP)
-///////////////////////////////////////////////////////////////////////////////////////////
-int ConnectTcp(const char *pszHost, unsigned short shPort, unsigned long &lConnectedIP )
-{
-  int sockTcp = -1;
-  struct sockaddr_in addrTcp;
-  sockTcp = socket(AF_INET, SOCK_STREAM, 0);
-  if( sockTcp < 0 ){
-    perror("socket");
-    return -1;
-  }
-  addrTcp.sin_family = AF_INET;
-  addrTcp.sin_port = htons(shPort);
-  addrTcp.sin_addr.s_addr = inet_addr(pszHost);
-  if( addrTcp.sin_addr.s_addr == 0xffffffff ){
-    struct hostent *host = gethostbyname(pszHost);
-    if( host == NULL ){
-      if( h_errno == HOST_NOT_FOUND ){
-	printf("ConnectTcp() host not found : %s\n",pszHost);
-      }else{
-	printf("ConnectTcp() %s : %s\n",hstrerror(h_errno),pszHost);
-	fprintf(stderr,"%s : %s\n",hstrerror(h_errno),pszHost);
-      }
-      return -2;
-    }
-    unsigned int **addrptr = (unsigned int **)host->h_addr_list;
-    while( *addrptr != NULL){
-      addrTcp.sin_addr.s_addr = *(*addrptr);
-      if(connect(sockTcp,(struct sockaddr *)&addrTcp,sizeof(addrTcp)) ==0 )
-	{			
-	  lConnectedIP = (unsigned long )addrTcp.sin_addr.s_addr;
-	  break;
-	}
-      addrptr++;
-    }
-    if( addrptr == NULL) {
-      perror("ConnectTCP()::connect(1)");
-      printf("ERROR:ConnectTCP:: host not found (%d) to %s:%u\n",sockTcp,pszHost,shPort);
-      return -3;
-    }else{
-      printf("ConnectTCP::Connected0(%d) to %s:%u\n",sockTcp,pszHost,shPort);
-    }
-  }else{
-    if(connect(sockTcp,(struct sockaddr *)&addrTcp,sizeof(addrTcp)) !=0 )
-      {
-	perror("ConnectTCP()::connect(2)");
-	printf("ERROR:ConnectTCP:: can't connect not found (%d) to %08X %s:%u\n",addrTcp.sin_addr.s_addr,sockTcp,pszHost,shPort);
-	sockTcp = -1;
-	close(sockTcp);
-	return -4;
-      }else{
-      lConnectedIP = (unsigned long )addrTcp.sin_addr.s_addr;
-      printf("ConnectTCP::Connected1(%d) %s:%d\n",sockTcp,pszHost,shPort);
-    }
-  }
-  return( sockTcp );
-}
-
-
 ///////////////////////////////////////////////////////////////////////////////////////////
 // time calc
 ///////////////////////////////////////////////////////////////////////////////////////////
@@ -739,166 +873,6 @@ unsigned long long GetRealTimeInterval(const  struct timespec *pFrom, const stru
 
 
 
-///////////////////////////////////////////////////////
-// ANALYSIS
-///////////////////////////////////////////////////////
-
-
-
-
-
-bool analyze(unsigned short *buffer,
-	     int start,
-	     int end,
-	     int store_prob,  //ignored
-	     int Time,
-	     int dump=false){  // ignored
-  bool corrupted=false;
-
-  using namespace std;
-
-  const int last_row=(end-start)/8;
-  int roi_size=(last_row-3.0)/2.0;
-  //cout<<"ROI SIZE "<<roi_size<<endl;
-  int roi_border=start+3+roi_size;
-  
-
-  int &Event=Ev.Event;
-  int &Trigger=Ev.Trigger;
-  unsigned short *stopCellId=0;
-
-  double adc_sum=0;
-  int adc_counter=0;
-
-
-  int odd=0; // Set to 1 for the odd channels
-
-  int counter=0;
-  int other_counter=0;
-  
-  int guys=0;
-  double mean=0;
-
-  for(int row=0;row<last_row;row++){
-    
-    if(row==0){
-      // Evt Number and so on
-      unsigned short *prow=&buffer[start+row*8];
-      Event=prow[1]+0xffff*prow[0];
-      Trigger=prow[3]+0xffff*prow[2];
-
-      if(dump && 0) cout<<"###>>"<<endl<<"EVENT "<<Event<<" TRIGGER "<<Trigger<<" Corr Read Evt:"<<Ev.Counter<<endl;
-      continue;
-    }
-    
-    if(row==1) continue; // FLAGS
-    
-    if(row==2){
-      stopCellId=&buffer[start+row*8];
-      if(dump && 0){
-	cout<<"###>>"<<"STOP CELLS ";
-	for(int ii=0;ii<8;ii++) cout<<"###>>"<<buffer[ii]<<" ";
-      }
-      continue;
-    }
-    
-    if(row>=roi_border) odd=1;
-
-    for(int record=0;record<8;record++){
-      if(odd && record>5) break; // DO NOT READ THE _TAG, whatever it is
-      
-      int channel=(record&0xfffe)+odd;
-      int low_gain=record%2;
-      
-      int cellId=row-(odd?roi_border:3)        // Slices-offset
-	+stopCellId[channel];                  // Stop cell id
-      
-
-      int adc=buffer[start+row*8+record];
-      int roi=row-(odd?roi_border:3);
-
-      if(dump && 0){
-	if(record==0) cout<<"###>>"<<endl<<"ROI "<<roi<<" ";
-	fprintf(stderr,"(c%i,g%i) %i ",channel,low_gain,adc);
-      }
-
-      Ev.Channel=channel;
-      Ev.LowGain=low_gain;
-      Ev.CellId=cellId%4096;
-      Ev.Roi=roi;
-      Ev.Adc=adc;
-
-      // Update the map
-      int *value=eventsMap[Ev.Id][Ev.Channel][Ev.CellId][Ev.LowGain];
-      int &upts=eventsMapUpt[Ev.Id][Ev.Channel][Ev.CellId][Ev.LowGain];
-
-
-      if(roi>1 && roi<roi_size-1){ 
-
-	  // Search for the closer one
-	  int closer=_npointers;
-	  int vals[_npointers+1];
-	  vals[closer]=9999999;
-	  for(int i=0;i<_npointers;i++) vals[i]=abs(Ev.Adc-value[i]);  // Try to use vectorization
-	  for(int i=0;i<_npointers;i++) closer=vals[i]<vals[closer]?i:closer;
-	  
-	  if(closer<_npointers && value[closer]>0){
-	    
-	    Ev.AdcCorr=value[closer];
-	    if(Ev.Trigger>100){
-	      guys++;
-	      mean+=(Ev.Adc-Ev.AdcCorr);
-	    }
-	    //	    if(Ev.Adc-Ev.AdcCorr<-150) corrupted=true;
-	    Ev.Status=0;
-
-
-	    /*
-	    if(otree){
-	      bool store_it=false;
-	      if(gRandom->Uniform()<0.01) {Ev.Status+=1;store_it=true;}
-	      if(Ev.Trigger!=Ev.Event){Ev.Status+=10; store_it=true;}
-	      if(Ev.Adc-Ev.AdcCorr<-150) {Ev.Status+=100; store_it=true;}
-	      if(Ev.Adc<50) {Ev.Status+=1000; store_it=true;}
-	      if(store_it) otree->Fill();
-	    }
-	    */
-	    if(dump) otree->Fill();
-
-	  }
-	  
-	  adc_sum+=Ev.Adc;
-	  adc_counter++;
-
-	  if(Ev.Adc>0){
-	    value[upts%_npointers]=Ev.Adc;
-	    upts++;
-	  }
-      }
-      
-    }
-  }
-  
-
-  Ev.Adc=adc_sum/adc_counter;
-
-
-  if(otree && 0) otree->Fill();
-
-
-  double sigmas=fabs(mean/guys)*sqrt(guys)/7.993;
-  if(guys>1 && sigmas>4) corrupted=1;
-  
-  return corrupted;
-}
-
-
-bool Analysis(unsigned short *buffer,int start,int end,int store,int threshold){
-  bool corrupted=analyze(buffer,start,end,store,threshold);
-  if(Ev.Adc<200){corrupted=1;analyze(buffer,start,end,store,threshold,1);} ///// TEST TO DUMP CORRUPTED
-  return corrupted;
-}
-
 ///////////////////////////////////////////////////////////////////////////////////////////
 // ALL END
 ///////////////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,270 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+// DragonEvent.cpp
+//
+// ****Function****
+//  The read loops take every evsize bytes on the socket as one event. When a
+//  FEB runs with another read depth than the one given with -r (rpcp), or
+//  bytes are lost, every later event is cut in the wrong place and the only
+//  trace used to be the "residual of N bytes" in the summary.
+//  ReadEvent() checks the 0xAAAA start word and the 0xDDDD_DDDD_DDDD_DDDD
+//  separator of each event, which costs two compares. On a mismatch the
+//  bytes read so far are searched (SSE2, 16 positions per step) for the
+//  next start word followed by the separator 24 bytes later; the stream
+//  is realigned there and the event is completed from the socket.
+//  Neither marker can appear in the 12 bit ADC data.
+//
+//  CounterCheck() follows the EventCounter of each FEB from the header of
+//  every event (no decoding of the data): a jump is an exact count of the
+//  events lost between the FEB and the host, a counter which does not
+//  advance is a duplicate, and a counter far back is taken as a reset of
+//  the FEB (after a reconnection) and followed from its new value. The
+//  TriggerCounter advances also for triggers the FEB could not read out,
+//  so the events missing from it give the dead time of the board itself.
+//
+//  HeaderCheckEvent() is the cheap tier of the Online programs with -S:
+//  from the header alone it flags the events found by a resync, after a
+//  counter jump, with a stop cell beyond 4095, a 133 MHz clock which did
+//  not advance or flags which changed. HeaderCheckDecode() then sends
+//  those, and a deterministic sample of the others, to the full decode.
+//
+//  EventFileOpen() maps a data file for the offline tools, and
+//  EventDecodeHeader() and EventDecodeWaveforms() turn a v5 event into
+//  host order values. The data are 2*rddepth rows of 8
+//  words: the first rddepth rows hold the even channels, the next rddepth
+//  the odd ones, each row as (ch,high) (ch,low) (ch+2,high) (ch+2,low) ...
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "DragonEvent.hh"
+
+// A start word at c is a candidate if the separator matches, or is not read yet
+static inline bool FrameCandidate(const unsigned char *buf, int c, int len)
+{
+  if(c+EV_OFF_SEPARATOR+8>len) return true;
+  unsigned long long sep;
+  memcpy(&sep,buf+c+EV_OFF_SEPARATOR,sizeof(sep));
+  return sep==0xDDDDDDDDDDDDDDDDULL;
+}
+
+int FrameFind(const unsigned char *buf, int len)
+{
+  int k=0;
+#if defined(__SSE2__)
+  const __m128i aa=_mm_set1_epi8((char)0xAA);
+  for(;k+17<=len;k+=16)
+    {
+      __m128i a=_mm_loadu_si128((const __m128i *)(buf+k));
+      __m128i b=_mm_loadu_si128((const __m128i *)(buf+k+1));
+      unsigned int m=_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a,aa),_mm_cmpeq_epi8(b,aa)));
+      while(m)
+	{
+	  int c=k+__builtin_ctz(m);
+	  if(FrameCandidate(buf,c,len)) return c;
+	  m&=m-1;
+	}
+    }
+#endif
+  for(;k+1<len;k++)
+    if(buf[k]==0xAA && buf[k+1]==0xAA && FrameCandidate(buf,k,len)) return k;
+  return -1;
+}
+
+// Fills buf[have,evsize) from the socket
+static int ReadFill(int fd, unsigned char *buf, int have, int evsize, FebInspect *inspect)
+{
+  while(have<evsize)
+    {
+      unsigned long long tRead= inspect ? InspectNow() : 0;
+      int ret=read(fd,buf+have,evsize-have);
+      if(inspect) InspectRead(inspect,tRead,ret);
+      if(ret<0 && errno==EINTR) continue;
+      if(ret<=0) return ret;
+      have+=ret;
+    }
+  return have;
+}
+
+int ReadEvent(int fd, unsigned char *buf, int evsize, bool framed, FrameStat *st, FebInspect *inspect)
+{
+  int ret=ReadFill(fd,buf,0,evsize,inspect);
+  if(ret<=0) return ret;
+  if(st) st->resynced=false;
+  if(!framed || EventFramed(buf)) return evsize;
+
+  // Misframed: drop bytes up to the next start word and complete the event
+  unsigned long long skipped=0;
+  do
+    {
+      int c=FrameFind(buf+1,evsize-1);
+      if(c>=0) c++;
+      else c= buf[evsize-1]==0xAA ? evsize-1 : evsize; // keep a possible first half of 0xAAAA
+      memmove(buf,buf+c,evsize-c);
+      skipped+=c;
+      ret=ReadFill(fd,buf,evsize-c,evsize,inspect);
+      if(ret<=0) return ret;
+    }
+  while(!EventFramed(buf));
+  if(st)
+    {
+      st->misframed++;
+      st->skipped+=skipped;
+      st->resynced=true;
+    }
+  return evsize;
+}
+
+void FrameReport(FILE *fp, const FrameStat *st, int nFeb, const std::string *names)
+{
+  bool any=false;
+  for(int i=0;i<nFeb;i++)
+    if(st[i].misframed) any=true;
+  if(!any) return;
+  fprintf(fp,"***** Framing *****\n");
+  fprintf(fp,"IPaddress  Misframed SkippedBytes\n");
+  for(int i=0;i<nFeb;i++)
+    if(st[i].misframed)
+      fprintf(fp,"%s  %llu %llu\n",names[i].c_str(),st[i].misframed,st[i].skipped);
+}
+
+void CounterReport(FILE *fp, const CounterStat *cs, int nFeb, const std::string *names)
+{
+  bool any=false;
+  for(int i=0;i<nFeb;i++)
+    if(cs[i].received) any=true;
+  if(!any) return;
+  fprintf(fp,"***** Event counters *****\n");
+  fprintf(fp,"IPaddress  FirstEvent LastEvent Received Lost Gaps Duplicates Restarts Triggers DeadTime[%%]\n");
+  for(int i=0;i<nFeb;i++)
+    {
+      const CounterStat &c=cs[i];
+      if(c.received==0) continue;
+      // triggers which the FEB did not turn into an event
+      double dead= c.triggers>c.made ? 100.*(c.triggers-c.made)/c.triggers : 0;
+      fprintf(fp,"%s  %u %u %llu %llu %llu %llu %llu %llu %.3f\n",names[i].c_str(),c.firstEvent,c.lastEvent,
+	      c.received,c.lost,c.gaps,c.duplicates,c.restarts,c.triggers,dead);
+    }
+}
+
+void HeaderCheckReport(FILE *fp, const HeaderCheck *hc, int nFeb, const std::string *names, unsigned int sample)
+{
+  fprintf(fp,"***** Tiered processing, one event in %u decoded *****\n",sample);
+  fprintf(fp,"IPaddress  HeaderOnly Sampled Flagged Decoded[%%] | Framing Counter StopCell Clock Flags\n");
+  for(int i=0;i<nFeb;i++)
+    {
+      const HeaderCheck &h=hc[i];
+      unsigned long long n=h.headerOnly+h.sampled+h.flagged;
+      fprintf(fp,"%s  %llu %llu %llu %.2f |",names[i].c_str(),h.headerOnly,h.sampled,h.flagged,
+	      n ? 100.*(h.sampled+h.flagged)/n : 0.);
+      for(int k=0;k<HDR_NCHECK;k++) fprintf(fp," %llu",h.failed[k]);
+      fprintf(fp,"\n");
+    }
+}
+
+void EventDecodeHeader(const unsigned char *ev, EventHeader *h)
+{
+  h->pps=ev[EV_OFF_PPS]<<8 | ev[EV_OFF_PPS+1];
+  h->clock10=EventBe32(ev+EV_OFF_10MHZ);
+  h->event=EventBe32(ev+EV_OFF_EVCOUNT);
+  h->trigger=EventBe32(ev+EV_OFF_TRIGCOUNT);
+  h->clock133=(unsigned long long)EventBe32(ev+EV_OFF_CLOCK133)<<32 | EventBe32(ev+EV_OFF_CLOCK133+4);
+  for(int k=0;k<8;k++)
+    {
+      h->flags[k]=ev[EV_OFF_FLAGS+2*k]<<8 | ev[EV_OFF_FLAGS+2*k+1];
+      h->stopCell[k]=ev[EV_OFF_STOPCELL+2*k]<<8 | ev[EV_OFF_STOPCELL+2*k+1];
+    }
+}
+
+void EventDecodeWaveforms(const unsigned char *ev, int rddepth, unsigned short *out)
+{
+  const unsigned char *row=ev+EV_HEADER_SIZE;
+  for(int half=0;half<2;half++)
+    for(int slice=0;slice<rddepth;slice++,row+=16)
+      {
+	unsigned short w[8];
+	memcpy(w,row,sizeof(w));
+	for(int r=0;r<8;r++)
+	  {
+	    int channel=(r&~1)+half;
+	    out[(channel*EV_NGAIN+(r&1))*rddepth+slice]=__builtin_bswap16(w[r]);
+	  }
+      }
+}
+
+int EventFileOpen(EventFile *f, const char *path, int evsize)
+{
+  f->name=path;
+  f->map=NULL;
+  f->size=0;
+  int fd=open(path,O_RDONLY);
+  struct stat st;
+  if(fd<0 || fstat(fd,&st)!=0)
+    {
+      perror(path);
+      if(fd>=0) close(fd);
+      return -1;
+    }
+  f->size=st.st_size;
+  if(f->size>0)
+    {
+      void *m=mmap(NULL,f->size,PROT_READ,MAP_PRIVATE,fd,0);
+      if(m==MAP_FAILED)
+	{
+	  perror(path);
+	  close(fd);
+	  return -1;
+	}
+      f->map=(const unsigned char *)m;
+    }
+  close(fd);
+  // -T files start with a sync record, see DragonRecord.hh
+  f->records=false;
+  f->first=0;
+  f->stride=evsize;
+  if(f->size>=sizeof(DragonRecord))
+    {
+      DragonRecord rec;
+      memcpy(&rec,f->map,sizeof(rec));
+      if(rec.magic==DRAGON_RECORD_MAGIC)
+	{
+	  f->records=true;
+	  if(rec.flags&DRAGON_RECORD_SYNC) f->first=sizeof(rec)+rec.size;
+	  f->stride=sizeof(DragonRecord)+evsize;
+	}
+    }
+  f->nEvents= f->size>f->first ? (f->size-f->first)/f->stride : 0;
+  size_t residual= f->size>f->first ? (f->size-f->first)%f->stride : 0;
+  if(residual) printf("%s: residual of %lu bytes ignored\n",path,(unsigned long)residual);
+  size_t p=f->name.rfind("_FEB");
+  f->feb= p==std::string::npos ? -1 : atoi(f->name.c_str()+p+4);
+  return 0;
+}
+
+void EventFileClose(EventFile *f)
+{
+  if(f->map) munmap((void *)f->map,f->size);
+  f->map=NULL;
+}
+
+int EventFileRddepth(const std::string &name)
+{
+  size_t p=name.rfind("RD");
+  while(p!=std::string::npos)
+    {
+      int rd;
+      if(sscanf(name.c_str()+p,"RD%d",&rd)==1 && rd>0) return rd;
+      if(p==0) break;
+      p=name.rfind("RD",p-1);
+    }
+  return -1;
+}
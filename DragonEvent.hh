@@ -0,0 +1,291 @@
+#ifndef DRAGON_EVENT_H
+#define DRAGON_EVENT_H
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+#include "DragonHist.hh"
+#include "DragonRecord.hh"
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Dragon v5 event layout, framing and counter checks, see DragonEvent.cpp
+//   all fields big endian
+//     0 0xAAAA              2 PPS counter       4 10 MHz counter
+//     8 EventCounter       12 TriggerCounter   16 133 MHz clock (8 bytes)
+//    24 0xDDDD x 4         32 flags (16)       48 stop cells (16)
+//    64 data, 16 bit words
+///////////////////////////////////////////////////////////////////////////////////////////
+#define EV_OFF_PPS         2
+#define EV_OFF_10MHZ       4
+#define EV_OFF_EVCOUNT     8
+#define EV_OFF_TRIGCOUNT  12
+#define EV_OFF_CLOCK133   16
+#define EV_OFF_SEPARATOR  24
+#define EV_OFF_FLAGS      32
+#define EV_OFF_STOPCELL   48
+#define EV_HEADER_SIZE    64
+
+#define EV_NCHANNEL        8
+#define EV_NGAIN           2  // 0: high gain, 1: low gain
+#define EV_NCELL        4096  // DRS4 capacitors per channel
+
+// Header of a v5 event in host byte order
+struct EventHeader
+{
+  unsigned short pps;
+  unsigned int clock10;
+  unsigned int event;
+  unsigned int trigger;
+  unsigned long long clock133;
+  unsigned short flags[8];
+  unsigned short stopCell[EV_NCHANNEL];
+};
+
+void EventDecodeHeader(const unsigned char *ev, EventHeader *h);
+// Waveforms of a v5 event in host byte order, out[(channel*EV_NGAIN+gain)*rddepth+slice]
+void EventDecodeWaveforms(const unsigned char *ev, int rddepth, unsigned short *out);
+
+// A DragonDaqM data file mapped read only: plain events, or events framed
+// by a DragonRecord (-T, unified) after a sync record. Every event has the
+// same size, so event k is found by a multiplication.
+struct EventFile
+{
+  std::string name;
+  const unsigned char *map;
+  size_t size;
+  size_t first;                 // offset of the first event
+  size_t stride;                // bytes per event, with its DragonRecord
+  bool records;
+  int feb;                      // from _FEB<i> in the name, -1 if none
+  unsigned long long nEvents;
+};
+
+int  EventFileOpen(EventFile *f, const char *path, int evsize);
+void EventFileClose(EventFile *f);
+// Read depth from the RD<n> of a file name, -1 if none
+int  EventFileRddepth(const std::string &name);
+
+// Event k. rec gets its DragonRecord, or the FEB of the file name and no
+// arrival time when the file has no records.
+inline const unsigned char *EventFileAt(const EventFile *f, unsigned long long k, DragonRecord *rec)
+{
+  const unsigned char *p=f->map+f->first+k*f->stride;
+  if(!f->records)
+    {
+      RecordFill(rec, f->feb<0 ? 0 : f->feb,f->stride,0);
+      return p;
+    }
+  memcpy(rec,p,sizeof(*rec));
+  return p+sizeof(*rec);
+}
+
+// Per-FEB framing counters, only touched by the thread reading the FEB
+struct FrameStat
+{
+  unsigned long long misframed; // events which did not start with the markers
+  unsigned long long skipped;   // bytes thrown away to find the next event
+  bool resynced;                // the last ReadEvent() had to resynchronise
+};
+
+// Start word and separator in place (a single compare of each on the common path)
+inline bool EventFramed(const unsigned char *ev)
+{
+  unsigned long long sep;
+  memcpy(&sep,ev+EV_OFF_SEPARATOR,sizeof(sep));
+  return ev[0]==0xAA && ev[1]==0xAA && sep==0xDDDDDDDDDDDDDDDDULL;
+}
+
+// Reads one event of evsize bytes into buf. With framed, the v5 markers are
+// checked and, when they are not where expected, the stream is searched for
+// the next event. inspect may be NULL (no close inspection).
+// Returns evsize, or the failing read() (<=0, errno set) when the connection is lost.
+int  ReadEvent(int fd, unsigned char *buf, int evsize, bool framed, FrameStat *st, FebInspect *inspect);
+
+// Offset of the first event start in buf[0,len), -1 if none (exposed for offline tools)
+int  FrameFind(const unsigned char *buf, int len);
+
+void FrameReport(FILE *fp, const FrameStat *st, int nFeb, const std::string *names);
+
+// Samples of an event below threshold, slice 0 left out (the -t check of
+// DragonDaqMOnline). first/last get the byte offsets of the first and last
+// of them, latest the value of the last one.
+inline int EventThresholdScan(const unsigned char *ev, int HeaderSize, int rddepth, unsigned int threshold,
+			      int *first, int *last, int *latest)
+{
+  int n=0;
+  for(int b=HeaderSize; b<HeaderSize+16*rddepth*2;b+=2)
+    {
+      unsigned short adc=(unsigned short)(ev[b]<<8 | ev[b+1]);
+      int slice=((b-HeaderSize)/16)%40;
+      if(adc<threshold && slice!=0)
+	{
+	  if(b>*last) *last=b;
+	  if(b<*first) *first=b;
+	  *latest=adc;
+	  n++;
+	}
+    }
+  return n;
+}
+
+inline unsigned int EventBe32(const unsigned char *p)
+{
+  unsigned int v;
+  memcpy(&v,p,sizeof(v));
+  return __builtin_bswap32(v);
+}
+
+// Continuity of the EventCounter and TriggerCounter of one FEB
+struct CounterStat
+{
+  bool started;
+  unsigned int firstEvent,lastEvent;
+  unsigned int lastTrigger;
+  unsigned long long received;   // events checked
+  unsigned long long lost;       // EventCounter values never received
+  unsigned long long gaps;       // jumps of the EventCounter
+  unsigned long long duplicates; // EventCounter not advancing, or a few back
+  unsigned long long restarts;   // EventCounter far back (FEB reset)
+  unsigned long long made;       // EventCounter advance
+  unsigned long long triggers;   // TriggerCounter advance
+};
+
+#define COUNTER_BACK_MAX 1024 // further back is a restart of the FEB
+
+// EventCounter advance d (modulo 2^32) since the last event kept
+enum { COUNTER_NEXT, COUNTER_GAP, COUNTER_DUPLICATE, COUNTER_RESTART };
+inline constexpr int CounterStep(unsigned int d)
+{
+  return d==1 ? COUNTER_NEXT :
+    (d==0 || d>=0u-COUNTER_BACK_MAX) ? COUNTER_DUPLICATE :  // repeated, or a few back
+    d>=0x80000000u ? COUNTER_RESTART : COUNTER_GAP;
+}
+// 100,101,102,101,103,104: one duplicate, nothing lost, no restart
+static_assert(CounterStep(101u-100u)==COUNTER_NEXT && CounterStep(102u-101u)==COUNTER_NEXT &&
+	      CounterStep(101u-102u)==COUNTER_DUPLICATE && CounterStep(103u-102u)==COUNTER_NEXT &&
+	      CounterStep(104u-103u)==COUNTER_NEXT,"CounterStep() on a late event");
+static_assert(CounterStep(0u-COUNTER_BACK_MAX-1)==COUNTER_RESTART && CounterStep(5)==COUNTER_GAP,
+	      "CounterStep() on a restart or a gap");
+
+// Header-only check of one event. Returns the number of events lost just
+// before it, -1 for a duplicate. *dTrigger is the TriggerCounter advance
+// since the previous event.
+inline int CounterCheck(CounterStat *cs, const unsigned char *ev, unsigned int *dTrigger)
+{
+  unsigned int e=EventBe32(ev+EV_OFF_EVCOUNT);
+  unsigned int t=EventBe32(ev+EV_OFF_TRIGCOUNT);
+  unsigned int d=e-cs->lastEvent; // modulo 2^32
+  unsigned int dt=t-cs->lastTrigger;
+  int step= cs->started ? CounterStep(d) : COUNTER_RESTART;
+  cs->received++;
+  *dTrigger=0;
+  if(step==COUNTER_NEXT)
+    {
+      cs->lastEvent=e;
+      cs->lastTrigger=t;
+      cs->made++;
+      cs->triggers+=dt;
+      *dTrigger=dt;
+      return 0;
+    }
+  if(step==COUNTER_RESTART)
+    {
+      if(cs->started) cs->restarts++;
+      else cs->firstEvent=e;
+      cs->started=true;
+      cs->lastEvent=e;
+      cs->lastTrigger=t;
+      return 0;
+    }
+  if(step==COUNTER_DUPLICATE)
+    {
+      cs->duplicates++;
+      return -1;
+    }
+  cs->lastEvent=e;
+  cs->lastTrigger=t;
+  cs->made+=d;
+  cs->triggers+=dt;
+  *dTrigger=dt;
+  cs->gaps++;
+  cs->lost+=d-1;
+  return (int)(d-1);
+}
+
+// Lost events, and dead time from the triggers which produced no event
+void CounterReport(FILE *fp, const CounterStat *cs, int nFeb, const std::string *names);
+
+/******************************************/
+//  Tiered processing (-S): header checks of every event of one FEB
+/******************************************/
+enum
+  {
+    HDR_FRAMING=0,    // the stream was resynchronised to find the event
+    HDR_COUNTER,      // events lost just before it, or a duplicate
+    HDR_STOPCELL,     // stop cell beyond the DRS4 capacitors
+    HDR_CLOCK,        // 133 MHz clock not advancing
+    HDR_FLAGS,        // flags not the same as in the previous event
+    HDR_NCHECK
+  };
+
+struct HeaderCheck
+{
+  bool started;
+  unsigned long long clock133;
+  unsigned long long flags[2];
+  unsigned long long failed[HDR_NCHECK];
+  unsigned long long headerOnly;  // events which only had their header checked
+  unsigned long long sampled;     // fully decoded, in the sample
+  unsigned long long flagged;     // fully decoded, failing a check
+};
+
+// Returns the checks the event failed, bit k for HDR_<k>.
+// lost: the return of CounterCheck() for the event
+inline unsigned int HeaderCheckEvent(HeaderCheck *hc, const unsigned char *ev, bool resynced, int lost)
+{
+  unsigned int fail=0;
+  if(resynced) fail|=1<<HDR_FRAMING;
+  if(lost) fail|=1<<HDR_COUNTER;
+  // 8 big endian stop cells, 0-4095: the top 4 bits of each are 0
+  unsigned long long stop[2];
+  memcpy(stop,ev+EV_OFF_STOPCELL,sizeof(stop));
+  if((stop[0]|stop[1])&0x00f000f000f000f0ULL) fail|=1<<HDR_STOPCELL;
+  unsigned long long clock=(unsigned long long)EventBe32(ev+EV_OFF_CLOCK133)<<32 | EventBe32(ev+EV_OFF_CLOCK133+4);
+  unsigned long long flags[2];
+  memcpy(flags,ev+EV_OFF_FLAGS,sizeof(flags));
+  if(hc->started)
+    {
+      if(clock<=hc->clock133 && !lost) fail|=1<<HDR_CLOCK;
+      if(flags[0]!=hc->flags[0] || flags[1]!=hc->flags[1]) fail|=1<<HDR_FLAGS;
+    }
+  hc->started=true;
+  hc->clock133=clock;
+  hc->flags[0]=flags[0];
+  hc->flags[1]=flags[1];
+  for(int k=0;k<HDR_NCHECK;k++)
+    if(fail&(1<<k)) hc->failed[k]++;
+  return fail;
+}
+
+// true when the event gets the full decode: it failed a check, or its
+// EventCounter is a multiple of sample (the same events on every FEB,
+// run after run). sample 0: every event.
+inline bool HeaderCheckDecode(HeaderCheck *hc, const unsigned char *ev, unsigned int fail, unsigned int sample)
+{
+  if(fail)
+    {
+      hc->flagged++;
+      return true;
+    }
+  if(sample==0 || EventBe32(ev+EV_OFF_EVCOUNT)%sample==0)
+    {
+      hc->sampled++;
+      return true;
+    }
+  hc->headerOnly++;
+  return false;
+}
+
+void HeaderCheckReport(FILE *fp, const HeaderCheck *hc, int nFeb, const std::string *names, unsigned int sample);
+#endif
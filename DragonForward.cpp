@@ -0,0 +1,438 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+// DragonForward.cpp
+//
+// ****Function****
+//  Streams the events stored by DragonDaqM to subscribers (-F), so that
+//  online reconstruction runs in another process, or on another host,
+//  without going through the data files:
+//    - a subscriber connects to the TCP port (loopback unless an address
+//      is given) or to the Unix socket, and from the next batch on gets
+//          ForwardHeader, then header.bytes of events, each after its
+//          DragonRecord (FEB index, arrival time), as in a -U file
+//      the header says how many batches it lost just before this one;
+//    - the writer thread copies the events out of the arena into a batch
+//      of -F ...,<batch kB> (256 kB by default) and hands a full batch, or
+//      one older than 10 ms, to the queue of every subscriber; the batch
+//      is shared by the queues and reused once the last one has sent it;
+//    - a sender thread sends each queue with sendmsg() of the headers and
+//      batches as one scatter-gather list, never blocking on a subscriber;
+//    - the queue of a subscriber is bounded (-F ...,<queue MB>, 64 MB by
+//      default): a subscriber too slow for the data rate loses whole
+//      batches, the acquisition and the other subscribers do not wait.
+//  The events are copied once per batch rather than sent from their arena
+//  slots, so that a slow subscriber never holds the slots the FEBs are
+//  read into.
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "DragonForward.hh"
+#include "DragonClock.hh"
+
+#define FORWARD_IOV 64                   // iovecs per sendmsg()
+#define FORWARD_FLUSH_NS 10000000ULL     // age of a partial batch sent anyway
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// batches, with the mutex held
+///////////////////////////////////////////////////////////////////////////////////////////
+static void BatchRelease(Forwarder *fw, ForwardBatch *b)
+{
+  if(--b->ref==0) fw->pool.push_back(b);
+}
+
+static void SubClose(Forwarder *fw, Subscriber *s)
+{
+  for(size_t k=0;k<s->queue.size();k++) BatchRelease(fw,s->queue[k].batch);
+  s->queue.clear();
+  s->queued=0;
+  close(s->fd);
+  printf("Subscriber %s left after %llu batches, %llu dropped\n",s->peer.c_str(),s->batches,s->dropped);
+  fw->gone.push_back(*s);
+  for(size_t k=0;k<fw->subs.size();k++)
+    if(fw->subs[k]==s)
+      {
+	fw->subs.erase(fw->subs.begin()+k);
+	break;
+      }
+  delete s;
+}
+
+// Queues the current batch to every subscriber with room for it
+static void Publish(Forwarder *fw)
+{
+  ForwardBatch *b=fw->cur;
+  fw->cur=NULL;
+  b->seq=fw->seq++;
+  size_t size=sizeof(ForwardHeader)+b->data.size();
+  pthread_mutex_lock(&fw->mutex);
+  for(size_t k=0;k<fw->subs.size();k++)
+    {
+      Subscriber *s=fw->subs[k];
+      // an empty queue takes a batch of any size
+      if(!s->queue.empty() && s->queued+size>fw->queueBytes)
+	{
+	  s->dropRun++;
+	  s->dropped++;
+	  s->droppedEvents+=b->nEvents;
+	  continue;
+	}
+      ForwardQueued q;
+      q.batch=b;
+      q.head.magic=FORWARD_MAGIC;
+      q.head.bytes=b->data.size();
+      q.head.nEvents=b->nEvents;
+      q.head.dropped=s->dropRun;
+      q.head.seq=b->seq;
+      s->queue.push_back(q);
+      s->queued+=size;
+      s->dropRun=0;
+      b->ref++;
+    }
+  BatchRelease(fw,b);
+  pthread_mutex_unlock(&fw->mutex);
+  unsigned long long one=1;
+  if(write(fw->wakefd,&one,sizeof(one))<0) {}
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// writer thread
+///////////////////////////////////////////////////////////////////////////////////////////
+void ForwardPut(Forwarder *fw, const DragonRecord *rec, const void *ev, size_t size)
+{
+  if(fw->cur==NULL)
+    {
+      pthread_mutex_lock(&fw->mutex);
+      if(fw->pool.empty())
+	{
+	  fw->cur=new ForwardBatch;
+	  fw->cur->data.reserve(fw->batchBytes+sizeof(*rec)+size);
+	}
+      else
+	{
+	  fw->cur=fw->pool.back();
+	  fw->pool.pop_back();
+	}
+      pthread_mutex_unlock(&fw->mutex);
+      fw->cur->data.clear();
+      fw->cur->nEvents=0;
+      fw->cur->ref=1;
+      fw->curStart=DragonClockNow();
+    }
+  ForwardBatch *b=fw->cur;
+  const unsigned char *r=(const unsigned char *)rec;
+  b->data.insert(b->data.end(),r,r+sizeof(*rec));
+  b->data.insert(b->data.end(),(const unsigned char *)ev,(const unsigned char *)ev+size);
+  b->nEvents++;
+  fw->nEvents++;
+  if(b->data.size()>=fw->batchBytes) Publish(fw);
+}
+
+void ForwardFlush(Forwarder *fw, unsigned long long now, bool force)
+{
+  if(fw->cur && (force || now-fw->curStart>=fw->flushNs)) Publish(fw);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// sender thread
+///////////////////////////////////////////////////////////////////////////////////////////
+// Sends what the socket takes of the queue, -1 when the subscriber is gone
+static int SubSend(Forwarder *fw, Subscriber *s)
+{
+  struct iovec iov[FORWARD_IOV];
+  int n=0;
+  pthread_mutex_lock(&fw->mutex);
+  // the writer only appends to the queue, the queued entries don't move
+  size_t skip=s->sent;
+  for(size_t k=0;k<s->queue.size() && n+2<=FORWARD_IOV;k++)
+    {
+      ForwardQueued &q=s->queue[k];
+      iov[n].iov_base=&q.head;
+      iov[n].iov_len=sizeof(q.head);
+      iov[n+1].iov_base=&q.batch->data[0];
+      iov[n+1].iov_len=q.batch->data.size();
+      for(int j=n;j<n+2;j++)
+	{
+	  size_t cut= skip<iov[j].iov_len ? skip : iov[j].iov_len;
+	  iov[j].iov_base=(char *)iov[j].iov_base+cut;
+	  iov[j].iov_len-=cut;
+	  skip-=cut;
+	}
+      n+=2;
+    }
+  pthread_mutex_unlock(&fw->mutex);
+  if(n==0) return 0;
+  struct msghdr msg;
+  memset(&msg,0,sizeof(msg));
+  msg.msg_iov=iov;
+  msg.msg_iovlen=n;
+  ssize_t ret=sendmsg(s->fd,&msg,MSG_NOSIGNAL|MSG_DONTWAIT);
+  if(ret<0) return errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR ? 0 : -1;
+  pthread_mutex_lock(&fw->mutex);
+  s->sent+=ret;
+  while(!s->queue.empty())
+    {
+      ForwardQueued &q=s->queue.front();
+      size_t size=sizeof(q.head)+q.batch->data.size();
+      if(s->sent<size) break;
+      s->sent-=size;
+      s->queued-=size;
+      s->batches++;
+      s->bytes+=size;
+      BatchRelease(fw,q.batch);
+      s->queue.pop_front();
+    }
+  pthread_mutex_unlock(&fw->mutex);
+  return 0;
+}
+
+static void SubAccept(Forwarder *fw)
+{
+  struct sockaddr_storage addr;
+  socklen_t len=sizeof(addr);
+  int fd=accept4(fw->listenfd,(struct sockaddr *)&addr,&len,SOCK_NONBLOCK|SOCK_CLOEXEC);
+  if(fd<0) return;
+  Subscriber *s=new Subscriber;
+  s->fd=fd;
+  char peer[64];
+  snprintf(peer,sizeof(peer),"%s#%d",fw->spec.c_str(),fd);
+  s->peer=peer;
+  if(addr.ss_family==AF_INET)
+    {
+      struct sockaddr_in *in=(struct sockaddr_in *)&addr;
+      char host[INET_ADDRSTRLEN];
+      inet_ntop(AF_INET,&in->sin_addr,host,sizeof(host));
+      snprintf(peer,sizeof(peer),"%s:%d",host,ntohs(in->sin_port));
+      s->peer=peer;
+      int one=1;
+      setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+    }
+  s->queued=0;
+  s->sent=0;
+  s->dropRun=0;
+  s->batches=0;
+  s->bytes=0;
+  s->dropped=0;
+  s->droppedEvents=0;
+  pthread_mutex_lock(&fw->mutex);
+  fw->subs.push_back(s);
+  pthread_mutex_unlock(&fw->mutex);
+  printf("Subscriber %s connected\n",s->peer.c_str());
+}
+
+static void *SenderLoop(void *arg)
+{
+  Forwarder *fw=(Forwarder *)arg;
+  std::vector<struct pollfd> pfd;
+  std::vector<Subscriber *> who;
+  for(;;)
+    {
+      pthread_mutex_lock(&fw->mutex);
+      bool quit=fw->quit;
+      who=fw->subs;   // only this thread adds or removes subscribers
+      pfd.resize(2+who.size());
+      for(size_t k=0;k<who.size();k++)
+	{
+	  pfd[2+k].fd=who[k]->fd;
+	  pfd[2+k].events= POLLIN | (who[k]->queue.empty() ? 0 : POLLOUT);
+	}
+      pthread_mutex_unlock(&fw->mutex);
+      if(quit) break;
+      pfd[0].fd=fw->listenfd;
+      pfd[0].events=POLLIN;
+      pfd[1].fd=fw->wakefd;
+      pfd[1].events=POLLIN;
+      if(poll(&pfd[0],pfd.size(),100)<=0) continue;
+      if(pfd[1].revents&POLLIN)
+	{
+	  unsigned long long n;
+	  if(read(fw->wakefd,&n,sizeof(n))<0) {}
+	}
+      for(size_t k=0;k<who.size();k++)
+	{
+	  Subscriber *s=who[k];
+	  short re=pfd[2+k].revents;
+	  bool gone= (re&(POLLERR|POLLHUP))!=0;
+	  if(!gone && (re&POLLIN))
+	    {
+	      // subscribers have nothing to say, anything read is discarded
+	      char buf[256];
+	      ssize_t n=recv(s->fd,buf,sizeof(buf),MSG_DONTWAIT);
+	      gone= n==0 || (n<0 && errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=EINTR);
+	    }
+	  if(!gone && (re&POLLOUT)) gone= SubSend(fw,s)!=0;
+	  if(gone)
+	    {
+	      pthread_mutex_lock(&fw->mutex);
+	      SubClose(fw,s);
+	      pthread_mutex_unlock(&fw->mutex);
+	    }
+	}
+      if(pfd[0].revents&POLLIN) SubAccept(fw);
+    }
+  return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// setup
+///////////////////////////////////////////////////////////////////////////////////////////
+static int ForwardListen(const std::string &where)
+{
+  int fd;
+  if(where.compare(0,5,"unix:")==0)
+    {
+      struct sockaddr_un addr;
+      memset(&addr,0,sizeof(addr));
+      addr.sun_family=AF_UNIX;
+      if(where.size()-5>=sizeof(addr.sun_path))
+	{
+	  printf("ForwardStart() socket path too long : %s\n",where.c_str()+5);
+	  return -1;
+	}
+      strcpy(addr.sun_path,where.c_str()+5);
+      unlink(addr.sun_path);
+      fd=socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0);
+      if(fd<0 || bind(fd,(struct sockaddr *)&addr,sizeof(addr))!=0)
+	{
+	  perror("ForwardStart()::bind");
+	  if(fd>=0) close(fd);
+	  return -1;
+	}
+    }
+  else
+    {
+      struct sockaddr_in addr;
+      memset(&addr,0,sizeof(addr));
+      addr.sin_family=AF_INET;
+      addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+      size_t colon=where.rfind(':');
+      std::string port=where;
+      if(colon!=std::string::npos)
+	{
+	  std::string host=where.substr(0,colon);
+	  port=where.substr(colon+1);
+	  if(inet_pton(AF_INET,host.c_str(),&addr.sin_addr)!=1)
+	    {
+	      printf("ForwardStart() bad address %s\n",host.c_str());
+	      return -1;
+	    }
+	}
+      addr.sin_port=htons(atoi(port.c_str()));
+      fd=socket(AF_INET,SOCK_STREAM|SOCK_CLOEXEC,0);
+      int one=1;
+      if(fd>=0) setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+      if(fd<0 || bind(fd,(struct sockaddr *)&addr,sizeof(addr))!=0)
+	{
+	  perror("ForwardStart()::bind");
+	  if(fd>=0) close(fd);
+	  return -1;
+	}
+    }
+  if(listen(fd,8)!=0)
+    {
+      perror("ForwardStart()::listen");
+      close(fd);
+      return -1;
+    }
+  fcntl(fd,F_SETFL,fcntl(fd,F_GETFL)|O_NONBLOCK);
+  return fd;
+}
+
+Forwarder *ForwardStart(const char *spec)
+{
+  std::string s(spec);
+  size_t comma=s.find(',');
+  std::string where=s.substr(0,comma);
+  double queueMB=64,batchKB=256;
+  if(comma!=std::string::npos)
+    {
+      char *end;
+      queueMB=strtod(s.c_str()+comma+1,&end);
+      if(*end==',') batchKB=strtod(end+1,&end);
+      if(*end!='\0' || queueMB<=0 || batchKB<=0)
+	{
+	  printf("Bad forward %s, expected [<addr>:]<port>|unix:<path>[,<queue MB>[,<batch kB>]]\n",spec);
+	  return NULL;
+	}
+    }
+  int listenfd=ForwardListen(where);
+  if(listenfd<0) return NULL;
+  Forwarder *fw=new Forwarder;
+  fw->spec=where;
+  fw->listenfd=listenfd;
+  fw->wakefd=eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+  fw->queueBytes=(size_t)(queueMB*(1<<20));
+  fw->batchBytes=(size_t)(batchKB*(1<<10));
+  fw->flushNs=FORWARD_FLUSH_NS;
+  fw->cur=NULL;
+  fw->curStart=0;
+  fw->seq=0;
+  fw->nEvents=0;
+  fw->quit=false;
+  pthread_mutex_init(&fw->mutex,NULL);
+  if(fw->wakefd<0 || pthread_create(&fw->sender,NULL,SenderLoop,fw)!=0)
+    {
+      printf("ForwardStart() can't create sender thread\n");
+      close(listenfd);
+      delete fw;
+      return NULL;
+    }
+  printf("Events are forwarded to the subscribers of %s, batches of %g kB, %g MB queued at most\n",
+	 where.c_str(),batchKB,queueMB);
+  return fw;
+}
+
+void ForwardReport(FILE *fp, Forwarder *fw)
+{
+  if(fw==NULL) return;
+  pthread_mutex_lock(&fw->mutex);
+  std::vector<Subscriber> all(fw->gone);
+  for(size_t k=0;k<fw->subs.size();k++) all.push_back(*fw->subs[k]);
+  unsigned long long seq=fw->seq;
+  pthread_mutex_unlock(&fw->mutex);
+  fprintf(fp,"***** Forwarded to %s: %llu events in %llu batches *****\n",fw->spec.c_str(),fw->nEvents,seq);
+  if(all.empty()) return;
+  fprintf(fp,"Subscriber Batches MB DroppedBatches DroppedEvents Queued[kB]\n");
+  for(size_t k=0;k<all.size();k++)
+    fprintf(fp,"%s %llu %.1f %llu %llu %.0f\n",all[k].peer.c_str(),all[k].batches,all[k].bytes/1e6,
+	    all[k].dropped,all[k].droppedEvents,all[k].queued/1024.0);
+}
+
+void ForwardStop(Forwarder *fw)
+{
+  if(fw==NULL) return;
+  // give the subscribers a second to take the end of the run
+  for(int t=0;t<100;t++)
+    {
+      pthread_mutex_lock(&fw->mutex);
+      bool queued=false;
+      for(size_t k=0;k<fw->subs.size();k++) queued|=!fw->subs[k]->queue.empty();
+      pthread_mutex_unlock(&fw->mutex);
+      if(!queued) break;
+      usleep(10000);
+    }
+  pthread_mutex_lock(&fw->mutex);
+  fw->quit=true;
+  pthread_mutex_unlock(&fw->mutex);
+  pthread_join(fw->sender,NULL);
+  while(!fw->subs.empty()) SubClose(fw,fw->subs.back());
+  if(fw->cur) fw->pool.push_back(fw->cur);
+  for(size_t k=0;k<fw->pool.size();k++) delete fw->pool[k];
+  close(fw->listenfd);
+  close(fw->wakefd);
+  if(fw->spec.compare(0,5,"unix:")==0) unlink(fw->spec.c_str()+5);
+  pthread_mutex_destroy(&fw->mutex);
+  delete fw;
+}
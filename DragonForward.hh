@@ -0,0 +1,90 @@
+#ifndef DRAGON_FORWARD_H
+#define DRAGON_FORWARD_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "DragonRecord.hh"
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Events streamed to subscribers over TCP or a Unix socket, see DragonForward.cpp
+///////////////////////////////////////////////////////////////////////////////////////////
+#define FORWARD_MAGIC 0x46475244   // "DRGF"
+
+// Sent before each batch (host byte order), followed by bytes of
+// DragonRecord framed events
+struct ForwardHeader
+{
+  unsigned int magic;
+  unsigned int bytes;        // following this header
+  unsigned int nEvents;
+  unsigned int dropped;      // batches this subscriber lost just before this one
+  unsigned long long seq;    // batch number since the start of the program
+};
+
+// Events of one batch, shared by the queues of all the subscribers
+struct ForwardBatch
+{
+  std::vector<unsigned char> data;
+  unsigned int nEvents;
+  unsigned long long seq;
+  int ref;                   // queues holding it, and the writer while it fills
+};
+
+struct ForwardQueued
+{
+  ForwardBatch *batch;
+  ForwardHeader head;        // this subscriber's
+};
+
+struct Subscriber
+{
+  int fd;
+  std::string peer;
+  std::deque<ForwardQueued> queue;
+  size_t queued;             // bytes in the queue
+  size_t sent;               // bytes of the front batch (with its header) sent
+  unsigned int dropRun;      // batches dropped since the last queued one
+  unsigned long long batches;
+  unsigned long long bytes;
+  unsigned long long dropped;
+  unsigned long long droppedEvents;
+};
+
+struct Forwarder
+{
+  std::string spec;
+  int listenfd;
+  int wakefd;                // eventfd: batches were queued
+  size_t queueBytes;         // per subscriber
+  size_t batchBytes;
+  unsigned long long flushNs;
+  // writer thread
+  ForwardBatch *cur;
+  unsigned long long curStart;      // DragonClockNow() of the first event of cur
+  unsigned long long seq;
+  unsigned long long nEvents;
+  // shared with the sender thread
+  pthread_mutex_t mutex;
+  std::vector<Subscriber *> subs;
+  std::vector<Subscriber> gone;     // for the report
+  std::vector<ForwardBatch *> pool;
+  bool quit;
+  pthread_t sender;
+};
+
+// "[<addr>:]<port>|unix:<path>[,<queue MB>[,<batch kB>]]", the port on
+// the loopback interface unless an address is given. NULL on failure.
+Forwarder *ForwardStart(const char *spec);
+// Writer thread: appends an event to the current batch, queued to the
+// subscribers once full
+void ForwardPut(Forwarder *fw, const DragonRecord *rec, const void *ev, size_t size);
+// Writer thread: queues the current batch if it is older than the flush time, or now
+void ForwardFlush(Forwarder *fw, unsigned long long now, bool force);
+void ForwardReport(FILE *fp, Forwarder *fw);
+void ForwardStop(Forwarder *fw);
+#endif
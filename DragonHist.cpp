@@ -0,0 +1,72 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+// DragonHist.cpp
+//
+// ****Function****
+//  Log-linear (HDR) histograms for the close inspection mode (-c).
+//  Every event of the run is recorded with a few nsec of overhead,
+//  the report gives count/mean/p50/p99/p99.9/max for each FEB.
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <string.h>
+
+#include "DragonHist.hh"
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// percentile (upper edge of the bucket, never above the recorded max)
+///////////////////////////////////////////////////////////////////////////////////////////
+static unsigned long long HistBucketTop(int idx)
+{
+  if(idx<(1<<HIST_SUBBITS)) return idx;
+  int shift=(idx>>HIST_SUBBITS)-1;
+  unsigned long long sub=(idx&((1<<HIST_SUBBITS)-1))+(1ULL<<HIST_SUBBITS);
+  return ((sub+1)<<shift)-1;
+}
+
+unsigned long long HistPercentile(const HdrHist *h, double percent)
+{
+  if(h->count==0) return 0;
+  unsigned long long target=(unsigned long long)(percent/100.0*h->count+0.5);
+  if(target<1) target=1;
+  unsigned long long cum=0;
+  for(int i=0;i<HIST_NBINS;i++)
+    {
+      cum+=h->bin[i];
+      if(cum>=target)
+	{
+	  unsigned long long top=HistBucketTop(i);
+	  return top<h->max ? top : h->max;
+	}
+    }
+  return h->max;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// close inspection
+///////////////////////////////////////////////////////////////////////////////////////////
+FebInspect *InspectNew(int nFeb)
+{
+  FebInspect *fi=new FebInspect[nFeb];
+  memset(fi,0,sizeof(FebInspect)*nFeb);
+  return fi;
+}
+
+void InspectReport(FILE *fp, const FebInspect *fi, int nFeb, const std::string *names)
+{
+  static const char *HistName[INSP_NHIST]={"InterArrival","ReadCall","ReadBytes","Arrival2Write"};
+  static const char *HistUnit[INSP_NHIST]={"nsec","nsec","bytes","nsec"};
+  fprintf(fp,"FEB IPaddress       Quantity      Unit  Count        Mean         p50          p99          p99.9        Max\n");
+  for(int i=0;i<nFeb;i++)
+    for(int k=0;k<INSP_NHIST;k++)
+      {
+	const HdrHist *h=&fi[i].h[k];
+	fprintf(fp,"%-3d %-15s %-13s %-5s %-12llu %-12.1f %-12llu %-12llu %-12llu %llu\n",
+		i,names[i].c_str(),HistName[k],HistUnit[k],
+		h->count,
+		h->count ? (double)h->sum/h->count : 0.0,
+		HistPercentile(h,50.0),
+		HistPercentile(h,99.0),
+		HistPercentile(h,99.9),
+		h->max);
+      }
+}
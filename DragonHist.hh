@@ -0,0 +1,89 @@
+#ifndef DRAGON_HIST_H
+#define DRAGON_HIST_H
+
+#include <stdio.h>
+#include <string>
+
+#include "DragonClock.hh"
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// HDR-style log-linear histogram
+//   values below 2^HIST_SUBBITS are counted exactly, above that every power
+//   of two is split in 2^HIST_SUBBITS buckets (relative error < 0.8%).
+//   Values are clamped at 2^HIST_MAXBITS (~18 minutes in nsec).
+///////////////////////////////////////////////////////////////////////////////////////////
+#define HIST_SUBBITS 7
+#define HIST_MAXBITS 40
+#define HIST_NBINS   ((HIST_MAXBITS-HIST_SUBBITS+1)<<HIST_SUBBITS)
+
+struct HdrHist
+{
+  unsigned long long count;
+  unsigned long long sum;
+  unsigned long long max;
+  unsigned long long bin[HIST_NBINS];
+};
+
+inline int HistIndex(unsigned long long v)
+{
+  if(v>>HIST_MAXBITS) v=(1ULL<<HIST_MAXBITS)-1;
+  if(v<(1ULL<<HIST_SUBBITS)) return (int)v;
+  int shift=63-__builtin_clzll(v)-HIST_SUBBITS;
+  return ((shift+1)<<HIST_SUBBITS)+(int)((v>>shift)-(1ULL<<HIST_SUBBITS));
+}
+
+inline void HistRecord(HdrHist *h, unsigned long long v)
+{
+  h->bin[HistIndex(v)]++;
+  h->count++;
+  h->sum+=v;
+  if(v>h->max) h->max=v;
+}
+
+unsigned long long HistPercentile(const HdrHist *h, double percent);
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Close inspection: per-FEB histograms filled from the read loop, but
+// for the arrival-to-write one of DragonDaqM, filled by its writer thread
+///////////////////////////////////////////////////////////////////////////////////////////
+enum
+  {
+    INSP_INTERARRIVAL=0, // nsec between two events of the same FEB
+    INSP_READCALL,       // nsec spent in one read() call
+    INSP_READBYTES,      // bytes returned by one read() call
+    INSP_ARRIVAL2WRITE,  // nsec from the event arrival to the end of its write
+    INSP_NHIST
+  };
+
+struct FebInspect
+{
+  HdrHist h[INSP_NHIST];
+  unsigned long long lastArrival;
+};
+
+inline unsigned long long InspectNow()
+{
+  return DragonClockNow();
+}
+
+// Called when select() reports the FEB readable, before the first read()
+inline void InspectArrival(FebInspect *fi, unsigned long long now)
+{
+  if(fi->lastArrival) HistRecord(&fi->h[INSP_INTERARRIVAL],now-fi->lastArrival);
+  fi->lastArrival=now;
+}
+
+inline void InspectRead(FebInspect *fi, unsigned long long start, int ret)
+{
+  HistRecord(&fi->h[INSP_READCALL],InspectNow()-start);
+  if(ret>0) HistRecord(&fi->h[INSP_READBYTES],ret);
+}
+
+inline void InspectDone(FebInspect *fi, unsigned long long arrival)
+{
+  HistRecord(&fi->h[INSP_ARRIVAL2WRITE],InspectNow()-arrival);
+}
+
+FebInspect *InspectNew(int nFeb);
+void InspectReport(FILE *fp, const FebInspect *fi, int nFeb, const std::string *names);
+#endif
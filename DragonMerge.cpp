@@ -0,0 +1,347 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+// DragonMerge.cpp
+//
+// ****Function****
+//  Merges the data files of several DragonDaqM processes, each reading a
+//  shard of the FEBs (-S), into one file ordered by event counter, by
+//  133 MHz clock, or by arrival time:
+//    - the files of a FEB, or of a unified (-U) shard, are one stream,
+//      its rolled over files (_0000, _0001, ...) read one after the other,
+//    - the streams are in order, but for a unified file whose FEBs are
+//      written in the order they arrived: each stream goes through a
+//      window of -w events (1024 by default) which puts them back in order,
+//    - a heap with the next event of each stream gives the next event of
+//      the output (a k-way merge); equal keys come out by FEB index, so
+//      the events of one trigger follow each other,
+//    - the files are mmap()ed and read once from start to end, what has
+//      been merged is handed back to the kernel every few MB, so the
+//      memory used does not grow with the size of the run.
+//  The output has the framing of a unified file: a sync record, then
+//  each event after a DragonRecord with its FEB index in Connection.conf,
+//  and a <file>.crc sidecar (-K, DragonCrc.cpp). DragonReanalyze and
+//  DragonConvert read it as any -U file.
+//  A stream whose key goes back further than its window (a FEB restarted,
+//  or FEBs of a unified file too far apart) is counted out of order; its
+//  events are still written, where the window let them out.
+//  The arrival times of shards recorded on different hosts come from
+//  different clocks, only the event counter and the 133 MHz clock (with
+//  the FEBs on a common clock) order them.
+//
+// ****Usage****
+//   make DragonMerge
+//   ./DragonMerge [-k event|clock|arrival] [-r 30] [-w 1024] [-K 1M] -o calRD30_merged.dat calRD30_FEB*.dat
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <map>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "DragonEvent.hh"
+#include "DragonRecord.hh"
+#include "DragonClock.hh"
+#include "DragonCrc.hh"
+
+#define MERGE_RELEASE (16ULL<<20)   // bytes merged before they are given back
+
+enum MergeKey {KEY_EVENT, KEY_CLOCK, KEY_ARRIVAL};
+
+// An event waiting in the window of its stream, or in the merge heap
+struct HeapEntry
+{
+  unsigned long long key;
+  int feb;
+  int s;                        // stream, or order in the stream for the window
+  const unsigned char *ev;
+  unsigned long long arrival;
+  bool operator<(const HeapEntry &o) const // std::priority_queue keeps the largest on top
+  {
+    if(key!=o.key) return key>o.key;
+    if(feb!=o.feb) return feb>o.feb;
+    return s>o.s;
+  }
+};
+
+// The files of one FEB, or of one unified shard, in the order they were written.
+// They stay mapped until the end of the stream, the window may point into them.
+struct Stream
+{
+  std::string stem;
+  std::vector<EventFile> file;
+  size_t f;                     // current file
+  unsigned long long k;         // next event of the current file
+  size_t released;              // bytes of the current file given back
+  unsigned long long read;      // key of the last event read into the window
+  std::priority_queue<HeapEntry> window;
+  int order;
+  // next event
+  HeapEntry next;
+  unsigned long long last;      // key of the previous next event
+  unsigned long long events;
+  unsigned long long outOfOrder;
+};
+
+// File name without the rollover number and ".dat"
+static std::string MergeStem(const std::string &name)
+{
+  std::string s=name;
+  if(s.size()>4 && s.compare(s.size()-4,4,".dat")==0) s.erase(s.size()-4);
+  size_t u=s.rfind('_');
+  if(u!=std::string::npos && s.size()-u==5 && strspn(s.c_str()+u+1,"0123456789")==4) s.erase(u);
+  return s;
+}
+
+static inline unsigned long long MergeKeyOf(const unsigned char *ev, const DragonRecord &rec,
+					    unsigned long long prev, MergeKey by)
+{
+  switch(by)
+    {
+    case KEY_CLOCK:
+      return ((unsigned long long)EventBe32(ev+EV_OFF_CLOCK133)<<32)|EventBe32(ev+EV_OFF_CLOCK133+4);
+    case KEY_ARRIVAL:
+      return rec.arrival;
+    default:
+      {
+	// 32 bit counter: carry over a wrap so that the key keeps growing
+	unsigned long long key=(prev&~0xffffffffULL)|EventBe32(ev+EV_OFF_EVCOUNT);
+	if(key+0x80000000ULL<prev) key+=1ULL<<32;
+	return key;
+      }
+    }
+}
+
+// Reads the next event of the files into the window, false at their end
+static bool StreamRead(Stream &st, MergeKey by)
+{
+  for(;;)
+    {
+      if(st.f>=st.file.size()) return false;
+      if(st.k<st.file[st.f].nEvents) break;
+      st.f++;
+      st.k=0;
+      st.released=0;
+    }
+  EventFile &f=st.file[st.f];
+  DragonRecord rec;
+  HeapEntry e;
+  e.ev=EventFileAt(&f,st.k,&rec);
+  e.key=MergeKeyOf(e.ev,rec,st.read,by);
+  e.feb=rec.feb;
+  e.s=st.order++;
+  e.arrival=rec.arrival;
+  st.read=e.key;
+  st.window.push(e);
+  st.k++;
+  // the pages behind are read again from the file should the window need them
+  size_t done=f.first+st.k*f.stride;
+  if(done-st.released>=MERGE_RELEASE)
+    {
+      size_t page=sysconf(_SC_PAGESIZE);
+      size_t end=done&~(page-1);
+      madvise((void *)(f.map+st.released),end-st.released,MADV_DONTNEED);
+      st.released=end;
+    }
+  return true;
+}
+
+// Moves the stream to its next event, false at its end
+static bool StreamNext(Stream &st, MergeKey by, size_t window)
+{
+  while(st.window.size()<window && StreamRead(st,by)) {}
+  if(st.window.empty())
+    {
+      for(size_t i=0;i<st.file.size();i++) EventFileClose(&st.file[i]);
+      return false;
+    }
+  st.next=st.window.top();
+  st.window.pop();
+  if(st.events && st.next.key<st.last) st.outOfOrder++;
+  st.last=st.next.key;
+  st.events++;
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  MergeKey by=KEY_EVENT;
+  int rddepth=-1;
+  const char *output=NULL;
+  unsigned int crcBlock=CRC_BLOCK_DEFAULT;
+  size_t window=1024;
+  int opt;
+  while((opt=getopt(argc,argv,"hk:r:w:o:K:"))!=-1)
+    {
+      switch(opt)
+	{
+	case 'k':
+	  if(strcmp(optarg,"event")==0) by=KEY_EVENT;
+	  else if(strcmp(optarg,"clock")==0) by=KEY_CLOCK;
+	  else if(strcmp(optarg,"arrival")==0) by=KEY_ARRIVAL;
+	  else
+	    {
+	      printf("Bad key %s, expected event, clock or arrival\n",optarg);
+	      exit(1);
+	    }
+	  break;
+	case 'r': rddepth=atoi(optarg); break;
+	case 'w': window= atoi(optarg)>0 ? atoi(optarg) : 1; break;
+	case 'o': output=optarg; break;
+	case 'K':
+	  if(CrcParse(optarg,&crcBlock)!=0) exit(1);
+	  break;
+	default:
+	  printf("Usage: %s [-k event|clock|arrival] [-r readdepth] [-w events] [-K bytes] -o <out.dat> <DragonDaqM .dat files>\n",argv[0]);
+	  printf("  -k : order of the output, event counter (default), 133 MHz clock, or arrival time (-T files)\n");
+	  printf("  -r : read depth, default from the RD<n> in the first file name\n");
+	  printf("  -w : events of each stream put back in order, default 1024\n");
+	  printf("  -K : block size of the CRC32C in <out.dat>.crc, default 1M, 0 for none\n");
+	  printf("  -o : merged file, framed as a unified (-U) file\n");
+	  printf("The files of every shard may be given at once, in any order. Dragon v5 only.\n");
+	  exit(opt=='h' ? 0 : 1);
+	}
+    }
+  if(optind>=argc || output==NULL)
+    {
+      printf("%s -h for usage\n",argv[0]);
+      exit(1);
+    }
+  if(rddepth<=0) rddepth=EventFileRddepth(argv[optind]);
+  if(rddepth<=0)
+    {
+      printf("Can't guess the read depth from %s, use -r\n",argv[optind]);
+      exit(1);
+    }
+  int evsize=EV_HEADER_SIZE+2*8*2*rddepth;
+  DragonClockInit();
+
+  // the files of a stem are its rollover sequence, in the order of their numbers
+  std::vector<std::string> names(argv+optind,argv+argc);
+  std::sort(names.begin(),names.end());
+  std::map<std::string,int> byStem;
+  std::vector<Stream> stream;
+  bool haveSync=false;
+  unsigned long long realtimeOffset=0;
+  unsigned long long inBytes=0,inEvents=0;
+  for(size_t n=0;n<names.size();n++)
+    {
+      if(names[n]==output) continue;
+      EventFile f;
+      if(EventFileOpen(&f,names[n].c_str(),evsize)!=0) exit(1);
+      if(!f.records && f.feb<0)
+	{
+	  printf("%s: no _FEB<i> in the name and no records, can't tell its FEB\n",names[n].c_str());
+	  exit(1);
+	}
+      if(by==KEY_ARRIVAL && !f.records)
+	{
+	  printf("%s has no arrival times (recorded without -T), use -k event or clock\n",names[n].c_str());
+	  exit(1);
+	}
+      if(f.records && f.first>sizeof(DragonRecord) && !haveSync)
+	{
+	  memcpy(&realtimeOffset,f.map+sizeof(DragonRecord),sizeof(realtimeOffset));
+	  haveSync=true;
+	}
+      madvise((void *)f.map,f.size,MADV_SEQUENTIAL);
+      std::string stem=MergeStem(names[n]);
+      std::map<std::string,int>::iterator it=byStem.find(stem);
+      if(it==byStem.end())
+	{
+	  Stream st;
+	  st.stem=stem;
+	  st.f=0;
+	  st.k=0;
+	  st.released=0;
+	  st.read=0;
+	  st.order=0;
+	  st.last=0;
+	  st.events=0;
+	  st.outOfOrder=0;
+	  it=byStem.insert(std::make_pair(stem,(int)stream.size())).first;
+	  stream.push_back(st);
+	}
+      stream[it->second].file.push_back(f);
+      inBytes+=f.size;
+      inEvents+=f.nEvents;
+    }
+  printf("%llu events in %lu streams, RD%d, merged by %s\n",inEvents,(unsigned long)stream.size(),rddepth,
+	 by==KEY_EVENT ? "event counter" : by==KEY_CLOCK ? "133 MHz clock" : "arrival time");
+
+  FILE *fp=fopen(output,"wb");
+  if(fp==NULL)
+    {
+      perror(output);
+      exit(1);
+    }
+  std::vector<char> obuf(4<<20);
+  setvbuf(fp,&obuf[0],_IOFBF,obuf.size());
+  CrcWriter *crc=NULL;
+  if(crcBlock && (crc=CrcOpen(output,crcBlock))==NULL) exit(1);
+  DragonSync sync;
+  RecordFillSync(&sync,0,0,realtimeOffset);
+  fwrite(&sync,sizeof(sync),1,fp);
+  if(crc) CrcUpdate(crc,&sync,sizeof(sync));
+
+  unsigned long long t0=DragonClockNow();
+  std::priority_queue<HeapEntry> heap;
+  for(size_t s=0;s<stream.size();s++)
+    if(StreamNext(stream[s],by,window))
+      {
+	HeapEntry e=stream[s].next;
+	e.s=s;
+	heap.push(e);
+      }
+  unsigned long long outEvents=0;
+  while(!heap.empty())
+    {
+      HeapEntry e=heap.top();
+      heap.pop();
+      DragonRecord rec;
+      RecordFill(&rec,e.feb,evsize,e.arrival);
+      fwrite(&rec,sizeof(rec),1,fp);
+      fwrite(e.ev,evsize,1,fp);
+      if(crc)
+	{
+	  CrcUpdate(crc,&rec,sizeof(rec));
+	  CrcUpdate(crc,e.ev,evsize);
+	}
+      outEvents++;
+      Stream &st=stream[e.s];
+      if(StreamNext(st,by,window))
+	{
+	  HeapEntry n=st.next;
+	  n.s=e.s;
+	  heap.push(n);
+	}
+    }
+  int ret=0;
+  if(fflush(fp)!=0)
+    {
+      perror(output);
+      ret=1;
+    }
+  fclose(fp);
+  if(CrcClose(crc,true)!=0)
+    {
+      perror((std::string(output)+CRC_SUFFIX).c_str());
+      ret=1;
+    }
+  double sec=(DragonClockNow()-t0)*1e-9;
+
+  printf("***** Streams *****\n");
+  printf("Stream Files Events OutOfOrder\n");
+  for(size_t s=0;s<stream.size();s++)
+    printf("%s %lu %llu %llu\n",stream[s].stem.c_str(),(unsigned long)stream[s].file.size(),
+	   stream[s].events,stream[s].outOfOrder);
+  printf("%llu events written to %s, %.1f MB read in %.2f s (%.0f MB/s)\n",outEvents,output,
+	 inBytes/1e6,sec,sec>0 ? inBytes/1e6/sec : 0.0);
+  return ret;
+}
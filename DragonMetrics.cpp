@@ -0,0 +1,651 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+// DragonMetrics.cpp
+//
+// ****Function****
+//  Lightweight metrics exporter for the Dragon DAQ programs.
+//    (1)Every reading thread owns a MetricsShard of per-FEB counters.
+//       The read loop only does relaxed load+store on its own cache lines.
+//    (2)An exporter thread samples the sum of all shards every 100 msec
+//       and keeps 60 sec of history, so readfreq/readrate are available
+//       over sliding windows (1s,10s,60s) while the run is going on.
+//    (3)The exporter serves the metrics on a local TCP port or Unix socket,
+//       as Prometheus text (default) or JSON (request containing "json").
+//         curl http://127.0.0.1:<port>/metrics
+//         curl http://127.0.0.1:<port>/metrics.json
+//         echo json | socat - UNIX-CONNECT:<path>
+//    (4)A second thread appends the counters to a file every interval
+//       (-M <file>[,<sec>]), so that rate drops, stalls and bursts in the
+//       middle of a long run can be plotted afterwards. A .csv file gets
+//       one line per FEB and interval with the counter increments and the
+//       read rates, any other name the compact binary layout of
+//       DragonMetrics.hh with the counter totals.
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <string>
+#include <vector>
+
+#include "DragonMetrics.hh"
+
+static const char *CounterName[M_NCOUNTERS] =
+  {
+    "dragon_feb_events_total",
+    "dragon_feb_read_bytes_total",
+    "dragon_feb_written_events_total",
+    "dragon_feb_written_bytes_total",
+    "dragon_feb_corrupted_events_total",
+    "dragon_feb_overload_dropped_events_total",
+    "dragon_feb_overload_degraded_events_total",
+    "dragon_feb_misframed_events_total",
+    "dragon_feb_lost_events_total",
+    "dragon_feb_duplicate_events_total",
+    "dragon_feb_triggers_total",
+    "dragon_feb_header_flagged_events_total",
+    "dragon_feb_decoded_events_total",
+  };
+
+struct MetricsGauge
+{
+  std::string name;
+  std::string help;
+  double (*probe)(int feb, void *arg);
+  void *arg;
+};
+
+// History of the summed counters, one entry per 100 msec
+#define METRICS_TICK_NSEC 100000000ULL
+#define METRICS_NHIST     601
+struct MetricsSample
+{
+  unsigned long long ns;
+  std::vector<unsigned long long> v; // [feb*M_NCOUNTERS+counter]
+};
+
+static int nMetricsFeb=0;
+static std::atomic<int> MetricsEvsize(0);
+static std::vector<std::string> MetricsNames;
+static MetricsShard *MetricsShards=0;
+static std::vector<MetricsGauge> MetricsGauges;
+static pthread_mutex_t MetricsMutex=PTHREAD_MUTEX_INITIALIZER;
+
+static MetricsSample MetricsHist[METRICS_NHIST];
+static int nMetricsHist=0;
+static int MetricsHistHead=0;
+
+static int MetricsListenFd=-1;
+static std::string MetricsUnixPath;
+static pthread_t MetricsThread;
+static bool MetricsThreadRunning=false;
+static std::atomic<bool> MetricsQuit(false);
+
+// JSON keys drop the common "dragon_feb_" prefix
+static const char *MetricsJsonKey(const char *name)
+{
+  return strncmp(name,"dragon_feb_",11)==0 ? name+11 : name;
+}
+
+static unsigned long long MetricsNow()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (unsigned long long)ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// counters aggregation
+///////////////////////////////////////////////////////////////////////////////////////////
+static void MetricsSum(std::vector<unsigned long long> &v)
+{
+  v.assign(nMetricsFeb*M_NCOUNTERS,0);
+  pthread_mutex_lock(&MetricsMutex);
+  for(MetricsShard *ms=MetricsShards;ms;ms=ms->next)
+    for(int i=0;i<ms->nFeb;i++)
+      for(int c=0;c<M_NCOUNTERS;c++)
+	v[i*M_NCOUNTERS+c]+=ms->feb[i].c[c].load(std::memory_order_relaxed);
+  pthread_mutex_unlock(&MetricsMutex);
+}
+
+unsigned long long MetricsTotal(int feb, int counter)
+{
+  unsigned long long sum=0;
+  pthread_mutex_lock(&MetricsMutex);
+  for(MetricsShard *ms=MetricsShards;ms;ms=ms->next)
+    if(feb<ms->nFeb) sum+=ms->feb[feb].c[counter].load(std::memory_order_relaxed);
+  pthread_mutex_unlock(&MetricsMutex);
+  return sum;
+}
+
+static void MetricsTakeSample()
+{
+  MetricsHistHead=(MetricsHistHead+1)%METRICS_NHIST;
+  MetricsHist[MetricsHistHead].ns=MetricsNow();
+  MetricsSum(MetricsHist[MetricsHistHead].v);
+  if(nMetricsHist<METRICS_NHIST) nMetricsHist++;
+}
+
+// Oldest sample which is not older than the window (or the oldest we have)
+static const MetricsSample *MetricsWindowStart(unsigned long long now, unsigned long long window)
+{
+  const MetricsSample *best=0;
+  for(int k=0;k<nMetricsHist;k++)
+    {
+      const MetricsSample *s=&MetricsHist[(MetricsHistHead-k+METRICS_NHIST)%METRICS_NHIST];
+      if(now-s->ns>window && best) break;
+      best=s;
+    }
+  return best;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// rendering
+///////////////////////////////////////////////////////////////////////////////////////////
+static const int MetricsWindowSec[3]={1,10,60};
+
+struct MetricsRates
+{
+  double readfreq[3];  // Hz
+  double readrate[3];  // Mbps
+  double writerate[3]; // Mbps
+};
+
+static void MetricsComputeRates(const std::vector<unsigned long long> &cur, unsigned long long now,
+				std::vector<MetricsRates> &r)
+{
+  r.assign(nMetricsFeb,MetricsRates());
+  for(int w=0;w<3;w++)
+    {
+      const MetricsSample *s=MetricsWindowStart(now,MetricsWindowSec[w]*1000000000ULL);
+      double dt= s ? (now-s->ns)*1e-9 : 0;
+      for(int i=0;i<nMetricsFeb;i++)
+	{
+	  if(dt<=0)
+	    {
+	      r[i].readfreq[w]=r[i].readrate[w]=r[i].writerate[w]=0;
+	      continue;
+	    }
+	  const unsigned long long *o=&s->v[i*M_NCOUNTERS];
+	  const unsigned long long *c=&cur[i*M_NCOUNTERS];
+	  r[i].readfreq[w] =(double)(c[M_EVENTS]-o[M_EVENTS])/dt;
+	  r[i].readrate[w] =(double)(c[M_BYTES_READ]-o[M_BYTES_READ])*8.0/dt/1000./1000.;
+	  r[i].writerate[w]=(double)(c[M_BYTES_WRITTEN]-o[M_BYTES_WRITTEN])*8.0/dt/1000./1000.;
+	}
+    }
+}
+
+static void MetricsRender(std::string &out, bool json)
+{
+  std::vector<unsigned long long> cur;
+  MetricsSum(cur);
+  unsigned long long now=MetricsNow();
+  std::vector<MetricsRates> r;
+  MetricsComputeRates(cur,now,r);
+
+  char line[512];
+  out.clear();
+  pthread_mutex_lock(&MetricsMutex);
+  if(json)
+    {
+      snprintf(line,sizeof(line),"{\"evsize\":%d,\"febs\":[",MetricsEvsize.load());
+      out+=line;
+      for(int i=0;i<nMetricsFeb;i++)
+	{
+	  snprintf(line,sizeof(line),"%s{\"feb\":%d,\"addr\":\"%s\"",
+		   i?",":"",i,MetricsNames[i].c_str());
+	  out+=line;
+	  for(int c=0;c<M_NCOUNTERS;c++)
+	    {
+	      snprintf(line,sizeof(line),",\"%s\":%llu",MetricsJsonKey(CounterName[c]),cur[i*M_NCOUNTERS+c]);
+	      out+=line;
+	    }
+	  for(int w=0;w<3;w++)
+	    {
+	      snprintf(line,sizeof(line),
+		       ",\"readfreq_%ds\":%.3f,\"readrate_%ds\":%.3f,\"writerate_%ds\":%.3f",
+		       MetricsWindowSec[w],r[i].readfreq[w],
+		       MetricsWindowSec[w],r[i].readrate[w],
+		       MetricsWindowSec[w],r[i].writerate[w]);
+	      out+=line;
+	    }
+	  for(size_t g=0;g<MetricsGauges.size();g++)
+	    {
+	      snprintf(line,sizeof(line),",\"%s\":%g",MetricsJsonKey(MetricsGauges[g].name.c_str()),
+		       MetricsGauges[g].probe(i,MetricsGauges[g].arg));
+	      out+=line;
+	    }
+	  out+="}";
+	}
+      out+="]}\n";
+    }
+  else
+    {
+      for(int c=0;c<M_NCOUNTERS;c++)
+	{
+	  snprintf(line,sizeof(line),"# TYPE %s counter\n",CounterName[c]);
+	  out+=line;
+	  for(int i=0;i<nMetricsFeb;i++)
+	    {
+	      snprintf(line,sizeof(line),"%s{feb=\"%d\",addr=\"%s\"} %llu\n",
+		       CounterName[c],i,MetricsNames[i].c_str(),cur[i*M_NCOUNTERS+c]);
+	      out+=line;
+	    }
+	}
+      const char *RateName[3]={"dragon_feb_readfreq_hz","dragon_feb_readrate_mbps","dragon_feb_writerate_mbps"};
+      for(int k=0;k<3;k++)
+	{
+	  snprintf(line,sizeof(line),"# TYPE %s gauge\n",RateName[k]);
+	  out+=line;
+	  for(int i=0;i<nMetricsFeb;i++)
+	    for(int w=0;w<3;w++)
+	      {
+		double v= k==0 ? r[i].readfreq[w] : k==1 ? r[i].readrate[w] : r[i].writerate[w];
+		snprintf(line,sizeof(line),"%s{feb=\"%d\",addr=\"%s\",window=\"%ds\"} %.3f\n",
+			 RateName[k],i,MetricsNames[i].c_str(),MetricsWindowSec[w],v);
+		out+=line;
+	      }
+	}
+      for(size_t g=0;g<MetricsGauges.size();g++)
+	{
+	  snprintf(line,sizeof(line),"# HELP %s %s\n# TYPE %s gauge\n",
+		   MetricsGauges[g].name.c_str(),MetricsGauges[g].help.c_str(),
+		   MetricsGauges[g].name.c_str());
+	  out+=line;
+	  for(int i=0;i<nMetricsFeb;i++)
+	    {
+	      snprintf(line,sizeof(line),"%s{feb=\"%d\",addr=\"%s\"} %g\n",
+		       MetricsGauges[g].name.c_str(),i,MetricsNames[i].c_str(),
+		       MetricsGauges[g].probe(i,MetricsGauges[g].arg));
+	      out+=line;
+	    }
+	}
+    }
+  pthread_mutex_unlock(&MetricsMutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// exporter thread
+///////////////////////////////////////////////////////////////////////////////////////////
+static void MetricsServe(int fd)
+{
+  // Read the request (HTTP or a bare word), but never wait long for it
+  char req[1024];
+  int n=0;
+  struct pollfd pfd={fd,POLLIN,0};
+  while(n<(int)sizeof(req)-1 && poll(&pfd,1,200)>0)
+    {
+      int ret=read(fd,req+n,sizeof(req)-1-n);
+      if(ret<=0) break;
+      n+=ret;
+      req[n]=0;
+      if(strstr(req,"\r\n\r\n") || (strchr(req,'\n') && strncmp(req,"GET",3)!=0)) break;
+    }
+  req[n]=0;
+  char *eol=strchr(req,'\n');
+  if(eol) *eol=0;
+  bool json= strstr(req,"json")!=NULL;
+
+  std::string body;
+  MetricsRender(body,json);
+  char head[256];
+  int hlen=0;
+  if(strncmp(req,"GET",3)==0)
+    hlen=snprintf(head,sizeof(head),
+		  "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %lu\r\n\r\n",
+		  json?"application/json":"text/plain; version=0.0.4",(unsigned long)body.size());
+  if(hlen>0 && write(fd,head,hlen)<0) return;
+  size_t off=0;
+  while(off<body.size())
+    {
+      ssize_t ret=write(fd,body.data()+off,body.size()-off);
+      if(ret<=0) break;
+      off+=ret;
+    }
+}
+
+static void *MetricsLoop(void *)
+{
+  unsigned long long next=MetricsNow();
+  while(!MetricsQuit.load())
+    {
+      unsigned long long now=MetricsNow();
+      if(now>=next)
+	{
+	  MetricsTakeSample();
+	  next+=METRICS_TICK_NSEC;
+	  if(next<now) next=now+METRICS_TICK_NSEC;
+	}
+      struct pollfd pfd={MetricsListenFd,POLLIN,0};
+      int wait=(int)((next-now)/1000000ULL)+1;
+      if(poll(&pfd,1,wait)>0 && (pfd.revents&POLLIN))
+	{
+	  int fd=accept(MetricsListenFd,NULL,NULL);
+	  if(fd>=0)
+	    {
+	      MetricsServe(fd);
+	      close(fd);
+	    }
+	}
+    }
+  return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// rate time series
+///////////////////////////////////////////////////////////////////////////////////////////
+static FILE *SeriesFp=NULL;
+static bool SeriesCsv=false;
+static unsigned long long SeriesIntervalNs=1000000000ULL;
+static unsigned long long SeriesStartNs=0;
+static unsigned long long SeriesLastNs=0;
+static std::vector<unsigned long long> SeriesLast;
+static pthread_t SeriesThread;
+static std::atomic<bool> SeriesQuit(false);
+
+static unsigned long long SeriesRealtime()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME,&ts);
+  return (unsigned long long)ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+// CSV columns drop the "_total" of the counters, they are increments
+static std::string SeriesColumn(const char *name)
+{
+  std::string col=MetricsJsonKey(name);
+  size_t k=col.rfind("_total");
+  if(k!=std::string::npos && k+6==col.size()) col.erase(k);
+  return col;
+}
+
+static void SeriesWrite()
+{
+  std::vector<unsigned long long> cur;
+  MetricsSum(cur);
+  unsigned long long now=MetricsNow();
+  SeriesRecord rec;
+  rec.realtime=SeriesRealtime();
+  rec.elapsed=now-SeriesStartNs;
+  if(SeriesCsv)
+    {
+      double dt=(now-SeriesLastNs)*1e-9;
+      for(int i=0;i<nMetricsFeb;i++)
+	{
+	  const unsigned long long *c=&cur[i*M_NCOUNTERS];
+	  const unsigned long long *o=&SeriesLast[i*M_NCOUNTERS];
+	  fprintf(SeriesFp,"%llu.%06llu,%.6f,%d,%s,%.6f",rec.realtime/1000000000ULL,rec.realtime%1000000000ULL/1000,
+		  rec.elapsed*1e-9,i,MetricsNames[i].c_str(),dt);
+	  for(int k=0;k<M_NCOUNTERS;k++) fprintf(SeriesFp,",%llu",c[k]-o[k]);
+	  fprintf(SeriesFp,",%.3f,%.3f\n",dt>0 ? (c[M_EVENTS]-o[M_EVENTS])/dt : 0,
+		  dt>0 ? (c[M_BYTES_READ]-o[M_BYTES_READ])*8.0/dt/1000./1000. : 0);
+	}
+    }
+  else
+    {
+      fwrite(&rec,sizeof(rec),1,SeriesFp);
+      fwrite(&cur[0],sizeof(unsigned long long),cur.size(),SeriesFp);
+    }
+  // a line per interval survives a crash of the DAQ
+  fflush(SeriesFp);
+  SeriesLast.swap(cur);
+  SeriesLastNs=now;
+}
+
+static void *SeriesLoop(void *)
+{
+  unsigned long long next=SeriesStartNs+SeriesIntervalNs;
+  while(!SeriesQuit.load())
+    {
+      unsigned long long now=MetricsNow();
+      if(now>=next)
+	{
+	  SeriesWrite();
+	  next+=SeriesIntervalNs;
+	  if(next<now) next=now+SeriesIntervalNs;
+	  continue;
+	}
+      // wake up at least every 100 msec to see MetricsStop()
+      unsigned long long ns=next-now<METRICS_TICK_NSEC ? next-now : METRICS_TICK_NSEC;
+      struct timespec ts={(time_t)(ns/1000000000ULL),(long)(ns%1000000000ULL)};
+      nanosleep(&ts,NULL);
+    }
+  // the last, partial, interval
+  SeriesWrite();
+  return NULL;
+}
+
+// An existing binary series is only appended to when it has the same FEBs
+static int SeriesCheck(FILE *fp, const char *file, const SeriesHeader &hdr)
+{
+  SeriesHeader old;
+  std::vector<char> names(SERIES_NAME*nMetricsFeb),oldNames(SERIES_NAME*nMetricsFeb);
+  for(int i=0;i<nMetricsFeb;i++)
+    strncpy(&names[i*SERIES_NAME],MetricsNames[i].c_str(),SERIES_NAME-1);
+  rewind(fp);
+  if(fread(&old,sizeof(old),1,fp)!=1 || memcmp(&old,&hdr,sizeof(hdr))!=0 ||
+     fread(&oldNames[0],SERIES_NAME,nMetricsFeb,fp)!=(size_t)nMetricsFeb || oldNames!=names)
+    {
+      printf("%s holds a rate series of other FEBs or settings, not appending to it\n",file);
+      return -1;
+    }
+  return 0;
+}
+
+int MetricsSeriesStart(const char *spec)
+{
+  if(spec==NULL || spec[0]==0) return 0;
+  std::string file(spec);
+  size_t comma=file.rfind(',');
+  if(comma!=std::string::npos)
+    {
+      double sec=atof(file.c_str()+comma+1);
+      if(sec<=0)
+	{
+	  printf("Bad rate series interval in %s\n",spec);
+	  return -1;
+	}
+      SeriesIntervalNs=(unsigned long long)(sec*1e9);
+      file.erase(comma);
+    }
+  SeriesCsv= file.size()>4 && file.compare(file.size()-4,4,".csv")==0;
+  SeriesFp=fopen(file.c_str(),SeriesCsv ? "a" : "a+b");
+  if(SeriesFp==NULL)
+    {
+      printf("MetricsSeriesStart() can't open %s : %s\n",file.c_str(),strerror(errno));
+      return -1;
+    }
+  fseek(SeriesFp,0,SEEK_END);
+  bool empty= ftell(SeriesFp)==0;
+  if(SeriesCsv && empty)
+    {
+      fprintf(SeriesFp,"realtime,elapsed,feb,addr,interval");
+      for(int k=0;k<M_NCOUNTERS;k++) fprintf(SeriesFp,",%s",SeriesColumn(CounterName[k]).c_str());
+      fprintf(SeriesFp,",readfreq_hz,readrate_mbps\n");
+    }
+  else if(!SeriesCsv)
+    {
+      SeriesHeader hdr;
+      memset(&hdr,0,sizeof(hdr));
+      memcpy(hdr.magic,SERIES_MAGIC,sizeof(hdr.magic));
+      hdr.version=SERIES_VERSION;
+      hdr.nFeb=nMetricsFeb;
+      hdr.nCounters=M_NCOUNTERS;
+      hdr.evsize=MetricsEvsize.load();
+      hdr.intervalNs=SeriesIntervalNs;
+      if(empty)
+	{
+	  fwrite(&hdr,sizeof(hdr),1,SeriesFp);
+	  for(int i=0;i<nMetricsFeb;i++)
+	    {
+	      char name[SERIES_NAME];
+	      memset(name,0,sizeof(name));
+	      strncpy(name,MetricsNames[i].c_str(),SERIES_NAME-1);
+	      fwrite(name,sizeof(name),1,SeriesFp);
+	    }
+	}
+      else if(SeriesCheck(SeriesFp,file.c_str(),hdr)!=0)
+	{
+	  fclose(SeriesFp);
+	  SeriesFp=NULL;
+	  return -1;
+	}
+    }
+  fflush(SeriesFp);
+  MetricsSum(SeriesLast);
+  SeriesStartNs=SeriesLastNs=MetricsNow();
+  SeriesQuit=false;
+  if(pthread_create(&SeriesThread,NULL,SeriesLoop,NULL)!=0)
+    {
+      printf("MetricsSeriesStart() can't create reporter thread\n");
+      fclose(SeriesFp);
+      SeriesFp=NULL;
+      return -1;
+    }
+  printf("Rates are appended to %s every %g sec\n",file.c_str(),SeriesIntervalNs*1e-9);
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// setup
+///////////////////////////////////////////////////////////////////////////////////////////
+int MetricsStart(const char *spec, int nFeb, const std::string *names, int evsize)
+{
+  nMetricsFeb=nFeb;
+  MetricsEvsize=evsize;
+  MetricsNames.assign(names,names+nFeb);
+  if(spec==NULL || spec[0]==0) return 0;
+
+  if(strncmp(spec,"unix:",5)==0)
+    {
+      struct sockaddr_un addr;
+      memset(&addr,0,sizeof(addr));
+      addr.sun_family=AF_UNIX;
+      MetricsUnixPath=spec+5;
+      if(MetricsUnixPath.size()>=sizeof(addr.sun_path))
+	{
+	  printf("MetricsStart() socket path too long : %s\n",spec+5);
+	  return -1;
+	}
+      strcpy(addr.sun_path,MetricsUnixPath.c_str());
+      unlink(addr.sun_path);
+      MetricsListenFd=socket(AF_UNIX,SOCK_STREAM,0);
+      if(MetricsListenFd<0 || bind(MetricsListenFd,(struct sockaddr *)&addr,sizeof(addr))!=0)
+	{
+	  perror("MetricsStart()::bind");
+	  return -1;
+	}
+    }
+  else
+    {
+      struct sockaddr_in addr;
+      memset(&addr,0,sizeof(addr));
+      addr.sin_family=AF_INET;
+      addr.sin_port=htons(atoi(spec));
+      addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+      MetricsListenFd=socket(AF_INET,SOCK_STREAM,0);
+      int one=1;
+      setsockopt(MetricsListenFd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+      if(MetricsListenFd<0 || bind(MetricsListenFd,(struct sockaddr *)&addr,sizeof(addr))!=0)
+	{
+	  perror("MetricsStart()::bind");
+	  return -1;
+	}
+    }
+  if(listen(MetricsListenFd,8)!=0)
+    {
+      perror("MetricsStart()::listen");
+      return -1;
+    }
+  MetricsQuit=false;
+  if(pthread_create(&MetricsThread,NULL,MetricsLoop,NULL)!=0)
+    {
+      printf("MetricsStart() can't create exporter thread\n");
+      return -1;
+    }
+  MetricsThreadRunning=true;
+  printf("Metrics are served on %s\n",spec);
+  return 0;
+}
+
+// A reconfigured run may change the read depth
+void MetricsSetEvsize(int evsize)
+{
+  MetricsEvsize.store(evsize);
+}
+
+MetricsShard *MetricsNewShard()
+{
+  MetricsShard *ms=new MetricsShard;
+  ms->nFeb=nMetricsFeb;
+  ms->feb=new MetricsFeb[nMetricsFeb];
+  for(int i=0;i<nMetricsFeb;i++)
+    for(int c=0;c<M_NCOUNTERS;c++) ms->feb[i].c[c]=0;
+  pthread_mutex_lock(&MetricsMutex);
+  ms->next=MetricsShards;
+  MetricsShards=ms;
+  pthread_mutex_unlock(&MetricsMutex);
+  return ms;
+}
+
+void MetricsAddGauge(const char *name, const char *help,
+		     double (*probe)(int feb, void *arg), void *arg)
+{
+  MetricsGauge g;
+  g.name=name;
+  g.help=help;
+  g.probe=probe;
+  g.arg=arg;
+  pthread_mutex_lock(&MetricsMutex);
+  MetricsGauges.push_back(g);
+  pthread_mutex_unlock(&MetricsMutex);
+}
+
+void MetricsStop()
+{
+  if(SeriesFp)
+    {
+      SeriesQuit=true;
+      pthread_join(SeriesThread,NULL);
+      fclose(SeriesFp);
+      SeriesFp=NULL;
+    }
+  if(MetricsThreadRunning)
+    {
+      MetricsQuit=true;
+      pthread_join(MetricsThread,NULL);
+      MetricsThreadRunning=false;
+    }
+  if(MetricsListenFd>=0)
+    {
+      close(MetricsListenFd);
+      MetricsListenFd=-1;
+    }
+  if(!MetricsUnixPath.empty()) unlink(MetricsUnixPath.c_str());
+  // Gauges may point to sockets which are about to be closed
+  pthread_mutex_lock(&MetricsMutex);
+  MetricsGauges.clear();
+  pthread_mutex_unlock(&MetricsMutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// probes
+///////////////////////////////////////////////////////////////////////////////////////////
+// Bytes waiting in the kernel receive queue of the FEB socket
+double MetricsSocketBacklog(int feb, void *sock)
+{
+  int n=0;
+  int fd=((int *)sock)[feb];
+  if(fd<0 || ioctl(fd,FIONREAD,&n)!=0) return 0;
+  return n;
+}
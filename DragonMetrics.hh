@@ -0,0 +1,93 @@
+#ifndef DRAGON_METRICS_H
+#define DRAGON_METRICS_H
+
+#include <atomic>
+#include <string>
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Per-FEB counters exported by the metrics thread (see DragonMetrics.cpp)
+///////////////////////////////////////////////////////////////////////////////////////////
+enum MetricsCounter
+  {
+    M_EVENTS=0,        // events read from the socket
+    M_BYTES_READ,      // bytes read from the socket
+    M_EVENTS_WRITTEN,  // events written to the data file
+    M_BYTES_WRITTEN,   // bytes written to the data file
+    M_CORRUPTED,       // events flagged by the threshold scan or Analysis()
+    M_DROPPED,         // events not stored because of an overload (DragonOverload.cpp)
+    M_DEGRADED,        // events prescaled out or not analysed because of an overload
+    M_MISFRAMED,       // events found without their markers, stream resynchronised (DragonEvent.cpp)
+    M_LOST,            // EventCounter values never received
+    M_DUPLICATE,       // events whose EventCounter did not advance
+    M_TRIGGERS,        // TriggerCounter advance, triggers-events is the FEB dead time
+    M_FLAGGED,         // events failing a header check (DragonEvent.hh)
+    M_DECODED,         // events fully decoded by the online analysis, a sample of them with -S
+    M_NCOUNTERS
+  };
+
+// One block per FEB, padded to its own cache line.
+struct MetricsFeb
+{
+  std::atomic<unsigned long long> c[M_NCOUNTERS];
+} __attribute__((aligned(64)));
+
+// One shard per reading thread. Only the owning thread writes it,
+// the exporter sums all shards when it is scraped.
+struct MetricsShard
+{
+  int nFeb;
+  MetricsFeb *feb;
+  MetricsShard *next;
+};
+
+// Single writer: plain load+store, no locked instruction on the read loop.
+inline void MetricsAdd(MetricsShard *ms, int feb, int counter, unsigned long long v)
+{
+  std::atomic<unsigned long long> &c = ms->feb[feb].c[counter];
+  c.store(c.load(std::memory_order_relaxed)+v, std::memory_order_relaxed);
+}
+
+// spec : NULL (counters only), "<port>" (127.0.0.1:<port>) or "unix:<path>"
+int  MetricsStart(const char *spec, int nFeb, const std::string *names, int evsize);
+MetricsShard *MetricsNewShard();
+void MetricsSetEvsize(int evsize);
+void MetricsAddGauge(const char *name, const char *help,
+		     double (*probe)(int feb, void *arg), void *arg);
+unsigned long long MetricsTotal(int feb, int counter);
+// Stops the exporter and the rate time series
+void MetricsStop();
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Rate time series: the counters of all shards appended to a file every
+// interval by a thread of its own (see DragonMetrics.cpp).
+//   CSV (.csv): one line per FEB and interval, the counter increments and rates
+//   binary    : SeriesHeader, nFeb names of SERIES_NAME bytes, then per interval
+//               a SeriesRecord followed by the nFeb*nCounters counter totals
+//               (unsigned long long, [feb*nCounters+counter]), host byte order
+///////////////////////////////////////////////////////////////////////////////////////////
+#define SERIES_MAGIC   "DRGRATE1"
+#define SERIES_VERSION 1
+#define SERIES_NAME    64
+
+struct SeriesHeader
+{
+  char magic[8];
+  unsigned int version;
+  unsigned int nFeb;
+  unsigned int nCounters;        // M_NCOUNTERS, in MetricsCounter order
+  int evsize;
+  unsigned long long intervalNs;
+};
+
+struct SeriesRecord
+{
+  unsigned long long realtime;   // [nsec since the epoch]
+  unsigned long long elapsed;    // since the series was started [nsec]
+};
+
+// spec : <file>[,<sec>], every second by default. Appends to the file
+// when it already holds a series of the same FEBs.
+int  MetricsSeriesStart(const char *spec);
+
+double MetricsSocketBacklog(int feb, void *sock);
+#endif
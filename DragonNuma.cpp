@@ -0,0 +1,187 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+// DragonNuma.cpp
+//
+// ****Function****
+//  On dual-socket hosts the NIC hangs off one socket, and every packet the
+//  reader touches on the other one crosses the interconnect. The node of the
+//  NIC is found from the local address of a FEB connection:
+//    getsockname() -> getifaddrs() -> /sys/class/net/<if>/device/numa_node
+//  and threads are pinned to the cores listed in
+//    /sys/devices/system/node/node<N>/cpulist
+//  Buffers are pre-faulted by the thread which uses them (first touch), so
+//  that the kernel places their pages on its node.
+//  Only sysfs is used, no libnuma. Virtual interfaces (lo, bridges) have no
+//  numa_node and leave the placement to the scheduler.
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <ifaddrs.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "DragonNuma.hh"
+
+int NumaParse(const char *spec, int *nodes, int n)
+{
+  std::string s(spec);
+  size_t pos=0;
+  for(int k=0;k<n && pos<=s.size();k++)
+    {
+      size_t colon=s.find(':',pos);
+      std::string f=s.substr(pos,colon==std::string::npos ? std::string::npos : colon-pos);
+      if(f=="nic") nodes[k]=NUMA_NIC;
+      else if(f=="any") nodes[k]=NUMA_ANY;
+      else if(!f.empty())
+	{
+	  char *end;
+	  long v=strtol(f.c_str(),&end,10);
+	  if(*end!='\0' || v<0 || v>=NumaNodeCount())
+	    {
+	      printf("Bad NUMA node %s (node number, nic or any), %d node(s) on this host\n",
+		     f.c_str(),NumaNodeCount());
+	      return -1;
+	    }
+	  nodes[k]=(int)v;
+	}
+      if(colon==std::string::npos) break;
+      pos=colon+1;
+    }
+  return 0;
+}
+
+int NumaNodeCount()
+{
+  int n=0;
+  char path[96];
+  for(;;)
+    {
+      snprintf(path,sizeof(path),"/sys/devices/system/node/node%d",n);
+      if(access(path,F_OK)!=0) break;
+      n++;
+    }
+  return n>0 ? n : 1;
+}
+
+int NumaIfNode(const char *ifname)
+{
+  char path[128];
+  snprintf(path,sizeof(path),"/sys/class/net/%s/device/numa_node",ifname);
+  FILE *fp=fopen(path,"r");
+  if(fp==NULL) return -1;
+  int node=-1;
+  if(fscanf(fp,"%d",&node)!=1) node=-1;
+  fclose(fp);
+  return node;
+}
+
+int NumaSocketNode(int fd, std::string *ifname)
+{
+  struct sockaddr_in local;
+  socklen_t len=sizeof(local);
+  if(fd<0 || getsockname(fd,(struct sockaddr *)&local,&len)!=0 || local.sin_family!=AF_INET)
+    return -1;
+  struct ifaddrs *ifa;
+  if(getifaddrs(&ifa)!=0) return -1;
+  int node=-1;
+  for(struct ifaddrs *p=ifa;p;p=p->ifa_next)
+    {
+      if(p->ifa_addr==NULL || p->ifa_addr->sa_family!=AF_INET) continue;
+      if(((struct sockaddr_in *)p->ifa_addr)->sin_addr.s_addr!=local.sin_addr.s_addr) continue;
+      if(ifname) *ifname=p->ifa_name;
+      node=NumaIfNode(p->ifa_name);
+      break;
+    }
+  freeifaddrs(ifa);
+  return node;
+}
+
+int NumaFebNode(const int *socks, int first, int last, std::string *ifname)
+{
+  for(int i=first;i<last;i++)
+    if(socks[i]>=0) return NumaSocketNode(socks[i],ifname);
+  return -1;
+}
+
+// "0-3,8-11" into set
+static int NumaCpuList(int node, cpu_set_t *set)
+{
+  char path[96];
+  snprintf(path,sizeof(path),"/sys/devices/system/node/node%d/cpulist",node);
+  FILE *fp=fopen(path,"r");
+  if(fp==NULL) return -1;
+  char line[1024];
+  if(fgets(line,sizeof(line),fp)==NULL) line[0]='\0';
+  fclose(fp);
+  CPU_ZERO(set);
+  char *p=line;
+  while(*p>='0' && *p<='9')
+    {
+      int a=strtol(p,&p,10),b=a;
+      if(*p=='-') b=strtol(p+1,&p,10);
+      for(int c=a;c<=b && c<CPU_SETSIZE;c++) CPU_SET(c,set);
+      if(*p==',') p++;
+    }
+  return CPU_COUNT(set)>0 ? 0 : -1;
+}
+
+int NumaPinNode(int node)
+{
+  cpu_set_t set;
+  if(node<0 || NumaCpuList(node,&set)!=0) return -1;
+  if(sched_setaffinity(0,sizeof(set),&set)!=0)
+    {
+      perror("sched_setaffinity");
+      return -1;
+    }
+  return 0;
+}
+
+void NumaTouch(void *buf, size_t size)
+{
+  long page=sysconf(_SC_PAGESIZE);
+  volatile unsigned char *p=(volatile unsigned char *)buf;
+  for(size_t o=0;o<size;o+=page) p[o]=0;
+}
+
+void NumaStatRead(std::vector<NumaStat> &st)
+{
+  int n=NumaNodeCount();
+  st.assign(n,NumaStat());
+  for(int k=0;k<n;k++)
+    {
+      memset(&st[k],0,sizeof(NumaStat));
+      char path[96];
+      snprintf(path,sizeof(path),"/sys/devices/system/node/node%d/numastat",k);
+      FILE *fp=fopen(path,"r");
+      if(fp==NULL) continue;
+      char key[64];
+      unsigned long long v;
+      while(fscanf(fp,"%63s %llu",key,&v)==2)
+	{
+	  if(!strcmp(key,"numa_hit"))          st[k].hit=v;
+	  else if(!strcmp(key,"numa_miss"))    st[k].miss=v;
+	  else if(!strcmp(key,"numa_foreign")) st[k].foreign=v;
+	  else if(!strcmp(key,"local_node"))   st[k].local=v;
+	  else if(!strcmp(key,"other_node"))   st[k].other=v;
+	}
+      fclose(fp);
+    }
+}
+
+void NumaStatReport(FILE *fp, const std::vector<NumaStat> &before, const std::vector<NumaStat> &after)
+{
+  if(after.size()<2 || before.size()!=after.size()) return; // nothing to cross
+  fprintf(fp,"***** NUMA page allocations during the run (system wide) *****\n");
+  fprintf(fp,"Node  Hit Miss Foreign Local Other\n");
+  for(size_t k=0;k<after.size();k++)
+    fprintf(fp,"%d  %llu %llu %llu %llu %llu\n",(int)k,
+	    after[k].hit-before[k].hit,
+	    after[k].miss-before[k].miss,
+	    after[k].foreign-before[k].foreign,
+	    after[k].local-before[k].local,
+	    after[k].other-before[k].other);
+}
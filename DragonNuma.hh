@@ -0,0 +1,40 @@
+#ifndef DRAGON_NUMA_H
+#define DRAGON_NUMA_H
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// NUMA placement from sysfs, see DragonNuma.cpp
+///////////////////////////////////////////////////////////////////////////////////////////
+#define NUMA_ANY  -1  // leave the thread to the scheduler
+#define NUMA_NIC  -2  // node of the NIC the FEBs are connected through
+
+// "<node|nic|any>[:<node|nic|any>...]" into nodes[0..n), missing fields are left as they are
+int  NumaParse(const char *spec, int *nodes, int n);
+
+int  NumaNodeCount();
+// Node of a network interface (/sys/class/net/<if>/device/numa_node), -1 when unknown
+int  NumaIfNode(const char *ifname);
+// Node of the interface carrying a connected socket, -1 when unknown
+int  NumaSocketNode(int fd, std::string *ifname=NULL);
+// Node of the first connected socket in socks[first,last)
+int  NumaFebNode(const int *socks, int first, int last, std::string *ifname=NULL);
+// Pin the calling thread to the cores of a node, 0 on success
+int  NumaPinNode(int node);
+// Pre-fault a buffer from the calling thread, so that its pages are local to it
+void NumaTouch(void *buf, size_t size);
+
+// Per-node page allocation counters (/sys/devices/system/node/node<N>/numastat)
+struct NumaStat
+{
+  unsigned long long hit;      // allocated on the intended node
+  unsigned long long miss;     // intended for another node, allocated here
+  unsigned long long foreign;  // intended here, allocated on another node
+  unsigned long long local;    // allocated here by a process running here
+  unsigned long long other;    // allocated here by a process running elsewhere
+};
+void NumaStatRead(std::vector<NumaStat> &st);
+void NumaStatReport(FILE *fp, const std::vector<NumaStat> &before, const std::vector<NumaStat> &after);
+#endif
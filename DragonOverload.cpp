@@ -0,0 +1,119 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+// DragonOverload.cpp
+//
+// ****Function****
+//  When the stages after read() (disk, analysis) fall behind, the queue in
+//  front of them fills up and the FEBs end up throttled by TCP, which shows
+//  up as dead time on the hardware side with no trace in the DAQ.
+//  The controller watches the fill of that queue (the writer queue in
+//  DragonDaqM, the socket receive queue in the Online programs):
+//    - above "high" the overload level is raised, one step per hold time,
+//    - below "low", and no sample above "high" for a hold time, it is
+//      lowered again, one step per hold time.
+//  While the level is above 0 the configured policy degrades the
+//  processing, and every event which is not handled normally is
+//  counted per FEB and printed in the run summary.
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "DragonOverload.hh"
+
+static const char *PolicyName[]={"none","prescale","skip","drop"};
+
+const char *OverloadPolicyName(int policy)
+{
+  return PolicyName[policy];
+}
+
+int OverloadParse(const char *spec, OverloadConf *conf)
+{
+  conf->policy=OVL_NONE;
+  conf->high=0.8;
+  conf->low=0.5;
+  conf->holdNs=100000000ULL;
+  conf->maxLevel=1;
+  if(spec==NULL || *spec=='\0') return 0;
+
+  std::string s(spec);
+  std::string name=s.substr(0,s.find(':'));
+  int p;
+  for(p=0;p<4;p++)
+    if(name==PolicyName[p]) break;
+  if(p==4)
+    {
+      printf("Unknown overload policy %s (none, prescale, skip or drop)\n",name.c_str());
+      return -1;
+    }
+  conf->policy=p;
+  if(p==OVL_PRESCALE) conf->maxLevel=10; // the other policies are on/off
+  size_t colon=s.find(':');
+  if(colon!=std::string::npos)
+    {
+      double high=100,low=-1;
+      int n=sscanf(s.c_str()+colon+1,"%lf:%lf",&high,&low);
+      if(n>=1) conf->high=high/100.;
+      if(n==2) conf->low=low/100.;
+      else if(conf->high<=conf->low) conf->low=conf->high*0.6; // keep the default below high
+    }
+  if(conf->high<=0 || conf->high>1 || conf->low<0 || conf->low>=conf->high)
+    {
+      printf("Overload thresholds must be 0 <= low < high <= 100 : %s\n",spec);
+      return -1;
+    }
+  return 0;
+}
+
+void OverloadInit(OverloadState *st)
+{
+  memset(st,0,sizeof(*st));
+}
+
+void OverloadChange(OverloadState *st, const OverloadConf *conf, int level, double fill, unsigned long long now)
+{
+  if(st->level==0 && level>0)
+    {
+      st->nEnter++;
+      printf("overload: queue at %.0f%%, policy %s\n",fill*100,PolicyName[conf->policy]);
+    }
+  else if(st->level>0 && level==0)
+    printf("overload: back to normal, queue at %.0f%%\n",fill*100);
+  if(st->level>0) st->nsOverloaded+=now-st->lastChange;
+  st->level=level;
+  st->lastChange=now;
+  if(level>st->maxSeen) st->maxSeen=level;
+}
+
+void OverloadReport(FILE *fp, const OverloadConf *conf, const OverloadState *st, int nState,
+		    const OverloadLoss *loss, int nFeb, const std::string *names,
+		    unsigned long long now)
+{
+  unsigned long long nEnter=0,ns=0;
+  int maxSeen=0;
+  for(int k=0;k<nState;k++)
+    {
+      nEnter+=st[k].nEnter;
+      ns+=st[k].nsOverloaded;
+      if(st[k].level>0) ns+=now-st[k].lastChange;
+      if(st[k].maxSeen>maxSeen) maxSeen=st[k].maxSeen;
+    }
+  bool any= nEnter>0;
+  for(int i=0;i<nFeb && !any;i++)
+    for(int c=0;c<OVL_NCOUNT;c++)
+      if(loss[i].c[c]) any=true;
+  if(!any) return;
+
+  fprintf(fp,"***** Overload (policy %s, %.0f%%/%.0f%%) *****\n",
+	  PolicyName[conf->policy],conf->high*100,conf->low*100);
+  fprintf(fp,"entered %llu times, %.3f sec in total, highest level %d\n",nEnter,ns*1e-9,maxSeen);
+  fprintf(fp,"IPaddress  Dropped Prescaled Unanalyzed Stalled\n");
+  for(int i=0;i<nFeb;i++)
+    {
+      const unsigned long long *c=loss[i].c;
+      if(!(c[OVL_DROPPED]|c[OVL_PRESCALED]|c[OVL_UNANALYZED]|c[OVL_STALLED])) continue;
+      fprintf(fp,"%s  %llu %llu %llu %llu\n",names[i].c_str(),
+	      c[OVL_DROPPED],c[OVL_PRESCALED],c[OVL_UNANALYZED],c[OVL_STALLED]);
+    }
+}
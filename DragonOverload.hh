@@ -0,0 +1,85 @@
+#ifndef DRAGON_OVERLOAD_H
+#define DRAGON_OVERLOAD_H
+
+#include <stdio.h>
+#include <string>
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Overload controller, see DragonOverload.cpp
+///////////////////////////////////////////////////////////////////////////////////////////
+enum OverloadPolicy
+  {
+    OVL_NONE=0,     // only account, backpressure goes to the FEBs as before
+    OVL_PRESCALE,   // multiply the prescale by 2^level
+    OVL_SKIP,       // skip the online analysis
+    OVL_DROP        // keep only the events flagged by the online analysis
+  };
+
+struct OverloadConf
+{
+  int policy;
+  double high;                // queue fill [0-1] entering/raising the overload level
+  double low;                 // queue fill [0-1] lowering it
+  unsigned long long holdNs;  // minimum time between two level changes
+  int maxLevel;
+};
+
+// Controller state, one per thread watching a queue
+struct OverloadState
+{
+  int level;                  // 0: normal
+  int maxSeen;
+  unsigned long long lastHigh;
+  unsigned long long lastChange;
+  unsigned long long nEnter;  // times the overload state was entered
+  unsigned long long nsOverloaded;
+};
+
+// Per-FEB accounting of the events which were not handled normally
+enum
+  {
+    OVL_DROPPED=0,  // not stored
+    OVL_PRESCALED,  // not stored because of the raised prescale
+    OVL_UNANALYZED, // not analysed
+    OVL_STALLED,    // reader waited for the downstream queue
+    OVL_NCOUNT
+  };
+
+struct OverloadLoss
+{
+  unsigned long long c[OVL_NCOUNT];
+};
+
+// "<none|prescale|skip|drop>[:high%[:low%]]", e.g. "prescale:80:50"
+// high defaults to 80, low to 50 (60% of high when high is 50 or less)
+int  OverloadParse(const char *spec, OverloadConf *conf);
+const char *OverloadPolicyName(int policy);
+void OverloadInit(OverloadState *st);
+void OverloadChange(OverloadState *st, const OverloadConf *conf, int level, double fill, unsigned long long now);
+
+// Called with the current queue fill, returns the level
+inline int OverloadUpdate(OverloadState *st, const OverloadConf *conf, double fill, unsigned long long now)
+{
+  if(fill>=conf->high)
+    {
+      st->lastHigh=now;
+      if(st->level<conf->maxLevel && (st->level==0 || now-st->lastChange>=conf->holdNs))
+	OverloadChange(st,conf,st->level+1,fill,now);
+    }
+  else if(st->level>0 && fill<=conf->low &&
+	  now-st->lastHigh>=conf->holdNs && now-st->lastChange>=conf->holdNs)
+    OverloadChange(st,conf,st->level-1,fill,now);
+  return st->level;
+}
+
+// Effective prescale under OVL_PRESCALE
+inline int OverloadPrescale(const OverloadState *st, const OverloadConf *conf, int prescale)
+{
+  return conf->policy==OVL_PRESCALE ? prescale<<st->level : prescale;
+}
+
+// Summary of the run, prints nothing when nothing happened
+void OverloadReport(FILE *fp, const OverloadConf *conf, const OverloadState *st, int nState,
+		    const OverloadLoss *loss, int nFeb, const std::string *names,
+		    unsigned long long now);
+#endif
@@ -0,0 +1,314 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+// DragonPacer.cpp
+//
+// ****Function****
+//  Paces the reads of each FEB for the DRS4 memory clearing and dead time
+//  studies: while an event waits in the socket the FEB can't free its
+//  buffer, so delaying the read of one FEB delays its readout and nothing
+//  else. Every FEB has its own deadline for the next read:
+//    delay  : gap after the end of the previous read,
+//    rate   : start+k*gap, a late read doesn't shift the next ones,
+//    script : a file of delay/rate steps, each for a number of events.
+//  When none of the readable FEBs is due, the loop sleeps on a timerfd
+//  up to a little before the earliest deadline and spins the rest on
+//  the host clock. The spin is calibrated on the timer at start and
+//  grows whenever a wake-up comes late, so reads start within ~1 usec
+//  of their deadline instead of the 50-100 usec of usleep().
+//  The achieved delays and the lateness of every read are kept in HDR
+//  histograms (DragonHist.hh) and printed with the run summary.
+//
+// ****Usage****
+//   -t 200                  200 usec between the reads of a FEB
+//   -t rate:5000            5 kHz per FEB
+//   -t script:study.pace    with study.pace:
+//         # profile  usec|Hz  events (0 or none: until the end)
+//         delay      500      10000
+//         rate       2000     10000
+//         rate       8000
+//   -w <events|all>         events paced per FEB, then reads are free
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/timerfd.h>
+
+#include <algorithm>
+
+#include "DragonPacer.hh"
+
+#define PACER_SPIN_MIN   2000ULL      // nsec
+#define PACER_SPIN_MAX   1000000ULL
+#define PACER_CALIB      64           // timer wake-ups measured at start
+
+static const char *ProfileName[]={"off","delay","rate","script"};
+
+const char *PacerProfileName(int profile)
+{
+  return ProfileName[profile];
+}
+
+static int ParseStep(const char *kind, double value, unsigned long long events, PaceStep *s)
+{
+  if(strcmp(kind,"delay")==0 && value>=0)
+    {
+      s->profile=PACE_DELAY;
+      s->gapNs=(unsigned long long)(value*1000.+0.5);
+    }
+  else if(strcmp(kind,"rate")==0 && value>0)
+    {
+      s->profile=PACE_RATE;
+      s->gapNs=(unsigned long long)(1e9/value+0.5);
+    }
+  else
+    return -1;
+  s->events=events;
+  return 0;
+}
+
+static int ReadScript(const char *file, PacerConf *conf)
+{
+  FILE *fp=fopen(file,"r");
+  if(fp==NULL)
+    {
+      printf("Can't open pacing script %s: %s\n",file,strerror(errno));
+      return -1;
+    }
+  char line[256];
+  int nLine=0;
+  while(fgets(line,sizeof(line),fp))
+    {
+      nLine++;
+      char *hash=strchr(line,'#');
+      if(hash) *hash='\0';
+      char kind[32];
+      double value;
+      unsigned long long events=0;
+      int n=sscanf(line,"%31s %lf %llu",kind,&value,&events);
+      if(n<=0) continue;
+      PaceStep s;
+      if(n<2 || ParseStep(kind,value,events,&s)!=0)
+	{
+	  printf("%s:%d: expected delay <usec> [events] or rate <Hz> [events]\n",file,nLine);
+	  fclose(fp);
+	  return -1;
+	}
+      conf->step.push_back(s);
+    }
+  fclose(fp);
+  if(conf->step.empty())
+    {
+      printf("No step in pacing script %s\n",file);
+      return -1;
+    }
+  return 0;
+}
+
+int PacerParse(const char *spec, PacerConf *conf)
+{
+  conf->step.clear();
+  conf->profile=PACE_OFF;
+  conf->limit=~0ULL;
+  if(spec==NULL || *spec=='\0') return 0;
+
+  std::string s(spec);
+  size_t colon=s.find(':');
+  if(colon==std::string::npos)
+    {
+      // plain number: the minimum time between reads in usec of the old -t
+      char *end;
+      double us=strtod(spec,&end);
+      if(*end!='\0' || us<0)
+	{
+	  printf("Bad pacing %s, expected <usec>, delay:<usec>, rate:<Hz> or script:<file>\n",spec);
+	  return -1;
+	}
+      if(us==0) return 0;
+      s="delay:"+s;
+      colon=5;
+    }
+  std::string kind=s.substr(0,colon);
+  std::string arg=s.substr(colon+1);
+  if(kind=="script")
+    {
+      if(ReadScript(arg.c_str(),conf)!=0) return -1;
+      conf->profile=PACE_SCRIPT;
+      return 0;
+    }
+  PaceStep step;
+  char *end;
+  double value=strtod(arg.c_str(),&end);
+  if(arg.empty() || *end!='\0' || ParseStep(kind.c_str(),value,0,&step)!=0)
+    {
+      printf("Bad pacing %s, expected <usec>, delay:<usec>, rate:<Hz> or script:<file>\n",spec);
+      return -1;
+    }
+  conf->step.push_back(step);
+  conf->profile=step.profile;
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// waiting
+///////////////////////////////////////////////////////////////////////////////////////////
+static void Sleep(Pacer *p, unsigned long long ns)
+{
+  struct timespec ts;
+  ts.tv_sec=ns/1000000000ULL;
+  ts.tv_nsec=ns%1000000000ULL;
+  if(p->tfd>=0)
+    {
+      struct itimerspec its;
+      memset(&its,0,sizeof(its));
+      its.it_value=ts;
+      if(timerfd_settime(p->tfd,0,&its,NULL)==0)
+	{
+	  unsigned long long expired;
+	  if(read(p->tfd,&expired,sizeof(expired))>0) return;
+	}
+    }
+  nanosleep(&ts,NULL);
+}
+
+static inline void Spin()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  _mm_pause();
+#endif
+}
+
+static unsigned long long WaitUntil(Pacer *p, unsigned long long deadline)
+{
+  unsigned long long now=DragonClockNow();
+  if(deadline>now+p->spinNs)
+    {
+      Sleep(p,deadline-p->spinNs-now);
+      now=DragonClockNow();
+      if(now>deadline)
+	{
+	  // woke up past the deadline: spin longer from now on
+	  p->nSpinGrow++;
+	  p->spinNs=std::min(p->spinNs+(now-deadline),PACER_SPIN_MAX);
+	}
+    }
+  while(now<deadline)
+    {
+      Spin();
+      now=DragonClockNow();
+    }
+  p->nWaits++;
+  return now;
+}
+
+// The spin covers the p99 of the timer wake-up latency
+static void Calibrate(Pacer *p)
+{
+  std::vector<unsigned long long> over;
+  for(int i=0;i<PACER_CALIB;i++)
+    {
+      unsigned long long ask=50000+(i%4)*50000;
+      unsigned long long t0=DragonClockNow();
+      Sleep(p,ask);
+      unsigned long long dt=DragonClockNow()-t0;
+      over.push_back(dt>ask ? dt-ask : 0);
+    }
+  std::sort(over.begin(),over.end());
+  unsigned long long p50=over[over.size()/2];
+  unsigned long long p99=over[over.size()*99/100];
+  p->spinNs=std::max(PACER_SPIN_MIN,std::min(p99+p99/4,PACER_SPIN_MAX));
+  printf("Pacer: %s wake-up latency p50 %llu p99 %llu nsec, spinning the last %llu nsec\n",
+	 p->tfd>=0 ? "timerfd" : "nanosleep",p50,p99,p->spinNs);
+}
+
+Pacer *PacerNew(const PacerConf &conf, int nFeb)
+{
+  Pacer *p=new Pacer;
+  p->conf=conf;
+  p->nFeb=nFeb;
+  p->nWaits=0;
+  p->nSpinGrow=0;
+  p->feb.resize(nFeb);
+  for(int i=0;i<nFeb;i++)
+    memset(&p->feb[i],0,sizeof(FebPace));
+  p->tfd=timerfd_create(CLOCK_MONOTONIC,TFD_CLOEXEC);
+  if(p->tfd<0) printf("timerfd_create: %s, pacing with nanosleep()\n",strerror(errno));
+  Calibrate(p);
+  return p;
+}
+
+void PacerDelete(Pacer *p)
+{
+  if(p->tfd>=0) close(p->tfd);
+  delete p;
+}
+
+unsigned long long PacerWait(Pacer *p, const struct pollfd *pfd, unsigned long long now)
+{
+  unsigned long long next=~0ULL;
+  for(int i=0;i<p->nFeb;i++)
+    {
+      if(pfd[i].fd<0 || !pfd[i].revents) continue;
+      if(PacerDue(p,i,now)) return now;
+      next=std::min(next,p->feb[i].deadline);
+    }
+  if(next==~0ULL) return now;
+  return WaitUntil(p,next);
+}
+
+void PacerRead(Pacer *p, int feb, unsigned long long start, unsigned long long end)
+{
+  FebPace &f=p->feb[feb];
+  if(f.events>=p->conf.limit) return;
+  const PaceStep *s=&p->conf.step[f.step];
+  // the quantity the profile sets: end->start for a delay, start->start for a rate
+  if(f.events)
+    HistRecord(&f.delay,start-(s->profile==PACE_DELAY ? f.lastEnd : f.lastStart));
+  if(f.deadline)
+    HistRecord(&f.late,start>f.deadline ? start-f.deadline : 0);
+  f.lastStart=start;
+  f.lastEnd=end;
+  f.events++;
+  f.stepEvents++;
+  if(f.origin==0) f.origin=start-(f.stepEvents-1)*s->gapNs;
+  if(s->events && f.stepEvents>=s->events && f.step+1<p->conf.step.size())
+    {
+      f.step++;
+      s=&p->conf.step[f.step];
+      f.stepEvents=0;
+      f.origin=start+s->gapNs;
+    }
+  if(s->profile==PACE_DELAY)
+    f.deadline=end+s->gapNs;
+  else
+    f.deadline=f.origin+f.stepEvents*s->gapNs;
+}
+
+unsigned int PacerGapUs(const Pacer *p, int feb)
+{
+  return (unsigned int)(p->conf.step[p->feb[feb].step].gapNs/1000);
+}
+
+void PacerReport(FILE *fp, const Pacer *p, const std::string *names)
+{
+  fprintf(fp,"***** Pacing (%s, first %s events of each FEB) *****\n",PacerProfileName(p->conf.profile),
+	  p->conf.limit==~0ULL ? "all" : std::to_string(p->conf.limit).c_str());
+  fprintf(fp,"%llu waits, spin %llu nsec, %llu late wake-ups\n",p->nWaits,p->spinNs,p->nSpinGrow);
+  fprintf(fp,"FEB IPaddress       Events       Step  Target[us]  Delay[us]: p50      p99      p99.9    Max      Late[us]: p50      p99      Max\n");
+  for(int i=0;i<p->nFeb;i++)
+    {
+      const FebPace &f=p->feb[i];
+      const PaceStep &s=p->conf.step[f.step];
+      fprintf(fp,"%-3d %-15s %-12llu %-5s %-11.1f %-10s %-8.1f %-8.1f %-8.1f %-8.1f %-9s %-8.1f %-8.1f %.1f\n",
+	      i,names[i].c_str(),f.events,PacerProfileName(s.profile),s.gapNs/1000.,"",
+	      HistPercentile(&f.delay,50.0)/1000.,
+	      HistPercentile(&f.delay,99.0)/1000.,
+	      HistPercentile(&f.delay,99.9)/1000.,
+	      f.delay.max/1000.,"",
+	      HistPercentile(&f.late,50.0)/1000.,
+	      HistPercentile(&f.late,99.0)/1000.,
+	      f.late.max/1000.);
+    }
+}
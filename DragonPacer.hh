@@ -0,0 +1,88 @@
+#ifndef DRAGON_PACER_H
+#define DRAGON_PACER_H
+
+#include <stdio.h>
+#include <poll.h>
+#include <string>
+#include <vector>
+
+#include "DragonHist.hh"
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Per-FEB read pacing, see DragonPacer.cpp
+///////////////////////////////////////////////////////////////////////////////////////////
+enum PacerProfile
+  {
+    PACE_OFF=0,
+    PACE_DELAY,     // at least gap between the end of a read and the next one
+    PACE_RATE,      // reads at start+k*gap, late reads don't shift the schedule
+    PACE_SCRIPT     // a sequence of delay/rate steps, each for a number of events
+  };
+
+struct PaceStep
+{
+  int profile;                 // PACE_DELAY or PACE_RATE
+  unsigned long long gapNs;
+  unsigned long long events;   // 0: until the end of the run
+};
+
+struct PacerConf
+{
+  std::vector<PaceStep> step;  // a single one unless PACE_SCRIPT
+  int profile;
+  unsigned long long limit;    // events paced per FEB (-w), then reads are free
+};
+
+// Parses <us> (a delay, as -t always was), delay:<us>, rate:<Hz> or
+// script:<file>. Returns -1 on error.
+int  PacerParse(const char *spec, PacerConf *conf);
+const char *PacerProfileName(int profile);
+
+struct FebPace
+{
+  unsigned long long deadline;    // of the next read [nsec], 0: none
+  unsigned long long lastStart;   // of the previous read
+  unsigned long long lastEnd;
+  unsigned long long origin;      // deadline of the first read of the current step
+  unsigned long long events;      // paced reads
+  unsigned long long stepEvents;  // reads in the current step
+  size_t step;
+  HdrHist delay;                  // achieved time between two reads [nsec]
+  HdrHist late;                   // read start - deadline [nsec]
+};
+
+struct Pacer
+{
+  PacerConf conf;
+  int nFeb;
+  int tfd;                        // timerfd, -1: nanosleep()
+  unsigned long long spinNs;      // the end of every wait is spent spinning
+  unsigned long long nWaits;
+  unsigned long long nSpinGrow;   // waits which woke up past the deadline
+  std::vector<FebPace> feb;
+};
+
+// Calibrates the wake-up latency of the timer (a few ms)
+Pacer *PacerNew(const PacerConf &conf, int nFeb);
+void PacerDelete(Pacer *p);
+
+// true when FEB feb may be read at time now
+inline bool PacerDue(const Pacer *p, int feb, unsigned long long now)
+{
+  const FebPace &f=p->feb[feb];
+  return f.events>=p->conf.limit || now>=f.deadline;
+}
+
+// Sleeps until the earliest deadline among the FEBs poll() reported
+// readable, if none of them is due yet. Returns the time it woke up.
+unsigned long long PacerWait(Pacer *p, const struct pollfd *pfd, unsigned long long now);
+
+// A read of FEB feb which started at start ended at end: records the
+// delay since the previous one and schedules the next
+void PacerRead(Pacer *p, int feb, unsigned long long start, unsigned long long end);
+
+// Gap of the current step of FEB feb [usec]
+unsigned int PacerGapUs(const Pacer *p, int feb);
+
+void PacerReport(FILE *fp, const Pacer *p, const std::string *names);
+#endif
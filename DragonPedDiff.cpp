@@ -0,0 +1,165 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+// DragonPedDiff.cpp
+//
+// ****Function****
+//  Compares two pedestal snapshots (DragonPedestal.cpp) written by
+//  DragonDaqMOnlineCarlos -P, to find the capacitors whose pedestal moved
+//  between two runs without going back to the raw data. The pedestal of a
+//  cell is the mean of the values kept in its map (or, with -c, the
+//  running pedestal of the classifier); the FEBs are matched by IP:port
+//  and only the cells filled in both snapshots are compared.
+//  Prints per FEB/channel/gain the mean and rms of the differences and
+//  the cells beyond -t, then the -n cells which moved most.
+//
+// ****Usage****
+//   make DragonPedDiff
+//   ./DragonPedDiff [-t 10] [-n 20] [-c] yesterday.ped today.ped
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "DragonPedestal.hh"
+
+struct Drift
+{
+  int feb;              // in the second snapshot
+  int channel;
+  int gain;
+  int cell;
+  float before;
+  float after;
+};
+
+static bool DriftOrder(const Drift &a, const Drift &b)
+{
+  return fabsf(a.after-a.before)>fabsf(b.after-b.before);
+}
+
+// Pedestal of a cell, 0 when it was never filled
+static float CellPed(const PedSnapFile *f, int feb, int channel, int gain, int cell, bool classifier)
+{
+  if(classifier)
+    {
+      size_t c=(size_t)(channel*EV_NGAIN+gain)*EV_NCELL+cell;
+      float p=PedSnapPed(f,feb)[c];
+      return p>0 ? p : 0;
+    }
+  const int *value=(*PedSnapMap(f,feb))[channel][cell][gain];
+  int sum=0,n=0;
+  for(int i=0;i<_npointers;i++)
+    if(value[i]>0)
+      {
+	sum+=value[i];
+	n++;
+      }
+  return n ? (float)sum/n : 0;
+}
+
+static void PrintInfo(const char *path, const PedSnapFile *f)
+{
+  printf("%s: %u FEBs, RD%u, %llu events%s\n",path,f->hdr->nFeb,f->hdr->rddepth,f->hdr->events,
+	 (f->hdr->flags&PEDSNAP_CLASSIFIER) ? ", with classifier pedestals" : "");
+}
+
+int main(int argc, char *argv[])
+{
+  double threshold=10;
+  int nTop=20;
+  bool classifier=false;
+  int opt;
+  while((opt=getopt(argc,argv,"ht:n:c"))!=-1)
+    {
+      switch(opt)
+	{
+	case 't': threshold=atof(optarg); break;
+	case 'n': nTop=atoi(optarg); break;
+	case 'c': classifier=true; break;
+	default:
+	  printf("Usage: %s [-t adc] [-n cells] [-c] <snapshot> <snapshot>\n",argv[0]);
+	  printf("  -t : count the cells which moved by more than this, default 10 ADC counts\n");
+	  printf("  -n : list the cells which moved most, default 20\n");
+	  printf("  -c : compare the classifier pedestals instead of the analysis maps\n");
+	  exit(opt=='h' ? 0 : 1);
+	}
+    }
+  if(argc-optind!=2)
+    {
+      printf("%s -h for usage\n",argv[0]);
+      exit(1);
+    }
+  PedSnapFile *a=PedSnapOpen(argv[optind]);
+  PedSnapFile *b=PedSnapOpen(argv[optind+1]);
+  if(a==NULL || b==NULL) exit(1);
+  PrintInfo(argv[optind],a);
+  PrintInfo(argv[optind+1],b);
+  if(classifier && (!(a->hdr->flags&PEDSNAP_CLASSIFIER) || !(b->hdr->flags&PEDSNAP_CLASSIFIER)))
+    {
+      printf("-c needs two snapshots of runs with -L\n");
+      exit(1);
+    }
+  const int nChannel= classifier ? EV_NCHANNEL-1 : _nchannels;
+
+  std::vector<Drift> drift;
+  printf("***** Pedestal differences (%s) *****\n",classifier ? "classifier" : "analysis maps");
+  printf("%-22s%4s%5s%8s%10s%10s%10s%9s\n","FEB","Ch","Gain","Cells","Mean","RMS","MaxAbs",">t");
+  for(unsigned int fb=0;fb<b->hdr->nFeb;fb++)
+    {
+      int fa=-1;
+      for(unsigned int k=0;k<a->hdr->nFeb;k++)
+	if(a->names[k]==b->names[fb]) fa=k;
+      if(fa<0)
+	{
+	  printf("%-22s not in %s\n",b->names[fb].c_str(),argv[optind]);
+	  continue;
+	}
+      for(int ch=0;ch<nChannel;ch++)
+	for(int g=0;g<_ngains;g++)
+	  {
+	    int n=0,over=0;
+	    double sum=0,sum2=0,maxAbs=0;
+	    for(int cell=0;cell<_ncells;cell++)
+	      {
+		float pa=CellPed(a,fa,ch,g,cell,classifier);
+		float pb=CellPed(b,fb,ch,g,cell,classifier);
+		if(pa<=0 || pb<=0) continue;
+		double d=pb-pa;
+		n++;
+		sum+=d;
+		sum2+=d*d;
+		if(fabs(d)>maxAbs) maxAbs=fabs(d);
+		if(fabs(d)>threshold)
+		  {
+		    over++;
+		    Drift dr={(int)fb,ch,g,cell,pa,pb};
+		    drift.push_back(dr);
+		  }
+	      }
+	    double mean= n ? sum/n : 0;
+	    double rms= n ? sqrt(sum2/n-mean*mean) : 0;
+	    printf("%-22s%4d%5s%8d%10.2f%10.2f%10.1f%9d\n",b->names[fb].c_str(),ch,g ? "low" : "high",n,mean,rms,maxAbs,over);
+	  }
+    }
+  std::sort(drift.begin(),drift.end(),DriftOrder);
+  if(!drift.empty())
+    {
+      printf("***** Cells which moved most (%lu beyond %g) *****\n",(unsigned long)drift.size(),threshold);
+      printf("%-22s%4s%5s%6s%10s%10s%10s\n","FEB","Ch","Gain","Cell","Before","After","Diff");
+      for(size_t i=0;i<drift.size() && (int)i<nTop;i++)
+	{
+	  const Drift &d=drift[i];
+	  printf("%-22s%4d%5s%6d%10.1f%10.1f%10.1f\n",b->names[d.feb].c_str(),d.channel,d.gain ? "low" : "high",
+		 d.cell,d.before,d.after,d.after-d.before);
+	}
+    }
+  PedSnapClose(a);
+  PedSnapClose(b);
+  return 0;
+}
@@ -0,0 +1,319 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+// DragonPedestal.cpp
+//
+// ****Function****
+//  The maps of the analysis (the last ADC values of every capacitor) start
+//  empty, and the first events of a run are only good for filling them,
+//  which is part of why DragonDaqMOnlineCarlos slows down its first -w
+//  events. With -P the maps (and the pedestals of the classifier) are
+//  saved to a snapshot file at the end of the run and every few minutes
+//  during it, and the next run starts from it:
+//    - the file is written to <file>.tmp, synced, then renamed, so a
+//      snapshot is always complete, whatever happens to the run,
+//    - the periodic snapshots are a memcpy() of the maps in the event
+//      loop; the writing is done by a thread of its own,
+//    - at start, a snapshot of the same FEBs is mmap()ed MAP_PRIVATE and
+//      its maps used in place: no reading before the first event, the
+//      pages come in as the cells are hit, and nothing goes back to the
+//      file. The FEBs are matched by "IP:port", so a snapshot of another
+//      set of FEBs still warms up the ones it has (copied).
+//  DragonPedDiff compares two snapshots cell by cell.
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "DragonPedestal.hh"
+#include "DragonClock.hh"
+
+static size_t PageAlign(size_t n)
+{
+  long page=sysconf(_SC_PAGESIZE);
+  return (n+page-1)&~(size_t)(page-1);
+}
+
+PedSnapFile *PedSnapOpen(const char *path)
+{
+  int fd=open(path,O_RDONLY);
+  struct stat st;
+  if(fd<0 || fstat(fd,&st)!=0)
+    {
+      perror(path);
+      if(fd>=0) close(fd);
+      return NULL;
+    }
+  if((size_t)st.st_size<sizeof(PedSnapHeader))
+    {
+      printf("%s: not a pedestal snapshot\n",path);
+      close(fd);
+      return NULL;
+    }
+  void *m=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+  close(fd);
+  if(m==MAP_FAILED)
+    {
+      perror(path);
+      return NULL;
+    }
+  PedSnapFile *f=new PedSnapFile;
+  f->map=(const unsigned char *)m;
+  f->size=st.st_size;
+  f->hdr=(const PedSnapHeader *)f->map;
+  const PedSnapHeader &h=*f->hdr;
+  if(memcmp(h.magic,PEDSNAP_MAGIC,sizeof(h.magic))!=0)
+    {
+      printf("%s: not a pedestal snapshot\n",path);
+      PedSnapClose(f);
+      return NULL;
+    }
+  if(h.version!=PEDSNAP_VERSION || h.nChannels!=_nchannels || h.nCells!=_ncells
+     || h.nGains!=_ngains || h.nPointers!=_npointers)
+    {
+      printf("%s: snapshot version %u of maps %ux%ux%ux%u, this program reads version %d of %dx%dx%dx%d\n",
+	     path,h.version,h.nChannels,h.nCells,h.nGains,h.nPointers,
+	     PEDSNAP_VERSION,_nchannels,_ncells,_ngains,_npointers);
+      PedSnapClose(f);
+      return NULL;
+    }
+  size_t need=h.dataOffset+h.nFeb*(PedSnapMapBytes()+PedSnapUptBytes());
+  if(h.flags&PEDSNAP_CLASSIFIER) need+=h.nFeb*PedSnapCells()*(sizeof(float)+1);
+  if(h.dataOffset<sizeof(h)+(size_t)h.nFeb*PEDSNAP_NAME || need>f->size)
+    {
+      printf("%s: truncated snapshot\n",path);
+      PedSnapClose(f);
+      return NULL;
+    }
+  for(unsigned int k=0;k<h.nFeb;k++)
+    {
+      const char *name=(const char *)f->map+sizeof(h)+k*PEDSNAP_NAME;
+      f->names.push_back(std::string(name,strnlen(name,PEDSNAP_NAME)));
+    }
+  return f;
+}
+
+void PedSnapClose(PedSnapFile *f)
+{
+  if(f==NULL) return;
+  munmap((void *)f->map,f->size);
+  delete f;
+}
+
+static size_t PedOffset(const PedSnapFile *f)
+{
+  return f->hdr->dataOffset+f->hdr->nFeb*(PedSnapMapBytes()+PedSnapUptBytes());
+}
+
+const float *PedSnapPed(const PedSnapFile *f, int feb)
+{
+  if(!(f->hdr->flags&PEDSNAP_CLASSIFIER)) return NULL;
+  return (const float *)(f->map+PedOffset(f))+feb*PedSnapCells();
+}
+
+const unsigned char *PedSnapSeen(const PedSnapFile *f, int feb)
+{
+  if(!(f->hdr->flags&PEDSNAP_CLASSIFIER)) return NULL;
+  return f->map+PedOffset(f)+f->hdr->nFeb*PedSnapCells()*sizeof(float)+feb*PedSnapCells();
+}
+
+int PedSnapWrite(const char *path, const AnalysisState *st, const std::vector<std::string> &names, int rddepth)
+{
+  PedSnapHeader h;
+  memset(&h,0,sizeof(h));
+  memcpy(h.magic,PEDSNAP_MAGIC,sizeof(h.magic));
+  h.version=PEDSNAP_VERSION;
+  h.nFeb=st->nFeb;
+  h.nChannels=_nchannels;
+  h.nCells=_ncells;
+  h.nGains=_ngains;
+  h.nPointers=_npointers;
+  h.flags= st->classifier ? PEDSNAP_CLASSIFIER : 0;
+  h.rddepth=rddepth;
+  h.written=DragonClockNow()+DragonClockRealtimeOffset();
+  h.events=st->history+st->Ev.Counter;
+  h.dataOffset=PageAlign(sizeof(h)+(size_t)h.nFeb*PEDSNAP_NAME);
+  std::vector<char> head(h.dataOffset,0);
+  memcpy(&head[0],&h,sizeof(h));
+  for(int k=0;k<st->nFeb && k<(int)names.size();k++)
+    strncpy(&head[sizeof(h)+k*PEDSNAP_NAME],names[k].c_str(),PEDSNAP_NAME-1);
+
+  std::string tmp=std::string(path)+".tmp";
+  FILE *fp=fopen(tmp.c_str(),"wb");
+  if(fp==NULL)
+    {
+      perror(tmp.c_str());
+      return -1;
+    }
+  bool ok= fwrite(&head[0],head.size(),1,fp)==1
+    && fwrite(st->eventsMap,PedSnapMapBytes(),st->nFeb,fp)==(size_t)st->nFeb
+    && fwrite(st->eventsMapUpt,PedSnapUptBytes(),st->nFeb,fp)==(size_t)st->nFeb;
+  if(ok && st->classifier)
+    ok= fwrite(&st->classifier->ped[0],sizeof(float),st->classifier->ped.size(),fp)==st->classifier->ped.size()
+      && fwrite(&st->classifier->seen[0],1,st->classifier->seen.size(),fp)==st->classifier->seen.size();
+  ok= ok && fflush(fp)==0 && fdatasync(fileno(fp))==0;
+  if(fclose(fp)!=0) ok=false;
+  if(!ok || rename(tmp.c_str(),path)!=0)
+    {
+      perror(path);
+      unlink(tmp.c_str());
+      return -1;
+    }
+  return 0;
+}
+
+int PedSnapLoad(const char *path, AnalysisState *st, const std::vector<std::string> &names)
+{
+  if(access(path,F_OK)!=0 && errno==ENOENT)
+    {
+      printf("No pedestal snapshot %s yet, cold start\n",path);
+      return 0;
+    }
+  PedSnapFile *f=PedSnapOpen(path);
+  if(f==NULL) return -1;
+  const PedSnapHeader &h=*f->hdr;
+  bool same= (int)h.nFeb==st->nFeb && st->firstFeb==0 && names.size()==h.nFeb;
+  for(unsigned int k=0;same && k<h.nFeb;k++) same= f->names[k]==names[k];
+  std::vector<int> from(st->nFeb,-1);
+  int warm=0;
+  for(int k=0;k<st->nFeb && k<(int)names.size();k++)
+    for(unsigned int j=0;j<h.nFeb;j++)
+      if(f->names[j]==names[k])
+	{
+	  from[k]=j;
+	  warm++;
+	  break;
+	}
+
+  if(same)
+    {
+      // the maps of the run become those of the file, copy-on-write
+      int fd=open(path,O_RDONLY);
+      void *m= fd<0 ? MAP_FAILED : mmap(NULL,f->size,PROT_READ|PROT_WRITE,MAP_PRIVATE,fd,0);
+      if(fd>=0) close(fd);
+      if(m==MAP_FAILED)
+	{
+	  perror(path);
+	  PedSnapClose(f);
+	  return -1;
+	}
+      if(st->mapped) munmap(st->mapped,st->mappedSize);
+      else
+	{
+	  delete [] st->eventsMap;
+	  delete [] st->eventsMapUpt;
+	}
+      st->mapped=m;
+      st->mappedSize=f->size;
+      st->eventsMap=(EventsMapFeb *)((unsigned char *)m+h.dataOffset);
+      st->eventsMapUpt=(EventsMapUptFeb *)((unsigned char *)m+h.dataOffset+h.nFeb*PedSnapMapBytes());
+    }
+  else
+    for(int k=0;k<st->nFeb;k++)
+      if(from[k]>=0)
+	{
+	  memcpy(st->eventsMap[k],PedSnapMap(f,from[k]),PedSnapMapBytes());
+	  memcpy(st->eventsMapUpt[k],PedSnapUpt(f,from[k]),PedSnapUptBytes());
+	}
+  if(st->classifier && (h.flags&PEDSNAP_CLASSIFIER))
+    for(int k=0;k<st->nFeb;k++)
+      if(from[k]>=0)
+	{
+	  memcpy(&st->classifier->ped[k*PedSnapCells()],PedSnapPed(f,from[k]),PedSnapCells()*sizeof(float));
+	  memcpy(&st->classifier->seen[k*PedSnapCells()],PedSnapSeen(f,from[k]),PedSnapCells());
+	}
+  st->history=h.events;
+  long long age=(long long)(DragonClockNow()+DragonClockRealtimeOffset()-h.written)/1000000000LL;
+  printf("Pedestals of %d/%d FEBs from %s (RD%u, %llu events, %lld s old%s)\n",warm,st->nFeb,path,
+	 h.rddepth,h.events,age,same ? ", mapped" : "");
+  PedSnapClose(f);
+  return warm;
+}
+
+/******************************************/
+//  Writer thread
+/******************************************/
+static void *PedSnapLoop(void *arg)
+{
+  PedSnapWriter *w=(PedSnapWriter *)arg;
+  pthread_mutex_lock(&w->mutex);
+  for(;;)
+    {
+      while(!w->pending && !w->quit) pthread_cond_wait(&w->cond,&w->mutex);
+      if(!w->pending) break;
+      pthread_mutex_unlock(&w->mutex);
+      int ret=PedSnapWrite(w->path.c_str(),w->copy,w->names,w->rddepth);
+      pthread_mutex_lock(&w->mutex);
+      if(ret==0) w->nWritten++;
+      w->pending=false;
+    }
+  pthread_mutex_unlock(&w->mutex);
+  return NULL;
+}
+
+PedSnapWriter *PedSnapStart(const char *path, const std::vector<std::string> &names, int rddepth, const AnalysisState *st)
+{
+  PedSnapWriter *w=new PedSnapWriter;
+  w->path=path;
+  w->names=names;
+  w->rddepth=rddepth;
+  w->copy=AnalysisNew(st->firstFeb,st->nFeb);
+  if(st->classifier) w->copy->classifier=new Classifier(*st->classifier);
+  w->pending=false;
+  w->quit=false;
+  w->nWritten=0;
+  w->nSkipped=0;
+  pthread_mutex_init(&w->mutex,NULL);
+  pthread_cond_init(&w->cond,NULL);
+  pthread_create(&w->thread,NULL,PedSnapLoop,w);
+  return w;
+}
+
+void PedSnapRequest(PedSnapWriter *w, const AnalysisState *st)
+{
+  pthread_mutex_lock(&w->mutex);
+  bool busy=w->pending;
+  pthread_mutex_unlock(&w->mutex);
+  if(busy)
+    {
+      w->nSkipped++;
+      return;
+    }
+  // the thread only reads the copy while pending is set
+  AnalysisState *c=w->copy;
+  memcpy(c->eventsMap,st->eventsMap,st->nFeb*PedSnapMapBytes());
+  memcpy(c->eventsMapUpt,st->eventsMapUpt,st->nFeb*PedSnapUptBytes());
+  if(st->classifier && c->classifier)
+    {
+      c->classifier->ped=st->classifier->ped;
+      c->classifier->seen=st->classifier->seen;
+    }
+  c->Ev.Counter=st->Ev.Counter;
+  c->history=st->history;
+  pthread_mutex_lock(&w->mutex);
+  w->pending=true;
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->mutex);
+}
+
+int PedSnapStop(PedSnapWriter *w, const AnalysisState *st)
+{
+  // the thread finishes a pending snapshot before it quits
+  pthread_mutex_lock(&w->mutex);
+  w->quit=true;
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->mutex);
+  pthread_join(w->thread,NULL);
+  // the final state is what the warm start reads, it is never skipped
+  int ret= st ? PedSnapWrite(w->path.c_str(),st,w->names,w->rddepth) : -1;
+  if(ret==0) w->nWritten++;
+  pthread_mutex_destroy(&w->mutex);
+  pthread_cond_destroy(&w->cond);
+  AnalysisDelete(w->copy);
+  delete w;
+  return ret;
+}
@@ -0,0 +1,102 @@
+#ifndef DRAGON_PEDESTAL_H
+#define DRAGON_PEDESTAL_H
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+#include "DragonAnalysis.hh"
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Pedestal snapshot file, see DragonPedestal.cpp (host byte order)
+//   PedSnapHeader, nFeb names of PEDSNAP_NAME bytes, then from dataOffset
+//   (page aligned): eventsMap[nFeb], eventsMapUpt[nFeb] and, with
+//   PEDSNAP_CLASSIFIER, the classifier pedestals (float) and sample counts
+//   (unsigned char), EV_NCHANNEL*EV_NGAIN*EV_NCELL of each per FEB.
+///////////////////////////////////////////////////////////////////////////////////////////
+#define PEDSNAP_MAGIC      "DRGPED01"
+#define PEDSNAP_VERSION    1
+#define PEDSNAP_NAME       64       // "IP:port" of the FEB
+#define PEDSNAP_CLASSIFIER 0x0001
+
+struct PedSnapHeader
+{
+  char magic[8];
+  unsigned int version;
+  unsigned int nFeb;
+  unsigned int nChannels;          // shape of the maps, _nchannels ...
+  unsigned int nCells;
+  unsigned int nGains;
+  unsigned int nPointers;
+  unsigned int flags;
+  unsigned int rddepth;
+  unsigned long long written;      // realtime [nsec]
+  unsigned long long events;       // events analysed since the maps were empty
+  unsigned long long dataOffset;
+  unsigned long long reserved[3];
+};
+
+inline size_t PedSnapMapBytes()   { return sizeof(EventsMapFeb); }
+inline size_t PedSnapUptBytes()   { return sizeof(EventsMapUptFeb); }
+inline size_t PedSnapCells()      { return (size_t)EV_NCHANNEL*EV_NGAIN*EV_NCELL; }
+
+// A snapshot mmap()ed read only
+struct PedSnapFile
+{
+  const unsigned char *map;
+  size_t size;
+  const PedSnapHeader *hdr;
+  std::vector<std::string> names;
+};
+
+PedSnapFile *PedSnapOpen(const char *path);
+void PedSnapClose(PedSnapFile *f);
+inline const EventsMapFeb *PedSnapMap(const PedSnapFile *f, int feb)
+{
+  return (const EventsMapFeb *)(f->map+f->hdr->dataOffset)+feb;
+}
+inline const EventsMapUptFeb *PedSnapUpt(const PedSnapFile *f, int feb)
+{
+  return (const EventsMapUptFeb *)(f->map+f->hdr->dataOffset+f->hdr->nFeb*PedSnapMapBytes())+feb;
+}
+// classifier pedestals and counts, NULL when the snapshot has none
+const float *PedSnapPed(const PedSnapFile *f, int feb);
+const unsigned char *PedSnapSeen(const PedSnapFile *f, int feb);
+
+// Writes the state of the analysis to path through path.tmp and rename(),
+// so that a crash never leaves a partial snapshot. names: one per FEB.
+int  PedSnapWrite(const char *path, const AnalysisState *st, const std::vector<std::string> &names, int rddepth);
+
+// Warm start of the analysis from a snapshot. When it has the same FEBs in
+// the same order, its maps are mmap()ed MAP_PRIVATE in place of the empty
+// ones, so nothing is read until it is used; otherwise the maps of the
+// FEBs found by name are copied. Returns the number of FEBs warmed up, 0
+// when there is no snapshot, -1 when it can't be used.
+int  PedSnapLoad(const char *path, AnalysisState *st, const std::vector<std::string> &names);
+
+/******************************************/
+//  Periodic snapshots from a thread of their own
+/******************************************/
+struct PedSnapWriter
+{
+  std::string path;
+  std::vector<std::string> names;
+  int rddepth;
+  AnalysisState *copy;             // the state handed over, written by the thread
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  bool pending;
+  bool quit;
+  unsigned long long nWritten;
+  unsigned long long nSkipped;     // requests made while a snapshot was still being written
+};
+
+PedSnapWriter *PedSnapStart(const char *path, const std::vector<std::string> &names, int rddepth, const AnalysisState *st);
+// Copies the state (a memcpy of the maps) and has the thread write it.
+// Does nothing but count when the previous one isn't written yet.
+void PedSnapRequest(PedSnapWriter *w, const AnalysisState *st);
+// Waits for the snapshot being written, stops the thread, writes the
+// final state st (unless NULL) and deletes w. Returns -1 if st isn't written.
+int  PedSnapStop(PedSnapWriter *w, const AnalysisState *st);
+#endif
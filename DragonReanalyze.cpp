@@ -0,0 +1,338 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+// DragonReanalyze.cpp
+//
+// ****Function****
+//  Runs the corruption check of DragonDaqMOnlineCarlos (DragonAnalysis.cpp)
+//  on the data files recorded by DragonDaqM, so that its thresholds can be
+//  tuned on archived runs instead of on live FEBs:
+//    - the files are mmap()ed (-T, rolled over and unified files included),
+//    - every event goes through the very same AnalysisEvent() as online,
+//      after the same copy into a slot with a spare byte before it, with
+//      Ev.Time from the DragonRecord arrival time when there is one,
+//    - the analysis keeps history per FEB, so the FEBs are split into
+//      contiguous ranges of about the same number of events, one per
+//      thread, and each thread reads the events of its FEBs in file order.
+//  Reports the events/s and, per FEB, the events found corrupted and why
+//  (mean ADC below -A, or samples shifted by more than -S sigmas, or the
+//  likelihood test of -L); -l lists them, -d writes the samples the online
+//  program would put in its TTree.
+//
+// ****Usage****
+//   make DragonReanalyze
+//   ./DragonReanalyze [-r 30] [-v 5] [-j 4] [-S 4] [-A 200] [-L calib] [-l] [-d dump] calRD30_FEB*.dat
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "DragonEvent.hh"
+#include "DragonRecord.hh"
+#include "DragonClock.hh"
+#include "DragonAnalysis.hh"
+
+// One corrupted event
+struct Decision
+{
+  int feb;
+  unsigned long long index;    // event of the FEB, from 0
+  int event;
+  int trigger;
+  float adc;                   // mean ADC
+  bool lowAdc;
+};
+
+struct FebResult
+{
+  unsigned long long events;
+  unsigned long long corrupted;
+  unsigned long long lowAdc;
+  unsigned long long shifted;
+};
+
+struct Reanalyze
+{
+  std::vector<EventFile> in;
+  int rddepth;
+  int evsize;
+  int HeaderSize;
+  double sigmaCut;
+  float adcCut;
+  bool list;
+  const char *dumpStem;
+  bool classify;
+  ClassifierConf calib;        // -L
+  unsigned long long t0;       // first arrival time, 0 without records
+  std::vector<FebResult> result;  // per FEB, each written by the thread owning it
+};
+
+struct Worker
+{
+  Reanalyze *ra;
+  int firstFeb;
+  int nFeb;
+  FILE *dump;
+  unsigned long long nDump;
+  std::vector<Decision> decision;
+  pthread_t thread;
+};
+
+// The TTree rows of the online program, as EVT structs
+static void DumpWrite(void *arg, const EVT &ev)
+{
+  Worker *w=(Worker *)arg;
+  fwrite(&ev,sizeof(ev),1,w->dump);
+  w->nDump++;
+}
+
+static void *ReanalyzeLoop(void *arg)
+{
+  Worker *w=(Worker *)arg;
+  Reanalyze *ra=w->ra;
+  AnalysisState *st=AnalysisNew(w->firstFeb,w->nFeb);
+  st->sigmaCut=ra->sigmaCut;
+  st->adcCut=ra->adcCut;
+  if(ra->classify) st->classifier=ClassifierNew(ra->calib,w->firstFeb,w->nFeb);
+  if(w->dump)
+    {
+      st->dump=DumpWrite;
+      st->dumpArg=w;
+    }
+  std::vector<unsigned char> slot(ra->evsize+16);
+  unsigned char *buff=&slot[4];   // as the arena slot of the online program
+  for(size_t i=0;i<ra->in.size();i++)
+    {
+      const EventFile &f=ra->in[i];
+      if(!f.records && (f.feb<w->firstFeb || f.feb>=w->firstFeb+w->nFeb)) continue;
+      for(unsigned long long k=0;k<f.nEvents;k++)
+	{
+	  DragonRecord rec;
+	  const unsigned char *p=EventFileAt(&f,k,&rec);
+	  int feb=rec.feb;
+	  if(feb<w->firstFeb || feb>=w->firstFeb+w->nFeb) continue;
+	  memcpy(buff,p,ra->evsize);
+	  int time= rec.arrival>ra->t0 ? int((rec.arrival-ra->t0)/1000) : 0;
+	  FebResult &r=ra->result[feb];
+	  bool corrupted=AnalysisEvent(st,buff,feb,ra->HeaderSize,ra->rddepth,time);
+	  if(corrupted)
+	    {
+	      bool low=!ra->classify && st->Ev.Adc<st->adcCut;
+	      r.corrupted++;
+	      if(low) r.lowAdc++;
+	      else r.shifted++;
+	      if(ra->list)
+		{
+		  Decision d={feb,r.events,st->Ev.Event,st->Ev.Trigger,st->Ev.Adc,low};
+		  w->decision.push_back(d);
+		}
+	    }
+	  r.events++;
+	}
+    }
+  AnalysisDelete(st);
+  return NULL;
+}
+
+static bool DecisionOrder(const Decision &a, const Decision &b)
+{
+  return a.feb!=b.feb ? a.feb<b.feb : a.index<b.index;
+}
+
+int main(int argc, char *argv[])
+{
+  Reanalyze ra;
+  ra.rddepth=-1;
+  ra.sigmaCut=4;
+  ra.adcCut=200;
+  ra.list=false;
+  ra.dumpStem=NULL;
+  ra.classify=false;
+  ClassifierDefault(&ra.calib);
+  int dragonVer=5;
+  int nThread=sysconf(_SC_NPROCESSORS_ONLN);
+  int opt;
+  while((opt=getopt(argc,argv,"hr:v:j:S:A:L:ld:"))!=-1)
+    {
+      switch(opt)
+	{
+	case 'r': ra.rddepth=atoi(optarg); break;
+	case 'v': dragonVer=atoi(optarg); break;
+	case 'j': nThread=atoi(optarg); break;
+	case 'S': ra.sigmaCut=atof(optarg); break;
+	case 'A': ra.adcCut=atof(optarg); break;
+	case 'L':
+	  ra.classify=true;
+	  if(strcmp(optarg,"default")!=0 && ClassifierRead(optarg,&ra.calib)!=0) exit(1);
+	  break;
+	case 'l': ra.list=true; break;
+	case 'd': ra.dumpStem=optarg; break;
+	default:
+	  printf("Usage: %s [-r readdepth] [-v version] [-j threads] [-S sigmas] [-A adc] [-L calib] [-l] [-d stem] <DragonDaqM .dat files>\n",argv[0]);
+	  printf("  -r : read depth, default from the RD<n> in the first file name\n");
+	  printf("  -v : Dragon version, default 5\n");
+	  printf("  -j : threads, default is one per core (at most one per FEB)\n");
+	  printf("  -S : corrupted when the samples are shifted by more than this, default 4 sigmas\n");
+	  printf("  -A : corrupted when the mean ADC is below this, default 200\n");
+	  printf("  -L : likelihood test instead (DragonClassifier.cpp), with a calibration file or \"default\"\n");
+	  printf("  -l : list the corrupted events\n");
+	  printf("  -d : write the samples of the corrupted events to <stem>_T<thread>.evt (EVT structs)\n");
+	  printf("The files of a FEB must be given in the order they were written.\n");
+	  exit(opt=='h' ? 0 : 1);
+	}
+    }
+  if(optind>=argc)
+    {
+      printf("%s -h for usage\n",argv[0]);
+      exit(1);
+    }
+  if(ra.rddepth<=0) ra.rddepth=EventFileRddepth(argv[optind]);
+  if(ra.rddepth<=0)
+    {
+      printf("Can't guess the read depth from %s, use -r\n",argv[optind]);
+      exit(1);
+    }
+  // as DragonDaqMOnlineCarlos
+  if(dragonVer>4)
+    {
+      ra.evsize=EV_HEADER_SIZE+2*8*2*ra.rddepth;
+      ra.HeaderSize=EV_HEADER_SIZE;
+    }
+  else
+    {
+      ra.evsize=16*(ra.rddepth*2+3);
+      ra.HeaderSize=16+2*8+2*8;
+    }
+  DragonClockInit();
+
+  // events per FEB, the unified files are read through once for it
+  std::vector<unsigned long long> febEvents;
+  size_t inBytes=0;
+  ra.t0=0;
+  for(int a=optind;a<argc;a++)
+    {
+      EventFile f;
+      if(EventFileOpen(&f,argv[a],ra.evsize)!=0) exit(1);
+      if(f.feb<0) f.feb=0;
+      for(unsigned long long k=0;k<f.nEvents;k++)
+	{
+	  DragonRecord rec;
+	  EventFileAt(&f,k,&rec);
+	  if(rec.feb>=febEvents.size()) febEvents.resize(rec.feb+1,0);
+	  febEvents[rec.feb]++;
+	  if(rec.arrival && (ra.t0==0 || rec.arrival<ra.t0)) ra.t0=rec.arrival;
+	  if(!f.records)
+	    {
+	      febEvents[rec.feb]+=f.nEvents-1;
+	      break;
+	    }
+	}
+      printf("%s: %llu events%s\n",f.name.c_str(),f.nEvents,f.records ? " with records" : "");
+      inBytes+=f.size;
+      ra.in.push_back(f);
+    }
+  int nFeb=febEvents.size();
+  unsigned long long nEvents=0;
+  for(int feb=0;feb<nFeb;feb++) nEvents+=febEvents[feb];
+  FebResult zero={0,0,0,0};
+  ra.result.assign(nFeb,zero);
+
+  // contiguous FEB ranges of about nEvents/nThread events
+  if(nThread>nFeb) nThread=nFeb;
+  if(nThread<1) nThread=1;
+  std::vector<Worker> worker;
+  unsigned long long sum=0;
+  int first=0;
+  for(int feb=0;feb<nFeb;feb++)
+    {
+      sum+=febEvents[feb];
+      int left=nFeb-feb-1;
+      int wanted=nThread-(int)worker.size()-1;
+      if(feb==nFeb-1 || left==wanted || (wanted>0 && sum*nThread>=nEvents*(worker.size()+1)))
+	{
+	  Worker w;
+	  w.ra=&ra;
+	  w.firstFeb=first;
+	  w.nFeb=feb+1-first;
+	  w.dump=NULL;
+	  w.nDump=0;
+	  w.thread=0;
+	  worker.push_back(w);
+	  first=feb+1;
+	}
+    }
+  printf("%llu events of %d FEBs, RD%d, %lu threads\n",nEvents,nFeb,ra.rddepth,(unsigned long)worker.size());
+
+  for(size_t t=0;t<worker.size();t++)
+    {
+      if(ra.dumpStem==NULL) continue;
+      char name[1024];
+      snprintf(name,sizeof(name),"%s_T%lu.evt",ra.dumpStem,(unsigned long)t);
+      worker[t].dump=fopen(name,"wb");
+      if(worker[t].dump==NULL)
+	{
+	  perror(name);
+	  exit(1);
+	}
+    }
+  unsigned long long t0=DragonClockNow();
+  for(size_t t=0;t<worker.size();t++)
+    if(pthread_create(&worker[t].thread,NULL,ReanalyzeLoop,&worker[t])!=0)
+      {
+	printf("can't create thread %d\n",(int)t);
+	exit(1);
+      }
+  for(size_t t=0;t<worker.size();t++)
+    pthread_join(worker[t].thread,NULL);
+  unsigned long long t1=DragonClockNow();
+  for(size_t i=0;i<ra.in.size();i++)
+    EventFileClose(&ra.in[i]);
+
+  std::vector<Decision> decision;
+  unsigned long long nDump=0;
+  for(size_t t=0;t<worker.size();t++)
+    {
+      decision.insert(decision.end(),worker[t].decision.begin(),worker[t].decision.end());
+      if(worker[t].dump) fclose(worker[t].dump);
+      nDump+=worker[t].nDump;
+    }
+  if(ra.list)
+    {
+      std::sort(decision.begin(),decision.end(),DecisionOrder);
+      printf("***** Corrupted events *****\n");
+      for(size_t i=0;i<decision.size();i++)
+	{
+	  const Decision &d=decision[i];
+	  printf("FEB %3d  #%-10llu Event %-10d Trigger %-10d mean ADC %7.1f  %s\n",d.feb,d.index,d.event,d.trigger,
+		 d.adc,d.lowAdc ? "low ADC" : ra.classify ? "likelihood" : "shifted");
+	}
+    }
+
+  if(ra.classify) printf("***** Analysis decisions (-L, z > %g) *****\n",ra.calib.zCut);
+  else printf("***** Analysis decisions (-S %g -A %g) *****\n",ra.sigmaCut,ra.adcCut);
+  printf("%-6s%12s%12s%10s%10s%10s\n","FEB","Events","Corrupted","LowAdc","Shifted","[ppm]");
+  FebResult total=zero;
+  for(int feb=0;feb<nFeb;feb++)
+    {
+      const FebResult &r=ra.result[feb];
+      if(r.events==0) continue;
+      printf("%-6d%12llu%12llu%10llu%10llu%10.1f\n",feb,r.events,r.corrupted,r.lowAdc,r.shifted,r.corrupted*1e6/r.events);
+      total.events+=r.events;
+      total.corrupted+=r.corrupted;
+      total.lowAdc+=r.lowAdc;
+      total.shifted+=r.shifted;
+    }
+  printf("%-6s%12llu%12llu%10llu%10llu%10.1f\n","all",total.events,total.corrupted,total.lowAdc,total.shifted,
+	 total.events ? total.corrupted*1e6/total.events : 0.0);
+  double sec=(t1-t0)*1e-9;
+  if(sec<=0) sec=1e-9;
+  printf("analysed %llu events in %.3f sec: %.0f events/s, %.1f MB/s in\n",total.events,sec,total.events/sec,inBytes/sec/1e6);
+  if(ra.dumpStem) printf("%llu samples dumped to %s_T*.evt\n",nDump,ra.dumpStem);
+  return 0;
+}
@@ -0,0 +1,58 @@
+#ifndef DRAGON_RECORD_H
+#define DRAGON_RECORD_H
+
+#include <stdio.h>
+#include <string.h>
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Event framing written with -T|--timestamp
+//   Each event in the data file is preceded by a 24 byte DragonRecord
+//   (host byte order). The first record of a file is a sync record
+//   whose 8 byte payload is CLOCK_REALTIME-CLOCK_MONOTONIC_RAW [nsec],
+//   so arrival times can be converted to wall time.
+//   Without -T the data file is the plain concatenation of the events.
+///////////////////////////////////////////////////////////////////////////////////////////
+#define DRAGON_RECORD_MAGIC 0x54475244 // "DRGT"
+#define DRAGON_RECORD_SYNC  0x0001     // flags: clock sync record, not an event
+
+struct DragonRecord
+{
+  unsigned int       magic;
+  unsigned short     feb;      // FEB index in Connection.conf
+  unsigned short     flags;
+  unsigned int       size;     // bytes following this header
+  unsigned int       reserved;
+  unsigned long long arrival;  // host arrival time [nsec, CLOCK_MONOTONIC_RAW]
+};
+
+inline void RecordFill(DragonRecord *rec, int feb, unsigned int size, unsigned long long arrival)
+{
+  rec->magic=DRAGON_RECORD_MAGIC;
+  rec->feb=(unsigned short)feb;
+  rec->flags=0;
+  rec->size=size;
+  rec->reserved=0;
+  rec->arrival=arrival;
+}
+
+// The sync record with its payload, as written
+struct DragonSync
+{
+  DragonRecord rec;
+  unsigned long long realtimeOffset;
+};
+
+inline void RecordFillSync(DragonSync *s, int feb, unsigned long long now, unsigned long long realtimeOffset)
+{
+  RecordFill(&s->rec,feb,sizeof(realtimeOffset),now);
+  s->rec.flags=DRAGON_RECORD_SYNC;
+  s->realtimeOffset=realtimeOffset;
+}
+
+inline void RecordWriteSync(FILE *fp, int feb, unsigned long long now, unsigned long long realtimeOffset)
+{
+  DragonSync s;
+  RecordFillSync(&s,feb,now,realtimeOffset);
+  fwrite(&s,sizeof(s),1,fp);
+}
+#endif
@@ -0,0 +1,453 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+// DragonTcp.cpp
+//
+// ****Function****
+//  Connection handling for the Dragon FEBs (SiTCP).
+//    (1)ConnectTcpAll() starts a non-blocking connect() to every FEB at once
+//       and waits for all of them with a single deadline, so the startup time
+//       is the slowest connection, not the sum. Host names are resolved with
+//       getaddrinfo() (thread safe), dotted addresses are used as they are.
+//    (2)A FEB which fails at startup or drops during the run is handed to
+//       a reconnection thread. The read loop picks the new socket up with
+//       ReconnectPoll() and the gap is recorded for the run summary.
+//    (3)Socket options from Connection.conf (DragonConf.cpp) are set
+//       before connect(), so that SO_RCVBUF sizes the advertised window,
+//       and the values in effect are read back and printed.
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "DragonDaqM.hh"
+#include "DragonTcp.hh"
+#include "DragonClock.hh"
+
+static unsigned long long TcpNowMs()
+{
+  return DragonClockRaw()/1000000ULL;
+}
+
+static int TcpResolve(const char *host, unsigned short port, std::vector<struct sockaddr_in> &addrs)
+{
+  struct sockaddr_in addr;
+  memset(&addr,0,sizeof(addr));
+  addr.sin_family=AF_INET;
+  addr.sin_port=htons(port);
+  addr.sin_addr.s_addr=inet_addr(host);
+  if(addr.sin_addr.s_addr!=0xffffffff)
+    {
+      addrs.push_back(addr);
+      return 0;
+    }
+  struct addrinfo hints,*res=NULL;
+  memset(&hints,0,sizeof(hints));
+  hints.ai_family=AF_INET;
+  hints.ai_socktype=SOCK_STREAM;
+  int err=getaddrinfo(host,NULL,&hints,&res);
+  if(err!=0)
+    {
+      printf("ConnectTcp() %s : %s\n",gai_strerror(err),host);
+      return -2;
+    }
+  for(struct addrinfo *ai=res;ai;ai=ai->ai_next)
+    {
+      addr.sin_addr=((struct sockaddr_in *)ai->ai_addr)->sin_addr;
+      addrs.push_back(addr);
+    }
+  freeaddrinfo(res);
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// socket options
+///////////////////////////////////////////////////////////////////////////////////////////
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+
+static void TcpSetOpt(int fd, int level, int name, int val, const char *what, const char *host)
+{
+  if(val<0) return;
+  if(setsockopt(fd,level,name,&val,sizeof(val))!=0)
+    printf("WARNING:ConnectTCP:: %s=%d on %s: %s\n",what,val,host,strerror(errno));
+}
+
+static void TcpApplyOpt(int fd, const TcpSockOpt *opt, const char *host)
+{
+  if(opt==NULL) return;
+  // SO_RCVBUFFORCE goes beyond net.core.rmem_max but needs CAP_NET_ADMIN
+  if(opt->rcvbuf>=0 && setsockopt(fd,SOL_SOCKET,SO_RCVBUFFORCE,&opt->rcvbuf,sizeof(int))!=0)
+    TcpSetOpt(fd,SOL_SOCKET,SO_RCVBUF,opt->rcvbuf,"SO_RCVBUF",host);
+  TcpSetOpt(fd,SOL_SOCKET,SO_BUSY_POLL,opt->busyPoll,"SO_BUSY_POLL",host);
+  TcpSetOpt(fd,IPPROTO_TCP,TCP_QUICKACK,opt->quickack,"TCP_QUICKACK",host);
+  TcpSetOpt(fd,SOL_SOCKET,SO_INCOMING_CPU,opt->incomingCpu,"SO_INCOMING_CPU",host);
+}
+
+static int TcpGetOpt(int fd, int level, int name)
+{
+  int val=-1;
+  socklen_t len=sizeof(val);
+  if(getsockopt(fd,level,name,&val,&len)!=0) return -1;
+  return val;
+}
+
+// The effective values, which may differ from the requested ones
+static void TcpPrintOpt(int fd, const char *host, unsigned short port)
+{
+  printf("ConnectTCP::%s:%u SO_RCVBUF=%d SO_BUSY_POLL=%d TCP_QUICKACK=%d SO_INCOMING_CPU=%d\n",
+	 host,port,
+	 TcpGetOpt(fd,SOL_SOCKET,SO_RCVBUF),
+	 TcpGetOpt(fd,SOL_SOCKET,SO_BUSY_POLL),
+	 TcpGetOpt(fd,IPPROTO_TCP,TCP_QUICKACK),
+	 TcpGetOpt(fd,SOL_SOCKET,SO_INCOMING_CPU));
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// connect to all servers(SiTCP) in parallel
+///////////////////////////////////////////////////////////////////////////////////////////
+struct TcpPending
+{
+  std::vector<struct sockaddr_in> addrs;
+  size_t next;  // next address to try
+  int fd;       // connect() in progress, -1 when done/failed
+  const TcpSockOpt *opt;
+  const char *host;
+};
+
+// Start connect() on the next address, returns 1 if connected, 0 in progress, -1 no more address
+static int TcpStart(TcpPending &p)
+{
+  while(p.next<p.addrs.size())
+    {
+      const struct sockaddr_in &addr=p.addrs[p.next++];
+      p.fd=socket(AF_INET,SOCK_STREAM,0);
+      if(p.fd<0)
+	{
+	  perror("socket");
+	  return -1;
+	}
+      fcntl(p.fd,F_SETFL,fcntl(p.fd,F_GETFL)|O_NONBLOCK);
+      TcpApplyOpt(p.fd,p.opt,p.host);
+      if(connect(p.fd,(const struct sockaddr *)&addr,sizeof(addr))==0) return 1;
+      if(errno==EINPROGRESS) return 0;
+      close(p.fd);
+      p.fd=-1;
+    }
+  return -1;
+}
+
+static int TcpConnectAll(int n, const char *const *hosts, const unsigned short *ports,
+			 int *socks, unsigned long *connectedIP, int timeoutMs,
+			 const TcpSockOpt *opts, bool verbose)
+{
+  std::vector<TcpPending> pend(n);
+  int nConnected=0;
+  for(int i=0;i<n;i++)
+    {
+      socks[i]=-1;
+      pend[i].next=0;
+      pend[i].fd=-1;
+      pend[i].opt= opts ? &opts[i] : NULL;
+      pend[i].host=hosts[i];
+      if(TcpResolve(hosts[i],ports[i],pend[i].addrs)!=0) continue;
+      int ret=TcpStart(pend[i]);
+      if(ret==1)
+	{
+	  socks[i]=pend[i].fd;
+	  pend[i].fd=-1;
+	}
+    }
+
+  unsigned long long deadline=TcpNowMs()+timeoutMs;
+  for(;;)
+    {
+      std::vector<struct pollfd> pfd;
+      std::vector<int> who;
+      for(int i=0;i<n;i++)
+	if(pend[i].fd>=0)
+	  {
+	    struct pollfd p={pend[i].fd,POLLOUT,0};
+	    pfd.push_back(p);
+	    who.push_back(i);
+	  }
+      if(pfd.empty()) break;
+      unsigned long long now=TcpNowMs();
+      if(now>=deadline) break;
+      int ret=poll(&pfd[0],pfd.size(),(int)(deadline-now));
+      if(ret<0 && errno!=EINTR) break;
+      for(size_t k=0;k<pfd.size();k++)
+	{
+	  if(pfd[k].revents==0) continue;
+	  TcpPending &p=pend[who[k]];
+	  int err=0;
+	  socklen_t len=sizeof(err);
+	  getsockopt(p.fd,SOL_SOCKET,SO_ERROR,&err,&len);
+	  if(err==0)
+	    {
+	      socks[who[k]]=p.fd;
+	      p.fd=-1;
+	      continue;
+	    }
+	  close(p.fd);
+	  p.fd=-1;
+	  if(TcpStart(p)==1)
+	    {
+	      socks[who[k]]=p.fd;
+	      p.fd=-1;
+	    }
+	}
+    }
+
+  for(int i=0;i<n;i++)
+    {
+      if(pend[i].fd>=0)
+	{
+	  close(pend[i].fd);
+	  pend[i].fd=-1;
+	  if(verbose) printf("ERROR:ConnectTCP:: timeout after %d msec to %s:%u\n",timeoutMs,hosts[i],ports[i]);
+	}
+      if(socks[i]<0)
+	{
+	  if(verbose) printf("ERROR:ConnectTCP:: can't connect to %s:%u\n",hosts[i],ports[i]);
+	  continue;
+	}
+      // The read loop uses blocking read() for the rest of an event
+      fcntl(socks[i],F_SETFL,fcntl(socks[i],F_GETFL)&~O_NONBLOCK);
+      struct sockaddr_in peer;
+      socklen_t len=sizeof(peer);
+      getpeername(socks[i],(struct sockaddr *)&peer,&len);
+      if(connectedIP) connectedIP[i]=(unsigned long)peer.sin_addr.s_addr;
+      printf("ConnectTCP::Connected1(%d) %s:%d\n",socks[i],hosts[i],ports[i]);
+      if(verbose && opts) TcpPrintOpt(socks[i],hosts[i],ports[i]);
+      nConnected++;
+    }
+  return nConnected;
+}
+
+int ConnectTcpAll(int n, const char *const *hosts, const unsigned short *ports,
+		  int *socks, unsigned long *connectedIP, int timeoutMs,
+		  const TcpSockOpt *opts)
+{
+  return TcpConnectAll(n,hosts,ports,socks,connectedIP,timeoutMs,opts,true);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// connect to a server(SiTCP)
+///////////////////////////////////////////////////////////////////////////////////////////
+int ConnectTcp(const char *pszHost, unsigned short shPort, unsigned long &lConnectedIP )
+{
+  int sockTcp=-1;
+  ConnectTcpAll(1,&pszHost,&shPort,&sockTcp,&lConnectedIP,TCP_CONNECT_TIMEOUT_MS);
+  return( sockTcp );
+}
+
+void TcpPollSet(const int *socks, int n, std::vector<struct pollfd> &pfd)
+{
+  pfd.resize(n);
+  for(int i=0;i<n;i++)
+    {
+      pfd[i].fd=socks[i];
+      pfd[i].events=POLLIN;
+      pfd[i].revents=0;
+    }
+}
+
+void TcpRaiseFdLimit(int nFd)
+{
+  struct rlimit rl;
+  if(getrlimit(RLIMIT_NOFILE,&rl)!=0 || rl.rlim_cur>=(rlim_t)nFd) return;
+  rl.rlim_cur= rl.rlim_max>=(rlim_t)nFd ? (rlim_t)nFd : rl.rlim_max;
+  setrlimit(RLIMIT_NOFILE,&rl);
+  if(rl.rlim_cur<(rlim_t)nFd)
+    printf("WARNING: %d file descriptors needed, RLIMIT_NOFILE is %lu (ulimit -n)\n",
+	   nFd,(unsigned long)rl.rlim_cur);
+}
+
+double TcpBacklogFill(int fd)
+{
+  int n=0,rcvbuf=0;
+  socklen_t len=sizeof(rcvbuf);
+  if(fd<0 || ioctl(fd,FIONREAD,&n)!=0 ||
+     getsockopt(fd,SOL_SOCKET,SO_RCVBUF,&rcvbuf,&len)!=0 || rcvbuf<=0) return 0;
+  // the kernel doubles SO_RCVBUF for its bookkeeping, about half holds data
+  double fill=2.0*n/rcvbuf;
+  return fill>1 ? 1 : fill;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// reconnection thread
+///////////////////////////////////////////////////////////////////////////////////////////
+enum { RC_OK=0, RC_LOST, RC_READY };
+
+struct TcpGap
+{
+  unsigned long long start;   // DragonClockNow() when the FEB was lost
+  unsigned long long end;     // when it was back in the read loop (0: still lost)
+  unsigned long long events;  // events read from the FEB before the gap
+};
+
+struct TcpFebState
+{
+  int state;
+  int fd;                     // new socket when RC_READY
+  std::vector<TcpGap> gaps;
+};
+
+static std::vector<std::string> RcHosts;
+static std::vector<unsigned short> RcPorts;
+static std::vector<TcpSockOpt> RcOpts;
+static std::vector<TcpFebState> RcFeb;
+static int RcTimeoutMs=TCP_CONNECT_TIMEOUT_MS;
+static pthread_mutex_t RcMutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_t RcThread;
+static bool RcRunning=false;
+static std::atomic<bool> RcQuit(false);
+static std::atomic<int> nRcReady(0);
+
+static void *ReconnectLoop(void *)
+{
+  while(!RcQuit.load())
+    {
+      std::vector<int> who;
+      std::vector<const char *> hosts;
+      std::vector<unsigned short> ports;
+      std::vector<TcpSockOpt> opts;
+      pthread_mutex_lock(&RcMutex);
+      for(size_t i=0;i<RcFeb.size();i++)
+	if(RcFeb[i].state==RC_LOST)
+	  {
+	    who.push_back(i);
+	    hosts.push_back(RcHosts[i].c_str());
+	    ports.push_back(RcPorts[i]);
+	    if(!RcOpts.empty()) opts.push_back(RcOpts[i]);
+	  }
+      pthread_mutex_unlock(&RcMutex);
+
+      if(!who.empty())
+	{
+	  std::vector<int> socks(who.size(),-1);
+	  TcpConnectAll(who.size(),&hosts[0],&ports[0],&socks[0],NULL,RcTimeoutMs,
+			opts.empty() ? NULL : &opts[0],false);
+	  pthread_mutex_lock(&RcMutex);
+	  for(size_t k=0;k<who.size();k++)
+	    if(socks[k]>=0)
+	      {
+		RcFeb[who[k]].fd=socks[k];
+		RcFeb[who[k]].state=RC_READY;
+		nRcReady++;
+	      }
+	  pthread_mutex_unlock(&RcMutex);
+	}
+      for(int k=0;k<10 && !RcQuit.load();k++) usleep(100000);
+    }
+  return NULL;
+}
+
+void ReconnectStart(int n, const char *const *hosts, const unsigned short *ports, int timeoutMs,
+		    const TcpSockOpt *opts)
+{
+  RcHosts.assign(hosts,hosts+n);
+  RcPorts.assign(ports,ports+n);
+  if(opts) RcOpts.assign(opts,opts+n);
+  else RcOpts.clear();
+  RcFeb.assign(n,TcpFebState());
+  for(int i=0;i<n;i++)
+    {
+      RcFeb[i].state=RC_OK;
+      RcFeb[i].fd=-1;
+    }
+  RcTimeoutMs=timeoutMs;
+  RcQuit=false;
+  if(pthread_create(&RcThread,NULL,ReconnectLoop,NULL)==0) RcRunning=true;
+}
+
+void ReconnectLost(int feb, unsigned long long eventsSoFar)
+{
+  TcpGap gap;
+  gap.start=DragonClockNow();
+  gap.end=0;
+  gap.events=eventsSoFar;
+  pthread_mutex_lock(&RcMutex);
+  RcFeb[feb].state=RC_LOST;
+  RcFeb[feb].gaps.push_back(gap);
+  pthread_mutex_unlock(&RcMutex);
+}
+
+// Cheap when nothing is pending: one relaxed atomic load
+int ReconnectPoll(int *socks, int first, int last)
+{
+  if(nRcReady.load(std::memory_order_relaxed)==0) return 0;
+  int nJoined=0;
+  unsigned long long now=DragonClockNow();
+  pthread_mutex_lock(&RcMutex);
+  for(int i=first;i<last && i<(int)RcFeb.size();i++)
+    if(RcFeb[i].state==RC_READY)
+      {
+	socks[i]=RcFeb[i].fd;
+	RcFeb[i].fd=-1;
+	RcFeb[i].state=RC_OK;
+	if(!RcFeb[i].gaps.empty()) RcFeb[i].gaps.back().end=now;
+	printf("FEB %d (%s) rejoined\n",i,RcHosts[i].c_str());
+	nRcReady--;
+	nJoined++;
+      }
+  pthread_mutex_unlock(&RcMutex);
+  return nJoined;
+}
+
+// Prints the gaps and forgets those which are closed
+void ReconnectReport(FILE *fp, int n, const std::string *names)
+{
+  unsigned long long now=DragonClockNow();
+  pthread_mutex_lock(&RcMutex);
+  bool header=false;
+  for(int i=0;i<n && i<(int)RcFeb.size();i++)
+    {
+      std::vector<TcpGap> open;
+      for(size_t k=0;k<RcFeb[i].gaps.size();k++)
+	{
+	  const TcpGap &g=RcFeb[i].gaps[k];
+	  if(!header)
+	    {
+	      fprintf(fp,"***** Connection gaps *****\n");
+	      header=true;
+	    }
+	  unsigned long long end= g.end ? g.end : now;
+	  fprintf(fp,"From %s: lost after %llu events for %.3f sec%s\n",
+		  names[i].c_str(),g.events,(end-g.start)*1e-9,g.end ? "" : " (still lost)");
+	  if(g.end==0) open.push_back(g);
+	}
+      RcFeb[i].gaps.swap(open);
+    }
+  pthread_mutex_unlock(&RcMutex);
+}
+
+void ReconnectStop()
+{
+  if(!RcRunning) return;
+  RcQuit=true;
+  pthread_join(RcThread,NULL);
+  RcRunning=false;
+  for(size_t i=0;i<RcFeb.size();i++)
+    if(RcFeb[i].fd>=0) close(RcFeb[i].fd);
+}
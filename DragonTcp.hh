@@ -0,0 +1,51 @@
+#ifndef DRAGON_TCP_H
+#define DRAGON_TCP_H
+
+#include <stdio.h>
+#include <poll.h>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "DragonConf.hh"
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Connections to the FEBs (SiTCP), see DragonTcp.cpp
+///////////////////////////////////////////////////////////////////////////////////////////
+#define TCP_CONNECT_TIMEOUT_MS 3000
+
+// Connect to all FEBs at once, socks[i] is -1 for those which failed.
+// opts (may be NULL) are applied before connect() and read back after.
+// Returns the number of connected FEBs.
+int  ConnectTcpAll(int n, const char *const *hosts, const unsigned short *ports,
+		   int *socks, unsigned long *connectedIP, int timeoutMs,
+		   const TcpSockOpt *opts=NULL);
+
+// Background reconnection of FEBs lost during the run
+void ReconnectStart(int n, const char *const *hosts, const unsigned short *ports, int timeoutMs,
+		    const TcpSockOpt *opts=NULL);
+void ReconnectLost(int feb, unsigned long long eventsSoFar);
+int  ReconnectPoll(int *socks, int first, int last); // FEBs [first,last) only
+inline int ReconnectPoll(int *socks, int n) { return ReconnectPoll(socks,0,n); }
+void ReconnectReport(FILE *fp, int n, const std::string *names);
+void ReconnectStop();
+
+// TCP_QUICKACK is cleared by the kernel, so it is set again after each event
+inline void TcpQuickAck(int fd, const TcpSockOpt *opt)
+{
+  if(opt->quickack<=0) return;
+  int one=1;
+  setsockopt(fd,IPPROTO_TCP,TCP_QUICKACK,&one,sizeof(one));
+}
+
+// pfd[i] is FEB i, unconnected FEBs (fd -1) are ignored by poll()
+void TcpPollSet(const int *socks, int n, std::vector<struct pollfd> &pfd);
+
+// Fill [0-1] of the socket receive queue (FIONREAD against SO_RCVBUF)
+double TcpBacklogFill(int fd);
+
+// Raise RLIMIT_NOFILE so that nFd descriptors can be open
+void TcpRaiseFdLimit(int nFd);
+#endif
@@ -0,0 +1,246 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+// DragonVerify.cpp
+//
+// ****Function****
+//  Re-checks data files against the CRC32C of their blocks, kept in the
+//  <file>.crc sidecar written by DragonDaqM (DragonCrc.cpp), e.g. after
+//  a copy to the archive. The blocks of all the files are shared among
+//  the threads through a single counter, each thread pread()s its block
+//  and checksums it, so a few threads run at the speed of the disk.
+//  A file is bad when a block doesn't match, or when it is shorter than
+//  its checksums say; bytes beyond them (a file still being written) are
+//  only reported. -m writes the sidecar of the files which have none,
+//  for the data recorded before the checksums existed.
+//  The exit status is 0 when every file is good, 1 otherwise.
+//
+// ****Usage****
+//   make DragonVerify
+//   ./DragonVerify [-j 4] [-m] [-b 1M] [-q] /archive/2016/*.dat
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "DragonCrc.hh"
+#include "DragonClock.hh"
+
+struct VerifyFile
+{
+  std::string name;
+  unsigned long long size;
+  unsigned int block;
+  bool make;                   // no sidecar, compute it
+  std::vector<CrcBlock> crc;   // from the sidecar, or being computed
+  std::vector<unsigned int> got;
+  int error;                   // errno of a read
+};
+
+// One unit of work: block k of file f
+struct VerifyJob
+{
+  int f;
+  size_t k;
+};
+
+struct Verify
+{
+  std::vector<VerifyFile> file;
+  std::vector<VerifyJob> job;
+  std::atomic<size_t> next;
+  std::atomic<unsigned long long> bytes;
+  unsigned int maxBlock;
+};
+
+static void *VerifyLoop(void *arg)
+{
+  Verify *v=(Verify *)arg;
+  std::vector<unsigned char> buf(v->maxBlock);
+  int fd=-1,fdFile=-1;
+  for(;;)
+    {
+      size_t j=v->next.fetch_add(1);
+      if(j>=v->job.size()) break;
+      VerifyFile &f=v->file[v->job[j].f];
+      const CrcBlock &b=f.crc[v->job[j].k];
+      if(fdFile!=v->job[j].f)
+	{
+	  if(fd>=0) close(fd);
+	  fdFile=v->job[j].f;
+	  fd=open(f.name.c_str(),O_RDONLY);
+	  if(fd>=0) posix_fadvise(fd,0,0,POSIX_FADV_SEQUENTIAL);
+	}
+      size_t n=0;
+      while(fd>=0 && n<b.length)
+	{
+	  ssize_t ret=pread(fd,&buf[n],b.length-n,b.offset+n);
+	  if(ret<=0)
+	    {
+	      if(ret<0) f.error=errno;
+	      break;
+	    }
+	  n+=ret;
+	}
+      if(fd<0) f.error=errno;
+      // a short read leaves the block with the crc of what is there
+      f.got[v->job[j].k]=Crc32c(0,&buf[0],n);
+      v->bytes.fetch_add(n);
+    }
+  if(fd>=0) close(fd);
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  int nThread=4;
+  bool make=false;
+  bool quiet=false;
+  unsigned int makeBlock=CRC_BLOCK_DEFAULT;
+  int opt;
+  while((opt=getopt(argc,argv,"hj:mb:q"))!=-1)
+    {
+      switch(opt)
+	{
+	case 'j': nThread=atoi(optarg); break;
+	case 'm': make=true; break;
+	case 'b':
+	  if(CrcParse(optarg,&makeBlock)!=0 || makeBlock==0) exit(1);
+	  break;
+	case 'q': quiet=true; break;
+	default:
+	  printf("Usage: %s [-j threads] [-m] [-b bytes] [-q] <file.dat> ...\n",argv[0]);
+	  printf("  -j : threads reading the blocks, default 4\n");
+	  printf("  -m : write the checksums of the files without a .crc instead of failing them\n");
+	  printf("  -b : block size of the checksums made by -m, default 1M\n");
+	  printf("  -q : only print the bad files\n");
+	  exit(opt=='h' ? 0 : 1);
+	}
+    }
+  if(optind>=argc)
+    {
+      printf("%s -h for usage\n",argv[0]);
+      exit(1);
+    }
+  if(nThread<1) nThread=1;
+  DragonClockInit();
+
+  Verify v;
+  v.next=0;
+  v.bytes=0;
+  v.maxBlock=0;
+  int nBad=0;
+  for(int a=optind;a<argc;a++)
+    {
+      VerifyFile f;
+      f.name=argv[a];
+      f.make=false;
+      f.error=0;
+      struct stat st;
+      if(stat(f.name.c_str(),&st)!=0)
+	{
+	  printf("BAD   %s : %s\n",f.name.c_str(),strerror(errno));
+	  nBad++;
+	  continue;
+	}
+      f.size=st.st_size;
+      if(CrcRead(f.name,&f.block,f.crc)!=0)
+	{
+	  if(!make)
+	    {
+	      printf("BAD   %s : no usable %s\n",f.name.c_str(),CRC_SUFFIX);
+	      nBad++;
+	      continue;
+	    }
+	  f.make=true;
+	  f.block=makeBlock;
+	  f.crc.clear();
+	  for(unsigned long long off=0;off<f.size;off+=f.block)
+	    {
+	      CrcBlock b;
+	      b.offset=off;
+	      b.length= f.size-off<f.block ? f.size-off : f.block;
+	      b.crc=0;
+	      f.crc.push_back(b);
+	    }
+	}
+      f.got.assign(f.crc.size(),0);
+      if(f.block>v.maxBlock) v.maxBlock=f.block;
+      for(size_t k=0;k<f.crc.size();k++)
+	{
+	  VerifyJob j={(int)v.file.size(),k};
+	  v.job.push_back(j);
+	}
+      v.file.push_back(f);
+    }
+
+  unsigned long long t0=DragonClockNow();
+  std::vector<pthread_t> th(nThread);
+  for(int t=0;t<nThread;t++)
+    if(pthread_create(&th[t],NULL,VerifyLoop,&v)!=0)
+      {
+	printf("can't create thread %d\n",t);
+	exit(1);
+      }
+  for(int t=0;t<nThread;t++) pthread_join(th[t],NULL);
+  double sec=(DragonClockNow()-t0)*1e-9;
+
+  for(size_t i=0;i<v.file.size();i++)
+    {
+      VerifyFile &f=v.file[i];
+      unsigned long long covered= f.crc.empty() ? 0 : f.crc.back().offset+f.crc.back().length;
+      if(f.error)
+	{
+	  printf("BAD   %s : %s\n",f.name.c_str(),strerror(f.error));
+	  nBad++;
+	  continue;
+	}
+      if(f.make)
+	{
+	  for(size_t k=0;k<f.crc.size();k++) f.crc[k].crc=f.got[k];
+	  if(CrcWrite(f.name,f.block,f.crc)!=0)
+	    nBad++;
+	  else if(!quiet)
+	    printf("MADE  %s : %lu blocks of %u bytes\n",f.name.c_str(),(unsigned long)f.crc.size(),f.block);
+	  continue;
+	}
+      size_t nMismatch=0;
+      for(size_t k=0;k<f.crc.size();k++)
+	if(f.got[k]!=f.crc[k].crc)
+	  {
+	    if(nMismatch<10 && f.size>=covered)
+	      printf("      %s : block at %llu, %u bytes, crc %08x instead of %08x\n",f.name.c_str(),
+		     f.crc[k].offset,f.crc[k].length,f.got[k],f.crc[k].crc);
+	    nMismatch++;
+	  }
+      if(f.size<covered)
+	{
+	  printf("BAD   %s : %llu bytes, %llu expected\n",f.name.c_str(),f.size,covered);
+	  nBad++;
+	}
+      else if(nMismatch)
+	{
+	  printf("BAD   %s : %lu of %lu blocks differ\n",f.name.c_str(),(unsigned long)nMismatch,(unsigned long)f.crc.size());
+	  nBad++;
+	}
+      else if(!quiet)
+	{
+	  printf("OK    %s : %lu blocks",f.name.c_str(),(unsigned long)f.crc.size());
+	  if(f.size>covered) printf(", %llu bytes beyond the checksums",f.size-covered);
+	  printf("\n");
+	}
+    }
+  printf("%d/%lu files bad, %.1f MB checked in %.2f s (%.0f MB/s, %d threads, %s)\n",
+	 nBad,(unsigned long)(argc-optind),v.bytes.load()/1e6,sec,sec>0 ? v.bytes.load()/1e6/sec : 0.0,nThread,
+	 Crc32cHard() ? "SSE4.2" : "table");
+  return nBad ? 1 : 0;
+}
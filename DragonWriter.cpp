@@ -0,0 +1,208 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+// DragonWriter.cpp
+//
+// ****Function****
+//  Output files of a run. Without rollover each FEB gets one file for the
+//  whole run, as before. With rollover (-R) a file is closed and the next
+//  one of its sequence opened once it reaches a size or an age, so that a
+//  continuous run (-C) can go on for days with files of a usable size:
+//    <output>RD<rd>_FEB<i>_IP<id>_0000.dat, _0001.dat, ...
+//  or, unified (-U), one sequence for all FEBs with each event framed by
+//  a DragonRecord carrying its FEB index:
+//    <output>RD<rd>_ALL_0000.dat, ...
+//  Only the writer thread touches the open files. A file which is rolled
+//  over is handed to a closer thread which flushes, syncs and closes it,
+//  so the writer never waits for the disk to finish the old file.
+//  Unless -K 0, every file gets a <file>.crc sidecar with the CRC32C of
+//  each of its blocks (DragonCrc.cpp), closed along with the file.
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "DragonWriter.hh"
+#include "DragonClock.hh"
+#include "DragonRecord.hh"
+
+void RollInit(RollConf *conf)
+{
+  conf->bytes=0;
+  conf->ns=0;
+  conf->unified=false;
+}
+
+int RollParse(const char *spec, RollConf *conf)
+{
+  std::string s(spec);
+  size_t p=0;
+  while(p<s.size())
+    {
+      size_t comma=s.find(',',p);
+      std::string tok=s.substr(p, comma==std::string::npos ? std::string::npos : comma-p);
+      p= comma==std::string::npos ? s.size() : comma+1;
+      char *end;
+      double v=strtod(tok.c_str(),&end);
+      if(end==tok.c_str() || v<=0 || strlen(end)!=1)
+	{
+	  printf("Bad rollover %s (e.g. 2G, 10m or 1G,600s)\n",spec);
+	  return -1;
+	}
+      switch(*end)
+	{
+	case 'k': case 'K': conf->bytes=(unsigned long long)(v*(1ULL<<10)); break;
+	case 'M':           conf->bytes=(unsigned long long)(v*(1ULL<<20)); break;
+	case 'G':           conf->bytes=(unsigned long long)(v*(1ULL<<30)); break;
+	case 's':           conf->ns=(unsigned long long)(v*1e9); break;
+	case 'm':           conf->ns=(unsigned long long)(v*60e9); break;
+	case 'h':           conf->ns=(unsigned long long)(v*3600e9); break;
+	default:
+	  printf("Bad rollover unit in %s (k, M, G bytes or s, m, h)\n",spec);
+	  return -1;
+	}
+    }
+  return 0;
+}
+
+static int OutOpen(DataWriter *w, OutFile *f, int k, unsigned long long now)
+{
+  char seq[16];
+  snprintf(seq,sizeof(seq),"_%04d",f->seq);
+  std::string name=w->stem[k]+(w->rolling ? seq : "")+".dat";
+  FILE *fp=fopen(name.c_str(),"wb");
+  if(fp==NULL)
+    {
+      printf("Can't open %s\n",name.c_str());
+      return -1;
+    }
+  f->fp=fp;
+  f->name=name;
+  f->bytes=0;
+  f->opened=now;
+  f->crc=NULL;
+  if(w->crcBlock && (f->crc=CrcOpen(name,w->crcBlock))==NULL)
+    {
+      fclose(fp);
+      return -1;
+    }
+  if(w->sync)
+    {
+      DragonSync s;
+      RecordFillSync(&s, f->feb<0 ? 0 : f->feb,now,DragonClockRealtimeOffset());
+      fwrite(&s,sizeof(s),1,fp);
+      if(f->crc) CrcUpdate(f->crc,&s,sizeof(s));
+      f->bytes+=sizeof(s);
+    }
+  return 0;
+}
+
+static void *CloserLoop(void *arg)
+{
+  DataWriter *w=(DataWriter *)arg;
+  pthread_mutex_lock(&w->mutex);
+  for(;;)
+    {
+      while(w->closing.empty() && !w->quit) pthread_cond_wait(&w->cond,&w->mutex);
+      if(w->closing.empty()) break;
+      OutFile f=w->closing.front();
+      w->closing.pop_front();
+      pthread_mutex_unlock(&w->mutex);
+      // a rolled file must be on disk before it is announced as complete
+      if(fflush(f.fp)!=0 || (w->rolling && fdatasync(fileno(f.fp))!=0)) perror(f.name.c_str());
+      fclose(f.fp);
+      if(CrcClose(f.crc,w->rolling)!=0) perror((f.name+CRC_SUFFIX).c_str());
+      if(w->rolling) printf("closed %s, %llu bytes\n",f.name.c_str(),f.bytes);
+      pthread_mutex_lock(&w->mutex);
+      w->nClosed++;
+      w->bytesClosed+=f.bytes;
+    }
+  pthread_mutex_unlock(&w->mutex);
+  return NULL;
+}
+
+DataWriter *WriterOpen(const RollConf &conf, const std::vector<std::string> &stem,
+		       const std::vector<int> &feb, bool sync, unsigned int crcBlock)
+{
+  DataWriter *w=new DataWriter;
+  w->conf=conf;
+  w->rolling= conf.bytes>0 || conf.ns>0;
+  w->sync=sync;
+  w->crcBlock=crcBlock;
+  w->stem=stem;
+  w->nRolled=0;
+  w->quit=false;
+  w->nClosed=0;
+  w->bytesClosed=0;
+  unsigned long long now=DragonClockNow();
+  w->out.resize(stem.size());
+  for(size_t k=0;k<stem.size();k++)
+    {
+      OutFile &f=w->out[k];
+      f.seq=0;
+      f.feb= conf.unified ? -1 : feb[k];
+      if(OutOpen(w,&f,k,now)!=0)
+	{
+	  for(size_t j=0;j<k;j++)
+	    {
+	      fclose(w->out[j].fp);
+	      CrcClose(w->out[j].crc,false);
+	    }
+	  delete w;
+	  return NULL;
+	}
+      printf("File %d %s\n",(int)k+1,f.name.c_str());
+    }
+  pthread_mutex_init(&w->mutex,NULL);
+  pthread_cond_init(&w->cond,NULL);
+  if(pthread_create(&w->closer,NULL,CloserLoop,w)!=0)
+    {
+      printf("can't create file closer thread\n");
+      exit(1);
+    }
+  return w;
+}
+
+int WriterRoll(DataWriter *w, int k, unsigned long long now)
+{
+  OutFile &f=w->out[k];
+  OutFile next=f;
+  next.seq++;
+  if(OutOpen(w,&next,k,now)!=0)
+    {
+      // keep the old file and try again after another full size or age
+      f.bytes=0;
+      f.opened=now;
+      return -1;
+    }
+  pthread_mutex_lock(&w->mutex);
+  w->closing.push_back(f);
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->mutex);
+  f=next;
+  w->nRolled++;
+  return 0;
+}
+
+void WriterClose(DataWriter *w)
+{
+  if(w==NULL) return;
+  pthread_mutex_lock(&w->mutex);
+  for(size_t k=0;k<w->out.size();k++) w->closing.push_back(w->out[k]);
+  w->quit=true;
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->mutex);
+  pthread_join(w->closer,NULL);
+  pthread_mutex_destroy(&w->mutex);
+  pthread_cond_destroy(&w->cond);
+}
+
+void WriterReport(FILE *fp, const DataWriter *w)
+{
+  if(w==NULL || !w->rolling) return;
+  fprintf(fp,"***** Output files *****\n");
+  fprintf(fp,"%llu rollover(s), %llu file(s) closed with %llu bytes\n",w->nRolled,w->nClosed,w->bytesClosed);
+  for(size_t k=0;k<w->out.size();k++)
+    fprintf(fp,"%s  last file %s (#%d)\n",
+	    w->conf.unified ? "all FEBs" : w->stem[k].c_str(),w->out[k].name.c_str(),w->out[k].seq);
+}
@@ -0,0 +1,87 @@
+#ifndef DRAGON_WRITER_H
+#define DRAGON_WRITER_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "DragonCrc.hh"
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Data files with size/time rollover, see DragonWriter.cpp
+///////////////////////////////////////////////////////////////////////////////////////////
+struct RollConf
+{
+  unsigned long long bytes;   // roll when a file would grow past this, 0: never
+  unsigned long long ns;      // roll files older than this, 0: never
+  bool unified;               // one file for all FEBs (DragonRecord framed)
+};
+
+// "<size>[,<age>]" with size in k/M/G bytes and age in s/m/h, e.g. "2G", "10m", "1G,600s"
+int  RollParse(const char *spec, RollConf *conf);
+void RollInit(RollConf *conf);
+
+struct OutFile
+{
+  FILE *fp;
+  std::string name;
+  unsigned long long bytes;
+  unsigned long long opened;  // DragonClockNow()
+  int seq;                    // rollover number
+  int feb;                    // FEB index in Connection.conf, -1 for the unified file
+  CrcWriter *crc;             // block checksums (DragonCrc.cpp), NULL: none
+};
+
+struct DataWriter
+{
+  RollConf conf;
+  bool rolling;
+  bool sync;                       // DragonRecord sync record at the start of each file
+  unsigned int crcBlock;           // bytes per checksum of the <file>.crc sidecars, 0: none
+  std::vector<std::string> stem;   // file names without the sequence number and ".dat"
+  std::vector<OutFile> out;        // per FEB, or one when unified
+  unsigned long long nRolled;      // writer thread only
+  // closer thread
+  pthread_t closer;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  std::deque<OutFile> closing;
+  bool quit;
+  unsigned long long nClosed;
+  unsigned long long bytesClosed;
+};
+
+// Opens the first file of each stem (stem.dat, or stem_0000.dat when rolling)
+// and starts the closer thread. Returns NULL when a file can't be opened.
+// feb is the FEB index of each stem in its sync record, unless unified.
+DataWriter *WriterOpen(const RollConf &conf, const std::vector<std::string> &stem,
+		       const std::vector<int> &feb, bool sync, unsigned int crcBlock);
+// Replaces file k with the next one of its sequence, the old one goes to the closer
+int  WriterRoll(DataWriter *w, int k, unsigned long long now);
+// Hands the open files to the closer thread and waits until everything is
+// closed, WriterReport() may follow before the DataWriter is deleted
+void WriterClose(DataWriter *w);
+void WriterReport(FILE *fp, const DataWriter *w);
+
+// File to append size bytes of FEB feb to, rolled over first when due
+inline FILE *WriterFile(DataWriter *w, int feb, unsigned int size, unsigned long long now)
+{
+  int k= w->conf.unified ? 0 : feb;
+  OutFile &f=w->out[k];
+  if(w->rolling && f.bytes>0 &&
+     ((w->conf.bytes && f.bytes+size>w->conf.bytes) || (w->conf.ns && now-f.opened>=w->conf.ns)))
+    WriterRoll(w,k,now);
+  f.bytes+=size;
+  return f.fp;
+}
+
+// Appends to the file WriterFile() returned for FEB feb, and to its checksums
+inline void WriterPut(DataWriter *w, int feb, const void *p, size_t n)
+{
+  OutFile &f=w->out[w->conf.unified ? 0 : feb];
+  fwrite(p,n,1,f.fp);
+  if(f.crc) CrcUpdate(f.crc,p,n);
+}
+#endif